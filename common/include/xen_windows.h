@@ -239,6 +239,35 @@ XnReadString(XN_HANDLE handle, ULONG base, PCHAR path, PCHAR *value);
 NTSTATUS
 XnWriteString(XN_HANDLE handle, ULONG base, PCHAR path, PCHAR value);
 
+#define XN_XENSTORE_READ_STRING  1 /* value is set, free it with XnFreeMem() */
+#define XN_XENSTORE_WRITE_STRING 2
+#define XN_XENSTORE_READ_INT     3 /* int_value is set */
+#define XN_XENSTORE_WRITE_INT    4
+
+typedef struct _XN_XENSTORE_OP {
+  ULONG type; /* XN_XENSTORE_* */
+  ULONG base; /* XN_BASE_* */
+  PCHAR path;
+  PCHAR value;
+  ULONGLONG int_value;
+  NTSTATUS status;
+} XN_XENSTORE_OP, *PXN_XENSTORE_OP;
+
+/* all the ops are sent before any reply is waited for. Each op's status is set, and STATUS_UNSUCCESSFUL is returned
+   if any failed. The ops are not a transaction - each one succeeds or fails by itself */
+NTSTATUS
+XnReadWriteMultiple(XN_HANDLE handle, PXN_XENSTORE_OP ops, ULONG count);
+
+static __inline VOID
+XnInitXenstoreOp(PXN_XENSTORE_OP op, ULONG type, ULONG base, PCHAR path, ULONGLONG int_value) {
+  op->type = type;
+  op->base = base;
+  op->path = path;
+  op->value = NULL;
+  op->int_value = int_value;
+  op->status = STATUS_PENDING;
+}
+
 NTSTATUS
 XnFreeString(XN_HANDLE handle, PCHAR string);
 
@@ -251,6 +280,23 @@ XnGrantAccess(XN_HANDLE handle, uint32_t frame, int readonly, grant_ref_t ref, U
 BOOLEAN
 XnEndAccess(XN_HANDLE handle, grant_ref_t ref, BOOLEAN keepref, ULONG tag);
 
+/* most frames XnGrantAccessMultiple and XnEndAccessMultiple take in one call */
+#define XN_GRANT_BATCH_MAX 64
+
+/* all or nothing. refs[i] of INVALID_GRANT_REF are allocated, the rest are reused */
+BOOLEAN
+XnGrantAccessMultiple(XN_HANDLE handle, uint32_t *frames, ULONG count, int readonly, grant_ref_t *refs, ULONG tag);
+
+/* FALSE if any ref was still in use. Those refs are not freed */
+BOOLEAN
+XnEndAccessMultiple(XN_HANDLE handle, grant_ref_t *refs, ULONG count, BOOLEAN keepref, ULONG tag);
+
+/* hypervisor side copies to or from pages the backend has granted us. Set GNTCOPY_source_gref/GNTCOPY_dest_gref for
+   the sides that are backend grant refs, the other side is a local pfn. The domids are filled in. Each op's status is
+   set, and STATUS_UNSUCCESSFUL is returned if any failed */
+NTSTATUS
+XnGrantCopy(XN_HANDLE handle, gnttab_copy_t *ops, ULONG count);
+
 grant_ref_t
 XnAllocateGrant(XN_HANDLE handle, ULONG tag);
 
@@ -260,6 +306,10 @@ XnFreeGrant(XN_HANDLE handle, grant_ref_t ref, ULONG tag);
 NTSTATUS
 XnBindEvent(XN_HANDLE handle, evtchn_port_t *port, PXN_EVENT_CALLBACK callback, PVOID context);
 
+/* as XnBindEvent, but callback is called at DISPATCH_LEVEL on processor cpu instead of at DIRQL */
+NTSTATUS
+XnBindEventCpu(XN_HANDLE handle, evtchn_port_t *port, PXN_EVENT_CALLBACK callback, PVOID context, ULONG cpu);
+
 NTSTATUS
 XnUnbindEvent(XN_HANDLE handle, evtchn_port_t port);
 
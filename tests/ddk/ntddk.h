@@ -0,0 +1,163 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+Stand-ins for the DDK headers so that the whole of xenvbd_storport can be
+built as user mode C with gcc and run against the simulated backend in
+xenvbd_sim.c. Only what the driver uses is here. The functions are
+implemented in xenvbd_sim.c.
+*/
+
+#ifndef _NTDDK_
+#define _NTDDK_
+
+#define WDK_SHIM_DDK
+#include "../wdk_shim.h"
+
+#include <wchar.h>
+
+#if defined(__x86_64__)
+#define _AMD64_
+#define _WIN64
+#elif defined(__i386__)
+#define _X86_
+#endif
+
+typedef int8_t INT8;
+typedef uint8_t UINT8;
+typedef int16_t INT16;
+typedef uint16_t UINT16;
+typedef int32_t INT32;
+typedef uint32_t UINT32;
+typedef int64_t INT64;
+typedef uint64_t UINT64;
+typedef USHORT *PUSHORT;
+typedef BOOLEAN *PBOOLEAN;
+typedef size_t SIZE_T;
+typedef wchar_t WCHAR, *PWCHAR;
+typedef UCHAR KIRQL;
+typedef ULONG_PTR PFN_NUMBER;
+
+typedef union _LARGE_INTEGER {
+  struct {
+    ULONG LowPart;
+    LONG HighPart;
+  };
+  LONGLONG QuadPart;
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+typedef LARGE_INTEGER PHYSICAL_ADDRESS;
+
+#define STATUS_PENDING ((NTSTATUS)0x00000103)
+#define STATUS_UNSUCCESSFUL ((NTSTATUS)0xC0000001)
+#define STATUS_INSUFFICIENT_RESOURCES ((NTSTATUS)0xC000009A)
+#define NT_SUCCESS(status) ((NTSTATUS)(status) >= 0)
+
+#define UNREFERENCED_PARAMETER(p) ((VOID)(p))
+#define FIELD_OFFSET(type, field) ((LONG)offsetof(type, field))
+#define UlongToPtr(u) ((PVOID)(ULONG_PTR)(u))
+#define NT_ASSERT(expr) do { if (!(expr)) abort(); } while (0)
+#define KdPrint(args)
+
+typedef struct _GUID {
+  ULONG Data1;
+  USHORT Data2;
+  USHORT Data3;
+  UCHAR Data4[8];
+} GUID;
+
+#define DEFINE_GUID(name, l, w1, w2, b1, b2, b3, b4, b5, b6, b7, b8) extern const GUID name
+
+/* xen_windows.h declares XnTmemOp with it */
+struct tmem_op;
+
+typedef enum {
+  NonPagedPool
+} POOL_TYPE;
+
+PVOID ExAllocatePoolWithTag(POOL_TYPE pool_type, SIZE_T size, ULONG tag);
+VOID ExFreePoolWithTag(PVOID p, ULONG tag);
+
+typedef enum {
+  NotificationEvent,
+  SynchronizationEvent
+} EVENT_TYPE;
+
+typedef enum {
+  Executive
+} KWAIT_REASON;
+
+typedef enum {
+  KernelMode
+} KPROCESSOR_MODE;
+
+typedef struct {
+  EVENT_TYPE type;
+  volatile LONG signalled;
+} KEVENT, *PKEVENT;
+
+VOID KeInitializeEvent(PKEVENT event, EVENT_TYPE type, BOOLEAN state);
+LONG KeSetEvent(PKEVENT event, LONG increment, BOOLEAN wait);
+NTSTATUS KeWaitForSingleObject(PVOID object, KWAIT_REASON wait_reason, KPROCESSOR_MODE wait_mode, BOOLEAN alertable, PLARGE_INTEGER timeout);
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER frequency);
+ULONG KeQueryTimeIncrement(VOID);
+KIRQL KeGetCurrentIrql(VOID);
+
+typedef struct _DEVICE_OBJECT DEVICE_OBJECT, *PDEVICE_OBJECT;
+typedef struct _DRIVER_OBJECT DRIVER_OBJECT, *PDRIVER_OBJECT;
+typedef struct _IO_WORKITEM *PIO_WORKITEM;
+
+typedef struct _UNICODE_STRING {
+  USHORT Length;
+  USHORT MaximumLength;
+  PWCHAR Buffer;
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT driver_object, PUNICODE_STRING registry_path);
+
+typedef VOID IO_WORKITEM_ROUTINE(PDEVICE_OBJECT device_object, PVOID context);
+typedef IO_WORKITEM_ROUTINE *PIO_WORKITEM_ROUTINE;
+
+typedef enum {
+  CriticalWorkQueue,
+  DelayedWorkQueue
+} WORK_QUEUE_TYPE;
+
+PIO_WORKITEM IoAllocateWorkItem(PDEVICE_OBJECT device_object);
+VOID IoQueueWorkItem(PIO_WORKITEM work_item, PIO_WORKITEM_ROUTINE routine, WORK_QUEUE_TYPE queue_type, PVOID context);
+
+PHYSICAL_ADDRESS MmGetPhysicalAddress(PVOID base_address);
+
+/* only used by the AllocatePages helpers in xen_windows.h, which xenvbd doesn't call */
+typedef struct _MDL {
+  PVOID va;
+  ULONG length;
+} MDL, *PMDL;
+
+#define MmGetMdlVirtualAddress(mdl) ((mdl)->va)
+#define MmSizeOfMdl(base, length) sizeof(MDL)
+#define MmInitializeMdl(mdl, base, size) ((mdl)->va = (base), (mdl)->length = (ULONG)(size))
+#define MmBuildMdlForNonPagedPool(mdl) ((VOID)(mdl))
+
+PVOID MmAllocateNonCachedMemory(SIZE_T size);
+VOID MmFreeNonCachedMemory(PVOID base, SIZE_T size);
+PMDL IoAllocateMdl(PVOID va, ULONG length, BOOLEAN secondary_buffer, BOOLEAN charge_quota, PVOID irp);
+VOID IoFreeMdl(PMDL mdl);
+
+#endif
@@ -0,0 +1,34 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _NTDDSCSI_H_
+#define _NTDDSCSI_H_
+
+#include "ntddk.h"
+
+typedef struct _SRB_IO_CONTROL {
+  ULONG HeaderLength;
+  UCHAR Signature[8];
+  ULONG Timeout;
+  ULONG ControlCode;
+  ULONG ReturnCode;
+  ULONG Length;
+} SRB_IO_CONTROL, *PSRB_IO_CONTROL;
+
+#endif
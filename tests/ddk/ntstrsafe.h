@@ -0,0 +1,31 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _NTSTRSAFE_H_INCLUDED_
+#define _NTSTRSAFE_H_INCLUDED_
+
+#include "ntddk.h"
+
+/* RtlStringCbCopyA is in wdk_shim.h */
+
+NTSTATUS RtlStringCbCopyNA(PCHAR dst, size_t dst_size, const char *src, size_t src_size);
+NTSTATUS RtlStringCbPrintfA(PCHAR dst, size_t dst_size, const char *format, ...);
+NTSTATUS RtlStringCchCopyW(PWCHAR dst, size_t dst_count, const WCHAR *src);
+
+#endif
@@ -0,0 +1,519 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+The parts of storport.h (and the scsi.h and srb.h definitions it brings in)
+that xenvbd uses. The layouts follow the DDK so the driver code is built
+unchanged.
+*/
+
+#ifndef _NTSTORPORT_
+#define _NTSTORPORT_
+
+#include "ntddk.h"
+
+#define SCSIOP_TEST_UNIT_READY    0x00
+#define SCSIOP_REQUEST_SENSE      0x03
+#define SCSIOP_INQUIRY            0x12
+#define SCSIOP_RESERVE_UNIT       0x16
+#define SCSIOP_RELEASE_UNIT       0x17
+#define SCSIOP_MODE_SENSE         0x1A
+#define SCSIOP_START_STOP_UNIT    0x1B
+#define SCSIOP_READ_CAPACITY      0x25
+#define SCSIOP_READ               0x28
+#define SCSIOP_WRITE              0x2A
+#define SCSIOP_VERIFY             0x2F
+#define SCSIOP_SYNCHRONIZE_CACHE  0x35
+#define SCSIOP_WRITE_SAME         0x41
+#define SCSIOP_READ_TOC           0x43
+#define SCSIOP_MODE_SENSE10       0x5A
+#define SCSIOP_READ16             0x88
+#define SCSIOP_WRITE16            0x8A
+#define SCSIOP_VERIFY16           0x8F
+#define SCSIOP_WRITE_SAME16       0x93
+#define SCSIOP_READ_CAPACITY16    0x9E
+#define SCSIOP_REPORT_LUNS        0xA0
+
+#define SRB_FUNCTION_EXECUTE_SCSI       0x00
+#define SRB_FUNCTION_IO_CONTROL         0x02
+#define SRB_FUNCTION_SHUTDOWN           0x07
+#define SRB_FUNCTION_FLUSH              0x08
+#define SRB_FUNCTION_RESET_BUS          0x12
+#define SRB_FUNCTION_RESET_DEVICE       0x13
+#define SRB_FUNCTION_WMI                0x17
+#define SRB_FUNCTION_RESET_LOGICAL_UNIT 0x20
+#define SRB_FUNCTION_POWER              0x24
+#define SRB_FUNCTION_PNP                0x25
+#define SRB_FUNCTION_DUMP_POINTERS      0x26
+
+#define SRB_STATUS_PENDING          0x00
+#define SRB_STATUS_SUCCESS          0x01
+#define SRB_STATUS_ERROR            0x04
+#define SRB_STATUS_INVALID_REQUEST  0x06
+#define SRB_STATUS_NO_DEVICE        0x08
+#define SRB_STATUS_BUS_RESET        0x0E
+#define SRB_STATUS_DATA_OVERRUN     0x12
+#define SRB_STATUS_AUTOSENSE_VALID  0x80
+
+#define SRB_FLAGS_DISABLE_AUTOSENSE 0x00000020
+#define SRB_FLAGS_DATA_IN           0x00000040
+#define SRB_FLAGS_DATA_OUT          0x00000080
+
+#define SCSISTAT_GOOD            0x00
+#define SCSISTAT_CHECK_CONDITION 0x02
+
+#define SCSI_SENSE_NO_SENSE        0x00
+#define SCSI_SENSE_MEDIUM_ERROR    0x03
+#define SCSI_SENSE_ILLEGAL_REQUEST 0x05
+#define SCSI_SENSE_UNIT_ATTENTION  0x06
+
+#define SCSI_ADSENSE_NO_SENSE          0x00
+#define SCSI_ADSENSE_ILLEGAL_BLOCK     0x21
+#define SCSI_ADSENSE_INVALID_CDB       0x24
+#define SCSI_ADSENSE_PARAMETERS_CHANGED 0x2A
+
+#define DIRECT_ACCESS_DEVICE           0x00
+#define READ_ONLY_DIRECT_ACCESS_DEVICE 0x05
+
+#define VPD_SUPPORTED_PAGES    0x00
+#define VPD_SERIAL_NUMBER      0x80
+#define VPD_DEVICE_IDENTIFIERS 0x83
+
+#define MODE_PAGE_FORMAT_DEVICE 0x03
+#define MODE_PAGE_CACHING       0x08
+#define MODE_PAGE_MEDIUM_TYPES  0x0B
+#define MODE_SENSE_RETURN_ALL   0x3F
+#define MODE_DSP_WRITE_PROTECT  0x80
+
+#define READ_TOC_FORMAT_TOC      0x00
+#define READ_TOC_FORMAT_SESSION  0x01
+#define READ_TOC_FORMAT_FULL_TOC 0x02
+#define READ_TOC_FORMAT_PMA      0x03
+#define READ_TOC_FORMAT_ATIP     0x04
+
+typedef union _CDB {
+  struct _CDB6GENERIC {
+    UCHAR OperationCode;
+    UCHAR Immediate:1;
+    UCHAR CommandUniqueBits:4;
+    UCHAR LogicalUnitNumber:3;
+    UCHAR CommandUniqueBytes[3];
+    UCHAR Link:1;
+    UCHAR Flag:1;
+    UCHAR Reserved:4;
+    UCHAR VendorUnique:2;
+  } CDB6GENERIC;
+  struct _READ_TOC {
+    UCHAR OperationCode;
+    UCHAR Reserved0:1;
+    UCHAR Msf:1;
+    UCHAR Reserved1:3;
+    UCHAR LogicalUnitNumber:3;
+    UCHAR Format2:4;
+    UCHAR Reserved2:4;
+    UCHAR Reserved3[3];
+    UCHAR StartingTrack;
+    UCHAR AllocationLength[2];
+    UCHAR Control:6;
+    UCHAR Format:2;
+  } READ_TOC;
+  UCHAR AsByte[16];
+} CDB, *PCDB;
+
+typedef struct _SENSE_DATA {
+  UCHAR ErrorCode:7;
+  UCHAR Valid:1;
+  UCHAR SegmentNumber;
+  UCHAR SenseKey:4;
+  UCHAR Reserved:1;
+  UCHAR IncorrectLength:1;
+  UCHAR EndOfMedia:1;
+  UCHAR FileMark:1;
+  UCHAR Information[4];
+  UCHAR AdditionalSenseLength;
+  UCHAR CommandSpecificInformation[4];
+  UCHAR AdditionalSenseCode;
+  UCHAR AdditionalSenseCodeQualifier;
+  UCHAR FieldReplaceableUnitCode;
+  UCHAR SenseKeySpecific[3];
+} SENSE_DATA, *PSENSE_DATA;
+
+typedef struct _INQUIRYDATA {
+  UCHAR DeviceType:5;
+  UCHAR DeviceTypeQualifier:3;
+  UCHAR DeviceTypeModifier:7;
+  UCHAR RemovableMedia:1;
+  UCHAR Versions;
+  UCHAR ResponseDataFormat:4;
+  UCHAR HiSupport:1;
+  UCHAR NormACA:1;
+  UCHAR TerminateTask:1;
+  UCHAR AERC:1;
+  UCHAR AdditionalLength;
+  UCHAR Reserved;
+  UCHAR Addr16:1;
+  UCHAR Addr32:1;
+  UCHAR AckReqQ:1;
+  UCHAR MediumChanger:1;
+  UCHAR MultiPort:1;
+  UCHAR ReservedBit2:1;
+  UCHAR EnclosureServices:1;
+  UCHAR ReservedBit3:1;
+  UCHAR SoftReset:1;
+  UCHAR CommandQueue:1;
+  UCHAR TransferDisable:1;
+  UCHAR LinkedCommands:1;
+  UCHAR Synchronous:1;
+  UCHAR Wide16Bit:1;
+  UCHAR Wide32Bit:1;
+  UCHAR RelativeAddressing:1;
+  UCHAR VendorId[8];
+  UCHAR ProductId[16];
+  UCHAR ProductRevisionLevel[4];
+  UCHAR VendorSpecific[20];
+  UCHAR Reserved3[40];
+} INQUIRYDATA, *PINQUIRYDATA;
+
+typedef struct _MODE_PARAMETER_HEADER {
+  UCHAR ModeDataLength;
+  UCHAR MediumType;
+  UCHAR DeviceSpecificParameter;
+  UCHAR BlockDescriptorLength;
+} MODE_PARAMETER_HEADER, *PMODE_PARAMETER_HEADER;
+
+typedef struct _MODE_PARAMETER_HEADER10 {
+  UCHAR ModeDataLength[2];
+  UCHAR MediumType;
+  UCHAR DeviceSpecificParameter;
+  UCHAR Reserved[2];
+  UCHAR BlockDescriptorLength[2];
+} MODE_PARAMETER_HEADER10, *PMODE_PARAMETER_HEADER10;
+
+typedef struct _MODE_PARAMETER_BLOCK {
+  UCHAR DensityCode;
+  UCHAR NumberOfBlocks[3];
+  UCHAR Reserved;
+  UCHAR BlockLength[3];
+} MODE_PARAMETER_BLOCK, *PMODE_PARAMETER_BLOCK;
+
+typedef struct _MODE_FORMAT_PAGE {
+  UCHAR PageCode:6;
+  UCHAR Reserved:1;
+  UCHAR PageSavable:1;
+  UCHAR PageLength;
+  UCHAR TracksPerZone[2];
+  UCHAR AlternateSectorsPerZone[2];
+  UCHAR AlternateTracksPerZone[2];
+  UCHAR AlternateTracksPerLogicalUnit[2];
+  UCHAR SectorsPerTrack[2];
+  UCHAR BytesPerPhysicalSector[2];
+  UCHAR Interleave[2];
+  UCHAR TrackSkewFactor[2];
+  UCHAR CylinderSkewFactor[2];
+  UCHAR Reserved2:4;
+  UCHAR SurfaceFirst:1;
+  UCHAR RemovableMedia:1;
+  UCHAR HardSectorFormating:1;
+  UCHAR SoftSectorFormating:1;
+  UCHAR Reserved3[3];
+} MODE_FORMAT_PAGE, *PMODE_FORMAT_PAGE;
+
+typedef struct _MODE_CACHING_PAGE {
+  UCHAR PageCode:6;
+  UCHAR Reserved:1;
+  UCHAR PageSavable:1;
+  UCHAR PageLength;
+  UCHAR ReadDisableCache:1;
+  UCHAR MultiplicationFactor:1;
+  UCHAR WriteCacheEnable:1;
+  UCHAR Reserved2:5;
+  UCHAR WriteRetensionPriority:4;
+  UCHAR ReadRetensionPriority:4;
+  UCHAR DisablePrefetchTransfer[2];
+  UCHAR MinimumPrefetch[2];
+  UCHAR MaximumPrefetch[2];
+  UCHAR MaximumPrefetchCeiling[2];
+} MODE_CACHING_PAGE, *PMODE_CACHING_PAGE;
+
+typedef struct _SCSI_REQUEST_BLOCK {
+  USHORT Length;
+  UCHAR Function;
+  UCHAR SrbStatus;
+  UCHAR ScsiStatus;
+  UCHAR PathId;
+  UCHAR TargetId;
+  UCHAR Lun;
+  UCHAR QueueTag;
+  UCHAR QueueAction;
+  UCHAR CdbLength;
+  UCHAR SenseInfoBufferLength;
+  ULONG SrbFlags;
+  ULONG DataTransferLength;
+  ULONG TimeOutValue;
+  PVOID DataBuffer;
+  PVOID SenseInfoBuffer;
+  struct _SCSI_REQUEST_BLOCK *NextSrb;
+  PVOID OriginalRequest;
+  PVOID SrbExtension;
+  ULONG QueueSortKey;
+#if defined(_WIN64)
+  ULONG Reserved;
+#endif
+  UCHAR Cdb[16];
+} SCSI_REQUEST_BLOCK, *PSCSI_REQUEST_BLOCK;
+
+typedef enum _STOR_PNP_ACTION {
+  StorStartDevice = 0x0,
+  StorRemoveDevice = 0x2,
+  StorStopDevice = 0x4,
+  StorQueryCapabilities = 0x9,
+  StorFilterResourceRequirements = 0xD
+} STOR_PNP_ACTION;
+
+typedef struct _SCSI_PNP_REQUEST_BLOCK {
+  USHORT Length;
+  UCHAR Function;
+  UCHAR SrbStatus;
+  UCHAR PathId;
+  UCHAR TargetId;
+  UCHAR Lun;
+  STOR_PNP_ACTION PnPAction;
+  ULONG SrbFlags;
+  ULONG SrbPnPFlags;
+} SCSI_PNP_REQUEST_BLOCK, *PSCSI_PNP_REQUEST_BLOCK;
+
+typedef enum _STOR_DEVICE_POWER_STATE {
+  StorPowerDeviceUnspecified,
+  StorPowerDeviceD0,
+  StorPowerDeviceD1,
+  StorPowerDeviceD2,
+  StorPowerDeviceD3
+} STOR_DEVICE_POWER_STATE;
+
+typedef enum _STOR_POWER_ACTION {
+  StorPowerActionNone,
+  StorPowerActionReserved,
+  StorPowerActionSleep,
+  StorPowerActionHibernate,
+  StorPowerActionShutdown,
+  StorPowerActionShutdownReset,
+  StorPowerActionShutdownOff,
+  StorPowerActionWarmEject
+} STOR_POWER_ACTION;
+
+typedef struct _SCSI_POWER_REQUEST_BLOCK {
+  USHORT Length;
+  UCHAR Function;
+  UCHAR SrbStatus;
+  UCHAR PathId;
+  UCHAR TargetId;
+  UCHAR Lun;
+  STOR_DEVICE_POWER_STATE DevicePowerState;
+  ULONG SrbFlags;
+  STOR_POWER_ACTION PowerAction;
+} SCSI_POWER_REQUEST_BLOCK, *PSCSI_POWER_REQUEST_BLOCK;
+
+typedef enum _INTERFACE_TYPE {
+  Internal
+} INTERFACE_TYPE;
+
+#define DUMP_MINIPORT_VERSION_1 0x0100
+#define DUMP_MINIPORT_NAME_LENGTH 15
+
+typedef struct _MINIPORT_DUMP_POINTERS {
+  USHORT Version;
+  USHORT Size;
+  WCHAR DriverName[DUMP_MINIPORT_NAME_LENGTH];
+  PVOID AdapterObject;
+  PVOID MappedRegisterBase;
+  ULONG CommonBufferSize;
+  PVOID MiniportPrivateDumpData;
+  ULONG SystemIoBusNumber;
+  INTERFACE_TYPE AdapterInterfaceType;
+  ULONG MaximumTransferLength;
+  ULONG NumberOfPhysicalBreaks;
+  ULONG AlignmentMask;
+  ULONG NumberOfAccessRanges;
+  UCHAR NumberOfBuses;
+  BOOLEAN Master;
+  BOOLEAN MapBuffers;
+  UCHAR MaximumNumberOfTargets;
+} MINIPORT_DUMP_POINTERS, *PMINIPORT_DUMP_POINTERS;
+
+#define SP_RETURN_NOT_FOUND  0
+#define SP_RETURN_FOUND      1
+#define SP_RETURN_ERROR      2
+#define SP_RETURN_BAD_CONFIG 3
+
+#define SCSI_DMA64_MINIPORT_SUPPORTED 0x01
+#define SCSI_DMA64_SYSTEM_SUPPORTED   0x80
+
+#define STOR_MAP_NO_BUFFERS             0
+#define STOR_MAP_ALL_BUFFERS            1
+#define STOR_MAP_NON_READ_WRITE_BUFFERS 2
+
+typedef enum _STOR_SYNCHRONIZATION_MODEL {
+  StorSynchronizeHalfDuplex,
+  StorSynchronizeFullDuplex
+} STOR_SYNCHRONIZATION_MODEL;
+
+typedef struct _PORT_CONFIGURATION_INFORMATION {
+  ULONG Length;
+  ULONG SystemIoBusNumber;
+  INTERFACE_TYPE AdapterInterfaceType;
+  ULONG MaximumTransferLength;
+  ULONG NumberOfPhysicalBreaks;
+  ULONG AlignmentMask;
+  ULONG NumberOfAccessRanges;
+  UCHAR NumberOfBuses;
+  UCHAR InitiatorBusId[8];
+  BOOLEAN ScatterGather;
+  BOOLEAN Master;
+  BOOLEAN CachesData;
+  BOOLEAN NeedPhysicalAddresses;
+  UCHAR MapBuffers;
+  UCHAR MaximumNumberOfTargets;
+  UCHAR MaximumNumberOfLogicalUnits;
+  UCHAR Dma64BitAddresses;
+  BOOLEAN VirtualDevice;
+  STOR_SYNCHRONIZATION_MODEL SynchronizationModel;
+  PVOID Reserved; /* MiniportDumpData before Windows 8 */
+} PORT_CONFIGURATION_INFORMATION, *PPORT_CONFIGURATION_INFORMATION;
+
+typedef enum _SCSI_ADAPTER_CONTROL_TYPE {
+  ScsiQuerySupportedControlTypes,
+  ScsiStopAdapter,
+  ScsiRestartAdapter,
+  ScsiSetBootConfig,
+  ScsiSetRunningConfig,
+  ScsiAdapterControlMax
+} SCSI_ADAPTER_CONTROL_TYPE;
+
+typedef enum _SCSI_ADAPTER_CONTROL_STATUS {
+  ScsiAdapterControlSuccess,
+  ScsiAdapterControlUnsuccessful
+} SCSI_ADAPTER_CONTROL_STATUS;
+
+typedef struct _SCSI_SUPPORTED_CONTROL_TYPE_LIST {
+  ULONG MaxControlType;
+  BOOLEAN SupportedTypeList[ScsiAdapterControlMax];
+} SCSI_SUPPORTED_CONTROL_TYPE_LIST, *PSCSI_SUPPORTED_CONTROL_TYPE_LIST;
+
+typedef BOOLEAN HW_INITIALIZE(PVOID DeviceExtension);
+typedef BOOLEAN HW_STARTIO(PVOID DeviceExtension, PSCSI_REQUEST_BLOCK Srb);
+typedef BOOLEAN HW_INTERRUPT(PVOID DeviceExtension);
+typedef BOOLEAN HW_RESET_BUS(PVOID DeviceExtension, ULONG PathId);
+typedef VOID HW_TIMER(PVOID DeviceExtension);
+typedef ULONG HW_FIND_ADAPTER(PVOID DeviceExtension, PVOID HwContext, PVOID BusInformation, PCHAR ArgumentString, PPORT_CONFIGURATION_INFORMATION ConfigInfo, PBOOLEAN Again);
+typedef ULONG VIRTUAL_HW_FIND_ADAPTER(PVOID DeviceExtension, PVOID HwContext, PVOID BusInformation, PVOID LowerDevice, PCHAR ArgumentString, PPORT_CONFIGURATION_INFORMATION ConfigInfo, PBOOLEAN Again);
+typedef SCSI_ADAPTER_CONTROL_STATUS HW_ADAPTER_CONTROL(PVOID DeviceExtension, SCSI_ADAPTER_CONTROL_TYPE ControlType, PVOID Parameters);
+
+typedef HW_INITIALIZE *PHW_INITIALIZE;
+typedef HW_STARTIO *PHW_STARTIO;
+typedef HW_INTERRUPT *PHW_INTERRUPT;
+typedef HW_RESET_BUS *PHW_RESET_BUS;
+typedef HW_TIMER *PHW_TIMER;
+typedef HW_FIND_ADAPTER *PHW_FIND_ADAPTER;
+typedef VIRTUAL_HW_FIND_ADAPTER *PVIRTUAL_HW_FIND_ADAPTER;
+typedef HW_ADAPTER_CONTROL *PHW_ADAPTER_CONTROL;
+
+typedef struct _HW_INITIALIZATION_DATA {
+  ULONG HwInitializationDataSize;
+  INTERFACE_TYPE AdapterInterfaceType;
+  PHW_INITIALIZE HwInitialize;
+  PHW_STARTIO HwStartIo;
+  PHW_INTERRUPT HwInterrupt;
+  PHW_FIND_ADAPTER HwFindAdapter;
+  PHW_RESET_BUS HwResetBus;
+  ULONG DeviceExtensionSize;
+  ULONG SpecificLuExtensionSize;
+  ULONG SrbExtensionSize;
+  ULONG NumberOfAccessRanges;
+  BOOLEAN MapBuffers;
+  BOOLEAN NeedPhysicalAddresses;
+  BOOLEAN TaggedQueuing;
+  BOOLEAN AutoRequestSense;
+  BOOLEAN MultipleRequestPerLu;
+  BOOLEAN ReceiveEvent;
+  PHW_ADAPTER_CONTROL HwAdapterControl;
+} HW_INITIALIZATION_DATA, *PHW_INITIALIZATION_DATA;
+
+typedef struct _VIRTUAL_HW_INITIALIZATION_DATA {
+  ULONG HwInitializationDataSize;
+  INTERFACE_TYPE AdapterInterfaceType;
+  PHW_INITIALIZE HwInitialize;
+  PHW_STARTIO HwStartIo;
+  PHW_INTERRUPT HwInterrupt;
+  PVIRTUAL_HW_FIND_ADAPTER HwFindAdapter;
+  PHW_RESET_BUS HwResetBus;
+  ULONG DeviceExtensionSize;
+  ULONG SpecificLuExtensionSize;
+  ULONG SrbExtensionSize;
+  ULONG NumberOfAccessRanges;
+  BOOLEAN MapBuffers;
+  BOOLEAN NeedPhysicalAddresses;
+  BOOLEAN TaggedQueuing;
+  BOOLEAN AutoRequestSense;
+  BOOLEAN MultipleRequestPerLu;
+  BOOLEAN ReceiveEvent;
+  PHW_ADAPTER_CONTROL HwAdapterControl;
+  ULONG PortVersionFlags;
+} VIRTUAL_HW_INITIALIZATION_DATA, *PVIRTUAL_HW_INITIALIZATION_DATA;
+
+typedef struct _STOR_DPC STOR_DPC, *PSTOR_DPC;
+typedef VOID HW_DPC_ROUTINE(PSTOR_DPC Dpc, PVOID HwDeviceExtension, PVOID SystemArgument1, PVOID SystemArgument2);
+typedef HW_DPC_ROUTINE *PHW_DPC_ROUTINE;
+
+struct _STOR_DPC {
+  PHW_DPC_ROUTINE routine;
+  PVOID device_extension;
+  volatile LONG queued;
+};
+
+typedef enum _STOR_SPINLOCK {
+  DpcLock = 1,
+  StartIoLock,
+  InterruptLock
+} STOR_SPINLOCK;
+
+typedef struct _STOR_LOCK_HANDLE {
+  STOR_SPINLOCK Lock;
+} STOR_LOCK_HANDLE, *PSTOR_LOCK_HANDLE;
+
+typedef enum _SCSI_NOTIFICATION_TYPE {
+  RequestComplete,
+  NextRequest,
+  NextLuRequest,
+  ResetDetected,
+  RequestTimerCall = 6
+} SCSI_NOTIFICATION_TYPE;
+
+#define STOR_STATUS_SUCCESS 0
+
+ULONG StorPortInitialize(PVOID Argument1, PVOID Argument2, PHW_INITIALIZATION_DATA HwInitializationData, PVOID HwContext);
+VOID StorPortNotification(SCSI_NOTIFICATION_TYPE NotificationType, PVOID HwDeviceExtension, ...);
+VOID StorPortAcquireSpinLock(PVOID HwDeviceExtension, STOR_SPINLOCK SpinLock, PVOID LockContext, PSTOR_LOCK_HANDLE LockHandle);
+VOID StorPortReleaseSpinLock(PVOID HwDeviceExtension, PSTOR_LOCK_HANDLE LockHandle);
+VOID StorPortInitializeDpc(PVOID HwDeviceExtension, PSTOR_DPC Dpc, PHW_DPC_ROUTINE HwDpcRoutine);
+BOOLEAN StorPortIssueDpc(PVOID HwDeviceExtension, PSTOR_DPC Dpc, PVOID SystemArgument1, PVOID SystemArgument2);
+ULONG StorPortGetSystemAddress(PVOID HwDeviceExtension, PSCSI_REQUEST_BLOCK Srb, PVOID *SystemAddress);
+PHYSICAL_ADDRESS StorPortGetPhysicalAddress(PVOID HwDeviceExtension, PSCSI_REQUEST_BLOCK Srb, PVOID VirtualAddress, ULONG *Length);
+BOOLEAN StorPortSetDeviceQueueDepth(PVOID HwDeviceExtension, UCHAR PathId, UCHAR TargetId, UCHAR Lun, ULONG Depth);
+
+#endif
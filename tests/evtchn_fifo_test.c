@@ -0,0 +1,387 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+Checks the FIFO event channel queue walk in xenpci/evtchn_fifo.h against a
+model of Xen's side of the ABI (evtchn_fifo_set_pending and
+evtchn_fifo_unmask in xen/common/event_fifo.c). Xen runs between the guest's
+interlocked operations, as it can on another cpu, and every event raised must
+be delivered exactly once, in priority order, and never while masked. With
+"bench" it compares the cost per event with the 2-level bitmap scan in
+EvtChn_EvtInterruptIsr.
+*/
+
+#include "wdk_shim.h"
+#include "test.h"
+
+typedef USHORT domid_t;
+#define DEFINE_XEN_GUEST_HANDLE(name)
+#include "event_channel.h"
+
+/* what xenpci gets from 64 bit xen_ulong_t */
+#define NR_EVENTS 4096
+
+/* Xen's half, running "concurrently" with the guest whenever it does something interlocked */
+static ULONG xen_interleave_chance; /* 1 in this many, 0 for never */
+static ULONG xen_interleave_budget; /* events left to raise during this walk, so that the walk ends */
+static VOID xen_interleave();
+
+static LONG
+test_exchange(volatile LONG *target, LONG value) {
+  xen_interleave();
+  return InterlockedExchange(target, value);
+}
+
+static LONG
+test_compare_exchange(volatile LONG *destination, LONG exchange, LONG comparand) {
+  xen_interleave();
+  return InterlockedCompareExchange(destination, exchange, comparand);
+}
+
+static BOOLEAN
+test_bit_test_and_reset(volatile LONG *base, LONG offset) {
+  xen_interleave();
+  return InterlockedBitTestAndReset(base, offset);
+}
+
+#define InterlockedExchange test_exchange
+#define InterlockedCompareExchange test_compare_exchange
+#define InterlockedBitTestAndReset test_bit_test_and_reset
+#undef KeMemoryBarrier
+#define KeMemoryBarrier() xen_interleave()
+
+#include "evtchn_fifo.h"
+
+static evtchn_fifo_control_block_t control;
+static event_word_t array[NR_EVENTS];
+static evtchn_port_t guest_head[EVTCHN_FIFO_MAX_QUEUES];
+static ULONG guest_ready;
+
+static evtchn_port_t xen_tail[EVTCHN_FIFO_MAX_QUEUES];
+static ULONG port_priority[NR_EVENTS];
+static ULONG bound_ports = NR_EVENTS;
+
+/* bookkeeping to check the guest against */
+static BOOLEAN raised_since_delivery[NR_EVENTS];
+static BOOLEAN masked[NR_EVENTS];
+static ULONGLONG raised;
+static ULONGLONG delivered;
+
+#define WORD_BIT(bit) ((event_word_t)1 << (bit))
+
+/* evtchn_fifo_set_link - only succeeds while the tail is still linked, ie the guest hasn't consumed it */
+static BOOLEAN
+xen_set_link(event_word_t *word, evtchn_port_t port) {
+  event_word_t old_word = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+
+  while (old_word & WORD_BIT(EVTCHN_FIFO_LINKED)) {
+    if (__atomic_compare_exchange_n(word, &old_word, (old_word & ~EVTCHN_FIFO_LINK_MASK) | port, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/* evtchn_fifo_set_pending */
+static VOID
+xen_set_pending(evtchn_port_t port) {
+  event_word_t *word = &array[port];
+  ULONG q = port_priority[port];
+  BOOLEAN linked = FALSE;
+
+  __atomic_fetch_or(word, WORD_BIT(EVTCHN_FIFO_PENDING), __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(word, __ATOMIC_SEQ_CST) & WORD_BIT(EVTCHN_FIFO_MASKED))
+    return;
+  if (__atomic_fetch_or(word, WORD_BIT(EVTCHN_FIFO_LINKED), __ATOMIC_SEQ_CST) & WORD_BIT(EVTCHN_FIFO_LINKED))
+    return;
+  /* the guest has consumed the old tail, which was this event, so the queue is empty */
+  if (xen_tail[q] == port)
+    xen_tail[q] = 0;
+  if (xen_tail[q])
+    linked = xen_set_link(&array[xen_tail[q]], port);
+  if (!linked)
+    __atomic_store_n(&control.head[q], port, __ATOMIC_SEQ_CST);
+  xen_tail[q] = port;
+  if (!linked)
+    __atomic_fetch_or(&control.ready, 1U << q, __ATOMIC_SEQ_CST);
+}
+
+static VOID
+xen_raise(evtchn_port_t port) {
+  raised++;
+  raised_since_delivery[port] = TRUE;
+  xen_set_pending(port);
+}
+
+static evtchn_port_t
+random_port() {
+  return 1 + test_rand_range(bound_ports - 1);
+}
+
+static VOID
+xen_interleave() {
+  ULONG count;
+
+  if (!xen_interleave_chance || test_rand_range(xen_interleave_chance))
+    return;
+  for (count = 1 + test_rand_range(3); count && xen_interleave_budget; count--) {
+    xen_interleave_budget--;
+    xen_raise(random_port());
+  }
+}
+
+/* EvtChn_Mask and EvtChn_Unmask. EVTCHNOP_unmask ends up in evtchn_fifo_unmask, which relinks a pending event */
+static VOID
+guest_mask(evtchn_port_t port) {
+  __atomic_fetch_or(&array[port], WORD_BIT(EVTCHN_FIFO_MASKED), __ATOMIC_SEQ_CST);
+  masked[port] = TRUE;
+}
+
+static VOID
+guest_unmask(evtchn_port_t port) {
+  masked[port] = FALSE;
+  __atomic_fetch_and(&array[port], ~WORD_BIT(EVTCHN_FIFO_MASKED), __ATOMIC_SEQ_CST);
+  if (array[port] & WORD_BIT(EVTCHN_FIFO_PENDING))
+    xen_set_pending(port);
+}
+
+/* EvtChn_FifoHandleEvents. delivered_ports, if not NULL, gets the ports in the order they were delivered */
+static ULONG
+guest_handle_events(evtchn_port_t *delivered_ports) {
+  evtchn_port_t port;
+  ULONG count = 0;
+
+  guest_ready = 0;
+  xen_interleave_budget = 64;
+  while ((port = EvtChn_FifoNextEvent(&control, array, guest_head, &guest_ready)) != 0) {
+    CHECK(port < bound_ports);
+    CHECK(raised_since_delivery[port]);
+    CHECK(!masked[port]);
+    raised_since_delivery[port] = FALSE;
+    if (delivered_ports)
+      delivered_ports[count] = port;
+    count++;
+    delivered++;
+  }
+  CHECK(!guest_ready);
+  return count;
+}
+
+/* with Xen quiet, nothing that was raised and isn't masked may be left behind */
+static VOID
+check_drained() {
+  evtchn_port_t port;
+
+  xen_interleave_chance = 0;
+  guest_handle_events(NULL);
+  CHECK(!control.ready);
+  for (port = 1; port < bound_ports; port++) {
+    if (masked[port])
+      continue;
+    CHECK(!raised_since_delivery[port]);
+    CHECK(!(array[port] & (WORD_BIT(EVTCHN_FIFO_PENDING) | WORD_BIT(EVTCHN_FIFO_LINKED))));
+  }
+}
+
+static VOID
+reset(ULONG ports) {
+  evtchn_port_t port;
+
+  memset(&control, 0, sizeof(control));
+  memset(array, 0, sizeof(array));
+  memset(guest_head, 0, sizeof(guest_head));
+  memset(xen_tail, 0, sizeof(xen_tail));
+  memset(raised_since_delivery, 0, sizeof(raised_since_delivery));
+  memset(masked, 0, sizeof(masked));
+  bound_ports = ports;
+  for (port = 0; port < NR_EVENTS; port++)
+    port_priority[port] = test_rand_range(EVTCHN_FIFO_MAX_QUEUES);
+}
+
+/* events raised while the guest is idle come out highest priority first and in the order raised within a priority */
+static VOID
+test_order() {
+  static evtchn_port_t raised_ports[NR_EVENTS];
+  static evtchn_port_t delivered_ports[NR_EVENTS];
+  static BOOLEAN queued[NR_EVENTS];
+  ULONG round, count, expected, i, priority;
+  evtchn_port_t port;
+
+  reset(NR_EVENTS);
+  for (round = 0; round < 2000; round++) {
+    memset(queued, 0, sizeof(queued));
+    count = 0;
+    for (i = 1 + test_rand_range(200); i; i--) {
+      port = random_port();
+      /* raising an event that is already queued doesn't move it */
+      if (!queued[port]) {
+        queued[port] = TRUE;
+        raised_ports[count++] = port;
+      }
+      xen_raise(port);
+    }
+    CHECK(guest_handle_events(delivered_ports) == count);
+    expected = 0;
+    for (priority = 0; priority < EVTCHN_FIFO_MAX_QUEUES; priority++) {
+      for (i = 0; i < count; i++) {
+        if (port_priority[raised_ports[i]] == priority)
+          CHECK(delivered_ports[expected++] == raised_ports[i]);
+      }
+    }
+    check_drained();
+  }
+}
+
+/* Xen raising events in the middle of the walk, with ports being masked and unmasked */
+static VOID
+test_concurrent() {
+  ULONG round, i;
+  evtchn_port_t port;
+
+  reset(NR_EVENTS);
+  for (round = 0; round < 200000; round++) {
+    xen_interleave_chance = 1 + test_rand_range(4);
+    switch (test_rand_range(8)) {
+    case 0:
+      port = random_port();
+      if (!masked[port])
+        guest_mask(port);
+      break;
+    case 1:
+    case 2:
+      port = random_port();
+      if (masked[port])
+        guest_unmask(port);
+      break;
+    default:
+      for (i = test_rand_range(8); i; i--) {
+        port = random_port();
+        xen_raise(port);
+        /* masked after it was linked, so the guest finds it on the queue */
+        if (!test_rand_range(4) && !masked[port])
+          guest_mask(port);
+      }
+      guest_handle_events(NULL);
+      break;
+    }
+    if (!(round & 1023))
+      check_drained();
+  }
+  for (port = 1; port < bound_ports; port++) {
+    if (masked[port])
+      guest_unmask(port);
+  }
+  check_drained();
+  CHECK(delivered > 0 && delivered <= raised);
+}
+
+/* the port a bad link would point at */
+static VOID
+test_out_of_range() {
+  reset(NR_EVENTS);
+  control.head[3] = NR_EVENTS + 5;
+  control.ready = 1U << 3;
+  xen_interleave_chance = 0;
+  CHECK(guest_handle_events(NULL) == 0);
+  CHECK(!control.ready);
+  CHECK(!guest_head[3]);
+}
+
+/* the 2-level ABI as EvtChn_EvtInterruptIsr walks it, 64 bit xen_ulong_t */
+static ULONGLONG level2_pending[64];
+static ULONGLONG level2_mask[64];
+static ULONGLONG level2_selector;
+
+static VOID
+level2_raise(evtchn_port_t port) {
+  level2_pending[port >> 6] |= 1ULL << (port & 63);
+  level2_selector |= 1ULL << (port >> 6);
+}
+
+static ULONG
+level2_handle_events() {
+  ULONGLONG words = __atomic_exchange_n(&level2_selector, 0, __ATOMIC_SEQ_CST);
+  ULONGLONG bits;
+  ULONG word, bit, count = 0;
+
+  while (words) {
+    word = __builtin_ctzll(words);
+    words &= ~(1ULL << word);
+    while ((bits = level2_pending[word] & ~level2_mask[word]) != 0) {
+      bit = __builtin_ctzll(bits);
+      __atomic_fetch_and(&level2_pending[word], ~(1ULL << bit), __ATOMIC_SEQ_CST);
+      count++;
+    }
+  }
+  return count;
+}
+
+static volatile ULONG bench_sink;
+
+static VOID
+bench(ULONG ports, ULONG per_interrupt) {
+  ULONG rounds = 2000000 / per_interrupt;
+  ULONGLONG t0, fifo_ns = 0, level2_ns = 0, timer_ns = 0;
+  ULONG round, i;
+
+  reset(ports);
+  xen_interleave_chance = 0;
+  for (round = 0; round < rounds; round++) {
+    t0 = test_now_ns();
+    timer_ns += test_now_ns() - t0;
+  }
+  for (round = 0; round < rounds; round++) {
+    for (i = 0; i < per_interrupt; i++)
+      xen_raise(random_port());
+    t0 = test_now_ns();
+    guest_ready = 0;
+    while (EvtChn_FifoNextEvent(&control, array, guest_head, &guest_ready))
+      bench_sink++;
+    fifo_ns += test_now_ns() - t0;
+  }
+  memset(raised_since_delivery, 0, sizeof(raised_since_delivery));
+  for (round = 0; round < rounds; round++) {
+    for (i = 0; i < per_interrupt; i++)
+      level2_raise(random_port());
+    t0 = test_now_ns();
+    bench_sink += level2_handle_events();
+    level2_ns += test_now_ns() - t0;
+  }
+  fifo_ns = fifo_ns > timer_ns ? fifo_ns - timer_ns : 0;
+  level2_ns = level2_ns > timer_ns ? level2_ns - timer_ns : 0;
+  printf("%5u ports, %3u events per interrupt: fifo %6.1f ns/event, 2-level %6.1f ns/event\n",
+    ports, per_interrupt, (double)fifo_ns / rounds / per_interrupt, (double)level2_ns / rounds / per_interrupt);
+}
+
+int
+main(int argc, char **argv) {
+  test_srand(45);
+  if (test_bench_mode(argc, argv)) {
+    bench(64, 1);
+    bench(64, 8);
+    bench(4096, 1);
+    bench(4096, 8);
+    bench(4096, 64);
+    return 0;
+  }
+  test_out_of_range();
+  test_order();
+  test_concurrent();
+  printf("evtchn_fifo_test: ok (%llu raised, %llu delivered)\n", (unsigned long long)raised, (unsigned long long)delivered);
+  return 0;
+}
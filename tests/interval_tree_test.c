@@ -0,0 +1,245 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+Checks xenvbd_common/interval_tree.h against a brute force scan of the same
+ranges, and benchmarks the overlap lookup against the linear walk of the
+shadows that XenVbd_IsWriteInFlight used to do.
+*/
+
+#include "wdk_shim.h"
+#include "test.h"
+#include "interval_tree.h"
+
+#define NODE_COUNT 2048
+#define SECTOR_SPACE 100000
+#define MAX_LENGTH 64
+
+static interval_node_t nodes[NODE_COUNT];
+static BOOLEAN in_tree[NODE_COUNT];
+
+/* checks the AVL balance, height, max_end and ordering of every node and returns the number of nodes */
+static ULONG
+check_subtree(interval_node_t *node, ULONGLONG *min_start, ULONGLONG *max_start) {
+  ULONGLONG left_min, left_max, right_min, right_max;
+  ULONGLONG max_end = node->end;
+  ULONG count = 1;
+  LONG left_height = interval_node_height(node->left);
+  LONG right_height = interval_node_height(node->right);
+
+  CHECK(node->start < node->end);
+  CHECK(left_height - right_height <= 1 && right_height - left_height <= 1);
+  CHECK(node->height == 1 + max(left_height, right_height));
+  *min_start = *max_start = node->start;
+  if (node->left) {
+    count += check_subtree(node->left, &left_min, &left_max);
+    CHECK(left_max <= node->start);
+    *min_start = left_min;
+    max_end = max(max_end, node->left->max_end);
+  }
+  if (node->right) {
+    count += check_subtree(node->right, &right_min, &right_max);
+    CHECK(right_min >= node->start);
+    *max_start = right_max;
+    max_end = max(max_end, node->right->max_end);
+  }
+  CHECK(node->max_end == max_end);
+  return count;
+}
+
+static VOID
+check_tree(interval_tree_t *tree) {
+  ULONGLONG min_start, max_start;
+  ULONG count = 0;
+  ULONG i;
+
+  if (tree->root)
+    count = check_subtree(tree->root, &min_start, &max_start);
+  CHECK(count == tree->count);
+  for (i = 0, count = 0; i < NODE_COUNT; i++)
+    count += in_tree[i];
+  CHECK(count == tree->count);
+}
+
+static BOOLEAN
+brute_force_overlap(ULONGLONG start, ULONGLONG end) {
+  ULONG i;
+
+  for (i = 0; i < NODE_COUNT; i++) {
+    if (in_tree[i] && nodes[i].start < end && start < nodes[i].end)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static VOID
+check_lookup(interval_tree_t *tree, ULONGLONG start, ULONGLONG end) {
+  interval_node_t *node = interval_tree_find_overlap(tree, start, end);
+
+  CHECK((node != NULL) == brute_force_overlap(start, end));
+  if (node) {
+    CHECK(in_tree[node - nodes]);
+    CHECK(node->start < end && start < node->end);
+  }
+}
+
+static VOID
+test_random() {
+  interval_tree_t tree;
+  ULONGLONG start;
+  ULONG i, n;
+
+  interval_tree_init(&tree);
+  test_srand(1);
+  for (n = 0; n < 200000; n++) {
+    i = test_rand_range(NODE_COUNT);
+    if (in_tree[i]) {
+      interval_tree_remove(&tree, &nodes[i]);
+      in_tree[i] = FALSE;
+    } else {
+      /* a narrow sector space so that duplicate starts and overlaps are common */
+      nodes[i].start = test_rand_range(SECTOR_SPACE);
+      nodes[i].end = nodes[i].start + 1 + test_rand_range(MAX_LENGTH);
+      interval_tree_insert(&tree, &nodes[i]);
+      in_tree[i] = TRUE;
+    }
+    start = test_rand_range(SECTOR_SPACE);
+    check_lookup(&tree, start, start + 1 + test_rand_range(MAX_LENGTH));
+    if (!(n & 1023))
+      check_tree(&tree);
+  }
+  /* empty it again */
+  for (i = 0; i < NODE_COUNT; i++) {
+    if (in_tree[i]) {
+      interval_tree_remove(&tree, &nodes[i]);
+      in_tree[i] = FALSE;
+    }
+  }
+  check_tree(&tree);
+  CHECK(tree.root == NULL);
+}
+
+/* the edges of [start, end) - touching ranges don't overlap */
+static VOID
+test_edges() {
+  interval_tree_t tree;
+
+  interval_tree_init(&tree);
+  memset(in_tree, 0, sizeof(in_tree));
+  nodes[0].start = 100;
+  nodes[0].end = 108;
+  interval_tree_insert(&tree, &nodes[0]);
+  in_tree[0] = TRUE;
+  CHECK(!interval_tree_find_overlap(&tree, 92, 100));
+  CHECK(!interval_tree_find_overlap(&tree, 108, 116));
+  CHECK(interval_tree_find_overlap(&tree, 99, 101) == &nodes[0]);
+  CHECK(interval_tree_find_overlap(&tree, 107, 108) == &nodes[0]);
+  CHECK(interval_tree_find_overlap(&tree, 0, 1000) == &nodes[0]);
+  /* a long range to the left of a short one must still be found through max_end */
+  nodes[1].start = 0;
+  nodes[1].end = 1000;
+  interval_tree_insert(&tree, &nodes[1]);
+  in_tree[1] = TRUE;
+  nodes[2].start = 200;
+  nodes[2].end = 201;
+  interval_tree_insert(&tree, &nodes[2]);
+  in_tree[2] = TRUE;
+  check_tree(&tree);
+  CHECK(interval_tree_find_overlap(&tree, 500, 501) == &nodes[1]);
+  interval_tree_remove(&tree, &nodes[1]);
+  in_tree[1] = FALSE;
+  check_tree(&tree);
+  CHECK(!interval_tree_find_overlap(&tree, 500, 501));
+  interval_tree_remove(&tree, &nodes[0]);
+  interval_tree_remove(&tree, &nodes[2]);
+  in_tree[0] = in_tree[2] = FALSE;
+  check_tree(&tree);
+}
+
+/* what XenVbd_IsWriteInFlight did before write_tree - look at every shadow holding a write */
+typedef struct {
+  ULONGLONG start;
+  ULONGLONG end;
+} bench_shadow_t;
+
+static bench_shadow_t bench_shadows[NODE_COUNT];
+
+static volatile ULONG bench_sink;
+
+static VOID
+bench(ULONG in_flight) {
+  interval_tree_t tree;
+  ULONGLONG start, t0, tree_ns, scan_ns;
+  ULONG lookups = 4000000 / in_flight * 32;
+  ULONG found;
+  ULONG i, j;
+
+  interval_tree_init(&tree);
+  test_srand(in_flight);
+  /* writes of 4K to 128K spread over a 1TB disk. The scan only looks at the shadows holding a write, which flatters it */
+  for (i = 0; i < in_flight; i++) {
+    bench_shadows[i].start = test_rand() % (1ULL << 31);
+    bench_shadows[i].end = bench_shadows[i].start + 8 + test_rand_range(248);
+    nodes[i].start = bench_shadows[i].start;
+    nodes[i].end = bench_shadows[i].end;
+    interval_tree_insert(&tree, &nodes[i]);
+  }
+
+  found = 0;
+  t0 = test_now_ns();
+  for (j = 0; j < lookups; j++) {
+    start = test_rand() % (1ULL << 31);
+    found += interval_tree_find_overlap(&tree, start, start + 128) != NULL;
+  }
+  tree_ns = test_now_ns() - t0;
+  bench_sink += found;
+
+  found = 0;
+  t0 = test_now_ns();
+  for (j = 0; j < lookups; j++) {
+    start = test_rand() % (1ULL << 31);
+    for (i = 0; i < in_flight; i++) {
+      if (bench_shadows[i].start < start + 128 && start < bench_shadows[i].end) {
+        found++;
+        break;
+      }
+    }
+  }
+  scan_ns = test_now_ns() - t0;
+  bench_sink += found;
+
+  printf("%5u writes in flight: tree %7.1f ns/lookup, linear scan %8.1f ns/lookup\n",
+    in_flight, (double)tree_ns / lookups, (double)scan_ns / lookups);
+}
+
+int
+main(int argc, char **argv) {
+  if (test_bench_mode(argc, argv)) {
+    bench(32);
+    bench(64);
+    bench(256);
+    bench(1024);
+    bench(2048);
+    return 0;
+  }
+  test_edges();
+  test_random();
+  printf("interval_tree_test: ok\n");
+  return 0;
+}
@@ -0,0 +1,87 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+Checks that XenVbd_LatencyBucket and XENVBD_LATENCY_BUCKET_MIN_US in
+xenvbd_common/xenvbd_ioctl.h agree, so that the bucket labels xenvbdstats
+prints match where the driver counted each request.
+*/
+
+#include "wdk_shim.h"
+#include "test.h"
+#include "xenvbd_ioctl.h"
+
+static VOID
+test_boundaries() {
+  ULONG bucket;
+
+  CHECK(XenVbd_LatencyBucket(0) == 0);
+  CHECK(XenVbd_LatencyBucket(31) == 0);
+  CHECK(XenVbd_LatencyBucket(32) == 1);
+  CHECK(XenVbd_LatencyBucket(63) == 1);
+  CHECK(XenVbd_LatencyBucket(64) == 2);
+  CHECK(XenVbd_LatencyBucket(1023) == 5);
+  CHECK(XenVbd_LatencyBucket(1024) == 6);
+  CHECK(XenVbd_LatencyBucket(XENVBD_LATENCY_BUCKET_MIN_US(XENVBD_LATENCY_BUCKETS - 1)) == XENVBD_LATENCY_BUCKETS - 1);
+  CHECK(XenVbd_LatencyBucket(60ULL * 1000 * 1000) == XENVBD_LATENCY_BUCKETS - 1);
+  CHECK(XenVbd_LatencyBucket((ULONGLONG)-1) == XENVBD_LATENCY_BUCKETS - 1);
+
+  CHECK(XENVBD_LATENCY_BUCKET_MIN_US(0) == 0);
+  for (bucket = 1; bucket < XENVBD_LATENCY_BUCKETS; bucket++) {
+    CHECK(XENVBD_LATENCY_BUCKET_MIN_US(bucket) > XENVBD_LATENCY_BUCKET_MIN_US(bucket - 1));
+    CHECK(XenVbd_LatencyBucket(XENVBD_LATENCY_BUCKET_MIN_US(bucket)) == bucket);
+    CHECK(XenVbd_LatencyBucket(XENVBD_LATENCY_BUCKET_MIN_US(bucket) - 1) == bucket - 1);
+  }
+}
+
+/* every value lands in the last bucket whose minimum it reaches */
+static VOID
+test_exhaustive() {
+  ULONGLONG us;
+  ULONG bucket;
+  ULONG expected;
+
+  for (us = 0; us < 4 * XENVBD_LATENCY_BUCKET_MIN_US(XENVBD_LATENCY_BUCKETS - 1); us++) {
+    bucket = XenVbd_LatencyBucket(us);
+    CHECK(bucket < XENVBD_LATENCY_BUCKETS);
+    for (expected = XENVBD_LATENCY_BUCKETS - 1; XENVBD_LATENCY_BUCKET_MIN_US(expected) > us; expected--);
+    CHECK(bucket == expected);
+  }
+}
+
+static VOID
+test_sizes() {
+  CHECK(XENVBD_LATENCY_SIZE(512) == 0);
+  CHECK(XENVBD_LATENCY_SIZE(4096) == 0);
+  CHECK(XENVBD_LATENCY_SIZE(4097) == 1);
+  CHECK(XENVBD_LATENCY_SIZE(16384) == 1);
+  CHECK(XENVBD_LATENCY_SIZE(16385) == 2);
+  CHECK(XENVBD_LATENCY_SIZE(65536) == 2);
+  CHECK(XENVBD_LATENCY_SIZE(65537) == 3);
+  CHECK(XENVBD_LATENCY_SIZE(44 * PAGE_SIZE) == XENVBD_LATENCY_SIZES - 1);
+}
+
+int
+main(int argc, char **argv) {
+  test_boundaries();
+  test_exhaustive();
+  test_sizes();
+  printf("latency_bucket_test: ok\n");
+  return 0;
+}
@@ -0,0 +1,381 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+Fuzzes xenvbd_common/read_cache.h the way common_miniport.h drives it and
+checks that the cache never returns stale data. Every sector of a model disk
+holds a version number which each write bumps. Requests are submitted,
+executed by the "backend" and completed in random order, like on the ring:
+  write      - invalidates at submit and again at completion (XenVbd_PutRequest
+               and XenVbd_HandleEvent)
+  read       - records the generation at submit and fills the cache with its
+               whole pages at completion if nothing was invalidated since
+               (XenVbd_FillReadCache)
+  read-ahead - takes PENDING pages at submit and inserts them at completion
+               under the same rule (XenVbd_ReadAhead, XenVbd_CompleteReadAhead)
+A cache hit is only allowed when no write overlapping it is on the ring, as in
+XenVbd_ReadFromCache, and must match the disk.
+*/
+
+#include "wdk_shim.h"
+#include "test.h"
+#include "read_cache.h"
+
+#define DISK_PAGES 96
+#define DISK_SECTORS (DISK_PAGES * READ_CACHE_SECTORS_PER_PAGE)
+#define CACHE_PAGES 64
+#define MAX_IN_FLIGHT 32
+#define MAX_READ_SECTORS 64
+#define MAX_READ_AHEAD_PAGES 8
+
+#define REQ_FREE       0
+#define REQ_WRITE      1
+#define REQ_READ       2
+#define REQ_READ_AHEAD 3
+
+typedef struct {
+  ULONG type;
+  BOOLEAN executed;
+  ULONGLONG start; /* sectors */
+  ULONGLONG end;
+  ULONG generation;
+  ULONGLONG data[MAX_READ_SECTORS]; /* sector versions read by a read */
+  read_cache_page_t *pages; /* read-ahead pages, linked through next */
+} request_t;
+
+static ULONGLONG disk[DISK_SECTORS]; /* version of each sector */
+static ULONGLONG disk_version;
+static request_t requests[MAX_IN_FLIGHT];
+
+static read_cache_t cache;
+static read_cache_page_t cache_pages[CACHE_PAGES];
+static UCHAR cache_data[CACHE_PAGES * PAGE_SIZE];
+
+static ULONG hits;
+static ULONG stale_fills_prevented;
+
+/* a sector's contents - its version and where it lives, so misplaced data is caught too */
+static VOID
+fill_sector(PUCHAR dst, ULONGLONG sector, ULONGLONG version) {
+  memcpy(dst, &sector, sizeof(sector));
+  memcpy(dst + sizeof(sector), &version, sizeof(version));
+}
+
+static BOOLEAN
+sector_matches(PUCHAR src, ULONGLONG sector, ULONGLONG version) {
+  ULONGLONG s, v;
+
+  memcpy(&s, src, sizeof(s));
+  memcpy(&v, src + sizeof(s), sizeof(v));
+  return (BOOLEAN)(s == sector && v == version);
+}
+
+static request_t *
+alloc_request() {
+  ULONG i;
+
+  for (i = 0; i < MAX_IN_FLIGHT; i++) {
+    if (requests[i].type == REQ_FREE)
+      return &requests[i];
+  }
+  return NULL;
+}
+
+/* a random in flight request, executed or not */
+static request_t *
+pick_request(BOOLEAN executed) {
+  ULONG i, n = test_rand_range(MAX_IN_FLIGHT);
+
+  for (i = 0; i < MAX_IN_FLIGHT; i++) {
+    request_t *req = &requests[(n + i) % MAX_IN_FLIGHT];
+    if (req->type != REQ_FREE && req->executed == executed)
+      return req;
+  }
+  return NULL;
+}
+
+static BOOLEAN
+write_in_flight(ULONGLONG start, ULONGLONG end) {
+  ULONG i;
+
+  for (i = 0; i < MAX_IN_FLIGHT; i++) {
+    if (requests[i].type == REQ_WRITE && requests[i].start < end && start < requests[i].end)
+      return TRUE;
+  }
+  return FALSE;
+}
+
+static VOID
+submit_write() {
+  request_t *req = alloc_request();
+
+  if (!req)
+    return;
+  req->type = REQ_WRITE;
+  req->executed = FALSE;
+  if (!test_rand_range(50)) {
+    /* a big discard, which takes the walk-every-page path */
+    req->start = test_rand_range(DISK_SECTORS / 2);
+    req->end = req->start + DISK_SECTORS / 2;
+  } else {
+    req->start = test_rand_range(DISK_SECTORS - MAX_READ_SECTORS);
+    req->end = req->start + 1 + test_rand_range(MAX_READ_SECTORS);
+  }
+  read_cache_invalidate(&cache, req->start, req->end);
+}
+
+static VOID
+submit_read() {
+  request_t *req = alloc_request();
+
+  if (!req)
+    return;
+  req->type = REQ_READ;
+  req->executed = FALSE;
+  req->start = test_rand_range(DISK_SECTORS - MAX_READ_SECTORS);
+  req->end = req->start + 1 + test_rand_range(MAX_READ_SECTORS);
+  req->generation = cache.generation;
+}
+
+static VOID
+submit_read_ahead() {
+  request_t *req = alloc_request();
+  read_cache_page_t *p;
+  ULONGLONG page;
+  ULONG i, count;
+
+  if (!req)
+    return;
+  count = 1 + test_rand_range(MAX_READ_AHEAD_PAGES);
+  page = test_rand_range(DISK_PAGES - count);
+  req->pages = NULL;
+  for (i = 0; i < count; i++) {
+    p = read_cache_get_page(&cache);
+    if (!p)
+      break;
+    CHECK(p->state == READ_CACHE_PAGE_PENDING);
+    p->page = page + i;
+    p->next = req->pages;
+    req->pages = p;
+  }
+  if (!req->pages)
+    return;
+  req->type = REQ_READ_AHEAD;
+  req->executed = FALSE;
+  req->start = page * READ_CACHE_SECTORS_PER_PAGE;
+  req->end = (page + i) * READ_CACHE_SECTORS_PER_PAGE;
+  req->generation = cache.generation;
+}
+
+static VOID
+execute() {
+  request_t *req = pick_request(FALSE);
+  read_cache_page_t *p;
+  ULONGLONG sector;
+  ULONG i;
+
+  if (!req)
+    return;
+  req->executed = TRUE;
+  switch (req->type) {
+  case REQ_WRITE:
+    disk_version++;
+    for (sector = req->start; sector < req->end; sector++)
+      disk[sector] = disk_version;
+    break;
+  case REQ_READ:
+    for (sector = req->start; sector < req->end; sector++)
+      req->data[sector - req->start] = disk[sector];
+    break;
+  case REQ_READ_AHEAD:
+    for (p = req->pages; p; p = p->next) {
+      for (i = 0; i < READ_CACHE_SECTORS_PER_PAGE; i++) {
+        sector = p->page * READ_CACHE_SECTORS_PER_PAGE + i;
+        fill_sector(p->data + i * 512, sector, disk[sector]);
+      }
+    }
+    break;
+  }
+}
+
+/* XenVbd_FillReadCacheRange */
+static VOID
+fill_from_read(request_t *req) {
+  ULONGLONG page = (req->start + READ_CACHE_SECTORS_PER_PAGE - 1) / READ_CACHE_SECTORS_PER_PAGE;
+  read_cache_page_t *p;
+  ULONGLONG sector;
+  ULONG i;
+
+  for (; (page + 1) * READ_CACHE_SECTORS_PER_PAGE <= req->end; page++) {
+    p = read_cache_get_page(&cache);
+    if (!p)
+      return;
+    for (i = 0; i < READ_CACHE_SECTORS_PER_PAGE; i++) {
+      sector = page * READ_CACHE_SECTORS_PER_PAGE + i;
+      fill_sector(p->data + i * 512, sector, req->data[sector - req->start]);
+    }
+    read_cache_insert(&cache, p, page);
+  }
+}
+
+static VOID
+complete() {
+  request_t *req = pick_request(TRUE);
+  read_cache_page_t *p;
+
+  if (!req)
+    return;
+  switch (req->type) {
+  case REQ_WRITE:
+    read_cache_invalidate(&cache, req->start, req->end);
+    break;
+  case REQ_READ:
+    if (req->generation == cache.generation)
+      fill_from_read(req);
+    else
+      stale_fills_prevented++;
+    break;
+  case REQ_READ_AHEAD:
+    while ((p = req->pages) != NULL) {
+      req->pages = p->next;
+      if (req->generation == cache.generation)
+        read_cache_insert(&cache, p, p->page);
+      else
+        read_cache_put_page(&cache, p);
+    }
+    break;
+  }
+  req->type = REQ_FREE;
+}
+
+/* XenVbd_ReadFromCache */
+static VOID
+lookup() {
+  ULONGLONG start = test_rand_range(DISK_SECTORS - MAX_READ_SECTORS);
+  ULONGLONG end = start + 1 + test_rand_range(MAX_READ_SECTORS);
+  ULONGLONG page, sector;
+  read_cache_page_t *p;
+
+  if (write_in_flight(start, end))
+    return;
+  for (page = start / READ_CACHE_SECTORS_PER_PAGE; page * READ_CACHE_SECTORS_PER_PAGE < end; page++) {
+    if (!read_cache_find(&cache, page))
+      return;
+  }
+  for (sector = start; sector < end; sector++) {
+    p = read_cache_find(&cache, sector / READ_CACHE_SECTORS_PER_PAGE);
+    CHECK(p->state == READ_CACHE_PAGE_VALID);
+    CHECK(sector_matches(p->data + (sector % READ_CACHE_SECTORS_PER_PAGE) * 512, sector, disk[sector]));
+  }
+  for (page = start / READ_CACHE_SECTORS_PER_PAGE; page * READ_CACHE_SECTORS_PER_PAGE < end; page++)
+    read_cache_touch(&cache, read_cache_find(&cache, page));
+  hits++;
+}
+
+static ULONG
+list_length(PLIST_ENTRY head, ULONG state) {
+  PLIST_ENTRY entry;
+  ULONG count = 0;
+
+  for (entry = head->Flink; entry != head; entry = entry->Flink) {
+    CHECK(CONTAINING_RECORD(entry, read_cache_page_t, list_entry)->state == state);
+    count++;
+    CHECK(count <= CACHE_PAGES);
+  }
+  return count;
+}
+
+/* every page is on exactly one of the free list, the lru list or a read-ahead, and the hash holds exactly the VALID pages */
+static VOID
+check_structure() {
+  read_cache_page_t *p;
+  ULONG free_count, valid_count, pending_count = 0, hashed_count = 0;
+  ULONG i;
+
+  free_count = list_length(&cache.free_list, READ_CACHE_PAGE_FREE);
+  valid_count = list_length(&cache.lru_list, READ_CACHE_PAGE_VALID);
+  for (i = 0; i < MAX_IN_FLIGHT; i++) {
+    if (requests[i].type != REQ_READ_AHEAD)
+      continue;
+    for (p = requests[i].pages; p; p = p->next) {
+      CHECK(p->state == READ_CACHE_PAGE_PENDING);
+      pending_count++;
+    }
+  }
+  CHECK(free_count + valid_count + pending_count == CACHE_PAGES);
+  for (i = 0; i < READ_CACHE_HASH_SIZE; i++) {
+    for (p = cache.hash[i]; p; p = p->next) {
+      CHECK(p->state == READ_CACHE_PAGE_VALID);
+      CHECK(read_cache_hash(p->page) == i);
+      CHECK(read_cache_find(&cache, p->page) == p); /* no second copy ahead of it */
+      hashed_count++;
+    }
+  }
+  CHECK(hashed_count == valid_count);
+}
+
+int
+main(int argc, char **argv) {
+  ULONG n;
+
+  read_cache_init(&cache, cache_pages, cache_data, CACHE_PAGES);
+  test_srand(35);
+  for (n = 0; n < 2000000; n++) {
+    switch (test_rand_range(16)) {
+    case 0:
+    case 1:
+      /* alternate busy writing phases with phases of mostly reads, in which the cache gets to fill */
+      if (!((n >> 16) & 1) || !test_rand_range(64))
+        submit_write();
+      break;
+    case 2:
+    case 3:
+      submit_read();
+      break;
+    case 4:
+      submit_read_ahead();
+      break;
+    case 5:
+    case 6:
+    case 7:
+      execute();
+      break;
+    case 8:
+    case 9:
+    case 10:
+      complete();
+      break;
+    case 11:
+      if (!test_rand_range(1000))
+        read_cache_invalidate_all(&cache);
+      break;
+    default:
+      lookup();
+      break;
+    }
+    if (!(n & 4095))
+      check_structure();
+  }
+  check_structure();
+  /* make sure the interesting paths were actually taken */
+  CHECK(hits > 1000);
+  CHECK(stale_fills_prevented > 1000);
+  printf("read_cache_test: ok (%u hits, %u stale fills prevented)\n", hits, stale_fills_prevented);
+  return 0;
+}
@@ -0,0 +1,73 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+Helpers shared by the user mode tests. Every test is a standalone program that
+exits non-zero on the first failure. Tests that have benchmarks run those
+instead when "bench" is the only argument.
+*/
+
+#ifndef _TEST_H
+#define _TEST_H
+
+#include <time.h>
+
+#define CHECK(expr) do { \
+  if (!(expr)) { \
+    fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #expr); \
+    exit(1); \
+  } \
+} while (0)
+
+/* xorshift64 - the tests must see the same sequence on every run and every platform */
+static ULONGLONG test_rand_state = 88172645463325252ULL;
+
+static inline VOID
+test_srand(ULONGLONG seed) {
+  test_rand_state = seed ? seed : 88172645463325252ULL;
+}
+
+static inline ULONGLONG
+test_rand() {
+  test_rand_state ^= test_rand_state << 13;
+  test_rand_state ^= test_rand_state >> 7;
+  test_rand_state ^= test_rand_state << 17;
+  return test_rand_state;
+}
+
+/* 0 to range - 1 */
+static inline ULONG
+test_rand_range(ULONG range) {
+  return (ULONG)(test_rand() % range);
+}
+
+static inline ULONGLONG
+test_now_ns() {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ULONGLONG)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline BOOLEAN
+test_bench_mode(int argc, char **argv) {
+  return (BOOLEAN)(argc == 2 && !strcmp(argv[1], "bench"));
+}
+
+#endif
@@ -0,0 +1,177 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+Just enough of the DDK types and list macros for the portable driver headers
+(xenvbd_common/interval_tree.h, read_cache.h, xenvbd_ioctl.h etc) to build as
+user mode C with gcc.
+*/
+
+#ifndef _WDK_SHIM_H
+#define _WDK_SHIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef void VOID, *PVOID;
+typedef unsigned char UCHAR, *PUCHAR;
+typedef unsigned char BOOLEAN;
+typedef unsigned short USHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR;
+typedef char CHAR, *PCHAR;
+typedef LONG NTSTATUS;
+
+#define STATUS_SUCCESS ((NTSTATUS)0)
+#define STATUS_BUFFER_OVERFLOW ((NTSTATUS)0x80000005)
+
+#define TRUE 1
+#define FALSE 0
+
+#define __inline inline
+
+#ifndef max
+#define max(a, b) (((a) > (b)) ? (a) : (b))
+#endif
+#ifndef min
+#define min(a, b) (((a) < (b)) ? (a) : (b))
+#endif
+
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+
+#define CONTAINING_RECORD(address, type, field) ((type *)((PUCHAR)(address) - offsetof(type, field)))
+#define RtlZeroMemory(dst, length) memset(dst, 0, length)
+#define RtlCopyMemory(dst, src, length) memcpy(dst, src, length)
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/* truncates like the real one */
+static inline NTSTATUS
+RtlStringCbCopyA(PCHAR dst, size_t dst_size, const char *src) {
+  size_t length = strlen(src);
+
+  if (length >= dst_size) {
+    memcpy(dst, src, dst_size - 1);
+    dst[dst_size - 1] = 0;
+    return STATUS_BUFFER_OVERFLOW;
+  }
+  memcpy(dst, src, length + 1);
+  return STATUS_SUCCESS;
+}
+
+/* when the whole driver is built (see ddk/ntddk.h) these come from xen_windows.h as they do in the DDK build */
+#ifndef WDK_SHIM_DDK
+#define FUNCTION_MSG(...) printf(__VA_ARGS__)
+
+#define XN_ASSERT(expr) do { \
+  if (!(expr)) { \
+    fprintf(stderr, "%s:%d: XN_ASSERT(%s) failed\n", __FILE__, __LINE__, #expr); \
+    abort(); \
+  } \
+} while (0)
+#endif
+
+/* single threaded tests can wrap these to run something between the steps of the code under test */
+static inline LONG
+InterlockedExchange(volatile LONG *target, LONG value) {
+  return __atomic_exchange_n(target, value, __ATOMIC_SEQ_CST);
+}
+
+static inline LONG
+InterlockedCompareExchange(volatile LONG *destination, LONG exchange, LONG comparand) {
+  __atomic_compare_exchange_n(destination, &comparand, exchange, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return comparand;
+}
+
+static inline BOOLEAN
+InterlockedBitTestAndSet(volatile LONG *base, LONG offset) {
+  return (BOOLEAN)((__atomic_fetch_or(base, (LONG)(1U << offset), __ATOMIC_SEQ_CST) >> offset) & 1);
+}
+
+static inline BOOLEAN
+InterlockedBitTestAndReset(volatile LONG *base, LONG offset) {
+  return (BOOLEAN)((__atomic_fetch_and(base, (LONG)~(1U << offset), __ATOMIC_SEQ_CST) >> offset) & 1);
+}
+
+static inline BOOLEAN
+_BitScanForward(ULONG *index, ULONG mask) {
+  if (!mask)
+    return FALSE;
+  *index = (ULONG)__builtin_ctz(mask);
+  return TRUE;
+}
+
+#define KeMemoryBarrier() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+typedef struct _LIST_ENTRY {
+  struct _LIST_ENTRY *Flink;
+  struct _LIST_ENTRY *Blink;
+} LIST_ENTRY, *PLIST_ENTRY;
+
+static inline VOID
+InitializeListHead(PLIST_ENTRY head) {
+  head->Flink = head->Blink = head;
+}
+
+static inline BOOLEAN
+IsListEmpty(PLIST_ENTRY head) {
+  return (BOOLEAN)(head->Flink == head);
+}
+
+static inline BOOLEAN
+RemoveEntryList(PLIST_ENTRY entry) {
+  PLIST_ENTRY flink = entry->Flink;
+  PLIST_ENTRY blink = entry->Blink;
+
+  blink->Flink = flink;
+  flink->Blink = blink;
+  return (BOOLEAN)(flink == blink);
+}
+
+static inline PLIST_ENTRY
+RemoveHeadList(PLIST_ENTRY head) {
+  PLIST_ENTRY entry = head->Flink;
+
+  RemoveEntryList(entry);
+  return entry;
+}
+
+static inline VOID
+InsertTailList(PLIST_ENTRY head, PLIST_ENTRY entry) {
+  entry->Flink = head;
+  entry->Blink = head->Blink;
+  head->Blink->Flink = entry;
+  head->Blink = entry;
+}
+
+static inline VOID
+InsertHeadList(PLIST_ENTRY head, PLIST_ENTRY entry) {
+  entry->Flink = head->Flink;
+  entry->Blink = head;
+  head->Flink->Blink = entry;
+  head->Flink = entry;
+}
+
+#endif
@@ -0,0 +1,254 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+Replays watch storms through XenBus_WatchRingAdd in xenpci/xenbus_watch.h
+with a consumer that drains the queue the way XenBus_WatchThreadProc does,
+including events arriving between the entries it pops. Coalescing and
+overflow may only ever drop an event if a dispatch for the same watch and
+path (or the fire-every-watch that follows an overflow) comes after it.
+With "bench" it times XenBus_WatchRingAdd against the depth of the queue.
+*/
+
+#include "wdk_shim.h"
+#include "test.h"
+#include "xenbus_watch.h"
+
+#define WATCHES 40
+#define PATHS_PER_WATCH 8
+#define KEYS (WATCHES * PATHS_PER_WATCH + WATCHES)
+
+static XENBUS_WATCH_RING ring[WATCH_RING_SIZE];
+static ULONG prod;
+static ULONG cons;
+static BOOLEAN overflow;
+
+static char paths[WATCHES][PATHS_PER_WATCH][64];
+static char long_path[300];
+
+/* per watch and path (the last WATCHES keys are the watches' own paths) */
+static ULONGLONG last_event[KEYS]; /* sequence number of the last event, 0 for none */
+static ULONGLONG covered[KEYS]; /* every event before this has been dispatched */
+static ULONGLONG sequence;
+
+static ULONG events, coalesced, overflows, dispatches, fire_alls;
+
+static ULONG
+key_of(int index, PCHAR path) {
+  ULONG i;
+
+  if (!path[0])
+    return WATCHES * PATHS_PER_WATCH + index;
+  for (i = 0; i < PATHS_PER_WATCH; i++) {
+    if (!strcmp(paths[index][i], path))
+      return index * PATHS_PER_WATCH + i;
+  }
+  CHECK(!"unknown path");
+  return 0;
+}
+
+static VOID
+produce(int index, PCHAR path) {
+  ULONG key = key_of(index, strlen(path) < sizeof(ring[0].Path) ? path : "");
+
+  events++;
+  last_event[key] = ++sequence;
+  switch (XenBus_WatchRingAdd(ring, cons, &prod, index, path)) {
+  case XENBUS_WATCH_COALESCED:
+    coalesced++;
+    break;
+  case XENBUS_WATCH_OVERFLOW:
+    overflow = TRUE;
+    overflows++;
+    break;
+  default:
+    CHECK(prod - cons <= WATCH_RING_SIZE);
+    break;
+  }
+}
+
+/* a watch storm - mostly a few hot paths, like a backend flapping its state, with the odd too long path. Wide storms touch every path alike */
+static BOOLEAN wide;
+
+static VOID
+produce_random() {
+  int index;
+
+  if (!test_rand_range(500)) {
+    produce(test_rand_range(WATCHES), long_path);
+    return;
+  }
+  if (!wide && test_rand_range(4)) {
+    index = test_rand_range(4);
+    produce(index, paths[index][test_rand_range(2)]);
+    return;
+  }
+  index = test_rand_range(WATCHES);
+  produce(index, paths[index][test_rand_range(PATHS_PER_WATCH)]);
+}
+
+/* the queue never holds the same watch and path twice */
+static VOID
+check_unique() {
+  static BOOLEAN seen[KEYS];
+  XENBUS_WATCH_RING *entry;
+  ULONG i, key;
+
+  memset(seen, 0, sizeof(seen));
+  for (i = cons; i != prod; i++) {
+    entry = &ring[i & (WATCH_RING_SIZE - 1)];
+    key = key_of(entry->Index, entry->Path);
+    CHECK(!seen[key]);
+    seen[key] = TRUE;
+  }
+}
+
+/* XenBus_WatchThreadProc. The producer may run between entries, as the thread drops the lock to dispatch */
+static VOID
+consume(ULONG producer_chance) {
+  XENBUS_WATCH_RING entry;
+  ULONGLONG popped;
+  ULONG key;
+
+  while (cons != prod) {
+    entry = ring[cons & (WATCH_RING_SIZE - 1)];
+    cons++;
+    popped = sequence + 1;
+    if (producer_chance && !test_rand_range(producer_chance))
+      produce_random();
+    key = key_of(entry.Index, entry.Path);
+    covered[key] = max(covered[key], popped);
+    dispatches++;
+  }
+  if (overflow) {
+    overflow = FALSE;
+    popped = sequence + 1;
+    for (key = 0; key < KEYS; key++)
+      covered[key] = max(covered[key], popped);
+    fire_alls++;
+  }
+}
+
+/* once the thread has caught up, nothing may be left undispatched */
+static VOID
+check_covered() {
+  ULONG key;
+
+  consume(0);
+  CHECK(cons == prod);
+  for (key = 0; key < KEYS; key++)
+    CHECK(last_event[key] < covered[key] || !last_event[key]);
+}
+
+static VOID
+setup() {
+  ULONG i, j;
+
+  for (i = 0; i < WATCHES; i++) {
+    for (j = 0; j < PATHS_PER_WATCH; j++)
+      snprintf(paths[i][j], sizeof(paths[i][j]), "backend/vbd/%u/%u/state", i, 768 + j);
+  }
+  memset(long_path, 'x', sizeof(long_path) - 1);
+}
+
+static VOID
+test_storm() {
+  ULONG round, burst;
+
+  for (round = 0; round < 20000; round++) {
+    /* bursts from a few events up to several times the queue */
+    wide = !test_rand_range(8);
+    for (burst = test_rand_range(test_rand_range(4) ? 32 : 4 * WATCH_RING_SIZE); burst; burst--)
+      produce_random();
+    check_unique();
+    consume(test_rand_range(4) ? 2 : 0);
+    if (!(round & 63))
+      check_covered();
+  }
+  check_covered();
+  CHECK(coalesced && overflows && fire_alls);
+}
+
+static VOID
+test_basic() {
+  ULONG p = 0, c = 0;
+  XENBUS_WATCH_RING r[WATCH_RING_SIZE];
+  char name[64];
+  ULONG i;
+
+  CHECK(XenBus_WatchRingAdd(r, c, &p, 1, "a") == XENBUS_WATCH_QUEUED);
+  CHECK(XenBus_WatchRingAdd(r, c, &p, 1, "a") == XENBUS_WATCH_COALESCED);
+  CHECK(XenBus_WatchRingAdd(r, c, &p, 2, "a") == XENBUS_WATCH_QUEUED);
+  CHECK(XenBus_WatchRingAdd(r, c, &p, 1, "b") == XENBUS_WATCH_QUEUED);
+  CHECK(p == 3);
+  /* popped entries don't coalesce */
+  c = 1;
+  CHECK(XenBus_WatchRingAdd(r, c, &p, 1, "a") == XENBUS_WATCH_QUEUED);
+  /* a path that doesn't fit is queued as the watch's own path */
+  CHECK(XenBus_WatchRingAdd(r, c, &p, 3, long_path) == XENBUS_WATCH_QUEUED);
+  CHECK(!r[4].Path[0] && r[4].Index == 3);
+  CHECK(XenBus_WatchRingAdd(r, c, &p, 3, "") == XENBUS_WATCH_COALESCED);
+  for (i = 0; p - c < WATCH_RING_SIZE; i++) {
+    snprintf(name, sizeof(name), "fill/%u", i);
+    CHECK(XenBus_WatchRingAdd(r, c, &p, 4, name) == XENBUS_WATCH_QUEUED);
+  }
+  CHECK(XenBus_WatchRingAdd(r, c, &p, 5, "new") == XENBUS_WATCH_OVERFLOW);
+  CHECK(XenBus_WatchRingAdd(r, c, &p, 1, "b") == XENBUS_WATCH_COALESCED);
+  CHECK(p - c == WATCH_RING_SIZE);
+}
+
+static VOID
+bench() {
+  XENBUS_WATCH_RING r[WATCH_RING_SIZE];
+  ULONG depths[] = {0, 8, 32, 127};
+  ULONG p, c, d, i, n = 1000000;
+  ULONGLONG t0, ns;
+  char name[64];
+
+  for (d = 0; d < ARRAY_SIZE(depths); d++) {
+    p = c = 0;
+    for (i = 0; i < depths[d]; i++) {
+      snprintf(name, sizeof(name), "backend/vbd/%u/768/state", i);
+      XenBus_WatchRingAdd(r, c, &p, (int)i, name);
+    }
+    /* add one more and take it off again, so every add scans depths[d] entries */
+    t0 = test_now_ns();
+    for (i = 0; i < n; i++) {
+      XenBus_WatchRingAdd(r, c, &p, WATCHES, "device/vbd/768/state");
+      p--;
+    }
+    ns = test_now_ns() - t0;
+    printf("%4u queued: %6.1f ns/event\n", depths[d], (double)ns / n);
+  }
+}
+
+int
+main(int argc, char **argv) {
+  setup();
+  if (test_bench_mode(argc, argv)) {
+    bench();
+    return 0;
+  }
+  test_srand(49);
+  test_basic();
+  test_storm();
+  printf("xenbus_watch_test: ok (%u events, %u coalesced, %u overflowed, %u dispatched, %u fire alls)\n",
+    events, coalesced, overflows, dispatches, fire_alls);
+  return 0;
+}
@@ -0,0 +1,1637 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+The storport, kernel and xenpci calls xenvbd_storport makes, done with
+pthreads, and a blkback stand-in for it to talk to. See xenvbd_sim.h.
+
+Storport is one adapter. StartIoLock is a mutex, the dpc runs on its own
+thread, the timer from RequestTimerCall runs on another and work items on a
+third. The backend raises events with its response lock held, which keeps
+them in order the way an interrupt would. Xenstore is a table per base, and
+a write to the frontend state moves the backend through its states there
+and then.
+*/
+
+#define _GNU_SOURCE
+
+#include "xenvbd_sim.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+DRIVER_INITIALIZE DriverEntry;
+
+/* longest a KeWaitForSingleObject may take before the simulation gives up on it */
+#define SIM_WAIT_LIMIT_US (60 * 1000000ULL)
+/* grant refs below this are left alone, as Xen reserves them */
+#define SIM_FIRST_GRANT_REF 8
+#define SIM_XENSTORE_ENTRIES 64
+#define SIM_EVENT_CHANNEL 1
+
+static sim_config_t config;
+static sim_stats_t stats;
+
+static VOID
+sim_violation(PCHAR format, ...) {
+  va_list args;
+
+  __atomic_add_fetch(&stats.violations, 1, __ATOMIC_SEQ_CST);
+  fprintf(stderr, "violation: ");
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  fprintf(stderr, "\n");
+}
+
+static VOID
+sim_count(ULONGLONG *counter) {
+  __atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+}
+
+ULONGLONG
+sim_now_us(VOID) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ULONGLONG)ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static VOID
+sim_cond_init(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/* waits on cond until the monotonic clock reaches until_us */
+static VOID
+sim_cond_wait_until(pthread_cond_t *cond, pthread_mutex_t *mutex, ULONGLONG until_us) {
+  struct timespec ts;
+
+  ts.tv_sec = until_us / 1000000ULL;
+  ts.tv_nsec = (until_us % 1000000ULL) * 1000;
+  pthread_cond_timedwait(cond, mutex, &ts);
+}
+
+static pthread_t
+sim_thread(PVOID (*routine)(PVOID), PVOID arg) {
+  pthread_t thread;
+
+  if (pthread_create(&thread, NULL, routine, arg)) {
+    fprintf(stderr, "pthread_create failed\n");
+    abort();
+  }
+  return thread;
+}
+
+/* -- memory ------------------------------------------------------------- */
+
+/* every pool allocation is page aligned and gets made up frame numbers, so anything the driver allocates can be
+   granted. Frame numbers are never reused, so a grant of freed memory can be caught */
+typedef struct {
+  PUCHAR va;
+  ULONG pages;
+  ULONG pfn;
+  BOOLEAN pool; /* from ExAllocatePoolWithTag by the driver */
+} sim_region_t;
+
+static pthread_mutex_t memory_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_region_t *regions; /* sorted by va */
+static ULONG region_count;
+static ULONG region_max;
+static PUCHAR *frames; /* va of each frame, NULL once freed. Frame 0 is never used */
+static ULONG frame_count = 1;
+static ULONG frame_max;
+static ULONG pool_allocations;
+
+static VOID sim_check_freed_frames(ULONG pfn, ULONG pages);
+
+/* index of the region containing va, or of where a region starting at va would go if found is NULL */
+static ULONG
+sim_find_region(PUCHAR va, BOOLEAN *found) {
+  ULONG low = 0, high = region_count, mid;
+
+  while (low < high) {
+    mid = (low + high) / 2;
+    if (va < regions[mid].va) {
+      high = mid;
+    } else if (va >= regions[mid].va + ((SIZE_T)regions[mid].pages << PAGE_SHIFT)) {
+      low = mid + 1;
+    } else {
+      *found = TRUE;
+      return mid;
+    }
+  }
+  *found = FALSE;
+  return low;
+}
+
+static PVOID
+sim_alloc_region(SIZE_T size, BOOLEAN pool) {
+  ULONG pages = (ULONG)((max(size, 1) + PAGE_SIZE - 1) >> PAGE_SHIFT);
+  PVOID va;
+  ULONG i, index;
+  BOOLEAN found;
+
+  if (posix_memalign(&va, PAGE_SIZE, (SIZE_T)pages << PAGE_SHIFT))
+    return NULL;
+  /* pool isn't zeroed */
+  memset(va, 0xA5, (SIZE_T)pages << PAGE_SHIFT);
+  pthread_mutex_lock(&memory_lock);
+  if (region_count == region_max) {
+    region_max = max(64, region_max * 2);
+    regions = realloc(regions, sizeof(sim_region_t) * region_max);
+  }
+  while (frame_count + pages > frame_max) {
+    frame_max = max(1024, frame_max * 2);
+    frames = realloc(frames, sizeof(PUCHAR) * frame_max);
+  }
+  index = sim_find_region(va, &found);
+  memmove(&regions[index + 1], &regions[index], sizeof(sim_region_t) * (region_count - index));
+  regions[index].va = va;
+  regions[index].pages = pages;
+  regions[index].pfn = frame_count;
+  regions[index].pool = pool;
+  region_count++;
+  for (i = 0; i < pages; i++)
+    frames[frame_count++] = (PUCHAR)va + ((SIZE_T)i << PAGE_SHIFT);
+  if (pool)
+    pool_allocations++;
+  pthread_mutex_unlock(&memory_lock);
+  return va;
+}
+
+static VOID
+sim_free_region(PVOID va, BOOLEAN pool) {
+  ULONG index, pfn, pages, i;
+  BOOLEAN found;
+
+  pthread_mutex_lock(&memory_lock);
+  index = sim_find_region(va, &found);
+  if (!found || regions[index].va != va || regions[index].pool != pool) {
+    pthread_mutex_unlock(&memory_lock);
+    sim_violation("freeing %p, which wasn't allocated", va);
+    return;
+  }
+  pfn = regions[index].pfn;
+  pages = regions[index].pages;
+  for (i = 0; i < pages; i++)
+    frames[pfn + i] = NULL;
+  memmove(&regions[index], &regions[index + 1], sizeof(sim_region_t) * (region_count - index - 1));
+  region_count--;
+  if (pool)
+    pool_allocations--;
+  pthread_mutex_unlock(&memory_lock);
+  sim_check_freed_frames(pfn, pages);
+  memset(va, 0x5A, (SIZE_T)pages << PAGE_SHIFT);
+  free(va);
+}
+
+/* NULL if pfn isn't there (any more) */
+static PUCHAR
+sim_frame_va(ULONG pfn) {
+  PUCHAR va = NULL;
+
+  pthread_mutex_lock(&memory_lock);
+  if (pfn && pfn < frame_count)
+    va = frames[pfn];
+  pthread_mutex_unlock(&memory_lock);
+  return va;
+}
+
+PVOID
+sim_alloc(SIZE_T size) {
+  return sim_alloc_region(size, FALSE);
+}
+
+VOID
+sim_free(PVOID p) {
+  sim_free_region(p, FALSE);
+}
+
+PVOID
+ExAllocatePoolWithTag(POOL_TYPE pool_type, SIZE_T size, ULONG tag) {
+  UNREFERENCED_PARAMETER(pool_type);
+  UNREFERENCED_PARAMETER(tag);
+  return sim_alloc_region(size, TRUE);
+}
+
+VOID
+ExFreePoolWithTag(PVOID p, ULONG tag) {
+  UNREFERENCED_PARAMETER(tag);
+  if (!p) {
+    sim_violation("ExFreePoolWithTag(NULL)");
+    return;
+  }
+  sim_free_region(p, TRUE);
+}
+
+PHYSICAL_ADDRESS
+MmGetPhysicalAddress(PVOID base_address) {
+  PHYSICAL_ADDRESS physical_address;
+  ULONG index;
+  BOOLEAN found;
+
+  pthread_mutex_lock(&memory_lock);
+  index = sim_find_region(base_address, &found);
+  if (!found) {
+    pthread_mutex_unlock(&memory_lock);
+    fprintf(stderr, "MmGetPhysicalAddress(%p) - not memory from the pool or sim_alloc\n", base_address);
+    abort();
+  }
+  physical_address.QuadPart = ((LONGLONG)(regions[index].pfn + (((PUCHAR)base_address - regions[index].va) >> PAGE_SHIFT)) << PAGE_SHIFT)
+    | ((ULONG_PTR)base_address & (PAGE_SIZE - 1));
+  pthread_mutex_unlock(&memory_lock);
+  return physical_address;
+}
+
+/* -- strings and debug output -------------------------------------------- */
+
+NTSTATUS
+RtlStringCbPrintfA(PCHAR dst, size_t dst_size, const char *format, ...) {
+  va_list args;
+  int length;
+
+  va_start(args, format);
+  length = vsnprintf(dst, dst_size, format, args);
+  va_end(args);
+  return (length < 0 || (size_t)length >= dst_size) ? STATUS_BUFFER_OVERFLOW : STATUS_SUCCESS;
+}
+
+NTSTATUS
+RtlStringCchCopyW(PWCHAR dst, size_t dst_count, const WCHAR *src) {
+  size_t length = wcslen(src);
+
+  if (length >= dst_count) {
+    wmemcpy(dst, src, dst_count - 1);
+    dst[dst_count - 1] = 0;
+    return STATUS_BUFFER_OVERFLOW;
+  }
+  wmemcpy(dst, src, length + 1);
+  return STATUS_SUCCESS;
+}
+
+/* only printed when verbose, except for a failed XN_ASSERT. %I64 is the msvc spelling of %ll */
+NTSTATUS
+XnDebugPrint(PCHAR format, ...) {
+  CHAR fixed[512];
+  PCHAR in, out;
+  va_list args;
+
+  if (!config.verbose && strncmp(format, "ASSERT(", 7) != 0)
+    return STATUS_SUCCESS;
+  for (in = format, out = fixed; *in && out < fixed + sizeof(fixed) - 3; ) {
+    if (in[0] == 'I' && in[1] == '6' && in[2] == '4') {
+      *out++ = 'l';
+      *out++ = 'l';
+      in += 3;
+    } else {
+      *out++ = *in++;
+    }
+  }
+  *out = 0;
+  va_start(args, format);
+  vfprintf(stderr, fixed, args);
+  va_end(args);
+  return STATUS_SUCCESS;
+}
+
+/* -- kernel -------------------------------------------------------------- */
+
+static pthread_mutex_t event_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond;
+
+VOID
+KeInitializeEvent(PKEVENT event, EVENT_TYPE type, BOOLEAN state) {
+  event->type = type;
+  event->signalled = state;
+}
+
+LONG
+KeSetEvent(PKEVENT event, LONG increment, BOOLEAN wait) {
+  LONG previous;
+
+  UNREFERENCED_PARAMETER(increment);
+  UNREFERENCED_PARAMETER(wait);
+  pthread_mutex_lock(&event_lock);
+  previous = event->signalled;
+  event->signalled = 1;
+  pthread_cond_broadcast(&event_cond);
+  pthread_mutex_unlock(&event_lock);
+  return previous;
+}
+
+/* only KEVENTs, and only without a timeout */
+NTSTATUS
+KeWaitForSingleObject(PVOID object, KWAIT_REASON wait_reason, KPROCESSOR_MODE wait_mode, BOOLEAN alertable, PLARGE_INTEGER timeout) {
+  PKEVENT event = object;
+  ULONGLONG limit = sim_now_us() + SIM_WAIT_LIMIT_US;
+
+  UNREFERENCED_PARAMETER(wait_reason);
+  UNREFERENCED_PARAMETER(wait_mode);
+  UNREFERENCED_PARAMETER(alertable);
+  XN_ASSERT(!timeout);
+  pthread_mutex_lock(&event_lock);
+  while (!event->signalled) {
+    if (sim_now_us() > limit) {
+      fprintf(stderr, "KeWaitForSingleObject - event not set after %llds\n", SIM_WAIT_LIMIT_US / 1000000);
+      abort();
+    }
+    sim_cond_wait_until(&event_cond, &event_lock, sim_now_us() + 100000);
+  }
+  if (event->type == SynchronizationEvent)
+    event->signalled = 0;
+  pthread_mutex_unlock(&event_lock);
+  return STATUS_SUCCESS;
+}
+
+/* 10MHz, like a recent Windows */
+LARGE_INTEGER
+KeQueryPerformanceCounter(PLARGE_INTEGER frequency) {
+  LARGE_INTEGER counter;
+  struct timespec ts;
+
+  if (frequency)
+    frequency->QuadPart = 10000000;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  counter.QuadPart = (LONGLONG)ts.tv_sec * 10000000 + ts.tv_nsec / 100;
+  return counter;
+}
+
+ULONG
+KeQueryTimeIncrement(VOID) {
+  return config.tick_us * 10;
+}
+
+KIRQL
+KeGetCurrentIrql(VOID) {
+  return 0;
+}
+
+/* -- work items ---------------------------------------------------------- */
+
+struct _IO_WORKITEM {
+  PIO_WORKITEM_ROUTINE routine;
+  PVOID context;
+  BOOLEAN queued;
+  struct _IO_WORKITEM *next; /* on the queue */
+  struct _IO_WORKITEM *all; /* every work item, so they can be freed */
+};
+
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond;
+static PIO_WORKITEM work_head;
+static PIO_WORKITEM work_tail;
+static PIO_WORKITEM work_items;
+static BOOLEAN work_stop;
+static pthread_t work_thread;
+
+PIO_WORKITEM
+IoAllocateWorkItem(PDEVICE_OBJECT device_object) {
+  PIO_WORKITEM work_item = calloc(1, sizeof(struct _IO_WORKITEM));
+
+  UNREFERENCED_PARAMETER(device_object);
+  pthread_mutex_lock(&work_lock);
+  work_item->all = work_items;
+  work_items = work_item;
+  pthread_mutex_unlock(&work_lock);
+  return work_item;
+}
+
+/* queueing a work item that is already queued does nothing */
+VOID
+IoQueueWorkItem(PIO_WORKITEM work_item, PIO_WORKITEM_ROUTINE routine, WORK_QUEUE_TYPE queue_type, PVOID context) {
+  UNREFERENCED_PARAMETER(queue_type);
+  pthread_mutex_lock(&work_lock);
+  if (!work_item->queued) {
+    work_item->routine = routine;
+    work_item->context = context;
+    work_item->queued = TRUE;
+    work_item->next = NULL;
+    if (work_tail)
+      work_tail->next = work_item;
+    else
+      work_head = work_item;
+    work_tail = work_item;
+    pthread_cond_signal(&work_cond);
+  }
+  pthread_mutex_unlock(&work_lock);
+}
+
+static PVOID
+sim_work_thread(PVOID arg) {
+  PIO_WORKITEM work_item;
+
+  UNREFERENCED_PARAMETER(arg);
+  pthread_mutex_lock(&work_lock);
+  while (!work_stop || work_head) {
+    if (!work_head) {
+      pthread_cond_wait(&work_cond, &work_lock);
+      continue;
+    }
+    work_item = work_head;
+    work_head = work_item->next;
+    if (!work_head)
+      work_tail = NULL;
+    work_item->queued = FALSE;
+    pthread_mutex_unlock(&work_lock);
+    work_item->routine(NULL, work_item->context);
+    pthread_mutex_lock(&work_lock);
+  }
+  pthread_mutex_unlock(&work_lock);
+  return NULL;
+}
+
+/* -- storport ------------------------------------------------------------ */
+
+static VIRTUAL_HW_INITIALIZATION_DATA hw;
+static PVOID device_extension;
+static ULONG fake_pdo;
+static ULONG fake_fdo;
+static pthread_mutex_t start_io_lock;
+
+static pthread_mutex_t dpc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dpc_cond;
+static PSTOR_DPC dpc_object;
+static BOOLEAN dpc_stop;
+static pthread_t dpc_thread;
+
+static pthread_mutex_t timer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_cond;
+static PHW_TIMER timer_routine;
+static ULONGLONG timer_due; /* 0 if the timer isn't set */
+static BOOLEAN timer_stop;
+static pthread_t timer_thread;
+
+ULONG
+StorPortInitialize(PVOID Argument1, PVOID Argument2, PHW_INITIALIZATION_DATA HwInitializationData, PVOID HwContext) {
+  PORT_CONFIGURATION_INFORMATION config_info;
+  BOOLEAN again = FALSE;
+
+  UNREFERENCED_PARAMETER(Argument1);
+  UNREFERENCED_PARAMETER(Argument2);
+  UNREFERENCED_PARAMETER(HwContext);
+  /* dump mode isn't simulated */
+  if (HwInitializationData->HwInitializationDataSize != sizeof(VIRTUAL_HW_INITIALIZATION_DATA))
+    return (ULONG)STATUS_UNSUCCESSFUL;
+  memcpy(&hw, HwInitializationData, sizeof(VIRTUAL_HW_INITIALIZATION_DATA));
+  device_extension = sim_alloc(hw.DeviceExtensionSize);
+  memset(device_extension, 0, hw.DeviceExtensionSize);
+  memset(&config_info, 0, sizeof(config_info));
+  config_info.Length = sizeof(config_info);
+  config_info.AdapterInterfaceType = Internal;
+  config_info.Dma64BitAddresses = SCSI_DMA64_SYSTEM_SUPPORTED;
+  if (hw.HwFindAdapter(device_extension, &fake_pdo, &fake_fdo, NULL, "", &config_info, &again) != SP_RETURN_FOUND)
+    return (ULONG)STATUS_UNSUCCESSFUL;
+  if (!hw.HwInitialize(device_extension))
+    return (ULONG)STATUS_UNSUCCESSFUL;
+  return STATUS_SUCCESS;
+}
+
+static VOID
+sim_set_timer(PHW_TIMER routine, ULONG us) {
+  pthread_mutex_lock(&timer_lock);
+  if (!us) {
+    timer_due = 0;
+  } else {
+    /* fires on a clock tick */
+    timer_routine = routine;
+    timer_due = sim_now_us() + (us + config.tick_us - 1) / config.tick_us * config.tick_us;
+  }
+  pthread_cond_signal(&timer_cond);
+  pthread_mutex_unlock(&timer_lock);
+}
+
+static PVOID
+sim_timer_thread(PVOID arg) {
+  PHW_TIMER routine;
+
+  UNREFERENCED_PARAMETER(arg);
+  pthread_mutex_lock(&timer_lock);
+  while (!timer_stop) {
+    if (!timer_due) {
+      pthread_cond_wait(&timer_cond, &timer_lock);
+    } else if (sim_now_us() < timer_due) {
+      sim_cond_wait_until(&timer_cond, &timer_lock, timer_due);
+    } else {
+      timer_due = 0;
+      routine = timer_routine;
+      pthread_mutex_unlock(&timer_lock);
+      routine(device_extension);
+      pthread_mutex_lock(&timer_lock);
+    }
+  }
+  pthread_mutex_unlock(&timer_lock);
+  return NULL;
+}
+
+VOID
+StorPortNotification(SCSI_NOTIFICATION_TYPE NotificationType, PVOID HwDeviceExtension, ...) {
+  va_list args;
+  PSCSI_REQUEST_BLOCK srb;
+  PHW_TIMER routine;
+  ULONG us;
+
+  UNREFERENCED_PARAMETER(HwDeviceExtension);
+  va_start(args, HwDeviceExtension);
+  switch (NotificationType) {
+  case RequestComplete:
+    srb = va_arg(args, PSCSI_REQUEST_BLOCK);
+    if (srb->SrbStatus == SRB_STATUS_PENDING)
+      sim_violation("srb %p completed with SRB_STATUS_PENDING", srb);
+    config.complete(srb);
+    break;
+  case NextRequest:
+    break;
+  case RequestTimerCall:
+    routine = va_arg(args, PHW_TIMER);
+    us = va_arg(args, ULONG);
+    sim_count(&stats.timer_calls);
+    sim_set_timer(routine, us);
+    break;
+  default:
+    sim_violation("unexpected StorPortNotification %d", NotificationType);
+    break;
+  }
+  va_end(args);
+}
+
+/* StartIoLock is the only one xenvbd takes. Taking it twice would hang a real system, so it aborts here */
+VOID
+StorPortAcquireSpinLock(PVOID HwDeviceExtension, STOR_SPINLOCK SpinLock, PVOID LockContext, PSTOR_LOCK_HANDLE LockHandle) {
+  UNREFERENCED_PARAMETER(HwDeviceExtension);
+  UNREFERENCED_PARAMETER(LockContext);
+  if (SpinLock != StartIoLock) {
+    sim_violation("StorPortAcquireSpinLock(%d) - only StartIoLock is simulated", SpinLock);
+    abort();
+  }
+  if (pthread_mutex_lock(&start_io_lock)) {
+    fprintf(stderr, "StartIoLock taken recursively\n");
+    abort();
+  }
+  LockHandle->Lock = SpinLock;
+}
+
+VOID
+StorPortReleaseSpinLock(PVOID HwDeviceExtension, PSTOR_LOCK_HANDLE LockHandle) {
+  UNREFERENCED_PARAMETER(HwDeviceExtension);
+  UNREFERENCED_PARAMETER(LockHandle);
+  if (pthread_mutex_unlock(&start_io_lock)) {
+    fprintf(stderr, "StartIoLock released when not held\n");
+    abort();
+  }
+}
+
+VOID
+StorPortInitializeDpc(PVOID HwDeviceExtension, PSTOR_DPC Dpc, PHW_DPC_ROUTINE HwDpcRoutine) {
+  Dpc->routine = HwDpcRoutine;
+  Dpc->device_extension = HwDeviceExtension;
+  Dpc->queued = FALSE;
+  dpc_object = Dpc;
+}
+
+/* FALSE if the dpc was already queued */
+BOOLEAN
+StorPortIssueDpc(PVOID HwDeviceExtension, PSTOR_DPC Dpc, PVOID SystemArgument1, PVOID SystemArgument2) {
+  BOOLEAN queued;
+
+  UNREFERENCED_PARAMETER(HwDeviceExtension);
+  UNREFERENCED_PARAMETER(SystemArgument1);
+  UNREFERENCED_PARAMETER(SystemArgument2);
+  if (Dpc != dpc_object) {
+    sim_violation("StorPortIssueDpc on a dpc that wasn't initialised");
+    return FALSE;
+  }
+  pthread_mutex_lock(&dpc_lock);
+  queued = !Dpc->queued;
+  Dpc->queued = TRUE;
+  pthread_cond_signal(&dpc_cond);
+  pthread_mutex_unlock(&dpc_lock);
+  return queued;
+}
+
+static PVOID
+sim_dpc_thread(PVOID arg) {
+  UNREFERENCED_PARAMETER(arg);
+  pthread_mutex_lock(&dpc_lock);
+  while (!dpc_stop) {
+    if (!dpc_object || !dpc_object->queued) {
+      pthread_cond_wait(&dpc_cond, &dpc_lock);
+      continue;
+    }
+    dpc_object->queued = FALSE;
+    pthread_mutex_unlock(&dpc_lock);
+    sim_count(&stats.dpcs);
+    dpc_object->routine(dpc_object, dpc_object->device_extension, NULL, NULL);
+    pthread_mutex_lock(&dpc_lock);
+  }
+  pthread_mutex_unlock(&dpc_lock);
+  return NULL;
+}
+
+/* MapBuffers is STOR_MAP_ALL_BUFFERS so DataBuffer is already a system address */
+ULONG
+StorPortGetSystemAddress(PVOID HwDeviceExtension, PSCSI_REQUEST_BLOCK Srb, PVOID *SystemAddress) {
+  UNREFERENCED_PARAMETER(HwDeviceExtension);
+  *SystemAddress = Srb->DataBuffer;
+  return STOR_STATUS_SUCCESS;
+}
+
+PHYSICAL_ADDRESS
+StorPortGetPhysicalAddress(PVOID HwDeviceExtension, PSCSI_REQUEST_BLOCK Srb, PVOID VirtualAddress, ULONG *Length) {
+  UNREFERENCED_PARAMETER(HwDeviceExtension);
+  UNREFERENCED_PARAMETER(Srb);
+  *Length = (ULONG)(PAGE_SIZE - ((ULONG_PTR)VirtualAddress & (PAGE_SIZE - 1)));
+  return MmGetPhysicalAddress(VirtualAddress);
+}
+
+BOOLEAN
+StorPortSetDeviceQueueDepth(PVOID HwDeviceExtension, UCHAR PathId, UCHAR TargetId, UCHAR Lun, ULONG Depth) {
+  UNREFERENCED_PARAMETER(HwDeviceExtension);
+  if (PathId || TargetId || Lun)
+    return FALSE;
+  stats.queue_depth = Depth;
+  return TRUE;
+}
+
+/* -- grant table --------------------------------------------------------- */
+
+typedef struct {
+  ULONG frame;
+  ULONG tag;
+  ULONG map_count; /* backend mappings */
+  BOOLEAN allocated;
+  BOOLEAN granted;
+  BOOLEAN readonly;
+  grant_ref_t next_free;
+} sim_grant_t;
+
+static pthread_mutex_t grant_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_grant_t *grants;
+static grant_ref_t grant_free;
+
+static VOID
+sim_init_grants(VOID) {
+  grant_ref_t ref;
+
+  grants = calloc(config.grant_entries, sizeof(sim_grant_t));
+  grant_free = INVALID_GRANT_REF;
+  for (ref = config.grant_entries; ref-- > SIM_FIRST_GRANT_REF; ) {
+    grants[ref].next_free = grant_free;
+    grant_free = ref;
+  }
+}
+
+/* called with grant_lock held */
+static sim_grant_t *
+sim_grant(grant_ref_t ref, PCHAR what) {
+  if (ref < SIM_FIRST_GRANT_REF || ref >= config.grant_entries || !grants[ref].allocated) {
+    sim_violation("%s on grant ref %u, which isn't allocated", what, ref);
+    return NULL;
+  }
+  return &grants[ref];
+}
+
+/* called with grant_lock held */
+static grant_ref_t
+sim_allocate_grant(ULONG tag) {
+  grant_ref_t ref = grant_free;
+
+  if (ref == INVALID_GRANT_REF)
+    return ref;
+  grant_free = grants[ref].next_free;
+  grants[ref].allocated = TRUE;
+  grants[ref].granted = FALSE;
+  grants[ref].tag = tag;
+  stats.grants_in_use++;
+  stats.grants_max = max(stats.grants_max, stats.grants_in_use);
+  return ref;
+}
+
+/* called with grant_lock held */
+static VOID
+sim_free_grant(grant_ref_t ref) {
+  grants[ref].allocated = FALSE;
+  grants[ref].next_free = grant_free;
+  grant_free = ref;
+  stats.grants_in_use--;
+}
+
+grant_ref_t
+XnGrantAccess(XN_HANDLE handle, uint32_t frame, int readonly, grant_ref_t ref, ULONG tag) {
+  sim_grant_t *grant;
+
+  UNREFERENCED_PARAMETER(handle);
+  pthread_mutex_lock(&grant_lock);
+  if (ref == INVALID_GRANT_REF) {
+    ref = sim_allocate_grant(tag);
+    if (ref == INVALID_GRANT_REF) {
+      pthread_mutex_unlock(&grant_lock);
+      return ref;
+    }
+  }
+  grant = sim_grant(ref, "XnGrantAccess");
+  if (grant) {
+    if (grant->granted)
+      sim_violation("grant ref %u granted again without XnEndAccess", ref);
+    if (grant->tag != tag)
+      sim_violation("grant ref %u granted with tag %08x, allocated with %08x", ref, tag, grant->tag);
+    if (!sim_frame_va(frame))
+      sim_violation("granting frame %u, which isn't allocated", frame);
+    grant->frame = frame;
+    grant->readonly = (BOOLEAN)readonly;
+    grant->granted = TRUE;
+  }
+  pthread_mutex_unlock(&grant_lock);
+  return ref;
+}
+
+BOOLEAN
+XnEndAccess(XN_HANDLE handle, grant_ref_t ref, BOOLEAN keepref, ULONG tag) {
+  sim_grant_t *grant;
+  BOOLEAN ended = FALSE;
+
+  UNREFERENCED_PARAMETER(handle);
+  pthread_mutex_lock(&grant_lock);
+  grant = sim_grant(ref, "XnEndAccess");
+  if (grant) {
+    if (!grant->granted) {
+      sim_violation("XnEndAccess on grant ref %u, which isn't granted", ref);
+    } else if (grant->map_count) {
+      sim_violation("XnEndAccess on grant ref %u while the backend has it mapped", ref);
+    } else {
+      if (grant->tag != tag)
+        sim_violation("XnEndAccess on grant ref %u with tag %08x, allocated with %08x", ref, tag, grant->tag);
+      grant->granted = FALSE;
+      if (!keepref)
+        sim_free_grant(ref);
+      ended = TRUE;
+    }
+  }
+  pthread_mutex_unlock(&grant_lock);
+  return ended;
+}
+
+grant_ref_t
+XnAllocateGrant(XN_HANDLE handle, ULONG tag) {
+  grant_ref_t ref;
+
+  UNREFERENCED_PARAMETER(handle);
+  pthread_mutex_lock(&grant_lock);
+  ref = sim_allocate_grant(tag);
+  pthread_mutex_unlock(&grant_lock);
+  return ref;
+}
+
+VOID
+XnFreeGrant(XN_HANDLE handle, grant_ref_t ref, ULONG tag) {
+  sim_grant_t *grant;
+
+  UNREFERENCED_PARAMETER(handle);
+  UNREFERENCED_PARAMETER(tag);
+  pthread_mutex_lock(&grant_lock);
+  grant = sim_grant(ref, "XnFreeGrant");
+  if (grant) {
+    if (grant->granted)
+      sim_violation("XnFreeGrant on grant ref %u, which is still granted", ref);
+    else
+      sim_free_grant(ref);
+  }
+  pthread_mutex_unlock(&grant_lock);
+}
+
+/* the backend's side. NULL if ref can't be mapped for this access */
+static PUCHAR
+sim_map_grant(grant_ref_t ref, BOOLEAN write) {
+  sim_grant_t *grant;
+  PUCHAR va = NULL;
+
+  pthread_mutex_lock(&grant_lock);
+  grant = sim_grant(ref, "backend map");
+  if (grant) {
+    if (!grant->granted) {
+      sim_violation("backend map of grant ref %u, which isn't granted", ref);
+    } else if (write && grant->readonly) {
+      sim_violation("backend write to grant ref %u, which is granted readonly", ref);
+    } else if (!(va = sim_frame_va(grant->frame))) {
+      sim_violation("backend map of grant ref %u, whose frame %u has been freed", ref, grant->frame);
+    } else {
+      grant->map_count++;
+    }
+  }
+  pthread_mutex_unlock(&grant_lock);
+  return va;
+}
+
+static VOID
+sim_unmap_grant(grant_ref_t ref) {
+  pthread_mutex_lock(&grant_lock);
+  grants[ref].map_count--;
+  pthread_mutex_unlock(&grant_lock);
+}
+
+static VOID
+sim_check_freed_frames(ULONG pfn, ULONG pages) {
+  grant_ref_t ref;
+
+  if (!grants)
+    return;
+  pthread_mutex_lock(&grant_lock);
+  for (ref = SIM_FIRST_GRANT_REF; ref < config.grant_entries; ref++) {
+    if (grants[ref].granted && grants[ref].frame >= pfn && grants[ref].frame < pfn + pages)
+      sim_violation("memory freed while grant ref %u still grants frame %u", ref, grants[ref].frame);
+  }
+  pthread_mutex_unlock(&grant_lock);
+}
+
+/* -- xenstore and the device --------------------------------------------- */
+
+typedef struct {
+  ULONG base;
+  CHAR path[32];
+  CHAR value[32];
+} sim_xenstore_entry_t;
+
+static pthread_mutex_t xenstore_lock = PTHREAD_MUTEX_INITIALIZER;
+static sim_xenstore_entry_t xenstore[SIM_XENSTORE_ENTRIES];
+static ULONG xenstore_count;
+
+static PXN_DEVICE_CALLBACK device_callback;
+static PVOID device_context;
+static UCHAR hypercall_stubs[PAGE_SIZE];
+
+static VOID sim_backend_frontend_state(ULONG state);
+
+static BOOLEAN
+sim_xenstore_read(ULONG base, PCHAR path, PCHAR value, size_t size) {
+  ULONG i;
+  BOOLEAN found = FALSE;
+
+  pthread_mutex_lock(&xenstore_lock);
+  for (i = 0; i < xenstore_count; i++) {
+    if (xenstore[i].base == base && !strcmp(xenstore[i].path, path)) {
+      RtlStringCbCopyA(value, size, xenstore[i].value);
+      found = TRUE;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&xenstore_lock);
+  return found;
+}
+
+static VOID
+sim_xenstore_write(ULONG base, PCHAR path, PCHAR value) {
+  ULONG i;
+
+  pthread_mutex_lock(&xenstore_lock);
+  for (i = 0; i < xenstore_count; i++) {
+    if (xenstore[i].base == base && !strcmp(xenstore[i].path, path))
+      break;
+  }
+  if (i == xenstore_count) {
+    if (xenstore_count == SIM_XENSTORE_ENTRIES) {
+      fprintf(stderr, "xenstore full\n");
+      abort();
+    }
+    xenstore_count++;
+    xenstore[i].base = base;
+    RtlStringCbCopyA(xenstore[i].path, sizeof(xenstore[i].path), path);
+  }
+  RtlStringCbCopyA(xenstore[i].value, sizeof(xenstore[i].value), value);
+  pthread_mutex_unlock(&xenstore_lock);
+  /* the backend's watch on the frontend state */
+  if (base == XN_BASE_FRONTEND && !strcmp(path, "state"))
+    sim_backend_frontend_state((ULONG)strtoul(value, NULL, 10));
+}
+
+static VOID
+sim_xenstore_write_int(ULONG base, PCHAR path, ULONGLONG value) {
+  CHAR string[32];
+
+  RtlStringCbPrintfA(string, sizeof(string), "%llu", value);
+  sim_xenstore_write(base, path, string);
+}
+
+NTSTATUS
+XnReadInt32(XN_HANDLE handle, ULONG base, PCHAR path, ULONG *value) {
+  CHAR string[32];
+
+  UNREFERENCED_PARAMETER(handle);
+  if (!sim_xenstore_read(base, path, string, sizeof(string)))
+    return STATUS_UNSUCCESSFUL;
+  *value = (ULONG)strtoul(string, NULL, 10);
+  return STATUS_SUCCESS;
+}
+
+NTSTATUS
+XnReadInt64(XN_HANDLE handle, ULONG base, PCHAR path, ULONGLONG *value) {
+  CHAR string[32];
+
+  UNREFERENCED_PARAMETER(handle);
+  if (!sim_xenstore_read(base, path, string, sizeof(string)))
+    return STATUS_UNSUCCESSFUL;
+  *value = strtoull(string, NULL, 10);
+  return STATUS_SUCCESS;
+}
+
+NTSTATUS
+XnWriteInt32(XN_HANDLE handle, ULONG base, PCHAR path, ULONG value) {
+  UNREFERENCED_PARAMETER(handle);
+  sim_xenstore_write_int(base, path, value);
+  return STATUS_SUCCESS;
+}
+
+/* free the string with XnFreeMem */
+NTSTATUS
+XnReadString(XN_HANDLE handle, ULONG base, PCHAR path, PCHAR *value) {
+  CHAR string[32];
+
+  UNREFERENCED_PARAMETER(handle);
+  if (!sim_xenstore_read(base, path, string, sizeof(string)))
+    return STATUS_UNSUCCESSFUL;
+  *value = ExAllocatePoolWithTag(NonPagedPool, strlen(string) + 1, XENPCI_POOL_TAG);
+  strcpy(*value, string);
+  return STATUS_SUCCESS;
+}
+
+NTSTATUS
+XnReadWriteMultiple(XN_HANDLE handle, PXN_XENSTORE_OP ops, ULONG count) {
+  NTSTATUS status = STATUS_SUCCESS;
+  ULONG i;
+
+  for (i = 0; i < count; i++) {
+    switch (ops[i].type) {
+    case XN_XENSTORE_READ_STRING:
+      ops[i].status = XnReadString(handle, ops[i].base, ops[i].path, &ops[i].value);
+      break;
+    case XN_XENSTORE_WRITE_STRING:
+      sim_xenstore_write(ops[i].base, ops[i].path, ops[i].value);
+      ops[i].status = STATUS_SUCCESS;
+      break;
+    case XN_XENSTORE_READ_INT:
+      ops[i].status = XnReadInt64(handle, ops[i].base, ops[i].path, &ops[i].int_value);
+      break;
+    case XN_XENSTORE_WRITE_INT:
+      sim_xenstore_write_int(ops[i].base, ops[i].path, ops[i].int_value);
+      ops[i].status = STATUS_SUCCESS;
+      break;
+    default:
+      sim_violation("XnReadWriteMultiple op type %d", ops[i].type);
+      ops[i].status = STATUS_UNSUCCESSFUL;
+      break;
+    }
+    if (!NT_SUCCESS(ops[i].status))
+      status = STATUS_UNSUCCESSFUL;
+  }
+  return status;
+}
+
+ULONG
+XnGetVersion() {
+  return 1;
+}
+
+/* the backend is in InitWait by the time the frontend opens it */
+XN_HANDLE
+XnOpenDevice(PDEVICE_OBJECT pdo, PXN_DEVICE_CALLBACK callback, PVOID context) {
+  UNREFERENCED_PARAMETER(pdo);
+  device_callback = callback;
+  device_context = context;
+  sim_xenstore_write_int(XN_BASE_BACKEND, "state", XenbusStateInitWait);
+  callback(context, XN_DEVICE_CALLBACK_BACKEND_STATE, (PVOID)(ULONG_PTR)XenbusStateInitWait);
+  return (XN_HANDLE)&device_callback;
+}
+
+VOID
+XnCloseDevice(XN_HANDLE handle) {
+  UNREFERENCED_PARAMETER(handle);
+  device_callback = NULL;
+}
+
+/* the disks are unplugged from qemu */
+VOID
+XnGetValue(XN_HANDLE handle, ULONG value_type, PVOID value) {
+  UNREFERENCED_PARAMETER(handle);
+  switch (value_type) {
+  case XN_VALUE_TYPE_QEMU_HIDE_FLAGS:
+    *(PULONG)value = QEMU_UNPLUG_ALL_IDE_DISKS;
+    break;
+  case XN_VALUE_TYPE_QEMU_FILTER:
+    *(PBOOLEAN)value = FALSE;
+    break;
+  }
+}
+
+PVOID
+XnGetHypercallStubs() {
+  return hypercall_stubs;
+}
+
+VOID
+XnSetHypercallStubs(PVOID _hypercall_stubs) {
+  UNREFERENCED_PARAMETER(_hypercall_stubs);
+}
+
+VOID
+XnPrintDump() {
+}
+
+/* -- backend ------------------------------------------------------------- */
+
+typedef struct sim_io {
+  struct sim_io *next_due;
+  struct sim_io *next_in_flight;
+  blkif_request_t req; /* copied off the ring */
+  PUCHAR va[BLKIF_MAX_SEGMENTS_PER_REQUEST]; /* mapped segments */
+  ULONG mapped;
+  ULONGLONG start; /* 512 byte sectors covered */
+  ULONGLONG end;
+  BOOLEAN write; /* changes the disk */
+  int16_t status;
+  ULONGLONG due_us;
+} sim_io_t;
+
+static struct {
+  pthread_mutex_t lock; /* the request side of the ring, in_flight and due */
+  pthread_cond_t ring_cond;
+  pthread_cond_t due_cond;
+  pthread_mutex_t response_lock; /* the response side of the ring and the event channel */
+  BOOLEAN stop;
+  BOOLEAN connected;
+  BOOLEAN kicked;
+  blkif_back_ring_t ring;
+  grant_ref_t ring_grefs[XENVBD_MAX_RING_PAGES];
+  ULONG ring_pages;
+  sim_io_t *in_flight; /* off the ring and not yet responded to */
+  sim_io_t *due; /* waiting for a worker, soonest first */
+  PUCHAR ram; /* RAM disk, or NULL if fd is a file */
+  int fd;
+  ULONGLONG rand_state;
+  PXN_EVENT_CALLBACK event_callback;
+  PVOID event_context;
+  pthread_t ring_thread;
+  pthread_t *workers;
+} backend;
+
+NTSTATUS
+XnBindEvent(XN_HANDLE handle, evtchn_port_t *port, PXN_EVENT_CALLBACK callback, PVOID context) {
+  UNREFERENCED_PARAMETER(handle);
+  pthread_mutex_lock(&backend.response_lock);
+  backend.event_callback = callback;
+  backend.event_context = context;
+  pthread_mutex_unlock(&backend.response_lock);
+  *port = SIM_EVENT_CHANNEL;
+  return STATUS_SUCCESS;
+}
+
+NTSTATUS
+XnUnbindEvent(XN_HANDLE handle, evtchn_port_t port) {
+  UNREFERENCED_PARAMETER(handle);
+  if (port != SIM_EVENT_CHANNEL)
+    sim_violation("XnUnbindEvent on port %d", port);
+  pthread_mutex_lock(&backend.response_lock);
+  backend.event_callback = NULL;
+  pthread_mutex_unlock(&backend.response_lock);
+  return STATUS_SUCCESS;
+}
+
+NTSTATUS
+XnNotify(XN_HANDLE handle, evtchn_port_t port) {
+  UNREFERENCED_PARAMETER(handle);
+  if (port != SIM_EVENT_CHANNEL)
+    sim_violation("XnNotify on port %d", port);
+  sim_count(&stats.frontend_notifies);
+  pthread_mutex_lock(&backend.lock);
+  backend.kicked = TRUE;
+  pthread_cond_signal(&backend.ring_cond);
+  pthread_mutex_unlock(&backend.lock);
+  return STATUS_SUCCESS;
+}
+
+static VOID
+sim_backend_set_state(ULONG state) {
+  sim_xenstore_write_int(XN_BASE_BACKEND, "state", state);
+  if (device_callback)
+    device_callback(device_context, XN_DEVICE_CALLBACK_BACKEND_STATE, (PVOID)(ULONG_PTR)state);
+}
+
+static VOID
+sim_backend_unmap(sim_io_t *io) {
+  while (io->mapped)
+    sim_unmap_grant(io->req.seg[--io->mapped].gref);
+}
+
+/* called with backend.lock held */
+static ULONGLONG
+sim_backend_due(VOID) {
+  ULONGLONG due_us = sim_now_us() + config.latency_us;
+
+  if (config.jitter_us) {
+    backend.rand_state ^= backend.rand_state << 13;
+    backend.rand_state ^= backend.rand_state >> 7;
+    backend.rand_state ^= backend.rand_state << 17;
+    due_us += backend.rand_state % config.jitter_us;
+  }
+  return due_us;
+}
+
+/* called with backend.lock held */
+/* checks a request taken off the ring, maps its segments and queues it for a worker */
+static VOID
+sim_backend_queue(sim_io_t *io) {
+  blkif_request_discard_t *discard = (blkif_request_discard_t *)&io->req;
+  sim_io_t *p, **pp;
+  ULONG i;
+
+  io->status = BLKIF_RSP_OKAY;
+  switch (io->req.operation) {
+  case BLKIF_OP_READ:
+  case BLKIF_OP_WRITE:
+    io->write = (BOOLEAN)(io->req.operation == BLKIF_OP_WRITE);
+    io->start = io->req.sector_number;
+    io->end = io->start;
+    if (!io->req.nr_segments || io->req.nr_segments > BLKIF_MAX_SEGMENTS_PER_REQUEST) {
+      sim_violation("request %llu has %d segments", io->req.id, io->req.nr_segments);
+      io->status = BLKIF_RSP_ERROR;
+      break;
+    }
+    for (i = 0; i < io->req.nr_segments; i++) {
+      if (io->req.seg[i].first_sect > io->req.seg[i].last_sect || io->req.seg[i].last_sect >= PAGE_SIZE / 512) {
+        sim_violation("request %llu segment %d is sectors %d to %d", io->req.id, i, io->req.seg[i].first_sect, io->req.seg[i].last_sect);
+        io->status = BLKIF_RSP_ERROR;
+        break;
+      }
+      io->end += io->req.seg[i].last_sect - io->req.seg[i].first_sect + 1;
+    }
+    if (io->status != BLKIF_RSP_OKAY)
+      break;
+    for (i = 0; i < io->req.nr_segments; i++) {
+      /* a read from the disk writes to the frontend's memory */
+      io->va[i] = sim_map_grant(io->req.seg[i].gref, (BOOLEAN)!io->write);
+      if (!io->va[i]) {
+        io->status = BLKIF_RSP_ERROR;
+        break;
+      }
+      io->mapped++;
+    }
+    stats.backend_segments += io->req.nr_segments;
+    break;
+  case BLKIF_OP_DISCARD:
+    io->write = TRUE;
+    io->start = discard->sector_number;
+    io->end = discard->sector_number + discard->nr_sectors;
+    break;
+  case BLKIF_OP_FLUSH_DISKCACHE:
+  case BLKIF_OP_WRITE_BARRIER:
+    break;
+  default:
+    io->status = BLKIF_RSP_EOPNOTSUPP;
+    break;
+  }
+  if (io->end > config.sectors || io->end < io->start) {
+    sim_violation("request %llu is sectors %llu to %llu, past the end of the disk", io->req.id, io->start, io->end);
+    io->status = BLKIF_RSP_ERROR;
+  }
+  if (io->status != BLKIF_RSP_OKAY) {
+    sim_backend_unmap(io);
+    io->start = io->end = 0;
+  }
+  for (p = backend.in_flight; p; p = p->next_in_flight) {
+    if (p->req.id == io->req.id)
+      sim_violation("request id %llu is already on the ring", io->req.id);
+    /* xenvbd holds back anything that overlaps a write until the write is done */
+    if (p->write && io->start < p->end && p->start < io->end)
+      sim_violation("request %llu (sectors %llu to %llu) overlaps write %llu (sectors %llu to %llu)",
+        io->req.id, io->start, io->end, p->req.id, p->start, p->end);
+  }
+  io->next_in_flight = backend.in_flight;
+  backend.in_flight = io;
+  stats.backend_requests++;
+
+  io->due_us = sim_backend_due();
+  for (pp = &backend.due; *pp && (*pp)->due_us <= io->due_us; pp = &(*pp)->next_due);
+  io->next_due = *pp;
+  *pp = io;
+  pthread_cond_signal(&backend.due_cond);
+}
+
+/* takes requests off the ring whenever the frontend notifies */
+static PVOID
+sim_ring_thread(PVOID arg) {
+  sim_io_t *io;
+  RING_IDX rc, rp;
+  int more;
+
+  UNREFERENCED_PARAMETER(arg);
+  pthread_mutex_lock(&backend.lock);
+  while (!backend.stop) {
+    if (!backend.kicked || !backend.connected) {
+      pthread_cond_wait(&backend.ring_cond, &backend.lock);
+      continue;
+    }
+    backend.kicked = FALSE;
+    sim_count(&stats.backend_events);
+    do {
+      rp = backend.ring.sring->req_prod;
+      KeMemoryBarrier();
+      for (rc = backend.ring.req_cons; rc != rp; rc++) {
+        if (RING_REQUEST_CONS_OVERFLOW(&backend.ring, rc)) {
+          sim_violation("frontend produced more requests than the ring holds");
+          break;
+        }
+        io = calloc(1, sizeof(sim_io_t));
+        memcpy(&io->req, RING_GET_REQUEST(&backend.ring, rc), sizeof(blkif_request_t));
+        backend.ring.req_cons = rc + 1;
+        sim_backend_queue(io);
+      }
+      RING_FINAL_CHECK_FOR_REQUESTS(&backend.ring, more);
+    } while (more);
+  }
+  pthread_mutex_unlock(&backend.lock);
+  return NULL;
+}
+
+static VOID
+sim_backend_rw(sim_io_t *io) {
+  ULONGLONG offset = io->start * 512;
+  ULONG i, length;
+  PUCHAR va;
+  ssize_t done;
+
+  for (i = 0; i < io->req.nr_segments; i++) {
+    va = io->va[i] + io->req.seg[i].first_sect * 512;
+    length = (io->req.seg[i].last_sect - io->req.seg[i].first_sect + 1) * 512;
+    if (backend.ram) {
+      if (io->write)
+        memcpy(backend.ram + offset, va, length);
+      else
+        memcpy(va, backend.ram + offset, length);
+    } else {
+      if (io->write)
+        done = pwrite(backend.fd, va, length, offset);
+      else
+        done = pread(backend.fd, va, length, offset);
+      if (done != (ssize_t)length) {
+        io->status = BLKIF_RSP_ERROR;
+        return;
+      }
+    }
+    offset += length;
+  }
+}
+
+static VOID
+sim_backend_discard(sim_io_t *io) {
+  if (backend.ram) {
+    memset(backend.ram + io->start * 512, 0, (io->end - io->start) * 512);
+  } else if (fallocate(backend.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, io->start * 512, (io->end - io->start) * 512)) {
+    io->status = BLKIF_RSP_ERROR;
+  }
+}
+
+/* called with backend.response_lock held */
+static VOID
+sim_backend_respond(sim_io_t *io) {
+  blkif_response_t *rsp;
+  int notify;
+
+  rsp = RING_GET_RESPONSE(&backend.ring, backend.ring.rsp_prod_pvt);
+  rsp->id = io->req.id;
+  rsp->operation = io->req.operation;
+  rsp->status = io->status;
+  backend.ring.rsp_prod_pvt++;
+  RING_PUSH_RESPONSES_AND_CHECK_NOTIFY(&backend.ring, notify);
+  if (notify && backend.event_callback)
+    backend.event_callback(backend.event_context);
+}
+
+/* does the requests as they come due, then responds */
+static PVOID
+sim_worker_thread(PVOID arg) {
+  sim_io_t *io, **pp;
+
+  UNREFERENCED_PARAMETER(arg);
+  pthread_mutex_lock(&backend.lock);
+  for (;;) {
+    if (!backend.due) {
+      if (backend.stop)
+        break;
+      pthread_cond_wait(&backend.due_cond, &backend.lock);
+      continue;
+    }
+    if (backend.due->due_us > sim_now_us()) {
+      sim_cond_wait_until(&backend.due_cond, &backend.lock, backend.due->due_us);
+      continue;
+    }
+    io = backend.due;
+    backend.due = io->next_due;
+    /* another worker may be waiting on the next one */
+    if (backend.due)
+      pthread_cond_signal(&backend.due_cond);
+    pthread_mutex_unlock(&backend.lock);
+
+    if (io->status == BLKIF_RSP_OKAY) {
+      switch (io->req.operation) {
+      case BLKIF_OP_READ:
+      case BLKIF_OP_WRITE:
+        sim_backend_rw(io);
+        break;
+      case BLKIF_OP_DISCARD:
+        sim_backend_discard(io);
+        break;
+      }
+    }
+    sim_backend_unmap(io);
+
+    /* out of in_flight before the response, as xenvbd may send an overlapping request as soon as it sees it */
+    pthread_mutex_lock(&backend.lock);
+    for (pp = &backend.in_flight; *pp != io; pp = &(*pp)->next_in_flight);
+    *pp = io->next_in_flight;
+    pthread_mutex_unlock(&backend.lock);
+
+    pthread_mutex_lock(&backend.response_lock);
+    if (backend.connected)
+      sim_backend_respond(io);
+    pthread_mutex_unlock(&backend.response_lock);
+    free(io);
+
+    pthread_mutex_lock(&backend.lock);
+  }
+  pthread_mutex_unlock(&backend.lock);
+  return NULL;
+}
+
+/* maps the ring the frontend has granted. The ring pages are one allocation, so contiguous here */
+static BOOLEAN
+sim_backend_connect(VOID) {
+  CHAR path[16];
+  CHAR protocol[32];
+  ULONG order = 0, i;
+  ULONG ref;
+  PUCHAR va, first = NULL;
+
+  XnReadInt32(NULL, XN_BASE_FRONTEND, "ring-page-order", &order);
+  if (order > config.max_ring_page_order) {
+    sim_violation("frontend ring-page-order %d is more than max-ring-page-order %d", order, config.max_ring_page_order);
+    return FALSE;
+  }
+  if (!sim_xenstore_read(XN_BASE_FRONTEND, "protocol", protocol, sizeof(protocol)) || strcmp(protocol, XEN_IO_PROTO_ABI_NATIVE)) {
+    sim_violation("frontend protocol isn't %s", XEN_IO_PROTO_ABI_NATIVE);
+    return FALSE;
+  }
+  backend.ring_pages = 1 << order;
+  for (i = 0; i < backend.ring_pages; i++) {
+    if (sim_xenstore_read(XN_BASE_FRONTEND, "ring-ref", path, sizeof(path)) != !order)
+      sim_violation("frontend ring-ref and ring-page-order %d disagree", order);
+    if (order)
+      RtlStringCbPrintfA(path, sizeof(path), "ring-ref%d", i);
+    else
+      RtlStringCbCopyA(path, sizeof(path), "ring-ref");
+    if (!NT_SUCCESS(XnReadInt32(NULL, XN_BASE_FRONTEND, path, &ref))) {
+      sim_violation("frontend has no %s", path);
+      return FALSE;
+    }
+    va = sim_map_grant((grant_ref_t)ref, TRUE);
+    if (!va)
+      return FALSE;
+    backend.ring_grefs[i] = (grant_ref_t)ref;
+    if (!i)
+      first = va;
+    else if (va != first + ((SIZE_T)i << PAGE_SHIFT))
+      sim_violation("ring page %d isn't after page 0", i);
+  }
+  pthread_mutex_lock(&backend.lock);
+  pthread_mutex_lock(&backend.response_lock);
+  BACK_RING_INIT(&backend.ring, (blkif_sring_t *)first, PAGE_SIZE << order);
+  backend.connected = TRUE;
+  pthread_mutex_unlock(&backend.response_lock);
+  pthread_mutex_unlock(&backend.lock);
+  return TRUE;
+}
+
+static VOID
+sim_backend_disconnect(VOID) {
+  ULONG i;
+
+  pthread_mutex_lock(&backend.lock);
+  pthread_mutex_lock(&backend.response_lock);
+  backend.connected = FALSE;
+  pthread_mutex_unlock(&backend.response_lock);
+  pthread_mutex_unlock(&backend.lock);
+  for (i = 0; i < backend.ring_pages; i++)
+    sim_unmap_grant(backend.ring_grefs[i]);
+  backend.ring_pages = 0;
+}
+
+/* the backend's watch on the frontend state */
+static VOID
+sim_backend_frontend_state(ULONG state) {
+  BOOLEAN busy;
+
+  switch (state) {
+  case XenbusStateInitialised:
+    if (sim_backend_connect())
+      sim_backend_set_state(XenbusStateConnected);
+    break;
+  case XenbusStateClosing:
+    pthread_mutex_lock(&backend.lock);
+    busy = (BOOLEAN)(backend.in_flight || (backend.connected && RING_HAS_UNCONSUMED_REQUESTS(&backend.ring)));
+    pthread_mutex_unlock(&backend.lock);
+    if (busy)
+      sim_violation("frontend closing with requests on the ring");
+    sim_backend_set_state(XenbusStateClosing);
+    break;
+  case XenbusStateClosed:
+    if (backend.ring_pages)
+      sim_backend_disconnect();
+    sim_backend_set_state(XenbusStateClosed);
+    break;
+  }
+}
+
+/* -- the simulation ------------------------------------------------------ */
+
+VOID
+sim_config_default(sim_config_t *sim_config) {
+  memset(sim_config, 0, sizeof(sim_config_t));
+  sim_config->sectors = 1024 * 1024;
+  sim_config->max_ring_page_order = 0;
+  sim_config->grant_entries = 1024;
+  sim_config->workers = 4;
+  sim_config->tick_us = 1000;
+}
+
+ULONG
+sim_srb_extension_size(VOID) {
+  return hw.SrbExtensionSize;
+}
+
+VOID
+sim_get_stats(sim_stats_t *sim_stats) {
+  *sim_stats = stats;
+}
+
+BOOLEAN
+sim_start(sim_config_t *sim_config) {
+  pthread_mutexattr_t attr;
+  ULONG i;
+
+  config = *sim_config;
+  memset(&stats, 0, sizeof(stats));
+  sim_cond_init(&event_cond);
+  sim_cond_init(&work_cond);
+  sim_cond_init(&dpc_cond);
+  sim_cond_init(&timer_cond);
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
+  pthread_mutex_init(&start_io_lock, &attr);
+  pthread_mutexattr_destroy(&attr);
+  sim_init_grants();
+
+  memset(&backend, 0, sizeof(backend));
+  pthread_mutex_init(&backend.lock, NULL);
+  pthread_mutex_init(&backend.response_lock, NULL);
+  sim_cond_init(&backend.ring_cond);
+  sim_cond_init(&backend.due_cond);
+  backend.rand_state = 0x9E3779B97F4A7C15ULL;
+  backend.fd = -1;
+  if (config.file) {
+    backend.fd = open(config.file, O_RDWR | O_CREAT, 0600);
+    if (backend.fd < 0 || ftruncate(backend.fd, config.sectors * 512)) {
+      fprintf(stderr, "can't use %s as the disk: %s\n", config.file, strerror(errno));
+      return FALSE;
+    }
+  } else {
+    /* only what gets written is ever backed */
+    backend.ram = mmap(NULL, config.sectors * 512, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (backend.ram == MAP_FAILED) {
+      fprintf(stderr, "can't map a %llu sector disk\n", (unsigned long long)config.sectors);
+      return FALSE;
+    }
+  }
+
+  xenstore_count = 0;
+  sim_xenstore_write(XN_BASE_FRONTEND, "device-type", "disk");
+  if (config.bounce_buffers)
+    sim_xenstore_write_int(XN_BASE_FRONTEND, "bounce-buffers", config.bounce_buffers);
+  if (config.read_cache_pages)
+    sim_xenstore_write_int(XN_BASE_FRONTEND, "read-cache-pages", config.read_cache_pages);
+  sim_xenstore_write_int(XN_BASE_BACKEND, "max-ring-page-order", config.max_ring_page_order);
+  sim_xenstore_write_int(XN_BASE_BACKEND, "sectors", config.sectors);
+  sim_xenstore_write_int(XN_BASE_BACKEND, "sector-size", 512);
+  sim_xenstore_write_int(XN_BASE_BACKEND, "feature-flush-cache", 1);
+  sim_xenstore_write_int(XN_BASE_BACKEND, "feature-discard", 1);
+  sim_xenstore_write(XN_BASE_BACKEND, "mode", "w");
+  sim_xenstore_write_int(XN_BASE_BACKEND, "state", XenbusStateInitialising);
+
+  work_stop = dpc_stop = timer_stop = FALSE;
+  work_thread = sim_thread(sim_work_thread, NULL);
+  dpc_thread = sim_thread(sim_dpc_thread, NULL);
+  timer_thread = sim_thread(sim_timer_thread, NULL);
+  backend.ring_thread = sim_thread(sim_ring_thread, NULL);
+  backend.workers = calloc(config.workers, sizeof(pthread_t));
+  for (i = 0; i < config.workers; i++)
+    backend.workers[i] = sim_thread(sim_worker_thread, NULL);
+
+  /* a RegistryPath, so not dump mode */
+  if (DriverEntry((PDRIVER_OBJECT)&fake_fdo, (PUNICODE_STRING)&fake_pdo) != STATUS_SUCCESS) {
+    fprintf(stderr, "DriverEntry failed\n");
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* what the bus driver does over a save and restore. The backend comes back in InitWait */
+VOID
+sim_suspend_resume(VOID) {
+  device_callback(device_context, XN_DEVICE_CALLBACK_SUSPEND, NULL);
+  sim_backend_set_state(XenbusStateInitWait);
+  device_callback(device_context, XN_DEVICE_CALLBACK_RESUME, NULL);
+}
+
+/* disconnects the way a suspend does, then checks that everything the driver had was given back */
+VOID
+sim_stop(VOID) {
+  PIO_WORKITEM work_item;
+  ULONG i;
+
+  device_callback(device_context, XN_DEVICE_CALLBACK_SUSPEND, NULL);
+  sim_set_timer(NULL, 0);
+
+  pthread_mutex_lock(&work_lock);
+  work_stop = TRUE;
+  pthread_cond_signal(&work_cond);
+  pthread_mutex_unlock(&work_lock);
+  pthread_join(work_thread, NULL);
+  pthread_mutex_lock(&dpc_lock);
+  dpc_stop = TRUE;
+  pthread_cond_signal(&dpc_cond);
+  pthread_mutex_unlock(&dpc_lock);
+  pthread_join(dpc_thread, NULL);
+  pthread_mutex_lock(&timer_lock);
+  timer_stop = TRUE;
+  pthread_cond_signal(&timer_cond);
+  pthread_mutex_unlock(&timer_lock);
+  pthread_join(timer_thread, NULL);
+  pthread_mutex_lock(&backend.lock);
+  backend.stop = TRUE;
+  pthread_cond_broadcast(&backend.ring_cond);
+  pthread_cond_broadcast(&backend.due_cond);
+  pthread_mutex_unlock(&backend.lock);
+  pthread_join(backend.ring_thread, NULL);
+  for (i = 0; i < config.workers; i++)
+    pthread_join(backend.workers[i], NULL);
+  free(backend.workers);
+
+  while (work_items) {
+    work_item = work_items;
+    work_items = work_item->all;
+    free(work_item);
+  }
+  work_head = work_tail = NULL;
+  sim_free(device_extension);
+  device_extension = NULL;
+  dpc_object = NULL;
+  if (stats.grants_in_use)
+    sim_violation("%d grant refs still allocated", stats.grants_in_use);
+  if (pool_allocations)
+    sim_violation("%d pool allocations not freed", pool_allocations);
+  free(grants);
+  grants = NULL;
+  if (backend.ram)
+    munmap(backend.ram, config.sectors * 512);
+  else
+    close(backend.fd);
+  pthread_mutex_destroy(&start_io_lock);
+}
+
+/* xenvbd takes StartIoLock in HwStartIo itself */
+VOID
+sim_start_io(PSCSI_REQUEST_BLOCK srb) {
+  if (!hw.HwStartIo(device_extension, srb))
+    sim_violation("HwStartIo returned FALSE");
+}
@@ -0,0 +1,85 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+Runs the storport miniport in xenvbd_storport as a user mode program.
+xenvbd_sim.c supplies the storport, kernel and xenpci calls the driver makes
+(see ddk/) and a blkback stand-in that serves the ring from a RAM disk or a
+sparse file on a pool of worker threads, with a configurable latency.
+
+Memory from ExAllocatePoolWithTag and sim_alloc is given made up page frame
+numbers so it can be granted. The grant table and the backend check what
+the driver does with them - granting memory that isn't there, ending access
+to a grant the backend still has mapped, freeing granted memory, requests
+with bad segments and requests that overlap a write already on the ring
+are all counted as violations.
+*/
+
+#ifndef _XENVBD_SIM_H
+#define _XENVBD_SIM_H
+
+#include "../xenvbd_storport/xenvbd.h"
+
+typedef VOID (*PSIM_COMPLETE)(PSCSI_REQUEST_BLOCK srb);
+
+typedef struct {
+  ULONGLONG sectors; /* disk size in 512 byte sectors */
+  PCHAR file; /* sparse file to serve from. NULL for a RAM disk */
+  ULONG max_ring_page_order; /* what the backend offers */
+  ULONG grant_entries; /* size of the grant table */
+  ULONG latency_us; /* backend service time for each request */
+  ULONG jitter_us; /* up to this much more at random */
+  ULONG workers; /* backend threads serving requests */
+  ULONG bounce_buffers; /* frontend bounce-buffers, 0 to leave it out */
+  ULONG read_cache_pages; /* frontend read-cache-pages, 0 to leave it out */
+  ULONG tick_us; /* clock tick. storport timer calls are rounded up to this */
+  BOOLEAN verbose; /* print the driver's debug output */
+  PSIM_COMPLETE complete; /* called for every completed srb, with StartIoLock held */
+} sim_config_t;
+
+typedef struct {
+  ULONG violations;
+  ULONG grants_in_use; /* allocated grant entries */
+  ULONG grants_max; /* most allocated at once */
+  ULONG queue_depth; /* what the driver set with StorPortSetDeviceQueueDepth */
+  ULONGLONG backend_requests;
+  ULONGLONG backend_segments;
+  ULONGLONG backend_events; /* events raised by the backend */
+  ULONGLONG frontend_notifies; /* XnNotify calls */
+  ULONGLONG timer_calls; /* RequestTimerCall notifications */
+  ULONGLONG dpcs; /* dpc routine calls */
+} sim_stats_t;
+
+VOID sim_config_default(sim_config_t *config);
+/* runs DriverEntry, which finds and connects the adapter. FALSE if that failed */
+BOOLEAN sim_start(sim_config_t *config);
+/* disconnects the device like a suspend does and stops the backend */
+VOID sim_stop(VOID);
+/* hands an srb to HwStartIo. srb->SrbExtension must have room for SrbExtensionSize bytes */
+VOID sim_start_io(PSCSI_REQUEST_BLOCK srb);
+ULONG sim_srb_extension_size(VOID);
+/* suspends and resumes the device from the calling thread. Srbs can be sent the whole time */
+VOID sim_suspend_resume(VOID);
+VOID sim_get_stats(sim_stats_t *stats);
+/* page aligned memory the driver can grant, for srb data buffers */
+PVOID sim_alloc(SIZE_T size);
+VOID sim_free(PVOID p);
+ULONGLONG sim_now_us(VOID);
+
+#endif
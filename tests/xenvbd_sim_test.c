@@ -0,0 +1,694 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+Drives the whole storport miniport (xenvbd_storport/xenvbd.c) against the
+blkback stand-in in xenvbd_sim.c, fio style. A submitter thread keeps a
+queue depth of READ/WRITE(10) and (16) srbs going through HwStartIo and
+collects them as the driver completes them.
+
+Every sector written holds its sector number, a stamp (the sequence number
+of the write) and a pattern made from both. A read has to see, for each
+sector, the last write submitted before it, as xenvbd keeps srbs in order
+against writes. Sectors written again while the read was in flight aren't
+checked - the write may overtake the read, even halfway through a sector. After each run the simulation checks that every
+grant and pool allocation was given back.
+
+With no arguments the checks below are run. "bench" runs a few fixed
+workloads and reports IOPS, bandwidth and latency percentiles, and
+"run --help" lists the options for a workload of your own.
+*/
+
+#include "xenvbd_sim.h"
+#include "test.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+#define MAX_QUEUE_DEPTH 256
+#define MAX_SECTORS 512 /* 256K */
+#define SECTOR_WORDS (512 / sizeof(ULONGLONG))
+
+typedef struct io {
+  SCSI_REQUEST_BLOCK srb; /* first, so the completion callback can find the io */
+  SENSE_DATA sense;
+  PVOID srb_extension;
+  PUCHAR buffer; /* MAX_SECTORS * 512 + PAGE_SIZE of grantable memory */
+  PUCHAR data; /* where in buffer this io's data starts */
+  ULONGLONG sector;
+  ULONG sectors;
+  BOOLEAN write;
+  BOOLEAN in_flight;
+  ULONGLONG seq;
+  ULONGLONG submit_ns;
+  ULONGLONG complete_ns;
+  ULONGLONG base[MAX_SECTORS]; /* for a read, the stamp of the last write submitted to each sector */
+  struct io *next_done;
+} io_t;
+
+typedef struct {
+  PCHAR name;
+  ULONG queue_depth;
+  ULONG min_sectors; /* sizes are powers of two between these */
+  ULONG max_sectors;
+  ULONG read_percent;
+  BOOLEAN sequential;
+  ULONGLONG span; /* sectors used, from 0 */
+  ULONG unaligned_percent; /* data buffers not on a 512 byte boundary */
+  ULONG ios; /* stop after this many */
+  ULONG seconds; /* or after this long */
+  ULONG suspends; /* suspend and resume this many times during the run */
+  BOOLEAN verify;
+} workload_t;
+
+typedef struct {
+  ULONGLONG ios;
+  ULONGLONG bytes;
+  ULONGLONG verify_errors;
+  ULONGLONG errors; /* srbs that didn't succeed */
+  ULONGLONG elapsed_ns;
+  ULONGLONG *latency_ns;
+  ULONGLONG latency_count;
+  ULONGLONG latency_max;
+  XENVBD_DEVICE_STATS device;
+  sim_stats_t sim;
+} result_t;
+
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static io_t *done_list;
+
+static io_t ios[MAX_QUEUE_DEPTH];
+static ULONGLONG *last_write; /* stamp of the last write submitted to each sector of the span */
+static volatile BOOLEAN suspends_done;
+
+/* called by the driver with StartIoLock held */
+static VOID
+complete_srb(PSCSI_REQUEST_BLOCK srb) {
+  io_t *io = (io_t *)srb;
+
+  pthread_mutex_lock(&done_lock);
+  if (!io->in_flight) {
+    fprintf(stderr, "srb %p completed twice\n", srb);
+    abort();
+  }
+  io->in_flight = FALSE;
+  io->complete_ns = test_now_ns();
+  io->next_done = done_list;
+  done_list = io;
+  pthread_cond_signal(&done_cond);
+  pthread_mutex_unlock(&done_lock);
+}
+
+/* completed ios, oldest last. Waits for at least one if wait is set */
+static io_t *
+take_done(BOOLEAN wait) {
+  io_t *list;
+
+  pthread_mutex_lock(&done_lock);
+  while (wait && !done_list)
+    pthread_cond_wait(&done_cond, &done_lock);
+  list = done_list;
+  done_list = NULL;
+  pthread_mutex_unlock(&done_lock);
+  return list;
+}
+
+static VOID
+init_io(io_t *io) {
+  memset(&io->srb, 0, sizeof(io->srb));
+  io->srb.Length = sizeof(SCSI_REQUEST_BLOCK);
+  io->srb.SrbExtension = io->srb_extension;
+  io->srb.SenseInfoBuffer = &io->sense;
+  io->srb.SenseInfoBufferLength = sizeof(io->sense);
+  io->srb.TimeOutValue = 10;
+}
+
+static VOID
+start_io(io_t *io) {
+  io->in_flight = TRUE;
+  io->submit_ns = test_now_ns();
+  sim_start_io(&io->srb);
+}
+
+/* sends one srb when nothing else is in flight and waits for it */
+static UCHAR
+run_srb(io_t *io) {
+  start_io(io);
+  CHECK(take_done(TRUE) == io);
+  return io->srb.SrbStatus & ~SRB_STATUS_AUTOSENSE_VALID;
+}
+
+static VOID
+get_device_stats(XENVBD_DEVICE_STATS *device_stats) {
+  io_t *io = &ios[0];
+  PSRB_IO_CONTROL sic = (PSRB_IO_CONTROL)io->buffer;
+
+  init_io(io);
+  memset(sic, 0, sizeof(SRB_IO_CONTROL) + sizeof(XENVBD_DEVICE_STATS));
+  sic->HeaderLength = sizeof(SRB_IO_CONTROL);
+  memcpy(sic->Signature, XENVBD_STATS_SIG, 8);
+  sic->ControlCode = XENVBD_STATS_GET_COUNTERS;
+  sic->Length = sizeof(XENVBD_DEVICE_STATS);
+  io->srb.Function = SRB_FUNCTION_IO_CONTROL;
+  io->srb.SrbFlags = SRB_FLAGS_DATA_IN | SRB_FLAGS_DATA_OUT;
+  io->srb.DataBuffer = sic;
+  io->srb.DataTransferLength = sizeof(SRB_IO_CONTROL) + sizeof(XENVBD_DEVICE_STATS);
+  CHECK(run_srb(io) == SRB_STATUS_SUCCESS);
+  memcpy(device_stats, (PUCHAR)sic + sizeof(SRB_IO_CONTROL), sizeof(XENVBD_DEVICE_STATS));
+}
+
+/* INQUIRY and READ CAPACITY, as the disk class driver would. Returns the queue depth the driver asked for */
+static ULONG
+probe_disk(ULONGLONG sectors) {
+  io_t *io = &ios[0];
+  PUCHAR data = io->buffer;
+  sim_stats_t sim_stats;
+
+  init_io(io);
+  io->srb.Function = SRB_FUNCTION_EXECUTE_SCSI;
+  io->srb.CdbLength = 6;
+  io->srb.Cdb[0] = SCSIOP_INQUIRY;
+  io->srb.Cdb[4] = 36;
+  io->srb.SrbFlags = SRB_FLAGS_DATA_IN;
+  io->srb.DataBuffer = data;
+  io->srb.DataTransferLength = 36;
+  CHECK(run_srb(io) == SRB_STATUS_SUCCESS);
+  CHECK((data[0] & 0x1f) == 0); /* direct access device */
+  CHECK(!memcmp(data + 8, SCSI_DEVICE_MANUFACTURER, 8));
+
+  init_io(io);
+  io->srb.Function = SRB_FUNCTION_EXECUTE_SCSI;
+  io->srb.CdbLength = 10;
+  io->srb.Cdb[0] = SCSIOP_READ_CAPACITY;
+  io->srb.SrbFlags = SRB_FLAGS_DATA_IN;
+  io->srb.DataBuffer = data;
+  io->srb.DataTransferLength = 8;
+  CHECK(run_srb(io) == SRB_STATUS_SUCCESS);
+  /* last block and block length, big endian */
+  CHECK(((ULONG)data[0] << 24 | (ULONG)data[1] << 16 | (ULONG)data[2] << 8 | data[3]) == min(sectors - 1, 0xFFFFFFFF));
+  CHECK(((ULONG)data[4] << 24 | (ULONG)data[5] << 16 | (ULONG)data[6] << 8 | data[7]) == 512);
+
+  sim_get_stats(&sim_stats);
+  CHECK(sim_stats.queue_depth);
+  return sim_stats.queue_depth;
+}
+
+static ULONGLONG
+pattern(ULONGLONG sector, ULONGLONG stamp, ULONG word) {
+  ULONGLONG x = (sector * 0x9E3779B97F4A7C15ULL) ^ (stamp * 0xC2B2AE3D27D4EB4FULL) ^ word;
+
+  x ^= x >> 29;
+  return x * 0xBF58476D1CE4E5B9ULL;
+}
+
+static VOID
+fill_sectors(io_t *io) {
+  ULONGLONG *words;
+  ULONG i, j;
+
+  for (i = 0; i < io->sectors; i++) {
+    words = (ULONGLONG *)(io->data + i * 512);
+    words[0] = io->sector + i;
+    words[1] = io->seq;
+    for (j = 2; j < SECTOR_WORDS; j++)
+      words[j] = pattern(io->sector + i, io->seq, j);
+  }
+}
+
+/* counts the sectors that don't hold what they should */
+static ULONG
+verify_sectors(io_t *io) {
+  ULONGLONG *words;
+  ULONGLONG stamp;
+  ULONG i, j, errors = 0;
+  BOOLEAN ok;
+
+  for (i = 0; i < io->sectors; i++) {
+    if (last_write[io->sector + i] > io->seq)
+      continue;
+    words = (ULONGLONG *)(io->data + i * 512);
+    stamp = words[1];
+    ok = TRUE;
+    if (stamp != io->base[i])
+      ok = FALSE;
+    else if (!stamp) {
+      /* never written */
+      for (j = 0; j < SECTOR_WORDS; j++)
+        ok = (BOOLEAN)(ok && !words[j]);
+    } else {
+      ok = (BOOLEAN)(words[0] == io->sector + i);
+      for (j = 2; j < SECTOR_WORDS; j++)
+        ok = (BOOLEAN)(ok && words[j] == pattern(io->sector + i, stamp, j));
+    }
+    if (!ok) {
+      if (errors < 4)
+        fprintf(stderr, "read %llu: sector %llu has stamp %llu, expected %llu\n",
+          (unsigned long long)io->seq, (unsigned long long)(io->sector + i), (unsigned long long)stamp, (unsigned long long)io->base[i]);
+      errors++;
+    }
+  }
+  return errors;
+}
+
+static VOID
+build_rw(io_t *io, workload_t *workload, ULONGLONG *next_sector, ULONGLONG seq) {
+  ULONG sizes = 0, offset;
+  ULONG i;
+
+  while ((workload->min_sectors << (sizes + 1)) <= workload->max_sectors)
+    sizes++;
+  io->sectors = workload->min_sectors << test_rand_range(sizes + 1);
+  if (workload->sequential) {
+    if (*next_sector + io->sectors > workload->span)
+      *next_sector = 0;
+    io->sector = *next_sector;
+    *next_sector += io->sectors;
+  } else {
+    io->sector = test_rand() % (workload->span - io->sectors + 1);
+    /* keep requests of a size on their natural boundary, as a filesystem would */
+    io->sector &= ~(ULONGLONG)(io->sectors - 1);
+  }
+  io->write = (BOOLEAN)(test_rand_range(100) >= workload->read_percent);
+  io->seq = seq;
+
+  if (workload->unaligned_percent && test_rand_range(100) < workload->unaligned_percent)
+    offset = 8;
+  else
+    offset = test_rand_range(PAGE_SIZE / 512) * 512;
+  io->data = io->buffer + offset;
+
+  init_io(io);
+  io->srb.Function = SRB_FUNCTION_EXECUTE_SCSI;
+  io->srb.SrbFlags = io->write ? SRB_FLAGS_DATA_OUT : SRB_FLAGS_DATA_IN;
+  io->srb.DataBuffer = io->data;
+  io->srb.DataTransferLength = io->sectors * 512;
+  if (test_rand_range(4)) {
+    io->srb.CdbLength = 10;
+    io->srb.Cdb[0] = io->write ? SCSIOP_WRITE : SCSIOP_READ;
+    for (i = 0; i < 4; i++)
+      io->srb.Cdb[2 + i] = (UCHAR)(io->sector >> (24 - i * 8));
+    io->srb.Cdb[7] = (UCHAR)(io->sectors >> 8);
+    io->srb.Cdb[8] = (UCHAR)io->sectors;
+  } else {
+    io->srb.CdbLength = 16;
+    io->srb.Cdb[0] = io->write ? SCSIOP_WRITE16 : SCSIOP_READ16;
+    for (i = 0; i < 8; i++)
+      io->srb.Cdb[2 + i] = (UCHAR)(io->sector >> (56 - i * 8));
+    for (i = 0; i < 4; i++)
+      io->srb.Cdb[10 + i] = (UCHAR)(io->sectors >> (24 - i * 8));
+  }
+
+  if (!workload->verify)
+    return;
+  if (io->write) {
+    fill_sectors(io);
+    for (i = 0; i < io->sectors; i++)
+      last_write[io->sector + i] = seq;
+  } else {
+    /* anything left in the buffer mustn't pass for the data */
+    memset(io->data, 0xEE, io->sectors * 512);
+    for (i = 0; i < io->sectors; i++)
+      io->base[i] = last_write[io->sector + i];
+  }
+}
+
+static PVOID
+suspend_thread(PVOID arg) {
+  workload_t *workload = arg;
+  ULONG i;
+
+  for (i = 0; i < workload->suspends; i++) {
+    usleep(10000 + (i * 7919) % 20000);
+    sim_suspend_resume();
+  }
+  suspends_done = TRUE;
+  return NULL;
+}
+
+static VOID
+run_workload(sim_config_t *config, workload_t *workload, result_t *result) {
+  ULONG slots[MAX_QUEUE_DEPTH];
+  ULONG free_slots, queue_depth, in_flight = 0;
+  ULONGLONG next_sector = 0, seq = 0, target, start_ns, stop_ns;
+  ULONGLONG latency_max_count;
+  pthread_t thread;
+  io_t *io, *next;
+  ULONG i;
+
+  memset(result, 0, sizeof(result_t));
+  config->complete = complete_srb;
+  for (i = 0; i < MAX_QUEUE_DEPTH; i++) {
+    ios[i].buffer = sim_alloc(MAX_SECTORS * 512 + PAGE_SIZE);
+    ios[i].in_flight = FALSE;
+  }
+  if (workload->verify)
+    last_write = calloc(workload->span, sizeof(ULONGLONG));
+  CHECK(workload->span <= config->sectors && workload->max_sectors <= MAX_SECTORS);
+  CHECK(sim_start(config));
+  for (i = 0; i < MAX_QUEUE_DEPTH; i++)
+    ios[i].srb_extension = malloc(sim_srb_extension_size());
+
+  queue_depth = min(min(workload->queue_depth, MAX_QUEUE_DEPTH), probe_disk(config->sectors));
+  for (free_slots = 0; free_slots < queue_depth; free_slots++)
+    slots[free_slots] = free_slots;
+  latency_max_count = workload->ios ? workload->ios : 1 << 20;
+  result->latency_ns = malloc(sizeof(ULONGLONG) * latency_max_count);
+
+  suspends_done = !workload->suspends;
+  if (workload->suspends)
+    pthread_create(&thread, NULL, suspend_thread, workload);
+  target = workload->ios;
+  start_ns = test_now_ns();
+  stop_ns = workload->seconds ? start_ns + workload->seconds * 1000000000ULL : ~0ULL;
+  for (;;) {
+    while (free_slots && (target ? seq < target : test_now_ns() < stop_ns)) {
+      io = &ios[slots[--free_slots]];
+      build_rw(io, workload, &next_sector, ++seq);
+      in_flight++;
+      start_io(io);
+    }
+    if (!in_flight) {
+      if (suspends_done)
+        break;
+      /* keep going until the suspends are done, so they happen with ios on the ring */
+      if (target)
+        target += queue_depth;
+      continue;
+    }
+    for (io = take_done(TRUE); io; io = next) {
+      next = io->next_done;
+      in_flight--;
+      slots[free_slots++] = (ULONG)(io - ios);
+      result->ios++;
+      if ((io->srb.SrbStatus & ~SRB_STATUS_AUTOSENSE_VALID) != SRB_STATUS_SUCCESS) {
+        if (result->errors < 4)
+          fprintf(stderr, "%s %llu sectors at %llu failed with SrbStatus %02x\n", io->write ? "write" : "read",
+            (unsigned long long)io->sectors, (unsigned long long)io->sector, io->srb.SrbStatus);
+        result->errors++;
+        continue;
+      }
+      result->bytes += io->sectors * 512;
+      if (workload->verify && !io->write)
+        result->verify_errors += verify_sectors(io);
+      if (result->latency_count < latency_max_count)
+        result->latency_ns[result->latency_count++] = io->complete_ns - io->submit_ns;
+      result->latency_max = max(result->latency_max, io->complete_ns - io->submit_ns);
+    }
+  }
+  result->elapsed_ns = test_now_ns() - start_ns;
+  if (workload->suspends)
+    pthread_join(thread, NULL);
+
+  get_device_stats(&result->device);
+  sim_stop();
+  sim_get_stats(&result->sim);
+  for (i = 0; i < MAX_QUEUE_DEPTH; i++) {
+    sim_free(ios[i].buffer);
+    free(ios[i].srb_extension);
+  }
+  free(last_write);
+  last_write = NULL;
+}
+
+static int
+compare_ns(const void *a, const void *b) {
+  ULONGLONG x = *(const ULONGLONG *)a, y = *(const ULONGLONG *)b;
+
+  return (x > y) - (x < y);
+}
+
+static double
+percentile_us(result_t *result, double p) {
+  if (!result->latency_count)
+    return 0;
+  return result->latency_ns[(ULONGLONG)(p / 100 * (result->latency_count - 1))] / 1000.0;
+}
+
+static VOID
+report(workload_t *workload, result_t *result) {
+  double seconds = result->elapsed_ns / 1e9;
+  ULONGLONG rw_requests = result->device.requests[XENVBD_LATENCY_OP_READ] + result->device.requests[XENVBD_LATENCY_OP_WRITE];
+
+  qsort(result->latency_ns, result->latency_count, sizeof(ULONGLONG), compare_ns);
+  printf("  %-22s %8.0f IOPS %8.1f MB/s  lat us p50 %7.1f p99 %7.1f p99.9 %7.1f max %7.1f\n",
+    workload->name, result->ios / seconds, result->bytes / seconds / 1e6,
+    percentile_us(result, 50), percentile_us(result, 99), percentile_us(result, 99.9), result->latency_max / 1000.0);
+  printf("  %-22s ring requests %llu (%.2f segments each), events %llu, notifies %llu, merged srbs %llu, cache hits %llu, bounced %llu, grants max %u\n",
+    "", (unsigned long long)rw_requests, rw_requests ? (double)result->device.segments / rw_requests : 0.0,
+    (unsigned long long)result->device.events, (unsigned long long)result->device.notifies,
+    (unsigned long long)result->device.merged_srbs, (unsigned long long)result->device.read_cache_hits,
+    (unsigned long long)result->device.bounce_requests, result->sim.grants_max);
+}
+
+static VOID
+check_result(workload_t *workload, result_t *result) {
+  report(workload, result);
+  CHECK(result->sim.violations == 0);
+  CHECK(result->sim.grants_in_use == 0);
+  CHECK(result->errors == 0);
+  CHECK(result->verify_errors == 0);
+  CHECK(result->ios >= workload->ios);
+  free(result->latency_ns);
+}
+
+static VOID
+run_checks(VOID) {
+  sim_config_t config;
+  workload_t workload;
+  result_t result;
+  CHAR file[] = "/tmp/xenvbd_sim_test.XXXXXX";
+  int fd;
+
+  /* small 4K requests on a single page ring */
+  sim_config_default(&config);
+  memset(&workload, 0, sizeof(workload));
+  workload.name = "random 4K 70/30";
+  workload.queue_depth = 32;
+  workload.min_sectors = workload.max_sectors = 8;
+  workload.read_percent = 70;
+  workload.span = 16384;
+  workload.ios = 20000;
+  workload.verify = TRUE;
+  run_workload(&config, &workload, &result);
+  check_result(&workload, &result);
+  CHECK(result.device.requests[XENVBD_LATENCY_OP_WRITE]);
+
+  /* every size up to 256K, some of them unaligned, with a grant table too small for everything on a 4 page ring */
+  sim_config_default(&config);
+  config.max_ring_page_order = 2;
+  config.grant_entries = 256;
+  config.latency_us = 50;
+  config.jitter_us = 200;
+  memset(&workload, 0, sizeof(workload));
+  workload.name = "mixed 512B-256K";
+  workload.queue_depth = 64;
+  workload.min_sectors = 1;
+  workload.max_sectors = 512;
+  workload.read_percent = 50;
+  workload.unaligned_percent = 10;
+  workload.span = 65536;
+  workload.ios = 10000;
+  workload.verify = TRUE;
+  run_workload(&config, &workload, &result);
+  check_result(&workload, &result);
+  CHECK(result.device.unaligned_requests);
+
+  /* mostly sequential reads through the read cache, served from a sparse file */
+  fd = mkstemp(file);
+  CHECK(fd >= 0);
+  close(fd);
+  sim_config_default(&config);
+  config.file = file;
+  config.read_cache_pages = 256;
+  config.latency_us = 20;
+  memset(&workload, 0, sizeof(workload));
+  workload.name = "sequential cached";
+  workload.queue_depth = 8;
+  workload.min_sectors = 1;
+  workload.max_sectors = 8;
+  workload.read_percent = 90;
+  workload.sequential = TRUE;
+  workload.span = 8192;
+  workload.ios = 20000;
+  workload.verify = TRUE;
+  run_workload(&config, &workload, &result);
+  unlink(file);
+  check_result(&workload, &result);
+  CHECK(result.device.read_cache_hits);
+
+  /* suspend and resume with the ring busy */
+  sim_config_default(&config);
+  config.latency_us = 100;
+  memset(&workload, 0, sizeof(workload));
+  workload.name = "suspend/resume";
+  workload.queue_depth = 32;
+  workload.min_sectors = 8;
+  workload.max_sectors = 128;
+  workload.read_percent = 50;
+  workload.span = 32768;
+  workload.ios = 10000;
+  workload.suspends = 5;
+  workload.verify = TRUE;
+  run_workload(&config, &workload, &result);
+  check_result(&workload, &result);
+
+  printf("xenvbd_sim_test: ok\n");
+}
+
+static VOID
+bench_one(PCHAR name, ULONG sectors, ULONG read_percent, BOOLEAN sequential, ULONG queue_depth, ULONG latency_us) {
+  sim_config_t config;
+  workload_t workload;
+  result_t result;
+
+  sim_config_default(&config);
+  config.max_ring_page_order = 4;
+  config.latency_us = latency_us;
+  memset(&workload, 0, sizeof(workload));
+  workload.name = name;
+  workload.queue_depth = queue_depth;
+  workload.min_sectors = workload.max_sectors = sectors;
+  workload.read_percent = read_percent;
+  workload.sequential = sequential;
+  workload.span = config.sectors;
+  workload.seconds = 1;
+  run_workload(&config, &workload, &result);
+  report(&workload, &result);
+  CHECK(result.sim.violations == 0 && result.errors == 0);
+  free(result.latency_ns);
+}
+
+static VOID
+run_benches(VOID) {
+  bench_one("4K randread qd1", 8, 100, FALSE, 1, 0);
+  bench_one("4K randread qd32", 8, 100, FALSE, 32, 0);
+  bench_one("64K seqread qd32", 128, 100, TRUE, 32, 0);
+  bench_one("4K randwrite qd32", 8, 0, FALSE, 32, 0);
+  bench_one("4K randread 100us qd1", 8, 100, FALSE, 1, 100);
+  bench_one("4K randread 100us qd32", 8, 100, FALSE, 32, 100);
+}
+
+static VOID
+usage(VOID) {
+  printf("xenvbd_sim_test run [options]\n"
+    "  --bs <bytes>        request size, a multiple of 512 up to 256K (4096)\n"
+    "  --qd <n>            queue depth (32)\n"
+    "  --rw <type>         randread, randwrite, randrw, read, write or rw (randread)\n"
+    "  --rwmix <percent>   reads for randrw and rw (70)\n"
+    "  --latency <us>      backend service time (0)\n"
+    "  --jitter <us>       up to this much more at random (0)\n"
+    "  --seconds <n>       (5)\n"
+    "  --file <path>       serve from a sparse file instead of RAM\n"
+    "  --size <MB>         disk size (512)\n"
+    "  --ring-order <n>    max-ring-page-order the backend offers (0)\n"
+    "  --read-cache <n>    read cache pages (0)\n"
+    "  --workers <n>       backend threads (4)\n"
+    "  --unaligned <pct>   buffers not on a 512 byte boundary (0)\n"
+    "  --verify            check the data read\n"
+    "  --verbose           print the driver's debug output\n");
+  exit(2);
+}
+
+static VOID
+run_custom(int argc, char **argv) {
+  sim_config_t config;
+  workload_t workload;
+  result_t result;
+  PCHAR rw = "randread";
+  ULONG bytes = 4096, rwmix = 70;
+  int i;
+
+  sim_config_default(&config);
+  config.sectors = 512 * 2048;
+  memset(&workload, 0, sizeof(workload));
+  workload.name = "run";
+  workload.queue_depth = 32;
+  workload.seconds = 5;
+  for (i = 2; i < argc; i++) {
+    if (!strcmp(argv[i], "--verify")) {
+      workload.verify = TRUE;
+    } else if (!strcmp(argv[i], "--verbose")) {
+      config.verbose = TRUE;
+    } else if (i + 1 == argc) {
+      usage();
+    } else if (!strcmp(argv[i], "--bs")) {
+      bytes = (ULONG)strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "--qd")) {
+      workload.queue_depth = (ULONG)strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "--rw")) {
+      rw = argv[++i];
+    } else if (!strcmp(argv[i], "--rwmix")) {
+      rwmix = (ULONG)strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "--latency")) {
+      config.latency_us = (ULONG)strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "--jitter")) {
+      config.jitter_us = (ULONG)strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "--seconds")) {
+      workload.seconds = (ULONG)strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "--file")) {
+      config.file = argv[++i];
+    } else if (!strcmp(argv[i], "--size")) {
+      config.sectors = strtoull(argv[++i], NULL, 0) * 2048;
+    } else if (!strcmp(argv[i], "--ring-order")) {
+      config.max_ring_page_order = (ULONG)strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "--read-cache")) {
+      config.read_cache_pages = (ULONG)strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "--workers")) {
+      config.workers = (ULONG)strtoul(argv[++i], NULL, 0);
+    } else if (!strcmp(argv[i], "--unaligned")) {
+      workload.unaligned_percent = (ULONG)strtoul(argv[++i], NULL, 0);
+    } else {
+      usage();
+    }
+  }
+  if (!bytes || bytes % 512 || bytes > MAX_SECTORS * 512 || !workload.queue_depth || !workload.seconds || !config.workers || !config.sectors)
+    usage();
+  workload.min_sectors = workload.max_sectors = bytes / 512;
+  workload.span = config.sectors;
+  workload.sequential = (BOOLEAN)strncmp(rw, "rand", 4);
+  if (!strcmp(rw, "randread") || !strcmp(rw, "read"))
+    workload.read_percent = 100;
+  else if (!strcmp(rw, "randwrite") || !strcmp(rw, "write"))
+    workload.read_percent = 0;
+  else if (!strcmp(rw, "randrw") || !strcmp(rw, "rw"))
+    workload.read_percent = rwmix;
+  else
+    usage();
+  run_workload(&config, &workload, &result);
+  report(&workload, &result);
+  printf("  violations %u, errors %llu, verify errors %llu\n", result.sim.violations,
+    (unsigned long long)result.errors, (unsigned long long)result.verify_errors);
+  exit(result.sim.violations || result.errors || result.verify_errors ? 1 : 0);
+}
+
+int
+main(int argc, char **argv) {
+  /* a run that is killed still shows how far it got */
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  if (argc >= 2 && !strcmp(argv[1], "run"))
+    run_custom(argc, argv);
+  else if (test_bench_mode(argc, argv))
+    run_benches();
+  else if (argc == 1)
+    run_checks();
+  else
+    usage();
+  return 0;
+}
@@ -358,7 +358,7 @@ XenNet_Connect(PVOID context, BOOLEAN suspend) {
   ULONG state;
   ULONG octet;
   PCHAR tmp_string;
-  ULONG tmp_ulong;
+  XN_XENSTORE_OP ops[8];
   LARGE_INTEGER timeout;
 
   if (!suspend) {
@@ -395,7 +395,6 @@ XenNet_Connect(PVOID context, BOOLEAN suspend) {
       return STATUS_UNSUCCESSFUL;
     }
     FUNCTION_MSG("event_channel = %d\n", xi->event_channel);
-    status = XnWriteInt32(xi->handle, XN_BASE_FRONTEND, "event-channel", xi->event_channel);
     xi->tx_sring = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, XENNET_POOL_TAG);
     if (!xi->tx_sring) {
       FUNCTION_MSG("Cannot allocate tx_sring\n");
@@ -407,7 +406,6 @@ XenNet_Connect(PVOID context, BOOLEAN suspend) {
     FUNCTION_MSG("tx sring pfn = %d\n", (ULONG)pfn);
     xi->tx_sring_gref = XnGrantAccess(xi->handle, (ULONG)pfn, FALSE, INVALID_GRANT_REF, XENNET_POOL_TAG);
     FUNCTION_MSG("tx sring_gref = %d\n", xi->tx_sring_gref);
-    status = XnWriteInt32(xi->handle, XN_BASE_FRONTEND, "tx-ring-ref", xi->tx_sring_gref);  
     xi->rx_sring = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, XENNET_POOL_TAG);
     if (!xi->rx_sring) {
       FUNCTION_MSG("Cannot allocate rx_sring\n");
@@ -419,32 +417,42 @@ XenNet_Connect(PVOID context, BOOLEAN suspend) {
     FUNCTION_MSG("rx sring pfn = %d\n", (ULONG)pfn);
     xi->rx_sring_gref = XnGrantAccess(xi->handle, (ULONG)pfn, FALSE, INVALID_GRANT_REF, XENNET_POOL_TAG);
     FUNCTION_MSG("rx sring_gref = %d\n", xi->rx_sring_gref);
-    status = XnWriteInt32(xi->handle, XN_BASE_FRONTEND, "rx-ring-ref", xi->rx_sring_gref);  
 
-    status = XnWriteInt32(xi->handle, XN_BASE_FRONTEND, "request-rx-copy", 1);
-    status = XnWriteInt32(xi->handle, XN_BASE_FRONTEND, "request-rx-notify", 1);
-    status = XnWriteInt32(xi->handle, XN_BASE_FRONTEND, "feature-no-csum-offload", !xi->frontend_csum_supported);
-    status = XnWriteInt32(xi->handle, XN_BASE_FRONTEND, "feature-sg", (int)xi->frontend_sg_supported);
-    status = XnWriteInt32(xi->handle, XN_BASE_FRONTEND, "feature-gso-tcpv4", !!xi->frontend_gso_value);
+    /* write everything the backend needs in one burst */
+    XnInitXenstoreOp(&ops[0], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "event-channel", xi->event_channel);
+    XnInitXenstoreOp(&ops[1], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "tx-ring-ref", xi->tx_sring_gref);
+    XnInitXenstoreOp(&ops[2], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "rx-ring-ref", xi->rx_sring_gref);
+    XnInitXenstoreOp(&ops[3], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "request-rx-copy", 1);
+    XnInitXenstoreOp(&ops[4], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "request-rx-notify", 1);
+    XnInitXenstoreOp(&ops[5], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "feature-no-csum-offload", !xi->frontend_csum_supported);
+    XnInitXenstoreOp(&ops[6], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "feature-sg", (int)xi->frontend_sg_supported);
+    XnInitXenstoreOp(&ops[7], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "feature-gso-tcpv4", !!xi->frontend_gso_value);
+    status = XnReadWriteMultiple(xi->handle, ops, 8);
   }
   
   /* backend always supports checksum offload */
   xi->backend_csum_supported = TRUE;
   
-  status = XnReadInt32(xi->handle, XN_BASE_BACKEND, "feature-sg", &tmp_ulong);
-  if (NT_SUCCESS(status) && tmp_ulong) {
+  XnInitXenstoreOp(&ops[0], XN_XENSTORE_READ_INT, XN_BASE_BACKEND, "feature-sg", 0);
+  XnInitXenstoreOp(&ops[1], XN_XENSTORE_READ_INT, XN_BASE_BACKEND, "feature-gso-tcpv4", 0);
+  XnInitXenstoreOp(&ops[2], XN_XENSTORE_READ_STRING, XN_BASE_BACKEND, "mac", 0);
+  status = XnReadWriteMultiple(xi->handle, ops, 3);
+  if (NT_SUCCESS(ops[0].status) && ops[0].int_value) {
     xi->backend_sg_supported = TRUE;
   } else {
     xi->backend_sg_supported = FALSE;
   }
-  status = XnReadInt32(xi->handle, XN_BASE_BACKEND, "feature-gso-tcpv4", &tmp_ulong);
-  if (NT_SUCCESS(status) && tmp_ulong) {
+  if (NT_SUCCESS(ops[1].status) && ops[1].int_value) {
     xi->backend_gso_value = xi->frontend_gso_value;
   } else {
     xi->backend_gso_value = FALSE;
   }
 
-  status = XnReadString(xi->handle, XN_BASE_BACKEND, "mac", &tmp_string);
+  if (!NT_SUCCESS(ops[2].status)) {
+    FUNCTION_MSG("Failed to read backend MAC address\n");
+    return STATUS_UNSUCCESSFUL;
+  }
+  tmp_string = ops[2].value;
   state = 0;
   octet = 0;
   for (i = 0; state != 3 && i < (int)strlen(tmp_string); i++) {
@@ -28,6 +28,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include "xenpci.h"
+#include "evtchn_fifo.h"
 
 /* Not really necessary but keeps PREfast happy */
 #if (VER_PRODUCTBUILD >= 7600)
@@ -49,6 +50,30 @@ static KDEFERRED_ROUTINE EvtChn_DpcBounce;
 #define BITS_PER_LONG (sizeof(xen_ulong_t) * 8)
 #define BITS_PER_LONG_SHIFT (5 + (sizeof(xen_ulong_t) >> 3))
 
+#define EVTCHN_FIFO_ARRAY_PAGES ((NR_EVENTS * sizeof(event_word_t) + PAGE_SIZE - 1) >> PAGE_SHIFT)
+
+/* xen/include/public/errno.h */
+#define XEN_ENOSYS 38
+
+/*
+FIFO ABI state. Once Xen has been given the pages it keeps writing to them
+until the domain is restored or migrated, which a cancelled suspend or a
+stop and start of the device (with a new xpdd) doesn't do, so the pages
+belong to the domain rather than to xpdd and are never freed.
+*/
+static struct {
+  BOOLEAN active; /* Xen has been given control and array */
+  evtchn_fifo_control_block_t *control; /* vcpu 0's control block, one page */
+  event_word_t *array; /* one word per port, NR_EVENTS words */
+  ULONG array_pages; /* pages of array Xen has been given */
+  evtchn_port_t head[EVTCHN_FIFO_MAX_QUEUES]; /* next port to consume from each queue */
+} evtchn_fifo;
+
+static __inline volatile LONG *
+EvtChn_FifoWord(evtchn_port_t port) {
+  return (volatile LONG *)&evtchn_fifo.array[port];
+}
+
 static VOID
 EvtChn_DpcBounce(PRKDPC Dpc, PVOID Context, PVOID SystemArgument1, PVOID SystemArgument2) {
   ev_action_t *action = Context;
@@ -96,6 +121,34 @@ EvtChn_AckEvent(PVOID context, evtchn_port_t port, BOOLEAN *last_interrupt) {
 
 //volatile ULONG in_inq = 0;
 
+/* Called at DIRQL from the isr when the FIFO ABI is in use */
+static BOOLEAN
+EvtChn_FifoHandleEvents(PXENPCI_DEVICE_DATA xpdd) {
+  ULONG ready = 0;
+  evtchn_port_t port;
+  ev_action_t *ev_action;
+  BOOLEAN handled = FALSE;
+
+  while ((port = EvtChn_FifoNextEvent(evtchn_fifo.control, evtchn_fifo.array, evtchn_fifo.head, &ready)) != 0) {
+    handled = TRUE;
+    ev_action = &xpdd->ev_actions[port];
+    ev_action->count++;
+    switch (ev_action->type)
+    {
+    case EVT_ACTION_TYPE_NORMAL:
+      ev_action->ServiceRoutine(ev_action->ServiceContext);
+      break;
+    case EVT_ACTION_TYPE_DPC:
+      KeInsertQueueDpc(&ev_action->Dpc, NULL, NULL);
+      break;
+    default:
+      FUNCTION_MSG("Unhandled Event!!! port=%d\n", port);
+      break;
+    }
+  }
+  return handled;
+}
+
 BOOLEAN
 EvtChn_EvtInterruptIsr(WDFINTERRUPT interrupt, ULONG message_id)
 {
@@ -143,6 +196,10 @@ to CPU != 0, but we should always use vcpu_info[0]
   {
     return TRUE;
   }
+
+  if (xpdd->evtchn_fifo) {
+    return EvtChn_FifoHandleEvents(xpdd);
+  }
   
   evt_words = (xen_ulong_t)xchg((volatile xen_long_t *)&vcpu_info->evtchn_pending_sel, 0);
 
@@ -291,6 +348,33 @@ EvtChn_BindDpc(PVOID Context, evtchn_port_t port, PXN_EVENT_CALLBACK ServiceRout
   return STATUS_SUCCESS;
 }
 
+/*
+Run the DPC of a port bound with EvtChn_BindDpc on processor cpu rather than
+the one that took the interrupt. Xen only raises the callback irq for events
+bound to vcpu 0 so the port itself stays there, but the DPC is where the
+work is done. Must be called before the port is bound.
+*/
+NTSTATUS
+EvtChn_SetCpu(PVOID Context, evtchn_port_t port, ULONG cpu) {
+  PXENPCI_DEVICE_DATA xpdd = Context;
+  ev_action_t *action = &xpdd->ev_actions[port];
+
+  if (cpu >= XenPci_ProcessorCount()) {
+    FUNCTION_MSG("cpu %d out of range for port %d\n", cpu, port);
+    return STATUS_INVALID_PARAMETER;
+  }
+  if (action->type != EVT_ACTION_TYPE_EMPTY) {
+    FUNCTION_MSG("Port %d already bound\n", port);
+    return STATUS_UNSUCCESSFUL;
+  }
+  KeSetTargetProcessorDpc(&action->Dpc, (CCHAR)cpu);
+#if (NTDDI_VERSION >= NTDDI_WS03)
+  /* don't wait for the target's next clock tick */
+  KeSetImportanceDpc(&action->Dpc, MediumHighImportance);
+#endif
+  return STATUS_SUCCESS;
+}
+
 #if 0
 NTSTATUS
 EvtChn_BindIrq(PVOID Context, evtchn_port_t port, ULONG vector, PCHAR description, ULONG flags)
@@ -340,6 +424,8 @@ EvtChn_Unbind(PVOID Context, evtchn_port_t port) {
   KeMemoryBarrier(); // make sure we don't call the old Service Routine with the new data...
   xpdd->ev_actions[port].ServiceRoutine = NULL;
   xpdd->ev_actions[port].ServiceContext = NULL;
+  /* forget any EvtChn_SetCpu */
+  KeInitializeDpc(&xpdd->ev_actions[port].Dpc, EvtChn_DpcBounce, action);
 
   return STATUS_SUCCESS;
 }
@@ -348,6 +434,10 @@ NTSTATUS
 EvtChn_Mask(PVOID Context, evtchn_port_t port) {
   PXENPCI_DEVICE_DATA xpdd = Context;
 
+  if (xpdd->evtchn_fifo) {
+    InterlockedBitTestAndSet(EvtChn_FifoWord(port), EVTCHN_FIFO_MASKED);
+    return STATUS_SUCCESS;
+  }
   synch_set_bit(port & (BITS_PER_LONG - 1),
     (volatile xen_long_t *)&xpdd->shared_info_area->evtchn_mask[port >> BITS_PER_LONG_SHIFT]);
   return STATUS_SUCCESS;
@@ -356,7 +446,17 @@ EvtChn_Mask(PVOID Context, evtchn_port_t port) {
 NTSTATUS
 EvtChn_Unmask(PVOID context, evtchn_port_t port) {
   PXENPCI_DEVICE_DATA xpdd = context;
-
+  evtchn_unmask_t op;
+
+  if (xpdd->evtchn_fifo) {
+    InterlockedBitTestAndReset(EvtChn_FifoWord(port), EVTCHN_FIFO_MASKED);
+    /* Xen doesn't link an event that went pending while masked until told about the unmask */
+    if (*EvtChn_FifoWord(port) & (1 << EVTCHN_FIFO_PENDING)) {
+      op.port = port;
+      HYPERVISOR_event_channel_op(EVTCHNOP_unmask, &op);
+    }
+    return STATUS_SUCCESS;
+  }
   synch_clear_bit(port & (BITS_PER_LONG - 1),
     (volatile xen_long_t *)&xpdd->shared_info_area->evtchn_mask[port >> BITS_PER_LONG_SHIFT]);
   return STATUS_SUCCESS;
@@ -418,6 +518,81 @@ EvtChn_PdoEventChannelDpc(PVOID context)
 }
 #endif
 
+/*
+Switch Xen to the FIFO ABI, giving it vcpu 0's control block and enough of
+the event array for NR_EVENTS ports. Nothing is written to the pages until
+Xen has accepted them, as they may still be in use from before. Returns
+STATUS_NOT_SUPPORTED if Xen doesn't support FIFO, in which case the 2-level
+ABI in shared_info is used as before.
+*/
+static NTSTATUS
+EvtChn_FifoInit() {
+  evtchn_init_control_t init_control;
+  evtchn_expand_array_t expand_array;
+  ULONG i;
+  int ret;
+
+  if (!evtchn_fifo.control) {
+    evtchn_fifo.control = ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, XENPCI_POOL_TAG);
+    evtchn_fifo.array = ExAllocatePoolWithTag(NonPagedPool, EVTCHN_FIFO_ARRAY_PAGES << PAGE_SHIFT, XENPCI_POOL_TAG);
+    if (!evtchn_fifo.control || !evtchn_fifo.array) {
+      FUNCTION_MSG("Failed to allocate FIFO event channel pages\n");
+      if (evtchn_fifo.control) {
+        ExFreePoolWithTag(evtchn_fifo.control, XENPCI_POOL_TAG);
+      }
+      if (evtchn_fifo.array) {
+        ExFreePoolWithTag(evtchn_fifo.array, XENPCI_POOL_TAG);
+      }
+      evtchn_fifo.control = NULL;
+      evtchn_fifo.array = NULL;
+      return STATUS_NOT_SUPPORTED;
+    }
+  }
+
+  init_control.control_gfn = (uint64_t)(MmGetPhysicalAddress(evtchn_fifo.control).QuadPart >> PAGE_SHIFT);
+  init_control.offset = 0;
+  init_control.vcpu = 0;
+  ret = HYPERVISOR_event_channel_op(EVTCHNOP_init_control, &init_control);
+  if (ret == -XEN_ENOSYS) {
+    FUNCTION_MSG("FIFO event channels not supported, using 2-level event channels\n");
+    return STATUS_NOT_SUPPORTED;
+  }
+  if (ret) {
+    if (evtchn_fifo.active) {
+      /* a cancelled suspend or a restart of the device. Xen still has our pages and the queues in them are live */
+      FUNCTION_MSG("FIFO event channels already initialised\n");
+      return STATUS_SUCCESS;
+    }
+    /* FIFO is set up with pages we don't know about (eg a previous load of the driver) and resetting it would close xenstore's channel too */
+    FUNCTION_MSG("EVTCHNOP_init_control failed (%d)\n", ret);
+    return STATUS_UNSUCCESSFUL;
+  }
+
+  /* Xen can't link any events until it has array pages, so the control block and heads are safe to reset now */
+  RtlZeroMemory(evtchn_fifo.control, PAGE_SIZE);
+  RtlZeroMemory(evtchn_fifo.head, sizeof(evtchn_fifo.head));
+  evtchn_fifo.active = TRUE;
+  for (i = 0; i < EVTCHN_FIFO_ARRAY_PAGES; i++) {
+    event_word_t *page = (event_word_t *)((PUCHAR)evtchn_fifo.array + (i << PAGE_SHIFT));
+    ULONG j;
+
+    /* every port starts out masked and unlinked */
+    for (j = 0; j < PAGE_SIZE / sizeof(event_word_t); j++) {
+      page[j] = 1 << EVTCHN_FIFO_MASKED;
+    }
+    KeMemoryBarrier();
+    expand_array.array_gfn = (uint64_t)(MmGetPhysicalAddress(page).QuadPart >> PAGE_SHIFT);
+    ret = HYPERVISOR_event_channel_op(EVTCHNOP_expand_array, &expand_array);
+    if (ret) {
+      FUNCTION_MSG("EVTCHNOP_expand_array failed (%d) for page %d\n", ret, i);
+      break;
+    }
+  }
+  evtchn_fifo.array_pages = i;
+  FUNCTION_MSG("Using FIFO event channels, %d event array pages, link_bits = %d\n", i, init_control.link_bits);
+  return STATUS_SUCCESS;
+}
+
 NTSTATUS
 EvtChn_Init(PXENPCI_DEVICE_DATA xpdd)
 {
@@ -425,8 +600,22 @@ EvtChn_Init(PXENPCI_DEVICE_DATA xpdd)
   ev_action_t *action;
   int i;
 
+  NTSTATUS status;
+
   FUNCTION_ENTER();
 
+  /* must come before anything is masked so EvtChn_Mask knows which ABI to use */
+  status = EvtChn_FifoInit();
+  if (status == STATUS_NOT_SUPPORTED) {
+    xpdd->evtchn_fifo = FALSE;
+  } else if (NT_SUCCESS(status)) {
+    xpdd->evtchn_fifo = TRUE;
+  } else {
+    FUNCTION_MSG("Xen is using FIFO event channels but the pages are unknown\n");
+    FUNCTION_EXIT();
+    return status;
+  }
+
   for (i = 0; i < NR_EVENTS; i++)
   {
     EvtChn_Mask(xpdd, i);
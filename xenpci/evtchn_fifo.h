@@ -0,0 +1,88 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+
+Copyright (c) 2014, James Harper
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of James Harper nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL JAMES HARPER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+The guest side of the FIFO event channel ABI queue walk, kept apart from
+evtchn.c so that it can be built and tested in user mode against a model of
+Xen (see tests/evtchn_fifo_test.c).
+
+Xen links pending events onto one queue per priority and sets the queue's bit
+in control->ready when it puts an event on an empty queue. Each event is taken
+off the head of the highest priority queue in turn, so the cost per event
+doesn't depend on the number of ports. head[] is the guest's copy of the next
+port to consume from each queue, 0 when the guest has emptied the queue, and
+ready holds the queues the guest knows to be non-empty. Both start at 0.
+*/
+
+/*
+Returns the next port that is pending and not masked, with its pending bit
+cleared, or 0 when every queue is empty.
+*/
+static __inline evtchn_port_t
+EvtChn_FifoNextEvent(evtchn_fifo_control_block_t *control, event_word_t *array, evtchn_port_t *head, ULONG *ready) {
+  volatile LONG *word;
+  ULONG priority;
+  evtchn_port_t port;
+  LONG old_word;
+  LONG new_word;
+
+  for (;;) {
+    *ready |= (ULONG)InterlockedExchange((volatile LONG *)&control->ready, 0);
+    if (!*ready)
+      return 0;
+    /* lowest bit is the highest priority */
+    _BitScanForward(&priority, *ready);
+    port = head[priority];
+    if (!port) {
+      /* we emptied this queue last time so Xen will have put the new head in the control block */
+      KeMemoryBarrier();
+      port = control->head[priority];
+    }
+    if (!port || port >= NR_EVENTS) {
+      if (port) {
+        FUNCTION_MSG("FIFO queue %d head port %d out of range\n", priority, port);
+      }
+      head[priority] = 0;
+      *ready &= ~(1 << priority);
+      continue;
+    }
+    word = (volatile LONG *)&array[port];
+    /* unlink the event. The link it had is the next event in the queue */
+    do {
+      old_word = *word;
+      new_word = old_word & ~((1 << EVTCHN_FIFO_LINKED) | EVTCHN_FIFO_LINK_MASK);
+    } while (InterlockedCompareExchange(word, new_word, old_word) != old_word);
+    head[priority] = old_word & EVTCHN_FIFO_LINK_MASK;
+    if (!head[priority]) {
+      *ready &= ~(1 << priority);
+    }
+    if (!(*word & (1 << EVTCHN_FIFO_MASKED)) && InterlockedBitTestAndReset(word, EVTCHN_FIFO_PENDING))
+      return port;
+  }
+}
@@ -29,46 +29,213 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "xenpci.h"
 
-VOID
-GntTbl_PutRef(PVOID Context, grant_ref_t ref, ULONG tag)
+/* gnttbl_free is only updated once per batch of refs moved on or off the global stack */
+static __inline VOID
+GntTbl_GaveRefs(PXENPCI_DEVICE_DATA xpdd, ULONG count)
 {
-  PXENPCI_DEVICE_DATA xpdd = Context;
+  if (count)
+    InterlockedExchangeAdd(&xpdd->gnttbl_free, (LONG)count);
+}
 
-  UNREFERENCED_PARAMETER(tag);
-  
-#if DBG
-  if (xpdd->gnttbl_tag[ref].tag != tag)
-    FUNCTION_MSG("Grant Entry %d for %.4s doesn't match %.4s\n", ref, (PUCHAR)&tag, (PUCHAR)&xpdd->gnttbl_tag[ref].tag);
-  XN_ASSERT(xpdd->gnttbl_tag[ref].tag == tag);
-  xpdd->gnttbl_tag[ref].tag = 0;
-  xpdd->gnttbl_tag[ref].generation = (ULONG)-1;
-#endif
-  stack_push(xpdd->gnttbl_ss, (PVOID)ref);
+static VOID
+GntTbl_TookRefs(PXENPCI_DEVICE_DATA xpdd, ULONG count)
+{
+  LONG free;
+
+  if (!count)
+    return;
+  free = InterlockedExchangeAdd(&xpdd->gnttbl_free, -(LONG)count) - (LONG)count;
+  if (free < xpdd->gnttbl_low_water)
+    xpdd->gnttbl_low_water = free;
+  /* allocation carries on from what is left while the dpc grows the table */
+  if (free < GNTTBL_GROW_WATERMARK && xpdd->grant_frames < xpdd->gnttbl_max_frames && !xpdd->gnttbl_grow_suspended
+      && InterlockedCompareExchange(&xpdd->gnttbl_grow_queued, 1, 0) == 0)
+    KeInsertQueueDpc(&xpdd->gnttbl_grow_dpc, NULL, NULL);
 }
 
-grant_ref_t
-GntTbl_GetRef(PVOID Context, ULONG tag)
+/* called at DISPATCH_LEVEL on the cache's own processor. Returns FALSE if the caches are disabled */
+static BOOLEAN
+GntTbl_CachePut(PXENPCI_DEVICE_DATA xpdd, gnttbl_cache_t *cache, grant_ref_t *refs, ULONG count)
 {
-  PXENPCI_DEVICE_DATA xpdd = Context;
-  unsigned int ref;
+  KeAcquireSpinLockAtDpcLevel(&cache->lock);
+  if (!xpdd->gnttbl_cache_enabled)
+  {
+    KeReleaseSpinLockFromDpcLevel(&cache->lock);
+    return FALSE;
+  }
+  while (count--)
+  {
+    if (cache->count == GNTTBL_CACHE_SIZE)
+    {
+      while (cache->count > GNTTBL_CACHE_SIZE - GNTTBL_CACHE_BATCH)
+        stack_push(xpdd->gnttbl_ss, (PVOID)(ULONG_PTR)cache->refs[--cache->count]);
+      GntTbl_GaveRefs(xpdd, GNTTBL_CACHE_BATCH);
+    }
+    cache->refs[cache->count++] = *refs++;
+  }
+  KeReleaseSpinLockFromDpcLevel(&cache->lock);
+  return TRUE;
+}
+
+/* called at DISPATCH_LEVEL. Refills the cache from the global stack whenever it runs empty. Returns how many refs it got */
+static ULONG
+GntTbl_CacheGet(PXENPCI_DEVICE_DATA xpdd, gnttbl_cache_t *cache, grant_ref_t *refs, ULONG count, BOOLEAN refill)
+{
+  ULONG got = 0;
   PVOID ptr_ref;
 
+  KeAcquireSpinLockAtDpcLevel(&cache->lock);
+  while (xpdd->gnttbl_cache_enabled && got < count)
+  {
+    if (!cache->count && refill)
+    {
+      while (cache->count < GNTTBL_CACHE_BATCH && stack_pop(xpdd->gnttbl_ss, &ptr_ref))
+        cache->refs[cache->count++] = (grant_ref_t)(ULONG_PTR)ptr_ref;
+      GntTbl_TookRefs(xpdd, cache->count);
+    }
+    if (!cache->count)
+      break;
+    refs[got++] = cache->refs[--cache->count];
+  }
+  KeReleaseSpinLockFromDpcLevel(&cache->lock);
+  return got;
+}
+
+/* puts every cached ref back on the global stack and stops the caches being used until GntTbl_Resume */
+static VOID
+GntTbl_DisableCache(PXENPCI_DEVICE_DATA xpdd)
+{
+  KIRQL old_irql = KeGetCurrentIrql();
+  ULONG i;
+  ULONG drained = 0;
+  gnttbl_cache_t *cache;
+
+  /* when called at HIGH_LEVEL for a suspend every other processor is spinning in a dpc, so none can be holding a lock */
+  if (old_irql < DISPATCH_LEVEL)
+    KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+  xpdd->gnttbl_cache_enabled = FALSE;
+  for (i = 0; i < xpdd->gnttbl_cache_count; i++)
+  {
+    cache = &xpdd->gnttbl_cache[i];
+    KeAcquireSpinLockAtDpcLevel(&cache->lock);
+    drained += cache->count;
+    while (cache->count)
+      stack_push(xpdd->gnttbl_ss, (PVOID)(ULONG_PTR)cache->refs[--cache->count]);
+    KeReleaseSpinLockFromDpcLevel(&cache->lock);
+  }
+  GntTbl_GaveRefs(xpdd, drained);
+  if (old_irql < DISPATCH_LEVEL)
+    KeLowerIrql(old_irql);
+  FUNCTION_MSG("%d cached grant refs returned\n", drained);
+}
+
+/* returns refs to this processor's cache, or the global stack. No tag checking */
+static VOID
+GntTbl_ReleaseRefs(PXENPCI_DEVICE_DATA xpdd, grant_ref_t *refs, ULONG count)
+{
+  KIRQL old_irql;
+  ULONG cpu;
+  BOOLEAN cached = FALSE;
+
+  /* above DISPATCH_LEVEL we could have interrupted this processor's own use of its cache */
+  if (xpdd->gnttbl_cache_enabled && KeGetCurrentIrql() <= DISPATCH_LEVEL)
+  {
+    KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+    cpu = KeGetCurrentProcessorNumber();
+    if (cpu < xpdd->gnttbl_cache_count)
+      cached = GntTbl_CachePut(xpdd, &xpdd->gnttbl_cache[cpu], refs, count);
+    KeLowerIrql(old_irql);
+  }
+  if (!cached)
+  {
+    GntTbl_GaveRefs(xpdd, count);
+    while (count--)
+      stack_push(xpdd->gnttbl_ss, (PVOID)(ULONG_PTR)*refs++);
+  }
+}
+
+/* gets count refs, all or none */
+static BOOLEAN
+GntTbl_GetRefs(PXENPCI_DEVICE_DATA xpdd, grant_ref_t *refs, ULONG count, ULONG tag)
+{
+  ULONG got = 0;
+  ULONG popped;
+  PVOID ptr_ref;
+  KIRQL old_irql;
+  ULONG cpu;
+  ULONG i;
+
   UNREFERENCED_PARAMETER(tag);
 
-  if (!stack_pop(xpdd->gnttbl_ss, &ptr_ref))
+  if (xpdd->gnttbl_cache_enabled && KeGetCurrentIrql() <= DISPATCH_LEVEL)
+  {
+    KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+    cpu = KeGetCurrentProcessorNumber();
+    if (cpu < xpdd->gnttbl_cache_count)
+      got = GntTbl_CacheGet(xpdd, &xpdd->gnttbl_cache[cpu], refs, count, TRUE);
+    /* the global stack is empty, but other processors may still have some cached */
+    for (i = 0; got < count && i < xpdd->gnttbl_cache_count; i++)
+    {
+      if (i != cpu)
+        got += GntTbl_CacheGet(xpdd, &xpdd->gnttbl_cache[i], refs + got, count - got, FALSE);
+    }
+    KeLowerIrql(old_irql);
+  }
+  for (popped = 0; got < count && stack_pop(xpdd->gnttbl_ss, &ptr_ref); popped++)
+    refs[got++] = (grant_ref_t)(ULONG_PTR)ptr_ref;
+  GntTbl_TookRefs(xpdd, popped);
+  if (got < count)
   {
     FUNCTION_MSG("No free grant refs\n");
-    return INVALID_GRANT_REF;
+    GntTbl_ReleaseRefs(xpdd, refs, got);
+    return FALSE;
   }
-  ref = (grant_ref_t)(ULONG_PTR)ptr_ref;
 #if DBG
-  if (xpdd->gnttbl_tag[ref].tag)
-    FUNCTION_MSG("Grant Entry %d for %.4s in use by %.4s\n", ref, (PUCHAR)&tag, (PUCHAR)&xpdd->gnttbl_tag[ref].tag);
-  XN_ASSERT(!xpdd->gnttbl_tag[ref].tag);
-  xpdd->gnttbl_tag[ref].generation = xpdd->gnttbl_generation;
-  xpdd->gnttbl_tag[ref].tag = tag;
+  for (i = 0; i < count; i++)
+  {
+    if (xpdd->gnttbl_tag[refs[i]].tag)
+      FUNCTION_MSG("Grant Entry %d for %.4s in use by %.4s\n", refs[i], (PUCHAR)&tag, (PUCHAR)&xpdd->gnttbl_tag[refs[i]].tag);
+    XN_ASSERT(!xpdd->gnttbl_tag[refs[i]].tag);
+    xpdd->gnttbl_tag[refs[i]].generation = xpdd->gnttbl_generation;
+    xpdd->gnttbl_tag[refs[i]].tag = tag;
+  }
 #endif
+  return TRUE;
+}
+
+static VOID
+GntTbl_PutRefs(PXENPCI_DEVICE_DATA xpdd, grant_ref_t *refs, ULONG count, ULONG tag)
+{
+#if DBG
+  ULONG i;
 
+  for (i = 0; i < count; i++)
+  {
+    if (xpdd->gnttbl_tag[refs[i]].tag != tag)
+      FUNCTION_MSG("Grant Entry %d for %.4s doesn't match %.4s\n", refs[i], (PUCHAR)&tag, (PUCHAR)&xpdd->gnttbl_tag[refs[i]].tag);
+    XN_ASSERT(xpdd->gnttbl_tag[refs[i]].tag == tag);
+    xpdd->gnttbl_tag[refs[i]].tag = 0;
+    xpdd->gnttbl_tag[refs[i]].generation = (ULONG)-1;
+  }
+#else
+  UNREFERENCED_PARAMETER(tag);
+#endif
+  GntTbl_ReleaseRefs(xpdd, refs, count);
+}
+
+VOID
+GntTbl_PutRef(PVOID Context, grant_ref_t ref, ULONG tag)
+{
+  GntTbl_PutRefs(Context, &ref, 1, tag);
+}
+
+grant_ref_t
+GntTbl_GetRef(PVOID Context, ULONG tag)
+{
+  grant_ref_t ref;
+
+  if (!GntTbl_GetRefs(Context, &ref, 1, tag))
+    return INVALID_GRANT_REF;
   return ref;
 }
 
@@ -78,6 +245,7 @@ GntTbl_Map(PVOID Context, unsigned int start_idx, unsigned int end_idx)
   PXENPCI_DEVICE_DATA xpdd = Context;
   struct xen_add_to_physmap xatp;
   unsigned int i = end_idx;
+  int errors = 0;
 
   FUNCTION_ENTER();
   /* Loop backwards, so that the first hypercall has the largest index,  ensuring that the table will grow only once.  */
@@ -89,11 +257,115 @@ GntTbl_Map(PVOID Context, unsigned int start_idx, unsigned int end_idx)
     if (HYPERVISOR_memory_op(XENMEM_add_to_physmap, &xatp))
     {
       FUNCTION_MSG("*** ERROR MAPPING FRAME %d ***\n", i);
+      errors++;
     }
   } while (i-- > start_idx);
   FUNCTION_EXIT();
 
-  return 0;
+  return errors;
+}
+
+/* make some holes for the grant pages to fill in */
+static VOID
+GntTbl_ReleaseFrames(PXENPCI_DEVICE_DATA xpdd, ULONG start_idx, ULONG end_idx)
+{
+  ULONG i;
+
+  for (i = start_idx; i < end_idx; i++)
+  {
+    struct xen_memory_reservation reservation;
+    xen_pfn_t pfn;
+    ULONG ret;
+    
+    reservation.address_bits = 0;
+    reservation.extent_order = 0;
+    reservation.domid = DOMID_SELF;
+    reservation.nr_extents = 1;
+    #pragma warning(disable: 4127) /* conditional expression is constant */
+    pfn = (xen_pfn_t)MmGetMdlPfnArray(xpdd->gnttbl_mdl)[i];
+    FUNCTION_MSG("pfn = %x\n", (ULONG)pfn);
+    set_xen_guest_handle(reservation.extent_start, &pfn);
+    
+    FUNCTION_MSG("Calling HYPERVISOR_memory_op - pfn = %x\n", (ULONG)pfn);
+    ret = HYPERVISOR_memory_op(XENMEM_decrease_reservation, &reservation);
+    FUNCTION_MSG("decreased %d pages for grant table frame %d\n", ret, i);
+  }
+}
+
+/* puts back the page under a frame that was released but couldn't be mapped */
+static VOID
+GntTbl_PopulateFrame(PXENPCI_DEVICE_DATA xpdd, ULONG idx)
+{
+  struct xen_memory_reservation reservation;
+  xen_pfn_t pfn;
+  ULONG ret;
+
+  reservation.address_bits = 0;
+  reservation.extent_order = 0;
+  reservation.domid = DOMID_SELF;
+  reservation.nr_extents = 1;
+  pfn = (xen_pfn_t)MmGetMdlPfnArray(xpdd->gnttbl_mdl)[idx];
+  set_xen_guest_handle(reservation.extent_start, &pfn);
+  ret = HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
+  FUNCTION_MSG("populated %d pages for grant table frame %d\n", ret, idx);
+}
+
+/* maps the next GNTTBL_GROW_FRAMES frames and puts their refs on the global stack */
+static VOID
+GntTbl_GrowDpc(PKDPC dpc, PVOID context, PVOID arg1, PVOID arg2)
+{
+  PXENPCI_DEVICE_DATA xpdd = context;
+  ULONG start_idx, end_idx;
+  ULONG i;
+
+  UNREFERENCED_PARAMETER(dpc);
+  UNREFERENCED_PARAMETER(arg1);
+  UNREFERENCED_PARAMETER(arg2);
+
+  KeAcquireSpinLockAtDpcLevel(&xpdd->gnttbl_grow_lock);
+  start_idx = xpdd->grant_frames;
+  end_idx = min(start_idx + GNTTBL_GROW_FRAMES, xpdd->gnttbl_max_frames);
+  if (xpdd->gnttbl_grow_suspended || start_idx >= end_idx)
+  {
+    InterlockedExchange(&xpdd->gnttbl_grow_queued, 0);
+    KeReleaseSpinLockFromDpcLevel(&xpdd->gnttbl_grow_lock);
+    return;
+  }
+  /* one frame at a time, so that on an error the frames mapped before it can still be used and no frame after it is
+     left without a page. grant_frames has to stay a contiguous count for GntTbl_Resume */
+  for (i = start_idx; i < end_idx; i++)
+  {
+    GntTbl_ReleaseFrames(xpdd, i, i + 1);
+    if (GntTbl_Map(xpdd, i, i))
+    {
+      GntTbl_PopulateFrame(xpdd, i);
+      break;
+    }
+  }
+  if (i < end_idx)
+  {
+    /* don't try again */
+    FUNCTION_MSG("Failed to grow grant table past %d frames\n", i);
+    xpdd->gnttbl_max_frames = i;
+    end_idx = i;
+    if (start_idx == end_idx)
+    {
+      InterlockedExchange(&xpdd->gnttbl_grow_queued, 0);
+      KeReleaseSpinLockFromDpcLevel(&xpdd->gnttbl_grow_lock);
+      return;
+    }
+  }
+  RtlZeroMemory(&xpdd->gnttbl_table[start_idx * GNTTBL_ENTRIES_PER_FRAME], (end_idx - start_idx) * PAGE_SIZE);
+  KeMemoryBarrier();
+  xpdd->grant_frames = end_idx;
+  for (i = start_idx * GNTTBL_ENTRIES_PER_FRAME; i < end_idx * GNTTBL_ENTRIES_PER_FRAME; i++)
+    stack_push(xpdd->gnttbl_ss, (PVOID)(ULONG_PTR)i);
+  GntTbl_GaveRefs(xpdd, (end_idx - start_idx) * GNTTBL_ENTRIES_PER_FRAME);
+  xpdd->gnttbl_grow_count++;
+  FUNCTION_MSG("grant table grown to %d frames, free = %d, low water = %d, grown %d times\n",
+    xpdd->grant_frames, xpdd->gnttbl_free, xpdd->gnttbl_low_water, xpdd->gnttbl_grow_count);
+  InterlockedExchange(&xpdd->gnttbl_grow_queued, 0);
+  KeReleaseSpinLockFromDpcLevel(&xpdd->gnttbl_grow_lock);
 }
 
 grant_ref_t
@@ -134,19 +406,14 @@ GntTbl_GrantAccess(
   return ref;
 }
 
-BOOLEAN
-GntTbl_EndAccess(
-  PVOID Context,
-  grant_ref_t ref,
-  BOOLEAN keepref,
-  ULONG tag)
+/* revokes access. Returns FALSE if the backend still has the page mapped */
+static BOOLEAN
+GntTbl_ClearFlags(PXENPCI_DEVICE_DATA xpdd, grant_ref_t ref, ULONG tag)
 {
-  PXENPCI_DEVICE_DATA xpdd = Context;
   unsigned short flags, nflags;
 
-  XN_ASSERT(ref != INVALID_GRANT_REF);
-  XN_ASSERT(xpdd->gnttbl_tag[ref].tag == tag);
-  
+  UNREFERENCED_PARAMETER(tag);
+
   nflags = xpdd->gnttbl_table[ref].flags;
   do {
     if ((flags = nflags) & (GTF_reading|GTF_writing))
@@ -156,6 +423,23 @@ GntTbl_EndAccess(
     }
   } while ((nflags = InterlockedCompareExchange16(
     (volatile SHORT *)&xpdd->gnttbl_table[ref].flags, 0, flags)) != flags);
+  return TRUE;
+}
+
+BOOLEAN
+GntTbl_EndAccess(
+  PVOID Context,
+  grant_ref_t ref,
+  BOOLEAN keepref,
+  ULONG tag)
+{
+  PXENPCI_DEVICE_DATA xpdd = Context;
+
+  XN_ASSERT(ref != INVALID_GRANT_REF);
+  XN_ASSERT(xpdd->gnttbl_tag[ref].tag == tag);
+  
+  if (!GntTbl_ClearFlags(xpdd, ref, tag))
+    return FALSE;
 
   if (!keepref)
     GntTbl_PutRef(Context, ref, tag);
@@ -163,6 +447,121 @@ GntTbl_EndAccess(
   return TRUE;
 }
 
+/* grants count frames, at most XN_GRANT_BATCH_MAX. Where refs[i] is INVALID_GRANT_REF a ref is allocated for it. All or
+   nothing - if there aren't enough free refs nothing is granted and refs is left as it was */
+BOOLEAN
+GntTbl_GrantAccessMultiple(
+  PVOID Context,
+  domid_t domid,
+  uint32_t *frames,
+  ULONG count,
+  int readonly,
+  grant_ref_t *refs,
+  ULONG tag)
+{
+  PXENPCI_DEVICE_DATA xpdd = Context;
+  grant_ref_t new_refs[XN_GRANT_BATCH_MAX];
+  ULONG needed = 0;
+  ULONG i, j;
+  uint16_t flags;
+
+  XN_ASSERT(count <= XN_GRANT_BATCH_MAX);
+  if (count > XN_GRANT_BATCH_MAX)
+    return FALSE;
+  for (i = 0; i < count; i++)
+  {
+    if (refs[i] == INVALID_GRANT_REF)
+      needed++;
+  }
+  if (needed && !GntTbl_GetRefs(xpdd, new_refs, needed, tag))
+    return FALSE;
+  for (i = 0, j = 0; i < count; i++)
+  {
+    if (refs[i] == INVALID_GRANT_REF)
+      refs[i] = new_refs[j++];
+    XN_ASSERT(xpdd->gnttbl_tag[refs[i]].tag == tag);
+    XN_ASSERT(!xpdd->gnttbl_table[refs[i]].flags);
+    xpdd->gnttbl_table[refs[i]].frame = frames[i];
+    xpdd->gnttbl_table[refs[i]].domid = domid;
+  }
+  /* one barrier for the lot instead of one per entry */
+  KeMemoryBarrier();
+  flags = (uint16_t)(GTF_permit_access | (readonly ? GTF_readonly : 0));
+  for (i = 0; i < count; i++)
+    xpdd->gnttbl_table[refs[i]].flags = flags;
+
+  return TRUE;
+}
+
+/* ends access to count refs, at most XN_GRANT_BATCH_MAX. Returns FALSE if any were still in use by the backend. Those
+   are left alone, the rest are freed together unless keepref */
+BOOLEAN
+GntTbl_EndAccessMultiple(
+  PVOID Context,
+  grant_ref_t *refs,
+  ULONG count,
+  BOOLEAN keepref,
+  ULONG tag)
+{
+  PXENPCI_DEVICE_DATA xpdd = Context;
+  grant_ref_t ended[XN_GRANT_BATCH_MAX];
+  ULONG ended_count = 0;
+  ULONG i;
+
+  XN_ASSERT(count <= XN_GRANT_BATCH_MAX);
+  if (count > XN_GRANT_BATCH_MAX)
+    return FALSE;
+  for (i = 0; i < count; i++)
+  {
+    XN_ASSERT(refs[i] != INVALID_GRANT_REF);
+    XN_ASSERT(xpdd->gnttbl_tag[refs[i]].tag == tag);
+    if (GntTbl_ClearFlags(xpdd, refs[i], tag))
+      ended[ended_count++] = refs[i];
+  }
+  if (!keepref && ended_count)
+    GntTbl_PutRefs(xpdd, ended, ended_count, tag);
+
+  return (BOOLEAN)(ended_count == count);
+}
+
+/* copies between local pages and pages granted to us by domid. The domid of each side is filled in from its
+   GNTCOPY_xxx_gref flag. Issued XN_GRANT_BATCH_MAX ops per hypercall so that a long list doesn't keep the processor
+   in the hypervisor for too long. Returns the number of ops that failed - their status says why */
+ULONG
+GntTbl_Copy(PVOID Context, domid_t domid, gnttab_copy_t *ops, ULONG count)
+{
+  PXENPCI_DEVICE_DATA xpdd = Context;
+  ULONG i, j, n;
+  ULONG failed = 0;
+  int rc;
+
+  UNREFERENCED_PARAMETER(xpdd);
+
+  for (i = 0; i < count; i++)
+  {
+    ops[i].source.domid = (ops[i].flags & GNTCOPY_source_gref) ? domid : DOMID_SELF;
+    ops[i].dest.domid = (ops[i].flags & GNTCOPY_dest_gref) ? domid : DOMID_SELF;
+  }
+  for (i = 0; i < count; i += n)
+  {
+    n = min(count - i, XN_GRANT_BATCH_MAX);
+    rc = HYPERVISOR_grant_table_op(GNTTABOP_copy, &ops[i], n);
+    if (rc)
+    {
+      /* the hypercall itself failed so none of the status fields were written */
+      FUNCTION_MSG("GNTTABOP_copy failed %d\n", rc);
+      for (j = i; j < i + n; j++)
+        ops[j].status = GNTST_general_error;
+    }
+  }
+  for (i = 0; i < count; i++)
+  {
+    if (ops[i].status != GNTST_okay)
+      failed++;
+  }
+  return failed;
+}
+
 static unsigned int 
 GntTbl_QueryMaxFrames(PXENPCI_DEVICE_DATA xpdd) {
   struct gnttab_query_size query;
@@ -189,9 +588,11 @@ GntTbl_Init(PXENPCI_DEVICE_DATA xpdd) {
   
   FUNCTION_ENTER();
   
-  xpdd->grant_frames = GntTbl_QueryMaxFrames(xpdd);
-  FUNCTION_MSG("grant_frames = %d\n", xpdd->grant_frames);
-  grant_entries = min(NR_GRANT_ENTRIES, (xpdd->grant_frames * PAGE_SIZE / sizeof(grant_entry_t)));
+  /* everything is allocated for gnttbl_max_frames, but only the first GNTTBL_INITIAL_FRAMES are mapped */
+  xpdd->gnttbl_max_frames = min(NR_GRANT_FRAMES, GntTbl_QueryMaxFrames(xpdd));
+  xpdd->grant_frames = min(GNTTBL_INITIAL_FRAMES, xpdd->gnttbl_max_frames);
+  FUNCTION_MSG("grant_frames = %d, max = %d\n", xpdd->grant_frames, xpdd->gnttbl_max_frames);
+  grant_entries = xpdd->gnttbl_max_frames * GNTTBL_ENTRIES_PER_FRAME;
   FUNCTION_MSG("grant_entries = %d\n", grant_entries);
   #if DBG
   xpdd->gnttbl_tag = ExAllocatePoolWithTag(NonPagedPool, grant_entries * sizeof(grant_tag_t), XENPCI_POOL_TAG);
@@ -199,44 +600,47 @@ GntTbl_Init(PXENPCI_DEVICE_DATA xpdd) {
   xpdd->gnttbl_tag_copy = ExAllocatePoolWithTag(NonPagedPool, grant_entries * sizeof(grant_tag_t), XENPCI_POOL_TAG);
   xpdd->gnttbl_generation = 0;
   #endif
-  xpdd->gnttbl_table_copy = ExAllocatePoolWithTag(NonPagedPool, xpdd->grant_frames * PAGE_SIZE, XENPCI_POOL_TAG);
+  xpdd->gnttbl_table_copy = ExAllocatePoolWithTag(NonPagedPool, xpdd->gnttbl_max_frames * PAGE_SIZE, XENPCI_POOL_TAG);
   XN_ASSERT(xpdd->gnttbl_table_copy); // lazy
-  xpdd->gnttbl_table = ExAllocatePoolWithTag(NonPagedPool, xpdd->grant_frames * PAGE_SIZE, XENPCI_POOL_TAG);
+  xpdd->gnttbl_table = ExAllocatePoolWithTag(NonPagedPool, xpdd->gnttbl_max_frames * PAGE_SIZE, XENPCI_POOL_TAG);
   XN_ASSERT(xpdd->gnttbl_table); // lazy
   /* dom0 crashes if we allocate the wrong amount of memory here! */
-  xpdd->gnttbl_mdl = IoAllocateMdl(xpdd->gnttbl_table, xpdd->grant_frames * PAGE_SIZE, FALSE, FALSE, NULL);
+  xpdd->gnttbl_mdl = IoAllocateMdl(xpdd->gnttbl_table, xpdd->gnttbl_max_frames * PAGE_SIZE, FALSE, FALSE, NULL);
   XN_ASSERT(xpdd->gnttbl_mdl); // lazy
   MmBuildMdlForNonPagedPool(xpdd->gnttbl_mdl);
 
-  /* make some holes for the grant pages to fill in */
-  for (i = 0; i < (int)xpdd->grant_frames; i++)
-  {
-    struct xen_memory_reservation reservation;
-    xen_pfn_t pfn;
-    ULONG ret;
-    
-    reservation.address_bits = 0;
-    reservation.extent_order = 0;
-    reservation.domid = DOMID_SELF;
-    reservation.nr_extents = 1;
-    #pragma warning(disable: 4127) /* conditional expression is constant */
-    pfn = (xen_pfn_t)MmGetMdlPfnArray(xpdd->gnttbl_mdl)[i];
-    FUNCTION_MSG("pfn = %x\n", (ULONG)pfn);
-    set_xen_guest_handle(reservation.extent_start, &pfn);
-    
-    FUNCTION_MSG("Calling HYPERVISOR_memory_op - pfn = %x\n", (ULONG)pfn);
-    ret = HYPERVISOR_memory_op(XENMEM_decrease_reservation, &reservation);
-    FUNCTION_MSG("decreased %d pages for grant table frame %d\n", ret, i);
-  }
+  GntTbl_ReleaseFrames(xpdd, 0, xpdd->grant_frames);
 
   stack_new(&xpdd->gnttbl_ss, grant_entries);
   
-  for (i = NR_RESERVED_ENTRIES; i < grant_entries; i++)
+  for (i = NR_RESERVED_ENTRIES; i < (int)(xpdd->grant_frames * GNTTBL_ENTRIES_PER_FRAME); i++)
     stack_push(xpdd->gnttbl_ss, (PVOID)i);
+  xpdd->gnttbl_free = xpdd->grant_frames * GNTTBL_ENTRIES_PER_FRAME - NR_RESERVED_ENTRIES;
+  xpdd->gnttbl_low_water = xpdd->gnttbl_free;
+  xpdd->gnttbl_grow_count = 0;
+  KeInitializeDpc(&xpdd->gnttbl_grow_dpc, GntTbl_GrowDpc, xpdd);
+  KeInitializeSpinLock(&xpdd->gnttbl_grow_lock);
+
+  xpdd->gnttbl_cache_count = XenPci_ProcessorCount();
+  /* small NonPagedPool allocations are only 8 or 16 byte aligned, which would leave each cache straddling two cache lines
+     and sharing them with its neighbours. An allocation of a page or more is page aligned */
+  xpdd->gnttbl_cache = ExAllocatePoolWithTag(NonPagedPool, max((SIZE_T)PAGE_SIZE, xpdd->gnttbl_cache_count * sizeof(gnttbl_cache_t)), XENPCI_POOL_TAG);
+  if (xpdd->gnttbl_cache)
+  {
+    RtlZeroMemory(xpdd->gnttbl_cache, xpdd->gnttbl_cache_count * sizeof(gnttbl_cache_t));
+    for (i = 0; i < (int)xpdd->gnttbl_cache_count; i++)
+      KeInitializeSpinLock(&xpdd->gnttbl_cache[i].lock);
+    xpdd->gnttbl_cache_enabled = TRUE;
+  }
+  else
+  {
+    FUNCTION_MSG("Failed to allocate grant ref caches\n");
+    xpdd->gnttbl_cache_count = 0;
+  }
   
   GntTbl_Map(xpdd, 0, xpdd->grant_frames - 1);
 
-  RtlZeroMemory(xpdd->gnttbl_table, PAGE_SIZE * xpdd->grant_frames);
+  RtlZeroMemory(xpdd->gnttbl_table, PAGE_SIZE * xpdd->gnttbl_max_frames);
   
   FUNCTION_EXIT();
 }
@@ -248,9 +652,24 @@ GntTbl_Suspend(PXENPCI_DEVICE_DATA xpdd)
   int grant_entries;
   #endif
   int i;
+  KIRQL old_irql = KeGetCurrentIrql();
   
   FUNCTION_ENTER();
   
+  /* wait for a grow in progress, and stop any more until resume. At HIGH_LEVEL nothing can be holding the lock */
+  if (old_irql < DISPATCH_LEVEL)
+    KeRaiseIrql(DISPATCH_LEVEL, &old_irql);
+  KeAcquireSpinLockAtDpcLevel(&xpdd->gnttbl_grow_lock);
+  xpdd->gnttbl_grow_suspended = TRUE;
+  KeReleaseSpinLockFromDpcLevel(&xpdd->gnttbl_grow_lock);
+  if (old_irql < DISPATCH_LEVEL)
+    KeLowerIrql(old_irql);
+  FUNCTION_MSG("grant table frames = %d, free = %d, low water = %d, grown %d times\n",
+    xpdd->grant_frames, xpdd->gnttbl_free, xpdd->gnttbl_low_water, xpdd->gnttbl_grow_count);
+
+  /* so the refs all go to the hibernate freelist, and so a ref isn't left cached on a processor across the suspend */
+  GntTbl_DisableCache(xpdd);
+
   #if DBG
   for (i = 0; i < (int)min(NR_GRANT_ENTRIES, (xpdd->grant_frames * PAGE_SIZE / sizeof(grant_entry_t))); i++)
   {
@@ -277,7 +696,9 @@ GntTbl_Suspend(PXENPCI_DEVICE_DATA xpdd)
     }
     FUNCTION_MSG("%d grant refs reserved\n", i);
     xpdd->gnttbl_ss_copy = xpdd->gnttbl_ss;
+    xpdd->gnttbl_free_copy = xpdd->gnttbl_free;
     stack_new(&xpdd->gnttbl_ss, HIBER_GREF_COUNT);
+    xpdd->gnttbl_free = 0;
   }
   else
   {
@@ -317,29 +738,14 @@ GntTbl_Resume(PXENPCI_DEVICE_DATA xpdd)
 
   FUNCTION_ENTER();
 
-  for (i = 0; i < (int)xpdd->grant_frames; i++)
-  {
-    struct xen_memory_reservation reservation;
-    xen_pfn_t pfn;
-    ULONG ret;
-    
-    reservation.address_bits = 0;
-    reservation.extent_order = 0;
-    reservation.domid = DOMID_SELF;
-    reservation.nr_extents = 1;
-    #pragma warning(disable: 4127) /* conditional expression is constant */
-    pfn = (xen_pfn_t)MmGetMdlPfnArray(xpdd->gnttbl_mdl)[i];
-    FUNCTION_MSG("pfn = %x\n", (ULONG)pfn);
-    set_xen_guest_handle(reservation.extent_start, &pfn);
-    
-    FUNCTION_MSG("Calling HYPERVISOR_memory_op - pfn = %x\n", (ULONG)pfn);
-    ret = HYPERVISOR_memory_op(XENMEM_decrease_reservation, &reservation);
-    FUNCTION_MSG("decreased %d pages for grant table frame %d\n", ret, i);
-  }
+  GntTbl_ReleaseFrames(xpdd, 0, xpdd->grant_frames);
 
   new_grant_frames = GntTbl_QueryMaxFrames(xpdd);
   FUNCTION_MSG("new_grant_frames = %d\n", new_grant_frames);
   XN_ASSERT(new_grant_frames >= xpdd->grant_frames); // lazy
+  /* we may have been migrated to a host that allows fewer frames */
+  if (new_grant_frames < xpdd->gnttbl_max_frames)
+    xpdd->gnttbl_max_frames = max(xpdd->grant_frames, new_grant_frames);
   result = GntTbl_Map(xpdd, 0, xpdd->grant_frames - 1);
   FUNCTION_MSG("GntTbl_Map result = %d\n", result);
   memcpy(xpdd->gnttbl_table, xpdd->gnttbl_table_copy, xpdd->grant_frames * PAGE_SIZE);
@@ -354,6 +760,7 @@ GntTbl_Resume(PXENPCI_DEVICE_DATA xpdd)
     FUNCTION_MSG("restoring grant ref stack\n");
     stack_delete(xpdd->gnttbl_ss, NULL, NULL);
     xpdd->gnttbl_ss = xpdd->gnttbl_ss_copy;
+    xpdd->gnttbl_free = xpdd->gnttbl_free_copy;
     for (i = 0; i < HIBER_GREF_COUNT; i++)
     {
       if (xpdd->hiber_grefs[i] == INVALID_GRANT_REF)
@@ -362,6 +769,9 @@ GntTbl_Resume(PXENPCI_DEVICE_DATA xpdd)
     }
     xpdd->gnttbl_ss_copy = NULL;
   }
+  if (xpdd->gnttbl_cache)
+    xpdd->gnttbl_cache_enabled = TRUE;
+  xpdd->gnttbl_grow_suspended = FALSE;
     
   FUNCTION_EXIT();
 }
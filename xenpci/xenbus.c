@@ -34,9 +34,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma warning( disable : 4221 ) 
 
 /* Not really necessary but keeps PREfast happy */
-static EVT_WDF_WORKITEM XenBus_WatchWorkItemProc;
-
-WDF_DECLARE_CONTEXT_TYPE(xsd_sockmsg_t)
+static KSTART_ROUTINE XenBus_WatchThreadProc;
 
 struct write_req {
     void *data;
@@ -76,7 +74,8 @@ static void memcpy_from_ring(void *Ring,
   memcpy(dest + c1, ring, c2);
 }
 
-/* called with xenbus_mutex held */
+/* called with xb_request_mutex held. With many requests in flight the ring
+   can fill, in which case we wait for xenstored to consume some of it */
 static void xb_write(
   PXENPCI_DEVICE_DATA xpdd,
   PVOID data,
@@ -85,8 +84,10 @@ static void xb_write(
 {
   XENSTORE_RING_IDX prod;
   ULONG copy_len;
+  ULONG avail;
   PUCHAR ptr;
   ULONG remaining;
+  LARGE_INTEGER timeout;
   
   //FUNCTION_ENTER();
 
@@ -96,7 +97,20 @@ static void xb_write(
   remaining = len;
   while (remaining)
   {
-    copy_len = min(remaining, XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(prod));
+    avail = XENSTORE_RING_SIZE - (prod - xpdd->xen_store_interface->req_cons);
+    if (!avail)
+    {
+      /* let xenstored have what we have written so far */
+      KeMemoryBarrier();
+      xpdd->xen_store_interface->req_prod = prod;
+      EvtChn_Notify(xpdd, xpdd->xenbus_event);
+      timeout.QuadPart = -10 * 1000 * 10; /* 10ms, in case we miss the event */
+      KeWaitForSingleObject(&xpdd->xb_ring_space_event, Executive, KernelMode, FALSE, &timeout);
+      continue;
+    }
+    /* make sure we see req_cons before we write over what was there */
+    KeMemoryBarrier();
+    copy_len = min(remaining, min(avail, XENSTORE_RING_SIZE - MASK_XENSTORE_IDX(prod)));
     memcpy((PUCHAR)xpdd->xen_store_interface->req + MASK_XENSTORE_IDX(prod), ptr, copy_len);
     prod += (XENSTORE_RING_IDX)copy_len;
     ptr += copy_len;
@@ -110,6 +124,70 @@ static void xb_write(
   //FUNCTION_EXIT();
 }
 
+/* Takes a free req_id and writes the request under xb_request_mutex. Other
+   threads can write their requests before we get our reply, so up to
+   NR_XB_REQS can be in flight. Overwrites msg->req_id. Returns the req_id
+   to pass to xb_wait, or -1 if wait is FALSE and none is free */
+static int
+xb_submit(
+  PXENPCI_DEVICE_DATA xpdd,
+  struct xsd_sockmsg *msg,
+  struct write_req *req,
+  int nr_reqs,
+  BOOLEAN wait)
+{
+  LARGE_INTEGER timeout;
+  int slot;
+  int i;
+
+  timeout.QuadPart = 0;
+  if (KeWaitForSingleObject(&xpdd->xb_req_semaphore, Executive, KernelMode, FALSE, wait ? NULL : &timeout) == STATUS_TIMEOUT)
+    return -1;
+  for (slot = 0; slot < NR_XB_REQS; slot++)
+  {
+    if (InterlockedCompareExchange(&xpdd->xb_reqs[slot].in_use, 1, 0) == 0)
+      break;
+  }
+  XN_ASSERT(slot < NR_XB_REQS);
+  msg->req_id = slot;
+
+  ExAcquireFastMutex(&xpdd->xb_request_mutex);
+  xb_write(xpdd, msg, sizeof(*msg));
+  for (i = 0; i < nr_reqs; i++)
+    xb_write(xpdd, req[i].data, req[i].len);
+  ExReleaseFastMutex(&xpdd->xb_request_mutex);
+
+  return slot;
+}
+
+/* waits for the reply to a request from xb_submit and frees its req_id */
+static struct xsd_sockmsg *
+xb_wait(
+  PXENPCI_DEVICE_DATA xpdd,
+  int slot)
+{
+  PXENBUS_REQ xb_req = &xpdd->xb_reqs[slot];
+  struct xsd_sockmsg *reply;
+
+  KeWaitForSingleObject(&xb_req->complete_event, Executive, KernelMode, FALSE, NULL);
+  reply = xb_req->reply;
+  xb_req->reply = NULL;
+  InterlockedExchange(&xb_req->in_use, 0);
+  KeReleaseSemaphore(&xpdd->xb_req_semaphore, IO_NO_INCREMENT, 1, FALSE);
+
+  return reply;
+}
+
+static struct xsd_sockmsg *
+xb_send(
+  PXENPCI_DEVICE_DATA xpdd,
+  struct xsd_sockmsg *msg,
+  struct write_req *req,
+  int nr_reqs)
+{
+  return xb_wait(xpdd, xb_submit(xpdd, msg, req, nr_reqs, TRUE));
+}
+
 /* takes and releases xb_request_mutex */
 static struct xsd_sockmsg *
 xenbus_format_msg_reply(
@@ -132,15 +210,7 @@ xenbus_format_msg_reply(
   for (i = 0; i < nr_reqs; i++)
     msg.len += req[i].len;
 
-  ExAcquireFastMutex(&xpdd->xb_request_mutex);
-  xb_write(xpdd, &msg, sizeof(msg));
-  for (i = 0; i < nr_reqs; i++)
-    xb_write(xpdd, req[i].data, req[i].len);
-
-  KeWaitForSingleObject(&xpdd->xb_request_complete_event, Executive, KernelMode, FALSE, NULL);
-  reply = xpdd->xb_reply;
-  xpdd->xb_reply = NULL;
-  ExReleaseFastMutex(&xpdd->xb_request_mutex);
+  reply = xb_send(xpdd, &msg, req, nr_reqs);
 
   //FUNCTION_EXIT();
   
@@ -154,15 +224,16 @@ XenBus_Raw(
   struct xsd_sockmsg *msg)
 {
   struct xsd_sockmsg *reply;
+  struct write_req req = { msg + 1, msg->len };
+  uint32_t req_id = msg->req_id;
   
   //FUNCTION_ENTER();
 
-  ExAcquireFastMutex(&xpdd->xb_request_mutex);
-  xb_write(xpdd, msg, sizeof(struct xsd_sockmsg) + msg->len);
-  KeWaitForSingleObject(&xpdd->xb_request_complete_event, Executive, KernelMode, FALSE, NULL);
-  reply = xpdd->xb_reply;
-  xpdd->xb_reply = NULL;
-  ExReleaseFastMutex(&xpdd->xb_request_mutex);  
+  /* the caller gets back the req_id it sent, not the one we used */
+  reply = xb_send(xpdd, msg, &req, 1);
+  msg->req_id = req_id;
+  if (reply)
+    reply->req_id = req_id;
 
   //FUNCTION_EXIT();
     
@@ -231,66 +302,199 @@ XenBus_Write(
   return NULL;
 }
 
-/* Called at PASSIVE_LEVEL */
+/* Called at PASSIVE_LEVEL. Like XenBus_Read and XenBus_Write, but every op
+   that there is a free req_id for is sent before waiting for any reply, so
+   the whole batch costs about one round trip. Only the first request of
+   each burst waits for a req_id, so two batches can't starve each other */
+VOID
+XenBus_ReadWriteMultiple(
+  PVOID Context,
+  xenbus_transaction_t xbt,
+  PXENBUS_OP ops,
+  ULONG count)
+{
+  PXENPCI_DEVICE_DATA xpdd = Context;
+  int slots[NR_XB_REQS];
+  struct xsd_sockmsg msg;
+  struct write_req req[2];
+  struct xsd_sockmsg *rep;
+  PXENBUS_OP op;
+  ULONG start;
+  ULONG sent;
+  ULONG i;
+
+  XN_ASSERT(KeGetCurrentIrql() < DISPATCH_LEVEL);
+
+  for (start = 0; start < count; start = sent)
+  {
+    for (sent = start; sent < count && sent - start < NR_XB_REQS; sent++)
+    {
+      op = &ops[sent];
+      msg.type = op->type;
+      msg.tx_id = xbt;
+      req[0].data = op->path;
+      req[0].len = (ULONG)strlen(op->path) + 1;
+      if (op->type == XS_WRITE)
+      {
+        req[1].data = op->value;
+        req[1].len = (ULONG)strlen(op->value);
+        msg.len = req[0].len + req[1].len;
+      }
+      else
+      {
+        XN_ASSERT(op->type == XS_READ);
+        msg.len = req[0].len;
+      }
+      slots[sent - start] = xb_submit(xpdd, &msg, req, op->type == XS_WRITE ? 2 : 1, (BOOLEAN)(sent == start));
+      if (slots[sent - start] < 0)
+        break;
+    }
+    for (i = start; i < sent; i++)
+    {
+      op = &ops[i];
+      rep = xb_wait(xpdd, slots[i - start]);
+      op->error = errmsg(rep);
+      if (op->error)
+      {
+        if (op->type == XS_READ)
+          op->value = NULL;
+        continue;
+      }
+      if (op->type == XS_READ)
+      {
+        op->value = ExAllocatePoolWithTag(NonPagedPool, rep->len + 1, XENPCI_POOL_TAG);
+        if (!op->value)
+        {
+          /* the reply header alone has room for the error string, and the caller frees error the same way */
+          FUNCTION_MSG("Failed to allocate value for %s\n", op->path);
+          op->error = (char *)rep;
+          memcpy(op->error, "ENOMEM", sizeof("ENOMEM"));
+          continue;
+        }
+        memcpy(op->value, rep + 1, rep->len);
+        op->value[rep->len] = 0;
+      }
+      ExFreePoolWithTag(rep, XENPCI_POOL_TAG);
+    }
+  }
+}
+
+/* Called at PASSIVE_LEVEL. A NULL or empty path means the watch's own path */
 static VOID
-XenBus_WatchWorkItemProc(WDFWORKITEM workitem)
+XenBus_DispatchWatch(PXENPCI_DEVICE_DATA xpdd, int index, PCHAR path)
 {
-  WDFDEVICE device = WdfWorkItemGetParentObject(workitem);
-  PXENPCI_DEVICE_DATA xpdd = GetXpdd(device);
-  xsd_sockmsg_t *msg;
-  PCHAR path;
-  int index;
   PXENBUS_WATCH_ENTRY entry;
-  PXN_WATCH_CALLBACK service_routine;
-  PVOID service_context;  
 
-  //FUNCTION_ENTER();
-  msg = WdfObjectGetTypedContext(workitem, xsd_sockmsg_t);
-  path = (PCHAR)msg + sizeof(xsd_sockmsg_t);
-  index = atoi(path + strlen(path) + 1);
   if (index < 0 || index >= MAX_WATCH_ENTRIES)
   {
     FUNCTION_MSG("Watch index %d out of range\n", index);
-    WdfObjectDelete(workitem);
-    //FUNCTION_ENTER();
     return;
   }
   ExAcquireFastMutex(&xpdd->xb_watch_mutex);
   entry = &xpdd->XenBus_WatchEntries[index];
   if (!entry->Active || !entry->ServiceRoutine)
   {
-    FUNCTION_MSG("No watch for index %d\n", index);
+    if (path)
+      FUNCTION_MSG("No watch for index %d\n", index);
     ExReleaseFastMutex(&xpdd->xb_watch_mutex);
-    WdfObjectDelete(workitem);
-    //FUNCTION_ENTER();
     return;
   }
   entry->Count++;
-  service_routine = entry->ServiceRoutine;
-  service_context = entry->ServiceContext;
-  service_routine(path, service_context);
+  entry->ServiceRoutine((path && path[0]) ? path : entry->Path, entry->ServiceContext);
   ExReleaseFastMutex(&xpdd->xb_watch_mutex);
-  WdfObjectDelete(workitem);
-  //FUNCTION_EXIT();
-}    
+}
+
+/*
+Called at DISPATCH_LEVEL with xb_ring_spinlock held. Watch events are queued
+for XenBus_WatchThreadProc, coalescing repeats (see XenBus_WatchRingAdd). If
+the queue is full we note the overflow and the thread fires every watch once,
+which is all a dropped event could have told anyone.
+*/
+static VOID
+XenBus_QueueWatch(PXENPCI_DEVICE_DATA xpdd, xsd_sockmsg_t *msg)
+{
+  PCHAR path = (PCHAR)msg + sizeof(xsd_sockmsg_t);
+  int index;
+  ULONG depth;
+
+  xpdd->xb_watch_events++;
+  index = atoi(path + strlen(path) + 1);
+
+  switch (XenBus_WatchRingAdd(xpdd->xb_watch_ring, xpdd->xb_watch_cons, &xpdd->xb_watch_prod, index, path))
+  {
+  case XENBUS_WATCH_COALESCED:
+    xpdd->xb_watch_coalesced++;
+    return;
+  case XENBUS_WATCH_OVERFLOW:
+    xpdd->xb_watch_overflow = TRUE;
+    xpdd->xb_watch_overflows++;
+    break;
+  default:
+    depth = xpdd->xb_watch_prod - xpdd->xb_watch_cons;
+    if (depth > xpdd->xb_watch_max_depth)
+      xpdd->xb_watch_max_depth = depth;
+    break;
+  }
+  KeSetEvent(&xpdd->xb_watch_event, IO_NO_INCREMENT, FALSE);
+}
+
+/* Called at PASSIVE_LEVEL */
+static VOID
+XenBus_WatchThreadProc(PVOID StartContext)
+{
+  PXENPCI_DEVICE_DATA xpdd = StartContext;
+  XENBUS_WATCH_RING ring_entry;
+  KIRQL old_irql;
+  BOOLEAN overflow;
+  int i;
+
+  FUNCTION_ENTER();
+
+  for(;;)
+  {
+    KeWaitForSingleObject(&xpdd->xb_watch_event, Executive, KernelMode, FALSE, NULL);
+    if (xpdd->xb_watch_shutdown)
+      break;
+    KeAcquireSpinLock(&xpdd->xb_ring_spinlock, &old_irql);
+    while (xpdd->xb_watch_cons != xpdd->xb_watch_prod)
+    {
+      ring_entry = xpdd->xb_watch_ring[xpdd->xb_watch_cons & (WATCH_RING_SIZE - 1)];
+      xpdd->xb_watch_cons++;
+      KeReleaseSpinLock(&xpdd->xb_ring_spinlock, old_irql);
+      XenBus_DispatchWatch(xpdd, ring_entry.Index, ring_entry.Path);
+      KeAcquireSpinLock(&xpdd->xb_ring_spinlock, &old_irql);
+    }
+    overflow = xpdd->xb_watch_overflow;
+    xpdd->xb_watch_overflow = FALSE;
+    KeReleaseSpinLock(&xpdd->xb_ring_spinlock, old_irql);
+    if (overflow)
+    {
+      FUNCTION_MSG("Watch queue overflowed, firing all watches\n");
+      for (i = 0; i < MAX_WATCH_ENTRIES; i++)
+        XenBus_DispatchWatch(xpdd, i, NULL);
+    }
+  }
+
+  FUNCTION_EXIT();
+  PsTerminateSystemThread(0);
+}
 
 /* Called at DISPATCH_LEVEL */
 static VOID
 XenBus_Dpc(PVOID ServiceContext)
 {
-  NTSTATUS status;
   PXENPCI_DEVICE_DATA xpdd = ServiceContext;
   xsd_sockmsg_t msg;
   ULONG msg_len;
-  WDF_WORKITEM_CONFIG workitem_config;
-  WDF_OBJECT_ATTRIBUTES workitem_attributes;
-  WDFWORKITEM workitem;
   ULONG rsp_prod;
 
   //FUNCTION_ENTER();
   
   KeAcquireSpinLockAtDpcLevel(&xpdd->xb_ring_spinlock);
 
+  /* xenstored notifies us when it consumes requests too */
+  KeSetEvent(&xpdd->xb_ring_space_event, IO_NO_INCREMENT, FALSE);
+
   /* snapshot rsp_prod so it doesn't change while we are looking at it */
   while ((rsp_prod = xpdd->xen_store_interface->rsp_prod) != xpdd->xen_store_interface->rsp_cons)
   {
@@ -328,28 +532,26 @@ XenBus_Dpc(PVOID ServiceContext)
 
     if (xpdd->xb_msg->type != XS_WATCH_EVENT)
     {
-      /* process reply - only ever one outstanding */
-      XN_ASSERT(xpdd->xb_reply == NULL);
-      xpdd->xb_reply = xpdd->xb_msg;
+      /* process reply - req_id is the slot the request is waiting in */
+      if (xpdd->xb_msg->req_id < NR_XB_REQS && xpdd->xb_reqs[xpdd->xb_msg->req_id].in_use
+          && !xpdd->xb_reqs[xpdd->xb_msg->req_id].reply)
+      {
+        xpdd->xb_reqs[xpdd->xb_msg->req_id].reply = xpdd->xb_msg;
+        KeSetEvent(&xpdd->xb_reqs[xpdd->xb_msg->req_id].complete_event, IO_NO_INCREMENT, FALSE);
+      }
+      else
+      {
+        FUNCTION_MSG("Reply for unexpected req_id %d\n", xpdd->xb_msg->req_id);
+        ExFreePoolWithTag(xpdd->xb_msg, XENPCI_POOL_TAG);
+      }
       xpdd->xb_msg = NULL;
-      KeSetEvent(&xpdd->xb_request_complete_event, IO_NO_INCREMENT, FALSE);
     }
     else
     {
       /* process watch */
-      WDF_WORKITEM_CONFIG_INIT(&workitem_config, XenBus_WatchWorkItemProc);
-      WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&workitem_attributes, xsd_sockmsg_t);
-      workitem_attributes.ParentObject = xpdd->wdf_device;
-      workitem_attributes.ContextSizeOverride = xpdd->xb_msg_offset;
-      status = WdfWorkItemCreate(&workitem_config, &workitem_attributes, &workitem);
-      if (!NT_SUCCESS(status))
-      {
-        FUNCTION_MSG("Failed to create work item for watch\n");
-        continue;
-      }
-      memcpy(WdfObjectGetTypedContext(workitem, xsd_sockmsg_t), xpdd->xb_msg, xpdd->xb_msg_offset);
+      XenBus_QueueWatch(xpdd, xpdd->xb_msg);
+      ExFreePoolWithTag(xpdd->xb_msg, XENPCI_POOL_TAG);
       xpdd->xb_msg = NULL;
-      WdfWorkItemEnqueue(workitem);
     }
     EvtChn_Notify(xpdd, xpdd->xenbus_event); /* there is room on the ring now */
   }
@@ -388,6 +590,7 @@ NTSTATUS
 XenBus_Init(PXENPCI_DEVICE_DATA xpdd)
 {
   NTSTATUS status;
+  HANDLE thread_handle;
   int i;
     
   FUNCTION_ENTER();
@@ -403,7 +606,33 @@ XenBus_Init(PXENPCI_DEVICE_DATA xpdd)
     xpdd->XenBus_WatchEntries[i].Active = 0;
   }
 
-  KeInitializeEvent(&xpdd->xb_request_complete_event, SynchronizationEvent, FALSE);
+  KeInitializeSemaphore(&xpdd->xb_req_semaphore, NR_XB_REQS, NR_XB_REQS);
+  for (i = 0; i < NR_XB_REQS; i++)
+  {
+    xpdd->xb_reqs[i].in_use = 0;
+    xpdd->xb_reqs[i].reply = NULL;
+    KeInitializeEvent(&xpdd->xb_reqs[i].complete_event, SynchronizationEvent, FALSE);
+  }
+  KeInitializeEvent(&xpdd->xb_ring_space_event, SynchronizationEvent, FALSE);
+
+  xpdd->xb_watch_prod = 0;
+  xpdd->xb_watch_cons = 0;
+  xpdd->xb_watch_overflow = FALSE;
+  xpdd->xb_watch_shutdown = FALSE;
+  xpdd->xb_watch_events = 0;
+  xpdd->xb_watch_coalesced = 0;
+  xpdd->xb_watch_overflows = 0;
+  xpdd->xb_watch_max_depth = 0;
+  KeInitializeEvent(&xpdd->xb_watch_event, SynchronizationEvent, FALSE);
+  status = PsCreateSystemThread(&thread_handle, THREAD_ALL_ACCESS, NULL, NULL, NULL, XenBus_WatchThreadProc, xpdd);
+  if (!NT_SUCCESS(status))
+  {
+    FUNCTION_MSG("Could not start watch thread\n");
+    FUNCTION_EXIT();
+    return status;
+  }
+  status = ObReferenceObjectByHandle(thread_handle, THREAD_ALL_ACCESS, NULL, KernelMode, &xpdd->xb_watch_thread, NULL);
+  ZwClose(thread_handle);
 
   status = XenBus_Connect(xpdd);
   if (!NT_SUCCESS(status))
@@ -466,6 +695,13 @@ XenBus_Halt(PXENPCI_DEVICE_DATA xpdd)
     }
   }
 
+  xpdd->xb_watch_shutdown = TRUE;
+  KeSetEvent(&xpdd->xb_watch_event, IO_NO_INCREMENT, FALSE);
+  KeWaitForSingleObject(xpdd->xb_watch_thread, Executive, KernelMode, FALSE, NULL);
+  ObDereferenceObject(xpdd->xb_watch_thread);
+  FUNCTION_MSG("watch events = %d, coalesced = %d, overflows = %d, max queue depth = %d\n",
+    xpdd->xb_watch_events, xpdd->xb_watch_coalesced, xpdd->xb_watch_overflows, xpdd->xb_watch_max_depth);
+
   XenBus_Disconnect(xpdd);
 
   FUNCTION_EXIT();
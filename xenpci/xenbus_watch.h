@@ -0,0 +1,79 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+
+Copyright (c) 2014, James Harper
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+    * Neither the name of James Harper nor the
+      names of its contributors may be used to endorse or promote products
+      derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL JAMES HARPER BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+The queue of watch events between XenBus_Dpc and XenBus_WatchThreadProc,
+kept apart from xenbus.c so that it can be built and tested in user mode
+(see tests/xenbus_watch_test.c). prod and cons are free running and the
+caller serialises access (xb_ring_spinlock).
+*/
+
+#define WATCH_RING_SIZE 128 /* must be a power of 2 */
+
+/* a watch event waiting for the watch thread. An empty Path means the watch's own path */
+typedef struct _XENBUS_WATCH_RING
+{
+  char Path[128];
+  int Index;
+} XENBUS_WATCH_RING;
+
+#define XENBUS_WATCH_QUEUED    0
+#define XENBUS_WATCH_COALESCED 1 /* already queued */
+#define XENBUS_WATCH_OVERFLOW  2 /* no room, the caller has to fire every watch later */
+
+/*
+Queues an event for watch index and path unless one for the same watch and
+path is still queued, as the callback will see the latest state when the
+queued one is dispatched. A path too long for the queue is queued as the
+watch's own path.
+*/
+static __inline ULONG
+XenBus_WatchRingAdd(XENBUS_WATCH_RING *ring, ULONG cons, ULONG *prod, int index, PCHAR path)
+{
+  XENBUS_WATCH_RING *ring_entry;
+  ULONG i;
+
+  if (strlen(path) >= ARRAY_SIZE(ring_entry->Path))
+    path = "";
+
+  for (i = cons; i != *prod; i++)
+  {
+    ring_entry = &ring[i & (WATCH_RING_SIZE - 1)];
+    if (ring_entry->Index == index && !strcmp(ring_entry->Path, path))
+      return XENBUS_WATCH_COALESCED;
+  }
+
+  if (*prod - cons == WATCH_RING_SIZE)
+    return XENBUS_WATCH_OVERFLOW;
+  ring_entry = &ring[*prod & (WATCH_RING_SIZE - 1)];
+  RtlStringCbCopyA(ring_entry->Path, ARRAY_SIZE(ring_entry->Path), path);
+  ring_entry->Index = index;
+  (*prod)++;
+  return XENBUS_WATCH_QUEUED;
+}
@@ -84,6 +84,11 @@ DEFINE_GUID( GUID_XENPCI_DEVCLASS, 0xC828ABE9, 0x14CA, 0x4445, 0xBA, 0xA6, 0x82,
 
 #define BALLOON_UNITS_KB (1 * 1024) /* 1MB */
 #define BALLOON_UNIT_PAGES ((BALLOON_UNITS_KB << 10) >> PAGE_SHIFT)
+#define BALLOON_MAX_UNITS_KB (64 * 1024) /* most given to Xen in one allocation, when memory is plentiful */
+#define BALLOON_PACED_UNITS_KB (8 * 1024) /* most given to Xen in one allocation otherwise */
+#define BALLOON_SUPERPAGE_ORDER 9 /* 2MB extents */
+#define BALLOON_SUPERPAGE_PAGES (1 << BALLOON_SUPERPAGE_ORDER)
+#define BALLOON_KB_TO_PAGES(kb) (((kb) + (PAGE_SIZE >> 10) - 1) / (PAGE_SIZE >> 10))
 
 extern PVOID hypercall_stubs;
 extern ULONG qemu_protocol_version;
@@ -103,11 +108,7 @@ typedef struct _ev_action_t {
   ULONG count;
 } ev_action_t;
 
-typedef struct _XENBUS_WATCH_RING
-{
-  char Path[128];
-  char Token[10];
-} XENBUS_WATCH_RING;
+#include "xenbus_watch.h"
 
 typedef struct xsd_sockmsg xsd_sockmsg_t;
 
@@ -119,9 +120,23 @@ typedef struct _XENBUS_WATCH_ENTRY {
   int Active;
 } XENBUS_WATCH_ENTRY, *PXENBUS_WATCH_ENTRY;
 
+/* a request waiting for its reply. The slot number is the req_id */
+typedef struct _XENBUS_REQ {
+  volatile LONG in_use;
+  KEVENT complete_event;
+  struct xsd_sockmsg *reply;
+} XENBUS_REQ, *PXENBUS_REQ;
+
+/* one read or write for XenBus_ReadWriteMultiple */
+typedef struct _XENBUS_OP {
+  ULONG type; /* XS_READ or XS_WRITE */
+  char *path;
+  char *value; /* to write, or the value read which the caller frees */
+  char *error; /* NULL on success, otherwise freed by the caller */
+} XENBUS_OP, *PXENBUS_OP;
+
 /* number of events is 1024 on 32 bits and 4096 on 64 bits */
 #define NR_EVENTS (sizeof(xen_ulong_t) * 8 * sizeof(xen_ulong_t) * 8)
-#define WATCH_RING_SIZE 128
 #define NR_XB_REQS 32
 #define MAX_WATCH_ENTRIES 128
 
@@ -134,14 +149,32 @@ typedef struct _XENBUS_WATCH_ENTRY {
 #define SUSPEND_STATE_HIGH_IRQL 2 /* all processors are at high IRQL and spinning */
 #define SUSPEND_STATE_RESUMING  3 /* we are the other side of the suspend and things are starting to get back to normal */
 
-/* we take some grant refs out and put them aside so that we dont get corrupted by hibernate */
-#define HIBER_GREF_COUNT 128
+/* we take some grant refs out and put them aside so that we dont get corrupted by hibernate. xenvbd keeps up to 16 requests of 11 pages in flight while writing the hibernate file */
+#define HIBER_GREF_COUNT 512
 
 typedef struct {
   ULONG generation;
   ULONG tag;
 } grant_tag_t;
 
+/* free grant refs are cached per processor so that the global stack's head isn't fought over by every processor
+   doing io. Refs move between a cache and the stack GNTTBL_CACHE_BATCH at a time */
+#define GNTTBL_CACHE_SIZE  64
+#define GNTTBL_CACHE_BATCH 32
+
+/* the grant table starts small and is grown GNTTBL_GROW_FRAMES at a time, from a dpc, whenever the free refs on the
+   global stack drop below GNTTBL_GROW_WATERMARK */
+#define GNTTBL_ENTRIES_PER_FRAME (PAGE_SIZE / sizeof(grant_entry_t))
+#define GNTTBL_INITIAL_FRAMES    4
+#define GNTTBL_GROW_FRAMES       4
+#define GNTTBL_GROW_WATERMARK    1024
+
+typedef struct {
+  KSPIN_LOCK lock; /* only ever contended when the caches are being drained or another processor has run out */
+  ULONG count;
+  grant_ref_t refs[GNTTBL_CACHE_SIZE];
+} DECLSPEC_ALIGN(64) gnttbl_cache_t; /* the array of these must be allocated 64 byte aligned, see GntTbl_Init */
+
 typedef struct {  
   WDFDEVICE wdf_device;
   
@@ -161,6 +194,7 @@ typedef struct {
   //evtchn_port_t pdo_event_channel;
   //KEVENT pdo_suspend_event;
   BOOLEAN interrupts_masked;
+  BOOLEAN evtchn_fifo; /* FIFO event channel ABI in use, otherwise 2-level */
   
   PHYSICAL_ADDRESS platform_mmio_addr;
   ULONG platform_mmio_orig_len;
@@ -176,6 +210,9 @@ typedef struct {
   /* grant related */
   struct stack_state *gnttbl_ss;
   struct stack_state *gnttbl_ss_copy;
+  gnttbl_cache_t *gnttbl_cache; /* one per processor */
+  ULONG gnttbl_cache_count;
+  BOOLEAN gnttbl_cache_enabled; /* FALSE from suspend to resume, so the hibernate freelist is used */
   grant_ref_t hiber_grefs[HIBER_GREF_COUNT];
   PMDL gnttbl_mdl;
   grant_entry_t *gnttbl_table;
@@ -185,7 +222,16 @@ typedef struct {
   grant_tag_t *gnttbl_tag;
   grant_tag_t *gnttbl_tag_copy;
   #endif
-  ULONG grant_frames;
+  ULONG grant_frames; /* frames mapped now */
+  ULONG gnttbl_max_frames; /* frames the table can grow to */
+  volatile LONG gnttbl_free; /* refs on the global stack, not counting the per processor caches */
+  LONG gnttbl_free_copy; /* gnttbl_free for the normal freelist while the hibernate one is in use */
+  LONG gnttbl_low_water; /* lowest gnttbl_free has been */
+  ULONG gnttbl_grow_count;
+  KDPC gnttbl_grow_dpc;
+  KSPIN_LOCK gnttbl_grow_lock; /* held while growing, and to stop growth over a suspend */
+  volatile LONG gnttbl_grow_queued;
+  BOOLEAN gnttbl_grow_suspended;
 
   ev_action_t ev_actions[NR_EVENTS];
 //  unsigned long bound_ports[NR_EVENTS/(8*sizeof(unsigned long))];
@@ -199,15 +245,30 @@ typedef struct {
   BOOLEAN balloon_shutdown;
   //ULONG initial_memory_kb;
   ULONG current_memory_kb;
+  ULONG balloon_pages_out; /* given to Xen since boot */
+  ULONG balloon_pages_in; /* taken back from Xen since boot */
+  ULONG balloon_pages_per_sec; /* rate of the last adjustment */
   ULONG target_memory_kb;
   
   /* xenbus related */
   XENBUS_WATCH_ENTRY XenBus_WatchEntries[MAX_WATCH_ENTRIES];
+  XENBUS_WATCH_RING xb_watch_ring[WATCH_RING_SIZE]; /* protected by xb_ring_spinlock */
+  ULONG xb_watch_prod;
+  ULONG xb_watch_cons;
+  BOOLEAN xb_watch_overflow;
+  PKTHREAD xb_watch_thread;
+  KEVENT xb_watch_event;
+  BOOLEAN xb_watch_shutdown;
+  ULONG xb_watch_events;
+  ULONG xb_watch_coalesced;
+  ULONG xb_watch_overflows;
+  ULONG xb_watch_max_depth;
   KSPIN_LOCK xb_ring_spinlock;
   FAST_MUTEX xb_watch_mutex;
-  FAST_MUTEX xb_request_mutex;
-  KEVENT xb_request_complete_event;
-  struct xsd_sockmsg *xb_reply;
+  FAST_MUTEX xb_request_mutex; /* held while writing a request to the ring */
+  KSEMAPHORE xb_req_semaphore; /* counts free xb_reqs */
+  XENBUS_REQ xb_reqs[NR_XB_REQS];
+  KEVENT xb_ring_space_event; /* set when xenstored may have consumed requests */
   struct xsd_sockmsg *xb_msg;
   ULONG xb_msg_offset;
   
@@ -332,6 +393,16 @@ XenPci_FreeMem(PVOID Ptr) {
   ExFreePoolWithTag(Ptr, XENPCI_POOL_TAG);
 }
 
+/* KeNumberProcessors is a pointer before XP */
+static __inline ULONG
+XenPci_ProcessorCount() {
+  #if (NTDDI_VERSION >= NTDDI_WINXP)
+  return (ULONG)KeNumberProcessors;
+  #else
+  return (ULONG)*KeNumberProcessors;
+  #endif
+}
+
 NTSTATUS XenBus_DeviceFileInit(WDFDEVICE device, PWDF_IO_QUEUE_CONFIG queue_config, WDFFILEOBJECT file_object);
 
 EVT_WDF_DEVICE_FILE_CREATE XenPci_EvtDeviceFileCreate;
@@ -402,6 +473,7 @@ XenPci_DebugPrint(PCHAR format, ...);
 struct xsd_sockmsg *XenBus_Raw(PXENPCI_DEVICE_DATA xpdd, struct xsd_sockmsg *msg);
 char *XenBus_Read(PVOID Context, xenbus_transaction_t xbt, char *path, char **value);
 char *XenBus_Write(PVOID Context, xenbus_transaction_t xbt, char *path, char *value);
+VOID XenBus_ReadWriteMultiple(PVOID Context, xenbus_transaction_t xbt, PXENBUS_OP ops, ULONG count);
 char *XenBus_Printf(PVOID Context, xenbus_transaction_t xbt, char *path, char *fmt, ...);
 char *XenBus_StartTransaction(PVOID Context, xenbus_transaction_t *xbt);
 char *XenBus_EndTransaction(PVOID Context, xenbus_transaction_t t, int abort, int *retry);
@@ -428,6 +500,7 @@ NTSTATUS EvtChn_Mask(PVOID context, evtchn_port_t port);
 NTSTATUS EvtChn_Unmask(PVOID context, evtchn_port_t port);
 NTSTATUS EvtChn_Bind(PVOID context, evtchn_port_t port, PXN_EVENT_CALLBACK ServiceRoutine, PVOID ServiceContext, ULONG flags);
 NTSTATUS EvtChn_BindDpc(PVOID context, evtchn_port_t port, PXN_EVENT_CALLBACK ServiceRoutine, PVOID ServiceContext, ULONG flags);
+NTSTATUS EvtChn_SetCpu(PVOID context, evtchn_port_t port, ULONG cpu);
 NTSTATUS EvtChn_Unbind(PVOID context, evtchn_port_t port);
 NTSTATUS EvtChn_Notify(PVOID context, evtchn_port_t port);
 VOID EvtChn_Close(PVOID context, evtchn_port_t port);
@@ -439,6 +512,9 @@ VOID GntTbl_Suspend(PXENPCI_DEVICE_DATA xpdd);
 VOID GntTbl_Resume(PXENPCI_DEVICE_DATA xpdd);
 grant_ref_t GntTbl_GrantAccess(PVOID Context, domid_t domid, uint32_t, int readonly, grant_ref_t ref, ULONG tag);
 BOOLEAN GntTbl_EndAccess(PVOID Context, grant_ref_t ref, BOOLEAN keepref, ULONG tag);
+BOOLEAN GntTbl_GrantAccessMultiple(PVOID Context, domid_t domid, uint32_t *frames, ULONG count, int readonly, grant_ref_t *refs, ULONG tag);
+BOOLEAN GntTbl_EndAccessMultiple(PVOID Context, grant_ref_t *refs, ULONG count, BOOLEAN keepref, ULONG tag);
+ULONG GntTbl_Copy(PVOID Context, domid_t domid, gnttab_copy_t *ops, ULONG count);
 VOID GntTbl_PutRef(PVOID Context, grant_ref_t ref, ULONG tag);
 grant_ref_t GntTbl_GetRef(PVOID Context, ULONG tag);
 
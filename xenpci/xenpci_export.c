@@ -146,6 +146,21 @@ XnBindEvent(XN_HANDLE handle, evtchn_port_t *port, PXN_EVENT_CALLBACK callback,
   return EvtChn_Bind(xpdd, *port, callback, context, EVT_ACTION_FLAGS_DEFAULT);
 }
 
+NTSTATUS
+XnBindEventCpu(XN_HANDLE handle, evtchn_port_t *port, PXN_EVENT_CALLBACK callback, PVOID context, ULONG cpu) {
+  PXENPCI_PDO_DEVICE_DATA xppdd = handle;
+  PXENPCI_DEVICE_DATA xpdd = xppdd->xpdd;
+  NTSTATUS status;
+
+  *port = EvtChn_AllocUnbound(xpdd, xppdd->backend_id);
+  status = EvtChn_SetCpu(xpdd, *port, cpu);
+  if (!NT_SUCCESS(status)) {
+    EvtChn_Close(xpdd, *port);
+    return status;
+  }
+  return EvtChn_BindDpc(xpdd, *port, callback, context, EVT_ACTION_FLAGS_DEFAULT);
+}
+
 NTSTATUS
 XnUnbindEvent(XN_HANDLE handle, evtchn_port_t port) {
   PXENPCI_PDO_DEVICE_DATA xppdd = handle;
@@ -169,6 +184,29 @@ XnEndAccess(XN_HANDLE handle, grant_ref_t ref, BOOLEAN keepref, ULONG tag) {
   return GntTbl_EndAccess(xpdd, ref, keepref, tag);
 }
 
+BOOLEAN
+XnGrantAccessMultiple(XN_HANDLE handle, uint32_t *frames, ULONG count, int readonly, grant_ref_t *refs, ULONG tag) {
+  PXENPCI_PDO_DEVICE_DATA xppdd = handle;
+  PXENPCI_DEVICE_DATA xpdd = xppdd->xpdd;
+  return GntTbl_GrantAccessMultiple(xpdd, xppdd->backend_id, frames, count, readonly, refs, tag);
+}
+
+BOOLEAN
+XnEndAccessMultiple(XN_HANDLE handle, grant_ref_t *refs, ULONG count, BOOLEAN keepref, ULONG tag) {
+  PXENPCI_PDO_DEVICE_DATA xppdd = handle;
+  PXENPCI_DEVICE_DATA xpdd = xppdd->xpdd;
+  return GntTbl_EndAccessMultiple(xpdd, refs, count, keepref, tag);
+}
+
+NTSTATUS
+XnGrantCopy(XN_HANDLE handle, gnttab_copy_t *ops, ULONG count) {
+  PXENPCI_PDO_DEVICE_DATA xppdd = handle;
+  PXENPCI_DEVICE_DATA xpdd = xppdd->xpdd;
+  if (GntTbl_Copy(xpdd, xppdd->backend_id, ops, count))
+    return STATUS_UNSUCCESSFUL;
+  return STATUS_SUCCESS;
+}
+
 grant_ref_t
 XnAllocateGrant(XN_HANDLE handle, ULONG tag) {
   PXENPCI_PDO_DEVICE_DATA xppdd = handle;
@@ -374,6 +412,100 @@ XnWriteInt64(XN_HANDLE handle, ULONG base, PCHAR path, ULONGLONG value) {
   return STATUS_SUCCESS;
 }
 
+static PCHAR
+XnBasePath(PXENPCI_PDO_DEVICE_DATA xppdd, ULONG base) {
+  switch(base) {
+  case XN_BASE_FRONTEND:
+    return xppdd->path;
+  case XN_BASE_BACKEND:
+    return xppdd->backend_path;
+  default:
+    return "";
+  }
+}
+
+/* room for the decimal string of any ULONGLONG */
+#define XN_INT_STRING_SIZE 21
+
+NTSTATUS
+XnReadWriteMultiple(XN_HANDLE handle, PXN_XENSTORE_OP ops, ULONG count) {
+  PXENPCI_PDO_DEVICE_DATA xppdd = handle;
+  PXENPCI_DEVICE_DATA xpdd = xppdd->xpdd;
+  PXENBUS_OP xb_ops;
+  PCHAR ptr;
+  size_t size;
+  size_t path_size;
+  ULONG i;
+  NTSTATUS status = STATUS_SUCCESS;
+
+  size = count * sizeof(XENBUS_OP);
+  for (i = 0; i < count; i++) {
+    if (ops[i].type < XN_XENSTORE_READ_STRING || ops[i].type > XN_XENSTORE_WRITE_INT) {
+      FUNCTION_MSG("Invalid op type %d\n", ops[i].type);
+      return STATUS_INVALID_PARAMETER;
+    }
+    size += strlen(XnBasePath(xppdd, ops[i].base)) + 1 + strlen(ops[i].path) + 1 + XN_INT_STRING_SIZE;
+  }
+  /* one allocation for the ops, their full paths and any ints to be written */
+  xb_ops = ExAllocatePoolWithTag(NonPagedPool, size, XENPCI_POOL_TAG);
+  if (!xb_ops) {
+    for (i = 0; i < count; i++)
+      ops[i].status = STATUS_INSUFFICIENT_RESOURCES;
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  ptr = (PCHAR)(xb_ops + count);
+  for (i = 0; i < count; i++) {
+    path_size = strlen(XnBasePath(xppdd, ops[i].base)) + 1 + strlen(ops[i].path) + 1;
+    RtlStringCbPrintfA(ptr, path_size, "%s/%s", XnBasePath(xppdd, ops[i].base), ops[i].path);
+    xb_ops[i].path = ptr;
+    ptr += path_size;
+    xb_ops[i].value = NULL;
+    switch (ops[i].type) {
+    case XN_XENSTORE_READ_STRING:
+    case XN_XENSTORE_READ_INT:
+      xb_ops[i].type = XS_READ;
+      break;
+    case XN_XENSTORE_WRITE_STRING:
+      xb_ops[i].type = XS_WRITE;
+      xb_ops[i].value = ops[i].value;
+      break;
+    case XN_XENSTORE_WRITE_INT:
+      xb_ops[i].type = XS_WRITE;
+      RtlStringCbPrintfA(ptr, XN_INT_STRING_SIZE, "%I64d", ops[i].int_value);
+      xb_ops[i].value = ptr;
+      break;
+    }
+    ptr += XN_INT_STRING_SIZE;
+  }
+
+  XenBus_ReadWriteMultiple(xpdd, XBT_NIL, xb_ops, count);
+
+  for (i = 0; i < count; i++) {
+    if (xb_ops[i].error) {
+      FUNCTION_MSG("Error %s %s - %s\n", (xb_ops[i].type == XS_READ) ? "reading" : "writing", xb_ops[i].path, xb_ops[i].error);
+      XenPci_FreeMem(xb_ops[i].error);
+      if (ops[i].type == XN_XENSTORE_READ_STRING)
+        ops[i].value = NULL;
+      ops[i].status = STATUS_UNSUCCESSFUL;
+      status = STATUS_UNSUCCESSFUL;
+      continue;
+    }
+    ops[i].status = STATUS_SUCCESS;
+    if (ops[i].type == XN_XENSTORE_READ_STRING) {
+      ops[i].value = xb_ops[i].value;
+    } else if (ops[i].type == XN_XENSTORE_READ_INT) {
+      ops[i].int_value = 0;
+      for (ptr = xb_ops[i].value; *ptr && *ptr >= '0' && *ptr <= '9'; ptr++) {
+        ops[i].int_value *= 10;
+        ops[i].int_value += (*ptr) - '0';
+      }
+      XenPci_FreeMem(xb_ops[i].value);
+    }
+  }
+  ExFreePoolWithTag(xb_ops, XENPCI_POOL_TAG);
+  return status;
+}
+
 NTSTATUS
 XnNotify(XN_HANDLE handle, evtchn_port_t port) {
   PXENPCI_PDO_DEVICE_DATA xppdd = handle;
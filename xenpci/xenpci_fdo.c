@@ -195,6 +195,113 @@ XenPci_SysrqHandler(char *path, PVOID context) {
   FUNCTION_EXIT();
 }
 
+/* Split pfn_count pages of mdl, starting at page first, into 2MB extents, one for each aligned run of physically
+   contiguous pages, and single pages for the rest. big needs room for pfn_count / BALLOON_SUPERPAGE_PAGES entries
+   and small for pfn_count */
+static VOID
+XenPci_BalloonExtents(PMDL mdl, ULONG first, ULONG pfn_count, xen_pfn_t *big, ULONG *big_count, xen_pfn_t *small, ULONG *small_count) {
+  PPFN_NUMBER mdl_pfns = MmGetMdlPfnArray(mdl) + first;
+  ULONG i;
+  ULONG j;
+
+  *big_count = 0;
+  *small_count = 0;
+  for (i = 0; i < pfn_count;) {
+    if (!(mdl_pfns[i] & (BALLOON_SUPERPAGE_PAGES - 1)) && i + BALLOON_SUPERPAGE_PAGES <= pfn_count) {
+      for (j = 1; j < BALLOON_SUPERPAGE_PAGES && mdl_pfns[i + j] == mdl_pfns[i] + j; j++);
+      if (j == BALLOON_SUPERPAGE_PAGES) {
+        big[(*big_count)++] = (xen_pfn_t)mdl_pfns[i];
+        i += j;
+        continue;
+      }
+    }
+    /* sizeof(xen_pfn_t) may not be the same as PPFN_NUMBER */
+    small[(*small_count)++] = (xen_pfn_t)mdl_pfns[i];
+    i++;
+  }
+}
+
+/* returns the number of extents done */
+static ULONG
+XenPci_BalloonReservation(int op, xen_pfn_t *pfns, ULONG count, ULONG order) {
+  struct xen_memory_reservation reservation;
+  int ret;
+
+  if (!count)
+    return 0;
+  reservation.address_bits = 0;
+  reservation.extent_order = order;
+  reservation.domid = DOMID_SELF;
+  reservation.nr_extents = count;
+  #pragma warning(disable: 4127) /* conditional expression is constant */
+  set_xen_guest_handle(reservation.extent_start, pfns);
+  ret = HYPERVISOR_memory_op(op, &reservation);
+  if (ret < 0) {
+    FUNCTION_MSG("memory_op %d of %d order %d extents failed (%d)\n", op, count, order, ret);
+    return 0;
+  }
+  return (ULONG)ret;
+}
+
+/* 2MB extents Xen wouldn't take go back on the end of small as single pages */
+static VOID
+XenPci_BalloonSplitExtents(xen_pfn_t *big, ULONG done, ULONG big_count, xen_pfn_t *small, ULONG *small_count) {
+  ULONG i;
+  ULONG j;
+
+  for (i = done; i < big_count; i++) {
+    for (j = 0; j < BALLOON_SUPERPAGE_PAGES; j++)
+      small[(*small_count)++] = big[i] + j;
+  }
+}
+
+/* Give pfn_count pages of mdl starting at page first to Xen (inflate), or take them back from Xen (deflate), with one
+   hypercall per extent size. Taking back is all or nothing - if Xen is out of pages, whatever was populated is given
+   back and FALSE returned */
+static BOOLEAN
+XenPci_BalloonMdl(PMDL mdl, ULONG first, ULONG pfn_count, BOOLEAN inflate) {
+  xen_pfn_t *big;
+  xen_pfn_t *small;
+  ULONG big_count;
+  ULONG small_count;
+  ULONG big_done;
+  ULONG small_done;
+  BOOLEAN result = TRUE;
+
+  big = ExAllocatePoolWithTag(NonPagedPool, (pfn_count / BALLOON_SUPERPAGE_PAGES + 1) * sizeof(xen_pfn_t), XENPCI_POOL_TAG);
+  small = ExAllocatePoolWithTag(NonPagedPool, pfn_count * sizeof(xen_pfn_t), XENPCI_POOL_TAG);
+  if (!big || !small) {
+    FUNCTION_MSG("Failed to allocate pfn arrays\n");
+    if (big)
+      ExFreePoolWithTag(big, XENPCI_POOL_TAG);
+    if (small)
+      ExFreePoolWithTag(small, XENPCI_POOL_TAG);
+    return FALSE;
+  }
+  XenPci_BalloonExtents(mdl, first, pfn_count, big, &big_count, small, &small_count);
+
+  if (inflate) {
+    big_done = XenPci_BalloonReservation(XENMEM_decrease_reservation, big, big_count, BALLOON_SUPERPAGE_ORDER);
+    XenPci_BalloonSplitExtents(big, big_done, big_count, small, &small_count);
+    XenPci_BalloonReservation(XENMEM_decrease_reservation, small, small_count, 0);
+  } else {
+    /* Xen may not have 2MB extents free, in which case we take single pages instead */
+    big_done = XenPci_BalloonReservation(XENMEM_populate_physmap, big, big_count, BALLOON_SUPERPAGE_ORDER);
+    XenPci_BalloonSplitExtents(big, big_done, big_count, small, &small_count);
+    small_done = XenPci_BalloonReservation(XENMEM_populate_physmap, small, small_count, 0);
+    if (small_done < small_count) {
+      /* We hit the Xen hard limit: reprobe. */
+      XenPci_BalloonReservation(XENMEM_decrease_reservation, big, big_done, BALLOON_SUPERPAGE_ORDER);
+      XenPci_BalloonReservation(XENMEM_decrease_reservation, small, small_done, 0);
+      FUNCTION_MSG("decreased %d pages (xen is out of pages)\n", big_done * BALLOON_SUPERPAGE_PAGES + small_done);
+      result = FALSE;
+    }
+  }
+  ExFreePoolWithTag(big, XENPCI_POOL_TAG);
+  ExFreePoolWithTag(small, XENPCI_POOL_TAG);
+  return result;
+}
+
 static VOID
 XenPci_BalloonThreadProc(PVOID StartContext)
 {
@@ -204,15 +311,21 @@ XenPci_BalloonThreadProc(PVOID StartContext)
   PLARGE_INTEGER ptimeout;
   PMDL head;
   PMDL mdl;      
-  struct xen_memory_reservation reservation;
-  xen_pfn_t *pfns;
-  int i;
-  ULONG ret;
-  int pfn_count;
+  ULONG pfn_count;
+  ULONG head_populated = 0; /* leading pages of head that have been taken back from Xen */
+  ULONG unit_kb;
+  ULONG pages_moved;
+  LARGE_INTEGER start_time;
+  LARGE_INTEGER end_time;
+  LARGE_INTEGER frequency;
+  ULONG elapsed_ms;
   int timeout_ms = 1000;
   DECLARE_CONST_UNICODE_STRING(low_mem_name, L"\\KernelObjects\\LowMemoryCondition");
+  DECLARE_CONST_UNICODE_STRING(high_mem_name, L"\\KernelObjects\\HighMemoryCondition");
   PKEVENT low_mem_event;
   HANDLE low_mem_handle;
+  PKEVENT high_mem_event;
+  HANDLE high_mem_handle;
   BOOLEAN hit_initial_target = FALSE;
   
   FUNCTION_ENTER();
@@ -220,6 +333,7 @@ XenPci_BalloonThreadProc(PVOID StartContext)
   head = NULL;
 
   low_mem_event = IoCreateNotificationEvent((PUNICODE_STRING)&low_mem_name, &low_mem_handle);
+  high_mem_event = IoCreateNotificationEvent((PUNICODE_STRING)&high_mem_name, &high_mem_handle);
   //high_commit_event = IoCreateNotificationEvent((PUNICODE_STRING)&high_commit_name, &high_commit_handle);
   //max_commit_event = IoCreateNotificationEvent((PUNICODE_STRING)&max_commit_name, &max_commit_handle);
 
@@ -249,47 +363,49 @@ XenPci_BalloonThreadProc(PVOID StartContext)
     // make sure target <= initial
     // make sure target > some % of initial
     
+    pages_moved = 0;
+    start_time = KeQueryPerformanceCounter(&frequency);
     if (xpdd->current_memory_kb == new_target_kb) {
       FUNCTION_MSG("No change to memory\n");
       continue;
     } else if (xpdd->current_memory_kb < new_target_kb) {
       FUNCTION_MSG("Trying to take %d KB from Xen\n", new_target_kb - xpdd->current_memory_kb);
       while ((mdl = head) != NULL && xpdd->current_memory_kb < new_target_kb) {
-        pfn_count = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(mdl), MmGetMdlByteCount(mdl));
-        pfns = ExAllocatePoolWithTag(NonPagedPool, pfn_count * sizeof(xen_pfn_t), XENPCI_POOL_TAG);
-        /* sizeof(xen_pfn_t) may not be the same as PPFN_NUMBER */
-        for (i = 0; i < pfn_count; i++)
-          pfns[i] = (xen_pfn_t)(MmGetMdlPfnArray(mdl)[i]);
-        reservation.address_bits = 0;
-        reservation.extent_order = 0;
-        reservation.domid = DOMID_SELF;
-        reservation.nr_extents = pfn_count;
-        #pragma warning(disable: 4127) /* conditional expression is constant */
-        set_xen_guest_handle(reservation.extent_start, pfns);
-        
-        //FUNCTION_MSG("Calling HYPERVISOR_memory_op(XENMEM_populate_physmap) - pfn_count = %d\n", pfn_count);
-        ret = HYPERVISOR_memory_op(XENMEM_populate_physmap, &reservation);
-        //FUNCTION_MSG("populated %d pages\n", ret);
-        if (ret < (ULONG)pfn_count) {
-          if (ret > 0) {
-            /* We hit the Xen hard limit: reprobe. */
-            reservation.nr_extents = ret;
-            ret = HYPERVISOR_memory_op(XENMEM_decrease_reservation, &reservation);
-            FUNCTION_MSG("decreased %d pages (xen is out of pages)\n", ret);
-          }
-          ExFreePoolWithTag(pfns, XENPCI_POOL_TAG);
+        /* The toolstack only allows a little over target, so never ask Xen for more than the distance to it. If that
+           is less than the whole of head, the rest of head stays ballooned until next time */
+        pfn_count = min(ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(mdl), MmGetMdlByteCount(mdl)) - head_populated,
+          BALLOON_KB_TO_PAGES(new_target_kb - xpdd->current_memory_kb));
+        if (!XenPci_BalloonMdl(mdl, head_populated, pfn_count, FALSE))
           break;
+        head_populated += pfn_count;
+        xpdd->current_memory_kb += (pfn_count << PAGE_SHIFT) >> 10;
+        xpdd->balloon_pages_in += pfn_count;
+        pages_moved += pfn_count;
+        if (head_populated == ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(mdl), MmGetMdlByteCount(mdl))) {
+          head = mdl->Next;
+          mdl->Next = NULL;        
+          MmFreePagesFromMdl(mdl);
+          ExFreePool(mdl);
+          head_populated = 0;
         }
-        ExFreePoolWithTag(pfns, XENPCI_POOL_TAG);
-        head = mdl->Next;
-        mdl->Next = NULL;        
-        MmFreePagesFromMdl(mdl);
-        ExFreePool(mdl);
-        xpdd->current_memory_kb += BALLOON_UNITS_KB;
       }
     } else {
       FUNCTION_MSG("Trying to give %d KB to Xen\n", xpdd->current_memory_kb - new_target_kb);
-      while (xpdd->current_memory_kb > new_target_kb) {
+      if (head_populated) {
+        /* give back pages from the end of what was taken back of head first, so only head is ever partly ballooned */
+        pfn_count = min(head_populated, BALLOON_KB_TO_PAGES(xpdd->current_memory_kb - new_target_kb));
+        if (XenPci_BalloonMdl(head, head_populated - pfn_count, pfn_count, TRUE)) {
+          head_populated -= pfn_count;
+          xpdd->current_memory_kb -= (pfn_count << PAGE_SHIFT) >> 10;
+          xpdd->balloon_pages_out += pfn_count;
+          pages_moved += pfn_count;
+        } else {
+          FUNCTION_MSG("Failed to give back %d pages of head\n", pfn_count);
+        }
+      }
+      /* a new mdl can only go in front of head once head is fully ballooned again, or the next deflate would start
+         populating the new mdl at head's offset */
+      while (!head_populated && xpdd->current_memory_kb > new_target_kb) {
         PHYSICAL_ADDRESS alloc_low;
         PHYSICAL_ADDRESS alloc_high;
         PHYSICAL_ADDRESS alloc_skip;
@@ -302,49 +418,52 @@ XenPci_BalloonThreadProc(PVOID StartContext)
           break;
         }
 
+        /* take big bites only while Windows says memory is plentiful */
+        if (high_mem_event && KeReadStateEvent(high_mem_event))
+          unit_kb = BALLOON_MAX_UNITS_KB;
+        else
+          unit_kb = BALLOON_PACED_UNITS_KB;
+        unit_kb = min(unit_kb, (xpdd->current_memory_kb - new_target_kb + BALLOON_UNITS_KB - 1) & ~(BALLOON_UNITS_KB - 1));
+
         #if (NTDDI_VERSION >= NTDDI_WS03SP1)
         /* our contract says that we must zero pages before returning to xen, so we can't use MM_DONT_ZERO_ALLOCATION */
-        mdl = MmAllocatePagesForMdlEx(alloc_low, alloc_high, alloc_skip, BALLOON_UNITS_KB * 1024, MmCached, 0);
+        mdl = MmAllocatePagesForMdlEx(alloc_low, alloc_high, alloc_skip, unit_kb * 1024, MmCached, 0);
         #else
-        mdl = MmAllocatePagesForMdl(alloc_low, alloc_high, alloc_skip, BALLOON_UNITS_KB * 1024);
+        mdl = MmAllocatePagesForMdl(alloc_low, alloc_high, alloc_skip, unit_kb * 1024);
         #endif
         if (!mdl) {
           FUNCTION_MSG("Allocation failed - try again soon\n");
           break;
-        } else {
-          int i;
-          ULONG ret;
-          int pfn_count = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(mdl), MmGetMdlByteCount(mdl));
-          if (pfn_count != BALLOON_UNIT_PAGES) {
-            /* we could probably do this better but it will only happen in low memory conditions... */
-            FUNCTION_MSG("wanted %d pages got %d pages\n", BALLOON_UNIT_PAGES, pfn_count);
-            MmFreePagesFromMdl(mdl);
-            ExFreePool(mdl);
-            break;
-          }
-          pfns = ExAllocatePoolWithTag(NonPagedPool, pfn_count * sizeof(xen_pfn_t), XENPCI_POOL_TAG);
-          /* sizeof(xen_pfn_t) may not be the same as PPFN_NUMBER */
-          for (i = 0; i < pfn_count; i++)
-            pfns[i] = (xen_pfn_t)(MmGetMdlPfnArray(mdl)[i]);
-          reservation.address_bits = 0;
-          reservation.extent_order = 0;
-          reservation.domid = DOMID_SELF;
-          reservation.nr_extents = pfn_count;
-          #pragma warning(disable: 4127) /* conditional expression is constant */
-          set_xen_guest_handle(reservation.extent_start, pfns);
-          
-          ret = HYPERVISOR_memory_op(XENMEM_decrease_reservation, &reservation);
-          ExFreePoolWithTag(pfns, XENPCI_POOL_TAG);
-          if (head) {
-            mdl->Next = head;
-            head = mdl;
-          } else {
-            head = mdl;
-          }
-          xpdd->current_memory_kb -= BALLOON_UNITS_KB;
+        }
+        pfn_count = ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(mdl), MmGetMdlByteCount(mdl));
+        if (pfn_count < BALLOON_UNIT_PAGES) {
+          /* we could probably do this better but it will only happen in low memory conditions... */
+          FUNCTION_MSG("wanted %d pages got %d pages\n", (unit_kb << 10) >> PAGE_SHIFT, pfn_count);
+          MmFreePagesFromMdl(mdl);
+          ExFreePool(mdl);
+          break;
+        }
+        if (!XenPci_BalloonMdl(mdl, 0, pfn_count, TRUE)) {
+          MmFreePagesFromMdl(mdl);
+          ExFreePool(mdl);
+          break;
+        }
+        mdl->Next = head;
+        head = mdl;
+        xpdd->current_memory_kb -= (pfn_count << PAGE_SHIFT) >> 10;
+        xpdd->balloon_pages_out += pfn_count;
+        pages_moved += pfn_count;
+        if (pfn_count < (unit_kb << 10) >> PAGE_SHIFT) {
+          FUNCTION_MSG("wanted %d pages got %d pages\n", (unit_kb << 10) >> PAGE_SHIFT, pfn_count);
+          break;
         }
       }
     }
+    end_time = KeQueryPerformanceCounter(NULL);
+    elapsed_ms = (ULONG)((end_time.QuadPart - start_time.QuadPart) * 1000 / frequency.QuadPart);
+    xpdd->balloon_pages_per_sec = (ULONG)((ULONGLONG)pages_moved * 1000 / max(elapsed_ms, 1));
+    FUNCTION_MSG("Moved %d pages in %d ms (%d pages/s), %d out and %d in since boot\n",
+      pages_moved, elapsed_ms, xpdd->balloon_pages_per_sec, xpdd->balloon_pages_out, xpdd->balloon_pages_in);
     FUNCTION_MSG("Memory = %d, Balloon Target = %d\n", xpdd->current_memory_kb, new_target_kb);
   }
 }
@@ -719,11 +838,11 @@ XenPci_EvtDeviceD0Entry(WDFDEVICE device, WDF_POWER_DEVICE_STATE previous_state)
       xpdd->removable = FALSE;
     }
     GntTbl_Init(xpdd);
-    EvtChn_Init(xpdd);
+    status = EvtChn_Init(xpdd);
   } else {
     XenPci_Resume(xpdd);
     GntTbl_Resume(xpdd);
-    EvtChn_Resume(xpdd);
+    status = EvtChn_Resume(xpdd);
   }
 
   FUNCTION_EXIT();
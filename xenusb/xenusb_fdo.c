@@ -155,10 +155,12 @@ XenUsb_HandleEventDpc(PKDPC dpc, PVOID context, PVOID arg1, PVOID arg2) {
           partial_pvurb->pvurb->rsp.status = urb_rsp->status;
         partial_pvurb->pvurb->rsp.error_count += urb_rsp->error_count;;
         if (partial_pvurb->mdl) {
+          grant_ref_t grefs[USBIF_MAX_SEGMENTS_PER_REQUEST];
           int i;
           for (i = 0; i < partial_pvurb->req.nr_buffer_segs; i++) {
-            XnEndAccess(xudd->handle, partial_pvurb->req.seg[i].gref, FALSE, (ULONG)'XUSB');
+            grefs[i] = partial_pvurb->req.seg[i].gref;
           }
+          XnEndAccessMultiple(xudd->handle, grefs, partial_pvurb->req.nr_buffer_segs, FALSE, (ULONG)'XUSB');
         }
 
         FUNCTION_MSG("urb_ring rsp id = %d\n", partial_pvurb->rsp.id);
@@ -939,16 +941,6 @@ XenUsb_EvtIoInternalDeviceControl_PVURB(
     FUNCTION_EXIT();
     return;
   }
-  KeAcquireSpinLock(&xudd->urb_ring_lock, &old_irql);
-  status = WdfRequestMarkCancelableEx(request, XenUsb_EvtRequestCancelPvUrb);
-  if (!NT_SUCCESS(status)) {
-    KeReleaseSpinLock(&xudd->urb_ring_lock, old_irql);  
-    FUNCTION_MSG("WdfRequestMarkCancelableEx returned %08x\n", status);
-    WdfRequestComplete(request, STATUS_INSUFFICIENT_RESOURCES);
-    FUNCTION_EXIT();
-    return;
-  }  
-  
   partial_pvurb->req = pvurb->req;
   partial_pvurb->mdl = pvurb->mdl; /* 1:1 right now, but may need to split up large pvurb into smaller partial_pvurb's */
   partial_pvurb->pvurb = pvurb;
@@ -960,11 +952,25 @@ XenUsb_EvtIoInternalDeviceControl_PVURB(
   } else {
     ULONG remaining = MmGetMdlByteCount(partial_pvurb->mdl);
     USHORT offset = (USHORT)MmGetMdlByteOffset(partial_pvurb->mdl);
+    uint32_t frames[USBIF_MAX_SEGMENTS_PER_REQUEST];
+    grant_ref_t grefs[USBIF_MAX_SEGMENTS_PER_REQUEST];
     int i;
     partial_pvurb->req.buffer_length = (USHORT)MmGetMdlByteCount(partial_pvurb->mdl);
     partial_pvurb->req.nr_buffer_segs = (USHORT)ADDRESS_AND_SIZE_TO_SPAN_PAGES(MmGetMdlVirtualAddress(partial_pvurb->mdl), MmGetMdlByteCount(partial_pvurb->mdl));
     for (i = 0; i < partial_pvurb->req.nr_buffer_segs; i++) {
-      partial_pvurb->req.seg[i].gref = XnGrantAccess(xudd->handle, (ULONG)MmGetMdlPfnArray(partial_pvurb->mdl)[i], FALSE, INVALID_GRANT_REF, (ULONG)'XUSB');
+      frames[i] = (ULONG)MmGetMdlPfnArray(partial_pvurb->mdl)[i];
+      grefs[i] = INVALID_GRANT_REF;
+    }
+    /* the whole request is granted in one go */
+    if (!XnGrantAccessMultiple(xudd->handle, frames, partial_pvurb->req.nr_buffer_segs, FALSE, grefs, (ULONG)'XUSB')) {
+      FUNCTION_MSG("Failed to grant %d segments\n", partial_pvurb->req.nr_buffer_segs);
+      ExFreePoolWithTag(partial_pvurb, XENUSB_POOL_TAG);
+      WdfRequestComplete(request, STATUS_INSUFFICIENT_RESOURCES);
+      FUNCTION_EXIT();
+      return;
+    }
+    for (i = 0; i < partial_pvurb->req.nr_buffer_segs; i++) {
+      partial_pvurb->req.seg[i].gref = grefs[i];
       partial_pvurb->req.seg[i].offset = (USHORT)offset;
       partial_pvurb->req.seg[i].length = (USHORT)min((USHORT)remaining, (USHORT)PAGE_SIZE - offset);
       offset = 0;
@@ -977,6 +983,24 @@ XenUsb_EvtIoInternalDeviceControl_PVURB(
     FUNCTION_MSG("buffer_length = %d\n", partial_pvurb->req.buffer_length);
     FUNCTION_MSG("nr_buffer_segs = %d\n", partial_pvurb->req.nr_buffer_segs);
   }
+  KeAcquireSpinLock(&xudd->urb_ring_lock, &old_irql);
+  status = WdfRequestMarkCancelableEx(request, XenUsb_EvtRequestCancelPvUrb);
+  if (!NT_SUCCESS(status)) {
+    KeReleaseSpinLock(&xudd->urb_ring_lock, old_irql);  
+    FUNCTION_MSG("WdfRequestMarkCancelableEx returned %08x\n", status);
+    if (partial_pvurb->mdl) {
+      grant_ref_t grefs[USBIF_MAX_SEGMENTS_PER_REQUEST];
+      int i;
+      for (i = 0; i < partial_pvurb->req.nr_buffer_segs; i++) {
+        grefs[i] = partial_pvurb->req.seg[i].gref;
+      }
+      XnEndAccessMultiple(xudd->handle, grefs, partial_pvurb->req.nr_buffer_segs, FALSE, (ULONG)'XUSB');
+    }
+    ExFreePoolWithTag(partial_pvurb, XENUSB_POOL_TAG);
+    WdfRequestComplete(request, STATUS_INSUFFICIENT_RESOURCES);
+    FUNCTION_EXIT();
+    return;
+  }  
   InsertTailList(&xudd->partial_pvurb_queue, &partial_pvurb->entry);
   PutRequestsOnRing(xudd);
   KeReleaseSpinLock(&xudd->urb_ring_lock, old_irql);  
@@ -19,9 +19,59 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 
 #define SCSIOP_UNMAP 0x42
 #define VPD_BLOCK_LIMITS 0xB0
+#ifndef VPD_LOGICAL_BLOCK_PROVISIONING
+#define VPD_LOGICAL_BLOCK_PROVISIONING 0xB2
+#endif
+
+#define UNMAP_HEADER_LENGTH 8
+#define UNMAP_DESCRIPTOR_LENGTH 16
+/* limit the parameter list to a single page */
+#define UNMAP_MAX_DESCRIPTORS ((PAGE_SIZE - UNMAP_HEADER_LENGTH) / UNMAP_DESCRIPTOR_LENGTH)
 
 #define XENVBD_POOL_TAG (ULONG) 'XVBD'
 
+#include "interval_tree.h"
+#include "read_cache.h"
+#include "xenvbd_ioctl.h"
+
+/* pre-granted buffers for unaligned requests. The number per device can be set with bounce-buffers in the frontend xenstore directory */
+#define MAX_BOUNCE_BUFFERS 16
+#define DEFAULT_BOUNCE_BUFFERS 4
+#define BOUNCE_BUFFER_SIZE (BLKIF_MAX_SEGMENTS_PER_REQUEST * PAGE_SIZE)
+
+/* optional read cache, sized with read-cache-pages in the frontend xenstore directory. Off if that isn't set */
+#define READ_CACHE_MAX_PAGES 4096
+#define READ_CACHE_MAX_SRB_LENGTH 65536 /* bigger reads are streaming and would just flush the cache */
+#define READ_AHEAD_PAGES 8 /* one request, so no more than BLKIF_MAX_SEGMENTS_PER_REQUEST */
+#define READ_AHEAD_TRIGGER 2 /* sequential reads in a row before read-ahead starts */
+
+/* largest ring negotiated with a backend that offers max-ring-page-order. 16 pages gives 512 slots, and a shadow for each */
+#define XENVBD_MAX_RING_PAGE_ORDER 4
+#define XENVBD_MAX_RING_PAGES (1 << XENVBD_MAX_RING_PAGE_ORDER)
+
+/* requests kept on the ring in dump mode. Each gets a full set of grefs when the dump driver starts so a dump never waits on the grant table */
+#define DUMP_MODE_SHADOWS 16
+
+/* how long to wait before running the queue again when it stalls with nothing on the ring (us) */
+#define XENVBD_RETRY_INTERVAL 10000
+
+/* completion moderation. rsp_event lets the backend batch up to rsp_event_distance responses per event. The distance
+   grows while events come well inside the latency ceiling and halves whenever a response has to be collected by the
+   timer instead, so a response is never held back much longer than the ceiling. The timer only fires on a clock tick
+   (10-15ms unless something has raised the resolution), so the ceiling is the longer of a tick and this (us) */
+#define XENVBD_COMPLETION_LATENCY_CEILING_MIN 1000
+/* responses handled in one pass before the rest are left for another dpc. Scaled up with rsp_event_distance */
+#define XENVBD_COMPLETION_BUDGET_MIN 32
+
+/* grefs held back per device so that a request can always be built when the grant table is exhausted */
+#define GREF_RESERVE_ENTRIES BLKIF_MAX_SEGMENTS_PER_REQUEST
+
+typedef struct {
+  PUCHAR buffer; /* BOUNCE_BUFFER_SIZE bytes, page aligned */
+  grant_ref_t grefs[BLKIF_MAX_SEGMENTS_PER_REQUEST]; /* one per page, granted for as long as we are connected */
+  BOOLEAN in_use;
+} bounce_buffer_t;
+
 #define DEVICE_STATE_DISCONNECTED  0 /* -> INITIALISING */
 #define DEVICE_STATE_INITIALISING  1 /* -> INACTIVE | ACTIVE */
 #define DEVICE_STATE_INACTIVE      2
@@ -45,13 +95,17 @@ typedef enum {
   XENVBD_DEVICEMODE_WRITE
 } XENVBD_DEVICEMODE;
 
-typedef struct {
+typedef struct srb_list_entry {
   LIST_ENTRY list_entry;
   PSCSI_REQUEST_BLOCK srb;
   ULONG length; /* cached srb length */
   ULONG offset; /* current srb offset */
   ULONG outstanding_requests; /* number of requests sent to xen for this srb */
   BOOLEAN error; /* true if any sub requests have returned an error */
+  BOOLEAN write_same; /* true if this srb holds a reference on write_same_buffer */
+  BOOLEAN write_in_flight; /* true if write_interval is in write_tree */
+  interval_node_t write_interval; /* 512 byte sectors covered by this srb */
+  struct srb_list_entry *merge_next; /* next srb merged onto the same ring request */
 } srb_list_entry_t;
 
 typedef struct {
@@ -61,8 +115,14 @@ typedef struct {
   PVOID system_address;
   ULONG length;
   BOOLEAN aligned_buffer_in_use;
+  bounce_buffer_t *bounce_buffer; /* NULL unless the data goes via a pre-granted bounce buffer */
   BOOLEAN reset;
-  #if DBG && NTDDI_VERSION >= NTDDI_WINXP
-  LARGE_INTEGER ring_submit_time;
-  #endif
+  BOOLEAN write_same; /* every segment uses the same gref. Once reset, the shadow holds the reference on write_same_buffer */
+  BOOLEAN write_in_flight; /* true if write_interval is in write_tree */
+  interval_node_t write_interval; /* sectors a discard is on, or a reset request is still writing after its srb has been completed */
+  USHORT reserved_grefs; /* bitmap of segments whose gref came from gref_reserve */
+  LARGE_INTEGER ring_submit_time; /* for latency_stats */
+  srb_list_entry_t *merged_srbs; /* srbs carried in full on the end of this request, chained via merge_next */
+  ULONG cache_generation; /* read_cache.generation when a read went on the ring */
+  read_cache_page_t *read_ahead; /* PENDING pages a read-ahead is filling, chained via next. srb is NULL */
 } blkif_shadow_t;
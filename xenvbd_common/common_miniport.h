@@ -69,17 +69,125 @@ put_shadow_on_freelist(PXENVBD_DEVICE_DATA xvdd, blkif_shadow_t *shadow)
   shadow->srb = NULL;
   shadow->reset = FALSE;
   shadow->aligned_buffer_in_use = FALSE;
+  if (shadow->bounce_buffer) {
+    shadow->bounce_buffer->in_use = FALSE;
+    shadow->bounce_buffer = NULL;
+  }
+  shadow->write_same = FALSE;
+  XN_ASSERT(!shadow->write_in_flight);
+  XN_ASSERT(!shadow->reserved_grefs);
+  XN_ASSERT(!shadow->merged_srbs);
+  XN_ASSERT(!shadow->read_ahead);
   xvdd->shadow_free++;
 }
 
+/* called from HwInitialize in dump mode */
+/* puts aside a full set of grefs for up to DUMP_MODE_SHADOWS shadows. Only those shadows are used for the dump, so up to
+   DUMP_MODE_SHADOWS requests can be on the ring without going to the grant table, which is small and shared during hibernate */
+static VOID
+XenVbd_ReserveDumpGrefs(PXENVBD_DEVICE_DATA xvdd) {
+  ULONG i, j;
+
+  if (xvdd->dump_shadow_count) {
+    /* HwInitialize has been called before. Keep the refs we already have */
+    return;
+  }
+  for (i = 0; i < min(DUMP_MODE_SHADOWS, xvdd->shadow_count); i++) {
+    for (j = 0; j < BLKIF_MAX_SEGMENTS_PER_REQUEST; j++) {
+      xvdd->dump_grefs[i][j] = XnAllocateGrant(xvdd->handle, xvdd->grant_tag);
+      if (xvdd->dump_grefs[i][j] == INVALID_GRANT_REF)
+        break;
+    }
+    if (j < BLKIF_MAX_SEGMENTS_PER_REQUEST) {
+      /* not enough for another full set */
+      while (j--)
+        XnFreeGrant(xvdd->handle, xvdd->dump_grefs[i][j], xvdd->grant_tag);
+      break;
+    }
+  }
+  xvdd->dump_shadow_count = i;
+  FUNCTION_MSG("%d dump mode shadows with their own grefs\n", xvdd->dump_shadow_count);
+}
+
+/* called with StartIoLock held */
+static bounce_buffer_t *
+XenVbd_GetBounceBuffer(PXENVBD_DEVICE_DATA xvdd) {
+  ULONG i;
+
+  for (i = 0; i < xvdd->bounce_buffer_count; i++) {
+    if (!xvdd->bounce_buffers[i].in_use) {
+      xvdd->bounce_buffers[i].in_use = TRUE;
+      return &xvdd->bounce_buffers[i];
+    }
+  }
+  return NULL;
+}
+
+/* called with StartIoLock held */
+static VOID
+XenVbd_EndSegmentAccess(PXENVBD_DEVICE_DATA xvdd, blkif_shadow_t *shadow, ULONG seg) {
+  if (dump_mode && xvdd->dump_shadow_count) {
+    /* the ref belongs to the shadow for the whole dump */
+    XnEndAccess(xvdd->handle, shadow->req.seg[seg].gref, TRUE, xvdd->grant_tag);
+  } else if (shadow->reserved_grefs & (1 << seg)) {
+    /* keep the ref and put it back in the reserve */
+    XnEndAccess(xvdd->handle, shadow->req.seg[seg].gref, TRUE, xvdd->grant_tag);
+    XN_ASSERT(xvdd->gref_reserve_count < GREF_RESERVE_ENTRIES);
+    xvdd->gref_reserve[xvdd->gref_reserve_count++] = shadow->req.seg[seg].gref;
+    shadow->reserved_grefs &= (USHORT)~(1 << seg);
+  } else {
+    XnEndAccess(xvdd->handle, shadow->req.seg[seg].gref, FALSE, xvdd->grant_tag);
+  }
+}
+
+/* called with StartIoLock held */
+static VOID
+XenVbd_EndShadowAccess(PXENVBD_DEVICE_DATA xvdd, blkif_shadow_t *shadow) {
+  ULONG i;
+
+  if (shadow->bounce_buffer) {
+    /* bounce buffer grefs stay granted until disconnect */
+    return;
+  }
+  for (i = 0; i < shadow->req.nr_segments; i++) {
+    XenVbd_EndSegmentAccess(xvdd, shadow, i);
+    if (shadow->write_same) {
+      /* every segment of a WRITE SAME request shares the one gref */
+      break;
+    }
+  }
+  shadow->reserved_grefs = 0;
+}
+
+/* called with StartIoLock held */
+/* grants pfn for segment seg of shadow. If the grant table is exhausted a ref is taken from gref_reserve */
+static grant_ref_t
+XenVbd_GrantAccess(PXENVBD_DEVICE_DATA xvdd, blkif_shadow_t *shadow, ULONG seg, PFN_NUMBER pfn, BOOLEAN readonly) {
+  grant_ref_t gref;
+
+  if (dump_mode && xvdd->dump_shadow_count) {
+    return XnGrantAccess(xvdd->handle, (ULONG)pfn, readonly, xvdd->dump_grefs[shadow->req.id & SHADOW_ID_ID_MASK][seg], xvdd->grant_tag);
+  }
+  gref = XnGrantAccess(xvdd->handle, (ULONG)pfn, readonly, INVALID_GRANT_REF, xvdd->grant_tag);
+  if (gref != INVALID_GRANT_REF || !xvdd->gref_reserve_count)
+    return gref;
+  xvdd->gref_reserve_count--;
+  gref = XnGrantAccess(xvdd->handle, (ULONG)pfn, readonly, xvdd->gref_reserve[xvdd->gref_reserve_count], xvdd->grant_tag);
+  shadow->reserved_grefs |= (USHORT)(1 << seg);
+  xvdd->stats.gref_reserve_used++;
+  return gref;
+}
+
 static __inline ULONG
 decode_cdb_length(PSCSI_REQUEST_BLOCK srb) {
   switch (srb->Cdb[0]) {
   case SCSIOP_READ:
   case SCSIOP_WRITE:
+  case SCSIOP_WRITE_SAME:
     return ((ULONG)(UCHAR)srb->Cdb[7] << 8) | (ULONG)(UCHAR)srb->Cdb[8];
   case SCSIOP_READ16:
   case SCSIOP_WRITE16:
+  case SCSIOP_WRITE_SAME16:
     return ((ULONG)(UCHAR)srb->Cdb[10] << 24) | ((ULONG)(UCHAR)srb->Cdb[11] << 16) | ((ULONG)(UCHAR)srb->Cdb[12] << 8) | (ULONG)(UCHAR)srb->Cdb[13];    
   default:
     FUNCTION_MSG("Unknown SCSIOP function %02x\n", srb->Cdb[0]);
@@ -92,10 +200,140 @@ XenVbd_GetResponse(PXENVBD_DEVICE_DATA xvdd, int i) {
   return RING_GET_RESPONSE(&xvdd->ring, i);
 }
 
+/* returns the number of 512 byte sectors a ring request covers */
+static ULONGLONG
+XenVbd_RequestSectors(blkif_request_t *req) {
+  ULONGLONG sectors = 0;
+  ULONG i;
+
+  switch (req->operation) {
+  case BLKIF_OP_READ:
+  case BLKIF_OP_WRITE:
+    for (i = 0; i < req->nr_segments; i++)
+      sectors += req->seg[i].last_sect - req->seg[i].first_sect + 1;
+    break;
+  case BLKIF_OP_DISCARD:
+    sectors = ((blkif_request_discard_t *)req)->nr_sectors;
+    break;
+  }
+  return sectors;
+}
+
+/* maps a blkif operation to XENVBD_LATENCY_OP_xxx */
+static ULONG
+XenVbd_StatsOp(UCHAR operation) {
+  switch (operation) {
+  case BLKIF_OP_READ:
+    return XENVBD_LATENCY_OP_READ;
+  case BLKIF_OP_WRITE:
+    return XENVBD_LATENCY_OP_WRITE;
+  case BLKIF_OP_DISCARD:
+    return XENVBD_LATENCY_OP_DISCARD;
+  default:
+    return XENVBD_LATENCY_OP_FLUSH;
+  }
+}
+
+/* called with StartIoLock held */
 static VOID
-XenVbd_PutRequest(PXENVBD_DEVICE_DATA xvdd, blkif_request_t *req) {
-  *RING_GET_REQUEST(&xvdd->ring, xvdd->ring.req_prod_pvt) = *req;
+XenVbd_InvalidateReadCache(PXENVBD_DEVICE_DATA xvdd, blkif_request_t *req) {
+  read_cache_invalidate(&xvdd->read_cache, req->sector_number, req->sector_number + XenVbd_RequestSectors(req));
+}
+
+/* called with StartIoLock held */
+static VOID
+XenVbd_PutRequest(PXENVBD_DEVICE_DATA xvdd, blkif_shadow_t *shadow) {
+  ULONG op = XenVbd_StatsOp(shadow->req.operation);
+
+  *RING_GET_REQUEST(&xvdd->ring, xvdd->ring.req_prod_pvt) = shadow->req;
   xvdd->ring.req_prod_pvt++;
+  xvdd->stats.requests[op]++;
+  xvdd->stats.sectors[op] += XenVbd_RequestSectors(&shadow->req);
+  if (op == XENVBD_LATENCY_OP_READ || op == XENVBD_LATENCY_OP_WRITE)
+    xvdd->stats.segments += shadow->req.nr_segments;
+  if (!dump_mode)
+    shadow->ring_submit_time = KeQueryPerformanceCounter(NULL);
+  if (xvdd->read_cache.page_count) {
+    if (shadow->req.operation != BLKIF_OP_READ) {
+      /* and again when it completes in case a read raced with it */
+      XenVbd_InvalidateReadCache(xvdd, &shadow->req);
+    } else {
+      shadow->cache_generation = xvdd->read_cache.generation;
+      if (!shadow->read_ahead) {
+        /* look for a sequential stream worth reading ahead of */
+        if (shadow->req.sector_number == xvdd->read_cache_next_sector)
+          xvdd->read_cache_sequential++;
+        else
+          xvdd->read_cache_sequential = 0;
+        xvdd->read_cache_next_sector = shadow->req.sector_number + XenVbd_RequestSectors(&shadow->req);
+      }
+    }
+  }
+}
+
+/* called with StartIoLock held */
+static VOID
+XenVbd_RecordLatency(PXENVBD_DEVICE_DATA xvdd, blkif_shadow_t *shadow) {
+  LARGE_INTEGER now;
+  ULONGLONG us;
+  ULONGLONG bytes;
+  ULONG op;
+  ULONG size;
+
+  if (dump_mode || !xvdd->performance_frequency)
+    return;
+  now = KeQueryPerformanceCounter(NULL);
+  us = (ULONGLONG)(now.QuadPart - shadow->ring_submit_time.QuadPart) * 1000000 / xvdd->performance_frequency;
+  op = XenVbd_StatsOp(shadow->req.operation);
+  bytes = XenVbd_RequestSectors(&shadow->req) * 512;
+  size = XENVBD_LATENCY_SIZE(bytes);
+  xvdd->latency_stats.count[op][size][XenVbd_LatencyBucket(us)]++;
+  xvdd->latency_stats.total_us[op][size] += us;
+  if (us > xvdd->latency_stats.max_us[op][size])
+    xvdd->latency_stats.max_us[op][size] = us;
+}
+
+/* called with StartIoLock held */
+/* handles the XENVBD_STATS_SIG SRB_IO_CONTROL's. Returns the SrbStatus */
+static UCHAR
+XenVbd_StatsIoControl(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
+  PSRB_IO_CONTROL sic = srb->DataBuffer;
+
+  switch (sic->ControlCode) {
+  case XENVBD_STATS_GET_LATENCY:
+    if (sic->HeaderLength != sizeof(SRB_IO_CONTROL) || sic->Length < sizeof(XENVBD_LATENCY_STATS)
+        || srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + sizeof(XENVBD_LATENCY_STATS)) {
+      return SRB_STATUS_DATA_OVERRUN;
+    }
+    xvdd->latency_stats.version = XENVBD_LATENCY_STATS_VERSION;
+    memcpy((PUCHAR)sic + sizeof(SRB_IO_CONTROL), &xvdd->latency_stats, sizeof(XENVBD_LATENCY_STATS));
+    sic->Length = sizeof(XENVBD_LATENCY_STATS);
+    sic->ReturnCode = 0;
+    return SRB_STATUS_SUCCESS;
+  case XENVBD_STATS_RESET_LATENCY:
+    RtlZeroMemory(&xvdd->latency_stats, sizeof(XENVBD_LATENCY_STATS));
+    sic->Length = 0;
+    sic->ReturnCode = 0;
+    return SRB_STATUS_SUCCESS;
+  case XENVBD_STATS_GET_COUNTERS:
+    if (sic->HeaderLength != sizeof(SRB_IO_CONTROL) || sic->Length < sizeof(XENVBD_DEVICE_STATS)
+        || srb->DataTransferLength < sizeof(SRB_IO_CONTROL) + sizeof(XENVBD_DEVICE_STATS)) {
+      return SRB_STATUS_DATA_OVERRUN;
+    }
+    xvdd->stats.version = XENVBD_DEVICE_STATS_VERSION;
+    memcpy((PUCHAR)sic + sizeof(SRB_IO_CONTROL), &xvdd->stats, sizeof(XENVBD_DEVICE_STATS));
+    sic->Length = sizeof(XENVBD_DEVICE_STATS);
+    sic->ReturnCode = 0;
+    return SRB_STATUS_SUCCESS;
+  case XENVBD_STATS_RESET_COUNTERS:
+    RtlZeroMemory(&xvdd->stats, sizeof(XENVBD_DEVICE_STATS));
+    sic->Length = 0;
+    sic->ReturnCode = 0;
+    return SRB_STATUS_SUCCESS;
+  default:
+    FUNCTION_MSG("Unknown stats ControlCode = %d\n", sic->ControlCode);
+    return SRB_STATUS_INVALID_REQUEST;
+  }
 }
 
 static VOID
@@ -106,6 +344,9 @@ XenVbd_PutSrbOnList(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
   srb_entry->length = srb->DataTransferLength;
   srb_entry->offset = 0;
   srb_entry->error = FALSE;
+  srb_entry->write_same = FALSE;
+  srb_entry->write_in_flight = FALSE;
+  srb_entry->merge_next = NULL;
   InsertTailList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
 }
 
@@ -117,10 +358,12 @@ decode_cdb_sector(PSCSI_REQUEST_BLOCK srb)
   switch (srb->Cdb[0]) {
   case SCSIOP_READ:
   case SCSIOP_WRITE:
+  case SCSIOP_WRITE_SAME:
     sector = ((ULONG)(UCHAR)srb->Cdb[2] << 24) | ((ULONG)(UCHAR)srb->Cdb[3] << 16) | ((ULONG)(UCHAR)srb->Cdb[4] << 8) | (ULONG)(UCHAR)srb->Cdb[5];
     break;
   case SCSIOP_READ16:
   case SCSIOP_WRITE16:
+  case SCSIOP_WRITE_SAME16:
     sector = ((ULONGLONG)(UCHAR)srb->Cdb[2] << 56) | ((ULONGLONG)(UCHAR)srb->Cdb[3] << 48)
            | ((ULONGLONG)(UCHAR)srb->Cdb[4] << 40) | ((ULONGLONG)(UCHAR)srb->Cdb[5] << 32)
            | ((ULONGLONG)(UCHAR)srb->Cdb[6] << 24) | ((ULONGLONG)(UCHAR)srb->Cdb[7] << 16)
@@ -145,6 +388,8 @@ decode_cdb_is_read(PSCSI_REQUEST_BLOCK srb)
     return TRUE;
   case SCSIOP_WRITE:
   case SCSIOP_WRITE16:
+  case SCSIOP_WRITE_SAME:
+  case SCSIOP_WRITE_SAME16:
     return FALSE;
   default:
     FUNCTION_MSG("Unknown SCSIOP function %02x\n", srb->Cdb[0]);
@@ -189,17 +434,270 @@ XenVbd_MakeAutoSense(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
   srb->SrbStatus = SRB_STATUS_ERROR | SRB_STATUS_AUTOSENSE_VALID;
 }
 
+/* called with StartIoLock held */
+/* completes a read from the read cache if every page it touches is there. Returns TRUE if it did */
+static BOOLEAN
+XenVbd_ReadFromCache(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
+  srb_list_entry_t *srb_entry = srb->SrbExtension;
+  ULONGLONG sector, end, page, first, last;
+  read_cache_page_t *p;
+  PVOID system_address;
+  ULONG copied;
+
+  if (!xvdd->read_cache.page_count || dump_mode || srb_entry->offset || xvdd->device_state != DEVICE_STATE_ACTIVE)
+    return FALSE;
+  sector = decode_cdb_sector(srb) * (xvdd->bytes_per_sector / 512);
+  end = sector + (ULONGLONG)decode_cdb_length(srb) * (xvdd->bytes_per_sector / 512);
+  if (end == sector)
+    return FALSE;
+  /* PutSrbOnRing will wait for the write to finish */
+  if (interval_tree_find_overlap(&xvdd->write_tree, sector, end))
+    return FALSE;
+  for (page = sector / READ_CACHE_SECTORS_PER_PAGE; page * READ_CACHE_SECTORS_PER_PAGE < end; page++) {
+    if (!read_cache_find(&xvdd->read_cache, page)) {
+      xvdd->stats.read_cache_misses++;
+      return FALSE;
+    }
+  }
+  if (SxxxPortGetSystemAddress(xvdd, srb, &system_address) != STATUS_SUCCESS)
+    return FALSE;
+  copied = 0;
+  for (page = sector / READ_CACHE_SECTORS_PER_PAGE; page * READ_CACHE_SECTORS_PER_PAGE < end; page++) {
+    p = read_cache_find(&xvdd->read_cache, page);
+    first = max(sector, page * READ_CACHE_SECTORS_PER_PAGE);
+    last = min(end, (page + 1) * READ_CACHE_SECTORS_PER_PAGE);
+    memcpy((PUCHAR)system_address + copied, p->data + (ULONG)(first - page * READ_CACHE_SECTORS_PER_PAGE) * 512, (ULONG)(last - first) * 512);
+    copied += (ULONG)(last - first) * 512;
+    read_cache_touch(&xvdd->read_cache, p);
+  }
+  xvdd->stats.read_cache_hits++;
+  srb->ScsiStatus = 0;
+  srb_entry->offset = srb_entry->length;
+  return TRUE;
+}
+
+/* called with StartIoLock held */
+/* caches every whole page in length bytes of buffer, which was read from sector */
+static VOID
+XenVbd_FillReadCacheRange(PXENVBD_DEVICE_DATA xvdd, PUCHAR buffer, ULONGLONG sector, ULONG length) {
+  ULONGLONG end = sector + length / 512;
+  ULONGLONG page = (sector + READ_CACHE_SECTORS_PER_PAGE - 1) / READ_CACHE_SECTORS_PER_PAGE;
+  read_cache_page_t *p;
+
+  if (length > READ_CACHE_MAX_SRB_LENGTH)
+    return;
+  for (; (page + 1) * READ_CACHE_SECTORS_PER_PAGE <= end; page++) {
+    p = read_cache_get_page(&xvdd->read_cache);
+    if (!p)
+      return;
+    memcpy(p->data, buffer + (ULONG)(page * READ_CACHE_SECTORS_PER_PAGE - sector) * 512, PAGE_SIZE);
+    read_cache_insert(&xvdd->read_cache, p, page);
+  }
+}
+
+/* called with StartIoLock held */
+/* caches what a completed read brought in, unless something was written while it was on the ring */
+static VOID
+XenVbd_FillReadCache(PXENVBD_DEVICE_DATA xvdd, blkif_shadow_t *shadow) {
+  srb_list_entry_t *srb_entry;
+  PVOID system_address;
+  ULONGLONG sector;
+  ULONG length;
+
+  if (!xvdd->read_cache.page_count || dump_mode || shadow->cache_generation != xvdd->read_cache.generation)
+    return;
+  /* the shadow's own srb comes first, then any merged onto the end */
+  length = shadow->length;
+  for (srb_entry = shadow->merged_srbs; srb_entry; srb_entry = srb_entry->merge_next)
+    length -= srb_entry->length;
+  if (((srb_list_entry_t *)shadow->srb->SrbExtension)->length <= READ_CACHE_MAX_SRB_LENGTH)
+    XenVbd_FillReadCacheRange(xvdd, shadow->system_address, shadow->req.sector_number, length);
+  sector = shadow->req.sector_number + length / 512;
+  for (srb_entry = shadow->merged_srbs; srb_entry; srb_entry = srb_entry->merge_next) {
+    if (SxxxPortGetSystemAddress(xvdd, srb_entry->srb, &system_address) == STATUS_SUCCESS)
+      XenVbd_FillReadCacheRange(xvdd, system_address, sector, srb_entry->length);
+    sector += srb_entry->length / 512;
+  }
+}
+
+/* called with StartIoLock held */
+/* once reads have been sequential for a while, reads the next READ_AHEAD_PAGES pages into the cache.
+   Returns TRUE if a request was put on the ring */
+static BOOLEAN
+XenVbd_ReadAhead(PXENVBD_DEVICE_DATA xvdd) {
+  blkif_shadow_t *shadow;
+  read_cache_page_t *p;
+  PHYSICAL_ADDRESS physical_address;
+  grant_ref_t gref;
+  ULONGLONG start;
+  ULONGLONG page;
+  ULONG i;
+
+  if (!xvdd->read_cache.page_count || dump_mode || xvdd->device_state != DEVICE_STATE_ACTIVE)
+    return FALSE;
+  if (xvdd->read_cache_sequential < READ_AHEAD_TRIGGER)
+    return FALSE;
+  /* leave most of the ring for real requests */
+  if (xvdd->shadow_free <= xvdd->shadow_count / 2)
+    return FALSE;
+  start = max(xvdd->read_cache_next_sector, xvdd->read_ahead_next_sector);
+  page = (start + READ_CACHE_SECTORS_PER_PAGE - 1) / READ_CACHE_SECTORS_PER_PAGE;
+  /* stay no more than one window in front of the reader */
+  if (page * READ_CACHE_SECTORS_PER_PAGE >= xvdd->read_cache_next_sector + READ_AHEAD_PAGES * READ_CACHE_SECTORS_PER_PAGE)
+    return FALSE;
+  if ((page + READ_AHEAD_PAGES) * READ_CACHE_SECTORS_PER_PAGE > xvdd->total_sectors * (xvdd->bytes_per_sector / 512))
+    return FALSE;
+  if (interval_tree_find_overlap(&xvdd->write_tree, page * READ_CACHE_SECTORS_PER_PAGE, (page + READ_AHEAD_PAGES) * READ_CACHE_SECTORS_PER_PAGE))
+    return FALSE;
+  xvdd->read_ahead_next_sector = (page + READ_AHEAD_PAGES) * READ_CACHE_SECTORS_PER_PAGE;
+  if (read_cache_find(&xvdd->read_cache, page)) {
+    /* already there, probably the same data being read again */
+    return FALSE;
+  }
+  shadow = get_shadow_from_freelist(xvdd);
+  XN_ASSERT(shadow);
+  XN_ASSERT(!shadow->srb);
+  shadow->req.sector_number = page * READ_CACHE_SECTORS_PER_PAGE;
+  shadow->req.handle = 0;
+  shadow->req.operation = BLKIF_OP_READ;
+  shadow->req.nr_segments = 0;
+  shadow->length = 0;
+  shadow->system_address = NULL;
+  shadow->reset = FALSE;
+  for (i = 0; i < READ_AHEAD_PAGES; i++) {
+    p = read_cache_get_page(&xvdd->read_cache);
+    if (!p)
+      break;
+    physical_address = MmGetPhysicalAddress(p->data);
+    gref = XnGrantAccess(xvdd->handle, (ULONG)(physical_address.QuadPart >> PAGE_SHIFT), FALSE, INVALID_GRANT_REF, xvdd->grant_tag);
+    if (gref == INVALID_GRANT_REF) {
+      read_cache_put_page(&xvdd->read_cache, p);
+      break;
+    }
+    p->page = page + i;
+    p->next = shadow->read_ahead;
+    shadow->read_ahead = p;
+    shadow->req.seg[i].gref = gref;
+    shadow->req.seg[i].first_sect = 0;
+    shadow->req.seg[i].last_sect = READ_CACHE_SECTORS_PER_PAGE - 1;
+    shadow->req.nr_segments++;
+    shadow->length += PAGE_SIZE;
+  }
+  if (!shadow->req.nr_segments) {
+    put_shadow_on_freelist(xvdd, shadow);
+    return FALSE;
+  }
+  xvdd->stats.read_ahead_requests++;
+  XenVbd_PutRequest(xvdd, shadow);
+  return TRUE;
+}
+
+/* called with StartIoLock held */
+static VOID
+XenVbd_CompleteReadAhead(PXENVBD_DEVICE_DATA xvdd, blkif_shadow_t *shadow, BOOLEAN success) {
+  read_cache_page_t *p;
+
+  XenVbd_EndShadowAccess(xvdd, shadow);
+  while ((p = shadow->read_ahead) != NULL) {
+    shadow->read_ahead = p->next;
+    if (success && shadow->cache_generation == xvdd->read_cache.generation)
+      read_cache_insert(&xvdd->read_cache, p, p->page);
+    else
+      read_cache_put_page(&xvdd->read_cache, p);
+  }
+}
+
+/* TRUE if rsp_event_distance is being tuned. Needs the retry timer to enforce the latency ceiling, which only storport has */
+static __inline BOOLEAN
+XenVbd_Moderating(PXENVBD_DEVICE_DATA xvdd) {
+#ifdef _NTSTORPORT_
+  return (BOOLEAN)(!dump_mode && xvdd->performance_frequency);
+#else
+  UNREFERENCED_PARAMETER(xvdd);
+  return FALSE;
+#endif
+}
+
+/* called with StartIoLock held */
+/* tunes rsp_event_distance from how long it took the responses held back by the last rsp_event to turn up */
+static VOID
+XenVbd_UpdateModeration(PXENVBD_DEVICE_DATA xvdd, LARGE_INTEGER now) {
+  ULONGLONG us;
+
+  if (!xvdd->rsp_event_time.QuadPart || !RING_HAS_UNCONSUMED_RESPONSES(&xvdd->ring))
+    return;
+  us = (ULONGLONG)(now.QuadPart - xvdd->rsp_event_time.QuadPart) * 1000000 / xvdd->performance_frequency;
+  if ((RING_IDX)(xvdd->ring.sring->rsp_prod - xvdd->ring.sring->rsp_event) < 0x80000000) {
+    /* the backend reached rsp_event. If it got there quickly there is room to batch more */
+    if (us < xvdd->completion_latency_ceiling / 2 && xvdd->rsp_event_distance < xvdd->shadow_count / 2)
+      xvdd->rsp_event_distance++;
+  } else if (us >= xvdd->completion_latency_ceiling) {
+    /* the timer (or a new srb) found responses still waiting for rsp_event */
+    xvdd->rsp_event_distance = max(1, xvdd->rsp_event_distance / 2);
+    xvdd->stats.moderation_timeouts++;
+  }
+  xvdd->rsp_event_time.QuadPart = 0;
+}
+
+/* called with StartIoLock held */
+/* clears event_pending before the ring is looked at, so an event raised after this gets another HandleEvent, and
+   records how long the event waited */
+static VOID
+XenVbd_TakeEvent(PXENVBD_DEVICE_DATA xvdd) {
+  LARGE_INTEGER event_time = xvdd->event_time;
+  LARGE_INTEGER now;
+  ULONGLONG us;
+
+  if (!InterlockedExchange(&xvdd->event_pending, 0))
+    return;
+  if (dump_mode || !xvdd->performance_frequency || !event_time.QuadPart)
+    return;
+  now = KeQueryPerformanceCounter(NULL);
+  us = (ULONGLONG)(now.QuadPart - event_time.QuadPart) * 1000000 / xvdd->performance_frequency;
+  xvdd->stats.event_latency[XenVbd_LatencyBucket(us)]++;
+  xvdd->stats.event_latency_total_us += us;
+  if (us > xvdd->stats.event_latency_max_us)
+    xvdd->stats.event_latency_max_us = us;
+}
+
+/* called with StartIo lock held */
+/* accounts for one completed ring request against srb_entry and completes the srb if it was the last */
+static VOID
+XenVbd_CompleteSrbRequest(PXENVBD_DEVICE_DATA xvdd, srb_list_entry_t *srb_entry) {
+  PSCSI_REQUEST_BLOCK srb = srb_entry->srb;
+
+  srb_entry->outstanding_requests--;
+  if (srb_entry->outstanding_requests != 0 || srb_entry->offset != srb_entry->length)
+    return;
+  if (srb_entry->write_same) {
+    xvdd->write_same_refs--;
+  }
+  if (srb_entry->write_in_flight) {
+    interval_tree_remove(&xvdd->write_tree, &srb_entry->write_interval);
+  }
+  if (srb_entry->error) {
+    srb->SrbStatus = SRB_STATUS_ERROR;
+    xvdd->last_sense_key = SCSI_SENSE_MEDIUM_ERROR;
+  }
+  XenVbd_MakeAutoSense(xvdd, srb);
+  SxxxPortNotification(RequestComplete, xvdd, srb);
+}
+
 /* called with StartIo lock held */
 static VOID
 XenVbd_HandleEvent(PXENVBD_DEVICE_DATA xvdd) {
   PSCSI_REQUEST_BLOCK srb;
   RING_IDX i, rp;
-  ULONG j;
   blkif_response_t *rep;
   //int block_count;
   int more_to_do = TRUE;
   blkif_shadow_t *shadow;
   srb_list_entry_t *srb_entry;
+  BOOLEAN error;
+  BOOLEAN moderating;
+  LARGE_INTEGER now;
+  ULONG budget;
+  ULONG distance;
 
   if (xvdd->device_state != DEVICE_STATE_ACTIVE && xvdd->device_state != DEVICE_STATE_DISCONNECTING) {
     /* if we aren't active (eg just restored from hibernate) then we still want to process non-scsi srb's */
@@ -207,32 +705,65 @@ XenVbd_HandleEvent(PXENVBD_DEVICE_DATA xvdd) {
     return;
   }
 
+  XenVbd_TakeEvent(xvdd);
+  moderating = XenVbd_Moderating(xvdd);
+  if (moderating) {
+    now = KeQueryPerformanceCounter(NULL);
+    XenVbd_UpdateModeration(xvdd, now);
+    budget = max(XENVBD_COMPLETION_BUDGET_MIN, xvdd->rsp_event_distance * 4);
+  } else {
+    now.QuadPart = 0;
+    budget = (ULONG)-1;
+  }
+
   while (more_to_do && !xvdd->cac) {
     rp = xvdd->ring.sring->rsp_prod;
     KeMemoryBarrier();
-    for (i = xvdd->ring.rsp_cons; i != rp && !xvdd->cac; i++) {
+    for (i = xvdd->ring.rsp_cons; i != rp && !xvdd->cac && budget; i++) {
+      budget--;
       rep = XenVbd_GetResponse(xvdd, i);
       shadow = &xvdd->shadows[rep->id & SHADOW_ID_ID_MASK];
+      xvdd->stats.responses++;
+      if (xvdd->read_cache.page_count && shadow->req.operation != BLKIF_OP_READ) {
+        XenVbd_InvalidateReadCache(xvdd, &shadow->req);
+      }
       if (shadow->reset) {
         /* the srb's here have already been returned */
         FUNCTION_MSG("discarding reset shadow\n");
-        for (j = 0; j < shadow->req.nr_segments; j++) {
-          XnEndAccess(xvdd->handle,
-            shadow->req.seg[j].gref, FALSE, xvdd->grant_tag);
+        if (shadow->write_in_flight) {
+          interval_tree_remove(&xvdd->write_tree, &shadow->write_interval);
+          shadow->write_in_flight = FALSE;
         }
+        if (shadow->write_same) {
+          xvdd->write_same_refs--;
+        }
+        XenVbd_EndShadowAccess(xvdd, shadow);
       } else if (dump_mode && !(rep->id & SHADOW_ID_DUMP_FLAG)) {
         FUNCTION_MSG("discarding stale (non-dump-mode) shadow\n");
+        /* HwInitialize already put every dump mode shadow on the freelist */
+        continue;
+      } else if (shadow->read_ahead) {
+        XenVbd_CompleteReadAhead(xvdd, shadow, (BOOLEAN)(rep->status == BLKIF_RSP_OKAY));
       } else {
         srb = shadow->srb;
         XN_ASSERT(srb);
         srb_entry = srb->SrbExtension;
         XN_ASSERT(srb_entry);
         /* a few errors occur in dump mode because Xen refuses to allow us to map pages we are using for other stuff. Just ignore them */
+        error = FALSE;
         if (rep->status == BLKIF_RSP_OKAY || (dump_mode &&  dump_mode_errors++ < DUMP_MODE_ERROR_LIMIT)) {
           srb->SrbStatus = SRB_STATUS_SUCCESS;
         } else {
-          FUNCTION_MSG("Xen Operation returned error\n");
-          if (decode_cdb_is_read(srb))
+          error = TRUE;
+          FUNCTION_MSG("Xen Operation returned error %d\n", rep->status);
+          if (shadow->req.operation == BLKIF_OP_DISCARD) {
+            FUNCTION_MSG("Operation = Discard\n");
+            if (rep->status == BLKIF_RSP_EOPNOTSUPP) {
+              /* no point sending any more */
+              FUNCTION_MSG("Discard not supported by backend. Disabling\n");
+              xvdd->feature_discard = 0;
+            }
+          } else if (decode_cdb_is_read(srb))
             FUNCTION_MSG("Operation = Read\n");
           else
             FUNCTION_MSG("Operation = Write\n");
@@ -244,17 +775,30 @@ XenVbd_HandleEvent(PXENVBD_DEVICE_DATA xvdd) {
           if (srb->SrbStatus == SRB_STATUS_SUCCESS && decode_cdb_is_read(srb))
             memcpy((PUCHAR)shadow->system_address, xvdd->aligned_buffer, shadow->length);
         }
-        for (j = 0; j < shadow->req.nr_segments; j++) {
-          XnEndAccess(xvdd->handle, shadow->req.seg[j].gref, FALSE, xvdd->grant_tag);
+        if (shadow->bounce_buffer) {
+          if (srb->SrbStatus == SRB_STATUS_SUCCESS && decode_cdb_is_read(srb))
+            memcpy((PUCHAR)shadow->system_address, shadow->bounce_buffer->buffer, shadow->length);
+        }
+        if (!error && shadow->req.operation == BLKIF_OP_READ) {
+          XenVbd_FillReadCache(xvdd, shadow);
         }
-        srb_entry->outstanding_requests--;
-        if (srb_entry->outstanding_requests == 0 && srb_entry->offset == srb_entry->length) {
-          if (srb_entry->error) {
-            srb->SrbStatus = SRB_STATUS_ERROR;
-            xvdd->last_sense_key = SCSI_SENSE_MEDIUM_ERROR;
-          }
-          XenVbd_MakeAutoSense(xvdd, srb);
-          SxxxPortNotification(RequestComplete, xvdd, srb);
+        XenVbd_RecordLatency(xvdd, shadow);
+        XenVbd_EndShadowAccess(xvdd, shadow);
+        if (shadow->write_in_flight) {
+          /* a discard tracks its own range rather than the srb's */
+          interval_tree_remove(&xvdd->write_tree, &shadow->write_interval);
+          shadow->write_in_flight = FALSE;
+        }
+        XenVbd_CompleteSrbRequest(xvdd, srb_entry);
+        /* fan the response out to any srbs merged onto the end of the request */
+        while ((srb_entry = shadow->merged_srbs) != NULL) {
+          shadow->merged_srbs = srb_entry->merge_next;
+          srb_entry->merge_next = NULL;
+          if (error)
+            srb_entry->error = TRUE;
+          else
+            srb_entry->srb->SrbStatus = SRB_STATUS_SUCCESS;
+          XenVbd_CompleteSrbRequest(xvdd, srb_entry);
         }
       }
       put_shadow_on_freelist(xvdd, shadow);
@@ -266,27 +810,172 @@ XenVbd_HandleEvent(PXENVBD_DEVICE_DATA xvdd) {
     }
 
     xvdd->ring.rsp_cons = i;
+    if (!budget && RING_HAS_UNCONSUMED_RESPONSES(&xvdd->ring)) {
+      if (XenVbd_QueueEvent(xvdd)) {
+        /* leave the rest for the dpc rather than hold this cpu for the whole ring */
+        xvdd->stats.budget_exhausted++;
+        break;
+      }
+      budget = (ULONG)-1;
+    }
     if (i == xvdd->ring.req_prod_pvt) {
       /* all possible requests complete - can't have more responses than requests */
       more_to_do = FALSE;
       xvdd->ring.sring->rsp_event = i + 1;
+      xvdd->rsp_event_time.QuadPart = 0;
     } else {
       more_to_do = RING_HAS_UNCONSUMED_RESPONSES(&xvdd->ring);
       if (!more_to_do) {
-        xvdd->ring.sring->rsp_event = i + max(1, (SHADOW_ENTRIES - xvdd->shadow_free) / 2);
+        distance = max(1, (xvdd->shadow_count - xvdd->shadow_free) / 2);
+        if (moderating)
+          distance = min(distance, xvdd->rsp_event_distance);
+        xvdd->ring.sring->rsp_event = i + distance;
         KeMemoryBarrier();
         more_to_do = RING_HAS_UNCONSUMED_RESPONSES(&xvdd->ring);
+        if (!more_to_do && moderating) {
+          xvdd->rsp_event_time = now;
+          if (distance > 1) {
+            /* responses short of rsp_event get collected by the timer */
+            XenVbd_QueueRetry(xvdd, xvdd->completion_latency_ceiling);
+          }
+        }
       }
     }
   }
 
-  if (xvdd->device_state == DEVICE_STATE_DISCONNECTING && xvdd->shadow_free == SHADOW_ENTRIES) {
+  if (xvdd->device_state == DEVICE_STATE_DISCONNECTING && xvdd->shadow_free == xvdd->shadow_count) {
     FUNCTION_MSG("ring now empty - completing disconnect\n");
     XenVbd_CompleteDisconnect(xvdd);
   }
   return;
 }
 
+/* called with StartIoLock held */
+/* returns TRUE if an in-flight write overlaps the given range (in 512 byte sectors) */
+/* we get warnings from drbd if we don't wait for these to complete */
+static BOOLEAN
+XenVbd_IsWriteInFlight(PXENVBD_DEVICE_DATA xvdd, ULONGLONG sector_number, ULONG block_count) {
+  interval_node_t *node;
+
+  node = interval_tree_find_overlap(&xvdd->write_tree, sector_number, sector_number + block_count);
+  if (!node)
+    return FALSE;
+  FUNCTION_MSG("Concurrent outstanding write detected (%I64d, %d) (%I64d, %d)\n",
+    sector_number, block_count, node->start, (ULONG)(node->end - node->start));
+  return TRUE;
+}
+
+/* called with StartIoLock held */
+/* adds a write srb to write_tree once its first request is on the ring. It stays there until the srb completes */
+static VOID
+XenVbd_TrackWrite(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
+  srb_list_entry_t *srb_entry = srb->SrbExtension;
+
+  if (srb_entry->write_in_flight)
+    return;
+  srb_entry->write_interval.start = decode_cdb_sector(srb) * (xvdd->bytes_per_sector / 512);
+  srb_entry->write_interval.end = srb_entry->write_interval.start + (ULONGLONG)decode_cdb_length(srb) * (xvdd->bytes_per_sector / 512);
+  interval_tree_insert(&xvdd->write_tree, &srb_entry->write_interval);
+  srb_entry->write_in_flight = TRUE;
+}
+
+/* called with StartIoLock held */
+/* returns TRUE if srb at the head of srb_list can go on the end of shadow's request in full */
+static BOOLEAN
+XenVbd_CanMergeSrb(PXENVBD_DEVICE_DATA xvdd, blkif_shadow_t *shadow, PSCSI_REQUEST_BLOCK srb) {
+  srb_list_entry_t *srb_entry = srb->SrbExtension;
+  ULONGLONG sector_number;
+  ULONG block_count;
+
+  if (srb->Function != SRB_FUNCTION_EXECUTE_SCSI || srb_entry->offset || !srb_entry->length)
+    return FALSE;
+  switch (srb->Cdb[0]) {
+  case SCSIOP_READ:
+  case SCSIOP_READ16:
+  case SCSIOP_WRITE:
+  case SCSIOP_WRITE16:
+    break;
+  default:
+    return FALSE;
+  }
+  /* leave anything that ProcessSrbList might need to fail or hold back */
+  if (xvdd->cac || xvdd->new_total_sectors != xvdd->total_sectors)
+    return FALSE;
+  if (decode_cdb_is_read(srb) != (shadow->req.operation == BLKIF_OP_READ))
+    return FALSE;
+  sector_number = decode_cdb_sector(srb) * (xvdd->bytes_per_sector / 512);
+  block_count = decode_cdb_length(srb) * (xvdd->bytes_per_sector / 512);
+  if (sector_number != shadow->req.sector_number + shadow->length / 512)
+    return FALSE;
+  if (XenVbd_IsWriteInFlight(xvdd, sector_number, block_count))
+    return FALSE;
+  return TRUE;
+}
+
+/* called with StartIoLock held */
+/* appends srbs from the head of srb_list that continue on from the end of shadow's request. Each merged srb must fit
+   in full in the segments left over, and is completed along with the srb that owns the shadow */
+static VOID
+XenVbd_MergeSrbs(PXENVBD_DEVICE_DATA xvdd, blkif_shadow_t *shadow) {
+  srb_list_entry_t *srb_entry;
+  srb_list_entry_t **merge_tail = &shadow->merged_srbs;
+  PSCSI_REQUEST_BLOCK srb;
+  PVOID system_address;
+  PUCHAR ptr;
+  ULONG remaining, offset, length;
+  ULONG first_seg;
+  ULONG i;
+  grant_ref_t gref;
+
+  while (shadow->req.nr_segments < BLKIF_MAX_SEGMENTS_PER_REQUEST && !IsListEmpty(&xvdd->srb_list)) {
+    srb_entry = (srb_list_entry_t *)xvdd->srb_list.Flink;
+    srb = srb_entry->srb;
+    if (!XenVbd_CanMergeSrb(xvdd, shadow, srb))
+      break;
+    if (SxxxPortGetSystemAddress(xvdd, srb, &system_address) != STATUS_SUCCESS || ((ULONG_PTR)system_address & 511))
+      break;
+    if (((((ULONG_PTR)system_address & (PAGE_SIZE - 1)) + srb_entry->length + PAGE_SIZE - 1) >> PAGE_SHIFT) > (ULONG)(BLKIF_MAX_SEGMENTS_PER_REQUEST - shadow->req.nr_segments))
+      break;
+    first_seg = shadow->req.nr_segments;
+    ptr = system_address;
+    remaining = srb_entry->length;
+    while (remaining > 0) {
+      PHYSICAL_ADDRESS physical_address = MmGetPhysicalAddress(ptr);
+      /* merging is optional so don't dip into gref_reserve for it */
+      gref = XnGrantAccess(xvdd->handle, (ULONG)(physical_address.QuadPart >> PAGE_SHIFT), FALSE, INVALID_GRANT_REF, xvdd->grant_tag);
+      if (gref == INVALID_GRANT_REF)
+        break;
+      offset = physical_address.LowPart & (PAGE_SIZE - 1);
+      length = min(PAGE_SIZE - offset, remaining);
+      shadow->req.seg[shadow->req.nr_segments].gref = gref;
+      shadow->req.seg[shadow->req.nr_segments].first_sect = (UCHAR)(offset / 512);
+      shadow->req.seg[shadow->req.nr_segments].last_sect = (UCHAR)(((offset + length) / 512) - 1);
+      remaining -= length;
+      ptr += length;
+      shadow->req.nr_segments++;
+    }
+    if (remaining) {
+      /* out of grefs. Give back what this srb took and leave it on the list */
+      for (i = first_seg; i < shadow->req.nr_segments; i++)
+        XenVbd_EndSegmentAccess(xvdd, shadow, i);
+      shadow->req.nr_segments = (UCHAR)first_seg;
+      break;
+    }
+    RemoveEntryList(&srb_entry->list_entry);
+    shadow->length += srb_entry->length;
+    srb_entry->offset = srb_entry->length;
+    srb_entry->outstanding_requests++;
+    *merge_tail = srb_entry;
+    merge_tail = &srb_entry->merge_next;
+    if (shadow->req.operation == BLKIF_OP_WRITE) {
+      XenVbd_TrackWrite(xvdd, srb);
+    }
+    xvdd->stats.merged_srbs++;
+  }
+  if (shadow->merged_srbs)
+    xvdd->stats.merged_requests++;
+}
+
 /* called with StartIoLock held */
 /* returns TRUE if something was put on the ring and notify might be required */
 static BOOLEAN
@@ -299,7 +988,6 @@ XenVbd_PutSrbOnRing(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
   ULONG remaining, offset, length;
   grant_ref_t gref;
   PUCHAR ptr;
-  int i;
   PVOID system_address;
 
   //if (dump_mode) FUNCTION_ENTER();
@@ -337,37 +1025,10 @@ XenVbd_PutSrbOnRing(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
   XN_ASSERT(block_count > 0);
 
   /* look for pending writes that overlap this one */
-  /* we get warnings from drbd if we don't */
-  if (srb_entry->offset == 0) {
-    for (i = 0; i < MAX_SHADOW_ENTRIES; i++) {
-      PSCSI_REQUEST_BLOCK srb2;
-      ULONGLONG sector_number2;
-      ULONG block_count2;
-      
-      srb2 = xvdd->shadows[i].srb;
-      if (!srb2)
-        continue;
-      if (decode_cdb_is_read(srb2))
-        continue;
-      block_count2 = decode_cdb_length(srb2);;
-      block_count2 *= xvdd->bytes_per_sector / 512;
-      sector_number2 = decode_cdb_sector(srb2);
-      sector_number2 *= xvdd->bytes_per_sector / 512;
-      
-      if (sector_number < sector_number2 && sector_number + block_count <= sector_number2)
-        continue;
-      if (sector_number2 < sector_number && sector_number2 + block_count2 <= sector_number)
-        continue;
-
-      FUNCTION_MSG("Concurrent outstanding write detected (%I64d, %d) (%I64d, %d)\n",
-        sector_number, block_count, sector_number2, block_count2);
-      break;
-    }
-    if (i != MAX_SHADOW_ENTRIES) {
-      /* put the srb back at the start of the queue */
-      InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb->SrbExtension);
-      return FALSE;
-    }
+  if (srb_entry->offset == 0 && XenVbd_IsWriteInFlight(xvdd, sector_number, block_count)) {
+    /* put the srb back at the start of the queue */
+    InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb->SrbExtension);
+    return FALSE;
   }
   
   shadow = get_shadow_from_freelist(xvdd);
@@ -378,6 +1039,7 @@ XenVbd_PutSrbOnRing(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
     return FALSE;
   }
   XN_ASSERT(!shadow->aligned_buffer_in_use);
+  XN_ASSERT(!shadow->bounce_buffer);
   XN_ASSERT(!shadow->srb);
   shadow->req.sector_number = sector_number;
   shadow->req.handle = 0;
@@ -390,13 +1052,26 @@ XenVbd_PutSrbOnRing(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
 
   if (!dump_mode) {
     if ((ULONG_PTR)shadow->system_address & 511) {
-      xvdd->aligned_buffer_in_use = TRUE;
-      /* limit to aligned_buffer_size */
-      block_count = min(block_count, xvdd->aligned_buffer_size / 512);
-      ptr = (PUCHAR)xvdd->aligned_buffer;
+      shadow->bounce_buffer = XenVbd_GetBounceBuffer(xvdd);
+      if (shadow->bounce_buffer) {
+        block_count = min(block_count, BOUNCE_BUFFER_SIZE / 512);
+        ptr = shadow->bounce_buffer->buffer;
+        shadow->aligned_buffer_in_use = FALSE;
+      } else if (!xvdd->aligned_buffer_in_use) {
+        xvdd->aligned_buffer_in_use = TRUE;
+        /* limit to aligned_buffer_size */
+        block_count = min(block_count, xvdd->aligned_buffer_size / 512);
+        ptr = (PUCHAR)xvdd->aligned_buffer;
+        shadow->aligned_buffer_in_use = TRUE;
+      } else {
+        /* nowhere to put the data. Wait for a bounce buffer to be freed */
+        xvdd->stats.unaligned_deferred++;
+        put_shadow_on_freelist(xvdd, shadow);
+        InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+        return FALSE;
+      }
       if (!decode_cdb_is_read(srb))
         memcpy(ptr, shadow->system_address, block_count * 512);
-      shadow->aligned_buffer_in_use = TRUE;
     } else {
       ptr = (PUCHAR)shadow->system_address;
       shadow->aligned_buffer_in_use = FALSE;
@@ -419,23 +1094,26 @@ XenVbd_PutSrbOnRing(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
       //FUNCTION_MSG("physical_address = %08I64x\n", physical_address.QuadPart);
       
     }
-    gref = XnGrantAccess(xvdd->handle,
-           (ULONG)(physical_address.QuadPart >> PAGE_SHIFT), FALSE, INVALID_GRANT_REF, xvdd->grant_tag);
+    if (shadow->bounce_buffer) {
+      /* already granted */
+      gref = shadow->bounce_buffer->grefs[(ptr - shadow->bounce_buffer->buffer) >> PAGE_SHIFT];
+    } else {
+      gref = XenVbd_GrantAccess(xvdd, shadow, shadow->req.nr_segments, (PFN_NUMBER)(physical_address.QuadPart >> PAGE_SHIFT), FALSE);
+    }
     if (gref == INVALID_GRANT_REF) {
-      ULONG i;
-      for (i = 0; i < shadow->req.nr_segments; i++) {
-        XnEndAccess(xvdd->handle,
-          shadow->req.seg[i].gref, FALSE, xvdd->grant_tag);
+      if (shadow->req.nr_segments) {
+        /* send what we have. The rest of the srb goes in a later request */
+        break;
       }
       if (shadow->aligned_buffer_in_use) {
         shadow->aligned_buffer_in_use = FALSE;
         xvdd->aligned_buffer_in_use = FALSE;
       }
-      /* put the srb back at the start of the queue */
+      /* put the srb back at the start of the queue. The reserve is only empty when its grefs are on the ring, so a completion will run the queue again (or the retry timer if there was no reserve) */
       InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
       put_shadow_on_freelist(xvdd, shadow);
+      xvdd->stats.gref_waits++;
       FUNCTION_MSG("Out of gref's. Deferring\n");
-      /* TODO: what if there are no requests currently in progress to kick the queue again?? timer? */
       return FALSE;
     }
     offset = physical_address.LowPart & (PAGE_SIZE - 1);
@@ -453,7 +1131,22 @@ XenVbd_PutSrbOnRing(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
   }
   srb_entry->offset += shadow->length;
   srb_entry->outstanding_requests++;
-  XenVbd_PutRequest(xvdd, &shadow->req);
+  if (!dump_mode && srb_entry->offset == srb_entry->length && !shadow->bounce_buffer && !shadow->aligned_buffer_in_use) {
+    XenVbd_MergeSrbs(xvdd, shadow);
+  }
+  XenVbd_PutRequest(xvdd, shadow);
+  if (shadow->bounce_buffer || shadow->aligned_buffer_in_use) {
+    xvdd->stats.unaligned_requests++;
+    xvdd->stats.unaligned_bytes += shadow->length;
+    if (shadow->bounce_buffer)
+      xvdd->stats.bounce_requests++;
+  } else {
+    xvdd->stats.aligned_requests++;
+    xvdd->stats.aligned_bytes += shadow->length;
+  }
+  if (shadow->req.operation == BLKIF_OP_WRITE) {
+    XenVbd_TrackWrite(xvdd, srb);
+  }
   if (srb_entry->offset < srb_entry->length) {
     /* put the srb back at the start of the queue to continue on the next request */
     InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
@@ -463,6 +1156,291 @@ XenVbd_PutSrbOnRing(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
   return TRUE;
 }
 
+/* called with StartIoLock held */
+/* puts a single BLKIF_OP_DISCARD for srb on the ring. sector_number and nr_sectors are in 512-byte sectors */
+/* the range goes in write_tree until the response comes back, so later reads and writes to it wait like they do for a write */
+/* returns FALSE if there is no free shadow, in which case the caller must requeue srb */
+static BOOLEAN
+XenVbd_PutDiscardOnRing(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb, ULONGLONG sector_number, ULONGLONG nr_sectors) {
+  srb_list_entry_t *srb_entry = srb->SrbExtension;
+  blkif_request_discard_t *discard;
+  blkif_shadow_t *shadow;
+
+  shadow = get_shadow_from_freelist(xvdd);
+  if (!shadow)
+    return FALSE;
+  XN_ASSERT(!shadow->aligned_buffer_in_use);
+  XN_ASSERT(!shadow->srb);
+  /* blkif_request_discard_t overlays the request and leaves id alone. flag overlays nr_segments so must be 0 */
+  discard = (blkif_request_discard_t *)&shadow->req;
+  discard->operation = BLKIF_OP_DISCARD;
+  discard->flag = 0;
+  discard->handle = 0;
+  discard->sector_number = sector_number;
+  discard->nr_sectors = nr_sectors;
+  shadow->srb = srb;
+  shadow->length = 0;
+  shadow->system_address = NULL;
+  shadow->reset = FALSE;
+  shadow->write_interval.start = sector_number;
+  shadow->write_interval.end = sector_number + nr_sectors;
+  interval_tree_insert(&xvdd->write_tree, &shadow->write_interval);
+  shadow->write_in_flight = TRUE;
+  srb_entry->outstanding_requests++;
+  XenVbd_PutRequest(xvdd, shadow);
+  return TRUE;
+}
+
+/* called with StartIoLock held */
+/* fails the srb with ILLEGAL_REQUEST and the given additional sense code */
+static VOID
+XenVbd_FailIllegalRequest(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb, UCHAR additional_sense_code) {
+  xvdd->last_sense_key = SCSI_SENSE_ILLEGAL_REQUEST;
+  xvdd->last_additional_sense_code = additional_sense_code;
+  xvdd->last_additional_sense_code_qualifier = 0;
+  srb->SrbStatus = SRB_STATUS_ERROR;
+  XenVbd_MakeAutoSense(xvdd, srb);
+  SxxxPortNotification(RequestComplete, xvdd, srb);
+}
+
+/* called with StartIoLock held */
+/* puts the next UNMAP block descriptor on the ring as a BLKIF_OP_DISCARD */
+/* srb_entry->offset is the offset of the next block descriptor in the parameter list */
+/* returns TRUE if something was put on the ring and notify might be required */
+static BOOLEAN
+XenVbd_PutUnmapOnRing(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
+  srb_list_entry_t *srb_entry = srb->SrbExtension;
+  PUCHAR data_buffer = srb->DataBuffer;
+  PUCHAR descriptor;
+  /* sector_number, end_sector, granularity and alignment are in 512-byte sectors */
+  ULONGLONG sector_number;
+  ULONGLONG end_sector;
+  ULONG block_count;
+  ULONG granularity;
+  ULONG alignment;
+  ULONG descriptor_data_length;
+
+  if (xvdd->device_state != DEVICE_STATE_ACTIVE) {
+    InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+    return FALSE;
+  }
+
+  if (srb_entry->offset == 0) {
+    /* first time through - check the whole parameter list before anything goes on the ring */
+    if (srb->DataTransferLength < UNMAP_HEADER_LENGTH) {
+      /* a zero length parameter list is not an error */
+      srb->SrbStatus = SRB_STATUS_SUCCESS;
+      SxxxPortNotification(RequestComplete, xvdd, srb);
+      return FALSE;
+    }
+    descriptor_data_length = ((ULONG)data_buffer[2] << 8) | (ULONG)data_buffer[3];
+    if ((descriptor_data_length % UNMAP_DESCRIPTOR_LENGTH) != 0
+        || descriptor_data_length / UNMAP_DESCRIPTOR_LENGTH > UNMAP_MAX_DESCRIPTORS
+        || UNMAP_HEADER_LENGTH + descriptor_data_length > srb->DataTransferLength) {
+      FUNCTION_MSG("UNMAP bad block descriptor data length %d (DataTransferLength = %d)\n", descriptor_data_length, srb->DataTransferLength);
+      XenVbd_FailIllegalRequest(xvdd, srb, 0x26); /* invalid field in parameter list */
+      return FALSE;
+    }
+    for (descriptor = data_buffer + UNMAP_HEADER_LENGTH; descriptor < data_buffer + UNMAP_HEADER_LENGTH + descriptor_data_length; descriptor += UNMAP_DESCRIPTOR_LENGTH) {
+      sector_number = ((ULONGLONG)descriptor[0] << 56) | ((ULONGLONG)descriptor[1] << 48)
+                    | ((ULONGLONG)descriptor[2] << 40) | ((ULONGLONG)descriptor[3] << 32)
+                    | ((ULONGLONG)descriptor[4] << 24) | ((ULONGLONG)descriptor[5] << 16)
+                    | ((ULONGLONG)descriptor[6] << 8) | ((ULONGLONG)descriptor[7]);
+      block_count = ((ULONG)descriptor[8] << 24) | ((ULONG)descriptor[9] << 16) | ((ULONG)descriptor[10] << 8) | (ULONG)descriptor[11];
+      if (sector_number > xvdd->total_sectors || block_count > xvdd->total_sectors - sector_number) {
+        FUNCTION_MSG("UNMAP out of range (%I64d, %d)\n", sector_number, block_count);
+        XenVbd_FailIllegalRequest(xvdd, srb, SCSI_ADSENSE_ILLEGAL_BLOCK);
+        return FALSE;
+      }
+    }
+    srb_entry->offset = UNMAP_HEADER_LENGTH;
+    srb_entry->length = UNMAP_HEADER_LENGTH + descriptor_data_length;
+  }
+
+  granularity = xvdd->discard_granularity / 512;
+  alignment = (xvdd->discard_alignment / 512) % granularity;
+  while (srb_entry->offset < srb_entry->length) {
+    descriptor = data_buffer + srb_entry->offset;
+    sector_number = ((ULONGLONG)descriptor[0] << 56) | ((ULONGLONG)descriptor[1] << 48)
+                  | ((ULONGLONG)descriptor[2] << 40) | ((ULONGLONG)descriptor[3] << 32)
+                  | ((ULONGLONG)descriptor[4] << 24) | ((ULONGLONG)descriptor[5] << 16)
+                  | ((ULONGLONG)descriptor[6] << 8) | ((ULONGLONG)descriptor[7]);
+    block_count = ((ULONG)descriptor[8] << 24) | ((ULONG)descriptor[9] << 16) | ((ULONG)descriptor[10] << 8) | (ULONG)descriptor[11];
+    sector_number *= xvdd->bytes_per_sector / 512;
+    end_sector = sector_number + (ULONGLONG)block_count * (xvdd->bytes_per_sector / 512);
+    /* only discard whole allocation units - round the start up and the end down to the granularity */
+    if (sector_number <= alignment) {
+      sector_number = alignment;
+    } else {
+      sector_number = (sector_number - alignment + granularity - 1) / granularity * granularity + alignment;
+    }
+    if (end_sector <= alignment) {
+      end_sector = 0;
+    } else {
+      end_sector = (end_sector - alignment) / granularity * granularity + alignment;
+    }
+    if (end_sector <= sector_number) {
+      /* less than one allocation unit - nothing to do for this descriptor */
+      srb_entry->offset += UNMAP_DESCRIPTOR_LENGTH;
+      continue;
+    }
+    /* look for pending writes (or discards) that overlap this one. end_sector - sector_number fits in a ULONG because a
+       descriptor's block count does and discard is only offered on disks, which have 512 byte sectors */
+    if (XenVbd_IsWriteInFlight(xvdd, sector_number, (ULONG)(end_sector - sector_number))) {
+      /* put the srb back at the start of the queue */
+      InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+      return FALSE;
+    }
+    if (!XenVbd_PutDiscardOnRing(xvdd, srb, sector_number, end_sector - sector_number)) {
+      /* put the srb back at the start of the queue */
+      InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+      return FALSE;
+    }
+    srb_entry->offset += UNMAP_DESCRIPTOR_LENGTH;
+    if (srb_entry->offset < srb_entry->length) {
+      /* put the srb back at the start of the queue to continue on the next request */
+      InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+    }
+    return TRUE;
+  }
+  /* the remaining descriptors were all too small to discard. complete now if nothing else will */
+  if (srb_entry->outstanding_requests == 0) {
+    if (srb_entry->error) {
+      srb->SrbStatus = SRB_STATUS_ERROR;
+      xvdd->last_sense_key = SCSI_SENSE_MEDIUM_ERROR;
+    } else {
+      srb->SrbStatus = SRB_STATUS_SUCCESS;
+    }
+    XenVbd_MakeAutoSense(xvdd, srb);
+    SxxxPortNotification(RequestComplete, xvdd, srb);
+  }
+  return FALSE;
+}
+
+/* called with StartIoLock held */
+/* puts the next part of a WRITE SAME on the ring */
+/* for WRITE SAME srb_entry->offset and length count 512-byte sectors of the target range, not bytes of DataBuffer */
+/* returns TRUE if something was put on the ring and notify might be required */
+static BOOLEAN
+XenVbd_PutWriteSameOnRing(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb) {
+  srb_list_entry_t *srb_entry = srb->SrbExtension;
+  blkif_shadow_t *shadow;
+  PUCHAR pattern;
+  /* sector_number and block_count are the adjusted-to-512-byte-sector values */
+  ULONGLONG sector_number;
+  ULONG block_count;
+  ULONG sectors_per_page;
+  ULONG remaining;
+  ULONG length;
+  ULONG i;
+  grant_ref_t gref;
+
+  if (xvdd->device_state != DEVICE_STATE_ACTIVE) {
+    InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+    return FALSE;
+  }
+
+  block_count = decode_cdb_length(srb);
+  sector_number = decode_cdb_sector(srb);
+
+  if (srb_entry->offset == 0 && !srb_entry->write_same) {
+    /* first time through (or requeued before anything went on the ring) - check the request */
+    if (block_count == 0 || srb->DataTransferLength != xvdd->bytes_per_sector || xvdd->bytes_per_sector > PAGE_SIZE) {
+      /* we set WSNZ so a block count of zero is invalid */
+      FUNCTION_MSG("WRITE_SAME invalid (block_count = %d, DataTransferLength = %d)\n", block_count, srb->DataTransferLength);
+      XenVbd_FailIllegalRequest(xvdd, srb, SCSI_ADSENSE_INVALID_CDB);
+      return FALSE;
+    }
+    if (sector_number > xvdd->total_sectors || block_count > xvdd->total_sectors - sector_number) {
+      FUNCTION_MSG("WRITE_SAME out of range (%I64d, %d)\n", sector_number, block_count);
+      XenVbd_FailIllegalRequest(xvdd, srb, SCSI_ADSENSE_ILLEGAL_BLOCK);
+      return FALSE;
+    }
+  }
+  block_count *= xvdd->bytes_per_sector / 512;
+  sector_number *= xvdd->bytes_per_sector / 512;
+  srb_entry->length = block_count;
+
+  /* look for pending writes that overlap this one */
+  if (srb_entry->offset == 0 && XenVbd_IsWriteInFlight(xvdd, sector_number, block_count)) {
+    /* put the srb back at the start of the queue */
+    InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+    return FALSE;
+  }
+
+  /* never called in dump mode */
+  if (SxxxPortGetSystemAddress(xvdd, srb, (PVOID *)&pattern) != STATUS_SUCCESS) {
+    FUNCTION_MSG("Failed to map DataBuffer\n");
+    InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+    return FALSE;
+  }
+
+  if (!srb_entry->write_same) {
+    /* every WRITE SAME in flight shares write_same_buffer so they must all have the same pattern */
+    if (xvdd->write_same_refs) {
+      if (memcmp(xvdd->write_same_buffer, pattern, xvdd->bytes_per_sector) != 0) {
+        /* put the srb back at the start of the queue until the current pattern is finished with */
+        InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+        return FALSE;
+      }
+    } else {
+      for (i = 0; i < PAGE_SIZE; i += xvdd->bytes_per_sector) {
+        memcpy(xvdd->write_same_buffer + i, pattern, xvdd->bytes_per_sector);
+      }
+    }
+    xvdd->write_same_refs++;
+    srb_entry->write_same = TRUE;
+  }
+
+  shadow = get_shadow_from_freelist(xvdd);
+  if (!shadow) {
+    /* put the srb back at the start of the queue */
+    InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+    return FALSE;
+  }
+  XN_ASSERT(!shadow->aligned_buffer_in_use);
+  XN_ASSERT(!shadow->srb);
+  /* the whole request only needs the one page granted, once */
+  gref = XenVbd_GrantAccess(xvdd, shadow, 0, (PFN_NUMBER)(MmGetPhysicalAddress(xvdd->write_same_buffer).QuadPart >> PAGE_SHIFT), TRUE);
+  if (gref == INVALID_GRANT_REF) {
+    put_shadow_on_freelist(xvdd, shadow);
+    /* put the srb back at the start of the queue */
+    InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+    xvdd->stats.gref_waits++;
+    FUNCTION_MSG("Out of gref's. Deferring\n");
+    return FALSE;
+  }
+  shadow->req.sector_number = sector_number + srb_entry->offset;
+  shadow->req.handle = 0;
+  shadow->req.operation = BLKIF_OP_WRITE;
+  shadow->req.nr_segments = 0;
+  shadow->srb = srb;
+  shadow->length = 0;
+  shadow->system_address = NULL;
+  shadow->reset = FALSE;
+  shadow->write_same = TRUE;
+
+  sectors_per_page = PAGE_SIZE / 512;
+  remaining = srb_entry->length - srb_entry->offset;
+  while (remaining > 0 && shadow->req.nr_segments < BLKIF_MAX_SEGMENTS_PER_REQUEST) {
+    length = min(sectors_per_page, remaining);
+    shadow->req.seg[shadow->req.nr_segments].gref = gref;
+    shadow->req.seg[shadow->req.nr_segments].first_sect = 0;
+    shadow->req.seg[shadow->req.nr_segments].last_sect = (UCHAR)(length - 1);
+    remaining -= length;
+    srb_entry->offset += length;
+    shadow->req.nr_segments++;
+  }
+  srb_entry->outstanding_requests++;
+  XenVbd_PutRequest(xvdd, shadow);
+  XenVbd_TrackWrite(xvdd, srb);
+  if (srb_entry->offset < srb_entry->length) {
+    /* put the srb back at the start of the queue to continue on the next request */
+    InsertHeadList(&xvdd->srb_list, (PLIST_ENTRY)srb_entry);
+  }
+  return TRUE;
+}
+
 static UCHAR
 XenVbd_FillModePage(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb, PULONG data_transfer_length) {
   PMODE_PARAMETER_HEADER parameter_header = NULL;
@@ -610,7 +1588,7 @@ XenVbd_FillModePage(PXENVBD_DEVICE_DATA xvdd, PSCSI_REQUEST_BLOCK srb, PULONG da
 static BOOLEAN
 XenVbd_ResetBus(PXENVBD_DEVICE_DATA xvdd, ULONG PathId) {
   //srb_list_entry_t *srb_entry;
-  int i;
+  ULONG i;
   /* need to make sure that each SRB is only reset once */
   LIST_ENTRY srb_reset_list;
   PLIST_ENTRY list_entry;
@@ -643,16 +1621,39 @@ XenVbd_ResetBus(PXENVBD_DEVICE_DATA xvdd, ULONG PathId) {
   }
   
   /* add any in-flight srbs that aren't already on the list (could be multiple shadows per srb if it's been broken up */
-  for (i = 0; i < MAX_SHADOW_ENTRIES; i++) {
+  for (i = 0; i < xvdd->shadow_count; i++) {
     if (xvdd->shadows[i].srb) {
       srb_list_entry_t *srb_entry = xvdd->shadows[i].srb->SrbExtension;
-      for (list_entry = srb_reset_list.Flink; list_entry != &srb_reset_list; list_entry = list_entry->Flink) {
-        if (list_entry == &srb_entry->list_entry)
-          break;
+      srb_list_entry_t *merged_srbs = xvdd->shadows[i].merged_srbs;
+      /* the shadow's own srb first, then any merged onto its request */
+      while (srb_entry) {
+        for (list_entry = srb_reset_list.Flink; list_entry != &srb_reset_list; list_entry = list_entry->Flink) {
+          if (list_entry == &srb_entry->list_entry)
+            break;
+        }
+        if (list_entry == &srb_reset_list) {
+          FUNCTION_MSG("adding in-flight SRB %p to reset list\n", srb_entry->srb);
+          InsertTailList(&srb_reset_list, &srb_entry->list_entry);
+        }
+        srb_entry->merge_next = NULL;
+        srb_entry = merged_srbs;
+        if (merged_srbs)
+          merged_srbs = merged_srbs->merge_next;
+      }
+      xvdd->shadows[i].merged_srbs = NULL;
+      /* the srbs are completed below but the backend still has the request. Until the response comes back the shadow
+         takes over their place in write_tree and the reference on write_same_buffer. A discard is already there */
+      if (xvdd->shadows[i].req.operation != BLKIF_OP_READ && !xvdd->shadows[i].write_in_flight) {
+        ULONGLONG sectors = XenVbd_RequestSectors(&xvdd->shadows[i].req);
+        if (sectors) {
+          xvdd->shadows[i].write_interval.start = xvdd->shadows[i].req.sector_number;
+          xvdd->shadows[i].write_interval.end = xvdd->shadows[i].req.sector_number + sectors;
+          interval_tree_insert(&xvdd->write_tree, &xvdd->shadows[i].write_interval);
+          xvdd->shadows[i].write_in_flight = TRUE;
+        }
       }
-      if (list_entry == &srb_reset_list) {
-        FUNCTION_MSG("adding in-flight SRB %p to reset list\n", srb_entry->srb);
-        InsertTailList(&srb_reset_list, &srb_entry->list_entry);
+      if (xvdd->shadows[i].write_same) {
+        xvdd->write_same_refs++;
       }
       /* set reset here so that the interrupt won't do anything with the srb but will dispose of the shadow entry correctly */
       xvdd->shadows[i].reset = TRUE;
@@ -664,6 +1665,14 @@ XenVbd_ResetBus(PXENVBD_DEVICE_DATA xvdd, ULONG PathId) {
   while((list_entry = RemoveHeadList(&srb_reset_list)) != &srb_reset_list) {
     srb_list_entry_t *srb_entry = CONTAINING_RECORD(list_entry, srb_list_entry_t, list_entry);
     srb_entry->outstanding_requests = 0;
+    if (srb_entry->write_same) {
+      xvdd->write_same_refs--;
+      srb_entry->write_same = FALSE;
+    }
+    if (srb_entry->write_in_flight) {
+      interval_tree_remove(&xvdd->write_tree, &srb_entry->write_interval);
+      srb_entry->write_in_flight = FALSE;
+    }
     srb_entry->srb->SrbStatus = SRB_STATUS_BUS_RESET;
     FUNCTION_MSG("completing SRB %p with status SRB_STATUS_BUS_RESET\n", srb_entry->srb);
     SxxxPortNotification(RequestComplete, xvdd, srb_entry->srb);
@@ -696,7 +1705,8 @@ XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd) {
   PSRB_IO_CONTROL sic;
   ULONG prev_offset;
 
-  while(!xvdd->aligned_buffer_in_use && xvdd->shadow_free && (srb_entry = (srb_list_entry_t *)RemoveHeadList(&xvdd->srb_list)) != (srb_list_entry_t *)&xvdd->srb_list) {
+  /* no shadows at all means we are disconnected. Keep going so that non-scsi srbs still complete */
+  while((xvdd->shadow_free || !xvdd->shadows) && (srb_entry = (srb_list_entry_t *)RemoveHeadList(&xvdd->srb_list)) != (srb_list_entry_t *)&xvdd->srb_list) {
     srb = srb_entry->srb;
     prev_offset = srb_entry->offset;
     if (xvdd->device_state == DEVICE_STATE_INACTIVE) {
@@ -722,6 +1732,9 @@ XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd) {
         } else {
           FUNCTION_MSG("Resize detected. Setting UNIT_ATTENTION\n");
           xvdd->total_sectors = xvdd->new_total_sectors;
+          if (xvdd->read_cache.page_count) {
+            read_cache_invalidate_all(&xvdd->read_cache);
+          }
           xvdd->last_sense_key = SCSI_SENSE_UNIT_ATTENTION;
           xvdd->last_additional_sense_code = SCSI_ADSENSE_PARAMETERS_CHANGED;
           xvdd->last_additional_sense_code_qualifier = 0x09; /* capacity changed */
@@ -768,6 +1781,14 @@ XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd) {
               memcpy(id->ProductId, SCSI_DISK_MODEL, 16); // product id
               memcpy(id->ProductRevisionLevel, "0000", 4); // product revision level
               data_transfer_length = FIELD_OFFSET(INQUIRYDATA, VendorSpecific);
+              #ifdef _NTSTORPORT_
+              /* otherwise storport stops at its default depth no matter how big the ring is */
+              if (!dump_mode && xvdd->shadow_count) {
+                ULONG depth = min(xvdd->shadow_count, XENVBD_STORPORT_MAX_QUEUE_DEPTH);
+                BOOLEAN result = StorPortSetDeviceQueueDepth(xvdd, srb->PathId, srb->TargetId, srb->Lun, depth);
+                FUNCTION_MSG("StorPortSetDeviceQueueDepth(%d) returned %d\n", depth, result);
+              }
+              #endif
             }
           } else {
             switch (srb->Cdb[2]) {
@@ -776,12 +1797,13 @@ XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd) {
               data_buffer[0] = DIRECT_ACCESS_DEVICE;
               data_buffer[1] = VPD_SUPPORTED_PAGES;
               data_buffer[2] = 0x00;
-              data_buffer[3] = 4;
+              data_buffer[3] = 5;
               data_buffer[4] = VPD_SUPPORTED_PAGES;
               data_buffer[5] = VPD_SERIAL_NUMBER;
               data_buffer[6] = VPD_DEVICE_IDENTIFIERS;
               data_buffer[7] = VPD_BLOCK_LIMITS;
-              data_transfer_length = 8;
+              data_buffer[8] = VPD_LOGICAL_BLOCK_PROVISIONING;
+              data_transfer_length = 9;
               break;
             case VPD_SERIAL_NUMBER: /* serial number */
               FUNCTION_MSG("VPD_SERIAL_NUMBER\n");
@@ -816,11 +1838,51 @@ XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd) {
               break;
             case VPD_BLOCK_LIMITS: /* to indicate support for UNMAP (TRIM/DISCARD) */
               FUNCTION_MSG("VPD_BLOCK_LIMITS\n");
-              // max descriptors = 1
-              // max sectors = 0xFFFFFFFF
-              // granularity = from xenbus
-              // alignment = from xenbus(?)
-              srb_status = SRB_STATUS_ERROR;
+              data_buffer[0] = DIRECT_ACCESS_DEVICE;
+              data_buffer[1] = VPD_BLOCK_LIMITS;
+              data_buffer[2] = 0x00;
+              data_buffer[3] = 0x3C;
+              if (data_transfer_length >= 0x40) {
+                data_buffer[4] = 0x01; /* WSNZ - WRITE SAME with a zero block count is not supported */
+              }
+              if (xvdd->feature_discard && data_transfer_length >= 0x40) {
+                ULONG granularity = xvdd->discard_granularity / xvdd->bytes_per_sector;
+                ULONG alignment = (xvdd->discard_alignment / xvdd->bytes_per_sector) % granularity;
+                /* maximum unmap lba count */
+                data_buffer[20] = 0xFF;
+                data_buffer[21] = 0xFF;
+                data_buffer[22] = 0xFF;
+                data_buffer[23] = 0xFF;
+                /* maximum unmap block descriptor count */
+                data_buffer[24] = (UCHAR)(UNMAP_MAX_DESCRIPTORS >> 24);
+                data_buffer[25] = (UCHAR)(UNMAP_MAX_DESCRIPTORS >> 16);
+                data_buffer[26] = (UCHAR)(UNMAP_MAX_DESCRIPTORS >> 8);
+                data_buffer[27] = (UCHAR)(UNMAP_MAX_DESCRIPTORS >> 0);
+                /* optimal unmap granularity */
+                data_buffer[28] = (UCHAR)(granularity >> 24);
+                data_buffer[29] = (UCHAR)(granularity >> 16);
+                data_buffer[30] = (UCHAR)(granularity >> 8);
+                data_buffer[31] = (UCHAR)(granularity >> 0);
+                /* UGAVALID + unmap granularity alignment */
+                data_buffer[32] = 0x80 | (UCHAR)((alignment >> 24) & 0x7F);
+                data_buffer[33] = (UCHAR)(alignment >> 16);
+                data_buffer[34] = (UCHAR)(alignment >> 8);
+                data_buffer[35] = (UCHAR)(alignment >> 0);
+              }
+              data_transfer_length = 0x40;
+              break;
+            case VPD_LOGICAL_BLOCK_PROVISIONING:
+              FUNCTION_MSG("VPD_LOGICAL_BLOCK_PROVISIONING\n");
+              data_buffer[0] = DIRECT_ACCESS_DEVICE;
+              data_buffer[1] = VPD_LOGICAL_BLOCK_PROVISIONING;
+              data_buffer[2] = 0x00;
+              data_buffer[3] = 4;
+              data_buffer[4] = 0; /* threshold exponent */
+              if (xvdd->feature_discard) {
+                data_buffer[5] = 0x80; /* LBPU - UNMAP supported */
+                data_buffer[6] = 0x02; /* thin provisioned */
+              }
+              data_transfer_length = 8;
               break;
             default:
               FUNCTION_MSG("Unknown Page %02x requested\n", srb->Cdb[2]);
@@ -951,7 +2013,7 @@ XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd) {
           FUNCTION_MSG("Unknown logical blocks per physical block %d (%d / %d)\n", xvdd->hw_bytes_per_sector / xvdd->bytes_per_sector, xvdd->hw_bytes_per_sector, xvdd->bytes_per_sector);
           break;
         }
-        data_buffer[14] = 0xC0; //0;
+        data_buffer[14] = xvdd->feature_discard ? 0x80 : 0; /* LBPME */
         data_buffer[15] = 0;
         data_transfer_length = 16;
         srb->ScsiStatus = 0;
@@ -965,6 +2027,15 @@ XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd) {
         break;
       case SCSIOP_READ:
       case SCSIOP_READ16:
+        if (XenVbd_ReadFromCache(xvdd, srb)) {
+          srb_status = SRB_STATUS_SUCCESS;
+          break;
+        }
+        if (XenVbd_PutSrbOnRing(xvdd, srb)) {
+          notify = TRUE;
+          XenVbd_ReadAhead(xvdd);
+        }
+        break;
       case SCSIOP_WRITE:
       case SCSIOP_WRITE16:
         if (XenVbd_PutSrbOnRing(xvdd, srb)) {
@@ -973,14 +2044,28 @@ XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd) {
         break;
       case SCSIOP_WRITE_SAME:
       case SCSIOP_WRITE_SAME16:
-        /* not yet supported */
-        FUNCTION_MSG("WRITE_SAME\n");
-        srb_status = SRB_STATUS_ERROR;
-       break;
+        if (dump_mode)
+          FUNCTION_MSG("Command = WRITE_SAME\n");
+        if (dump_mode || !xvdd->write_same_buffer || xvdd->device_mode != XENVBD_DEVICEMODE_WRITE) {
+          FUNCTION_MSG("WRITE_SAME not supported\n");
+          srb_status = SRB_STATUS_ERROR;
+          break;
+        }
+        if (XenVbd_PutWriteSameOnRing(xvdd, srb)) {
+          notify = TRUE;
+        }
+        break;
       case SCSIOP_UNMAP:
-        /* not yet supported */
-        FUNCTION_MSG("UNMAP\n");
-        srb_status = SRB_STATUS_ERROR;
+        if (dump_mode)
+          FUNCTION_MSG("Command = UNMAP\n");
+        if (!xvdd->feature_discard || xvdd->device_mode != XENVBD_DEVICEMODE_WRITE) {
+          FUNCTION_MSG("UNMAP not supported\n");
+          srb_status = SRB_STATUS_ERROR;
+          break;
+        }
+        if (XenVbd_PutUnmapOnRing(xvdd, srb)) {
+          notify = TRUE;
+        }
         break;
       case SCSIOP_VERIFY:
       case SCSIOP_VERIFY16:
@@ -1264,8 +2349,13 @@ XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd) {
       SxxxPortNotification(RequestComplete, xvdd, srb);
       break;
     case SRB_FUNCTION_IO_CONTROL:
-      FUNCTION_MSG("SRB_FUNCTION_IO_CONTROL\n");
       sic = srb->DataBuffer;
+      if (srb->DataTransferLength >= sizeof(SRB_IO_CONTROL) && memcmp(sic->Signature, XENVBD_STATS_SIG, 8) == 0) {
+        srb->SrbStatus = XenVbd_StatsIoControl(xvdd, srb);
+        SxxxPortNotification(RequestComplete, xvdd, srb);
+        break;
+      }
+      FUNCTION_MSG("SRB_FUNCTION_IO_CONTROL\n");
       FUNCTION_MSG("ControlCode = %d\n", sic->ControlCode);
       srb->SrbStatus = SRB_STATUS_INVALID_REQUEST;
       SxxxPortNotification(RequestComplete, xvdd, srb);
@@ -1284,15 +2374,27 @@ XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd) {
     if ((PLIST_ENTRY)srb_entry == xvdd->srb_list.Flink && srb_entry->offset == prev_offset) {
       FUNCTION_MSG("Same entry\n");
       /* same entry was put back onto the head of the list unchanged, so we can't progress */
+      xvdd->stats.requeues++;
       break;
     }
   }
   if (notify) {
     notify = FALSE;
     RING_PUSH_REQUESTS_AND_CHECK_NOTIFY(&xvdd->ring, notify);
+    xvdd->stats.ring_pushes++;
     if (notify) {
+      xvdd->stats.notifies++;
       XnNotify(xvdd->handle, xvdd->event_channel);
     }
   }
+  if (!IsListEmpty(&xvdd->srb_list)) {
+    if (xvdd->shadows && !xvdd->shadow_free) {
+      xvdd->stats.shadow_waits++;
+    } else if (!dump_mode && xvdd->device_state == DEVICE_STATE_ACTIVE && xvdd->shadow_free == xvdd->shadow_count) {
+      /* stuck, and nothing on the ring will complete and run the queue again */
+      xvdd->stats.retry_timer_calls++;
+      XenVbd_QueueRetry(xvdd, XENVBD_RETRY_INTERVAL);
+    }
+  }
   return;
 }
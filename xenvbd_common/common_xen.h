@@ -17,6 +17,232 @@ along with this program; if not, write to the Free Software
 Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 */
 
+/* called at DIRQL */
+/* flags that the ring needs looking at. HandleEvent clears the flag, so a filter that sees it already clear knows the
+   miniport got to the responses on its own. The time is only taken for the first event since the last HandleEvent */
+static __inline VOID
+XenVbd_MarkEventPending(PXENVBD_DEVICE_DATA xvdd) {
+  xvdd->stats.events++;
+  if (!xvdd->event_pending && xvdd->performance_frequency)
+    xvdd->event_time = KeQueryPerformanceCounter(NULL);
+  InterlockedExchange(&xvdd->event_pending, 1);
+}
+
+static VOID
+XenVbd_FreeBounceBuffers(PXENVBD_DEVICE_DATA xvdd) {
+  ULONG i, j;
+
+  for (i = 0; i < xvdd->bounce_buffer_count; i++) {
+    XN_ASSERT(!xvdd->bounce_buffers[i].in_use);
+    for (j = 0; j < BLKIF_MAX_SEGMENTS_PER_REQUEST; j++) {
+      XnEndAccess(xvdd->handle, xvdd->bounce_buffers[i].grefs[j], FALSE, xvdd->grant_tag);
+    }
+    ExFreePoolWithTag(xvdd->bounce_buffers[i].buffer, XENVBD_POOL_TAG);
+    xvdd->bounce_buffers[i].buffer = NULL;
+  }
+  xvdd->bounce_buffer_count = 0;
+}
+
+/* allocates and grants the bounce buffers. Running short isn't fatal - unaligned requests fall back to aligned_buffer */
+static VOID
+XenVbd_AllocateBounceBuffers(PXENVBD_DEVICE_DATA xvdd) {
+  ULONG count = DEFAULT_BOUNCE_BUFFERS;
+  ULONG i, j;
+  bounce_buffer_t *bounce;
+
+  /* anything still here is left over from a hibernate that never completed. The requests that had them went with the
+     old ring, so end the grants and free them before starting again */
+  for (i = 0; i < xvdd->bounce_buffer_count; i++)
+    xvdd->bounce_buffers[i].in_use = FALSE;
+  XenVbd_FreeBounceBuffers(xvdd);
+  XnReadInt32(xvdd->handle, XN_BASE_FRONTEND, "bounce-buffers", &count);
+  count = min(count, MAX_BOUNCE_BUFFERS);
+  for (i = 0; i < count; i++) {
+    bounce = &xvdd->bounce_buffers[i];
+    /* page aligned because it is bigger than a page */
+    bounce->buffer = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, BOUNCE_BUFFER_SIZE, XENVBD_POOL_TAG);
+    if (!bounce->buffer)
+      break;
+    bounce->in_use = FALSE;
+    for (j = 0; j < BLKIF_MAX_SEGMENTS_PER_REQUEST; j++) {
+      bounce->grefs[j] = XnGrantAccess(xvdd->handle,
+        (ULONG)(MmGetPhysicalAddress(bounce->buffer + j * PAGE_SIZE).QuadPart >> PAGE_SHIFT), FALSE, INVALID_GRANT_REF, xvdd->grant_tag);
+      if (bounce->grefs[j] == INVALID_GRANT_REF)
+        break;
+    }
+    if (j != BLKIF_MAX_SEGMENTS_PER_REQUEST) {
+      FUNCTION_MSG("Out of gref's for bounce buffers\n");
+      while (j--)
+        XnEndAccess(xvdd->handle, bounce->grefs[j], FALSE, xvdd->grant_tag);
+      ExFreePoolWithTag(bounce->buffer, XENVBD_POOL_TAG);
+      bounce->buffer = NULL;
+      break;
+    }
+    xvdd->bounce_buffer_count++;
+  }
+  FUNCTION_MSG("bounce_buffer_count = %d (requested %d)\n", xvdd->bounce_buffer_count, count);
+}
+
+static VOID
+XenVbd_FreeGrefReserve(PXENVBD_DEVICE_DATA xvdd) {
+  /* everything is back in the reserve once the ring is stopped */
+  while (xvdd->gref_reserve_count) {
+    xvdd->gref_reserve_count--;
+    XnFreeGrant(xvdd->handle, xvdd->gref_reserve[xvdd->gref_reserve_count], xvdd->grant_tag);
+  }
+}
+
+static VOID
+XenVbd_AllocateGrefReserve(PXENVBD_DEVICE_DATA xvdd) {
+  grant_ref_t gref;
+
+  /* anything still here is left over from a hibernate that never completed */
+  XenVbd_FreeGrefReserve(xvdd);
+  for (; xvdd->gref_reserve_count < GREF_RESERVE_ENTRIES; xvdd->gref_reserve_count++) {
+    gref = XnAllocateGrant(xvdd->handle, xvdd->grant_tag);
+    if (gref == INVALID_GRANT_REF) {
+      FUNCTION_MSG("Only reserved %d gref's\n", xvdd->gref_reserve_count);
+      break;
+    }
+    xvdd->gref_reserve[xvdd->gref_reserve_count] = gref;
+  }
+}
+
+static VOID
+XenVbd_FreeReadCache(PXENVBD_DEVICE_DATA xvdd) {
+  xvdd->read_cache.page_count = 0;
+  if (xvdd->read_cache_pages) {
+    ExFreePoolWithTag(xvdd->read_cache_pages, XENVBD_POOL_TAG);
+    xvdd->read_cache_pages = NULL;
+  }
+  if (xvdd->read_cache_data) {
+    ExFreePoolWithTag(xvdd->read_cache_data, XENVBD_POOL_TAG);
+    xvdd->read_cache_data = NULL;
+  }
+}
+
+/* the read cache is only enabled if read-cache-pages is set in the frontend xenstore directory */
+static VOID
+XenVbd_AllocateReadCache(PXENVBD_DEVICE_DATA xvdd) {
+  ULONG page_count = 0;
+
+  /* anything still here is left over from a hibernate that never completed */
+  XenVbd_FreeReadCache(xvdd);
+  xvdd->read_cache_next_sector = 0;
+  xvdd->read_cache_sequential = 0;
+  xvdd->read_ahead_next_sector = 0;
+  XnReadInt32(xvdd->handle, XN_BASE_FRONTEND, "read-cache-pages", &page_count);
+  if (!page_count || xvdd->device_type != XENVBD_DEVICETYPE_DISK)
+    return;
+  page_count = min(page_count, READ_CACHE_MAX_PAGES);
+  /* settle for less if there isn't that much contiguous NonPagedPool */
+  for (; page_count; page_count /= 2) {
+    xvdd->read_cache_data = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, page_count * PAGE_SIZE, XENVBD_POOL_TAG);
+    if (xvdd->read_cache_data)
+      break;
+  }
+  if (!page_count) {
+    FUNCTION_MSG("Failed to allocate read cache\n");
+    return;
+  }
+  xvdd->read_cache_pages = (read_cache_page_t *)ExAllocatePoolWithTag(NonPagedPool, sizeof(read_cache_page_t) * page_count, XENVBD_POOL_TAG);
+  if (!xvdd->read_cache_pages) {
+    FUNCTION_MSG("Failed to allocate read cache pages\n");
+    XenVbd_FreeReadCache(xvdd);
+    return;
+  }
+  read_cache_init(&xvdd->read_cache, xvdd->read_cache_pages, xvdd->read_cache_data, page_count);
+  FUNCTION_MSG("read cache = %d pages\n", page_count);
+}
+
+static VOID
+XenVbd_FreeRing(PXENVBD_DEVICE_DATA xvdd) {
+  ULONG i;
+
+  if (xvdd->shadows) {
+    ExFreePoolWithTag(xvdd->shadows, XENVBD_POOL_TAG);
+    xvdd->shadows = NULL;
+  }
+  if (xvdd->shadow_free_list) {
+    ExFreePoolWithTag(xvdd->shadow_free_list, XENVBD_POOL_TAG);
+    xvdd->shadow_free_list = NULL;
+  }
+  xvdd->shadow_count = 0;
+  xvdd->shadow_free = 0;
+  if (xvdd->sring) {
+    for (i = 0; i < (1U << xvdd->ring_page_order); i++) {
+      XnEndAccess(xvdd->handle, xvdd->sring_grefs[i], FALSE, xvdd->grant_tag);
+    }
+    ExFreePoolWithTag(xvdd->sring, XENVBD_POOL_TAG);
+    xvdd->sring = NULL;
+  }
+}
+
+/* allocates and grants a ring as big as the backend's max-ring-page-order allows, falling back to a single page,
+   and a shadow for every slot in it */
+static NTSTATUS
+XenVbd_AllocateRing(PXENVBD_DEVICE_DATA xvdd) {
+  ULONG max_ring_page_order = 0;
+  ULONG order;
+  ULONG i;
+  PFN_NUMBER pfn;
+
+  /* anything still here is left over from a hibernate that never completed. The old backend is gone so end its grants
+     and free it before starting again */
+  XenVbd_FreeRing(xvdd);
+  XnReadInt32(xvdd->handle, XN_BASE_BACKEND, "max-ring-page-order", &max_ring_page_order);
+  order = min(max_ring_page_order, XENVBD_MAX_RING_PAGE_ORDER);
+  while (!xvdd->sring) {
+    /* a multi-page allocation from NonPagedPool is page aligned */
+    xvdd->sring = (blkif_sring_t *)ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE << order, XENVBD_POOL_TAG);
+    if (xvdd->sring) {
+      for (i = 0; i < (1U << order); i++) {
+        pfn = (PFN_NUMBER)(MmGetPhysicalAddress((PUCHAR)xvdd->sring + (i << PAGE_SHIFT)).QuadPart >> PAGE_SHIFT);
+        xvdd->sring_grefs[i] = XnGrantAccess(xvdd->handle, (ULONG)pfn, FALSE, INVALID_GRANT_REF, xvdd->grant_tag);
+        if (xvdd->sring_grefs[i] == INVALID_GRANT_REF)
+          break;
+      }
+      if (i != (1U << order)) {
+        while (i--) {
+          XnEndAccess(xvdd->handle, xvdd->sring_grefs[i], FALSE, xvdd->grant_tag);
+        }
+        ExFreePoolWithTag(xvdd->sring, XENVBD_POOL_TAG);
+        xvdd->sring = NULL;
+      }
+    }
+    if (!xvdd->sring) {
+      if (!order) {
+        FUNCTION_MSG("Failed to allocate sring\n");
+        return STATUS_INSUFFICIENT_RESOURCES;
+      }
+      FUNCTION_MSG("Failed to allocate sring of order %d, trying a single page\n", order);
+      order = 0;
+    }
+  }
+  xvdd->ring_page_order = order;
+  SHARED_RING_INIT(xvdd->sring);
+  FRONT_RING_INIT(&xvdd->ring, xvdd->sring, PAGE_SIZE << order);
+
+  xvdd->shadow_count = RING_SIZE(&xvdd->ring);
+  xvdd->shadows = (blkif_shadow_t *)ExAllocatePoolWithTag(NonPagedPool, sizeof(blkif_shadow_t) * xvdd->shadow_count, XENVBD_POOL_TAG);
+  xvdd->shadow_free_list = (USHORT *)ExAllocatePoolWithTag(NonPagedPool, sizeof(USHORT) * xvdd->shadow_count, XENVBD_POOL_TAG);
+  if (!xvdd->shadows || !xvdd->shadow_free_list) {
+    FUNCTION_MSG("Failed to allocate %d shadows\n", xvdd->shadow_count);
+    XenVbd_FreeRing(xvdd);
+    return STATUS_INSUFFICIENT_RESOURCES;
+  }
+  RtlZeroMemory(xvdd->shadows, sizeof(blkif_shadow_t) * xvdd->shadow_count);
+  for (i = 0; i < xvdd->shadow_count; i++) {
+    xvdd->shadows[i].req.id = i;
+    xvdd->shadow_free_list[i] = (USHORT)i;
+  }
+  xvdd->shadow_free = (USHORT)xvdd->shadow_count;
+  xvdd->rsp_event_distance = 1;
+  xvdd->rsp_event_time.QuadPart = 0;
+  FUNCTION_MSG("ring-page-order = %d, shadows = %d\n", order, xvdd->shadow_count);
+  return STATUS_SUCCESS;
+}
+
 static NTSTATUS
 XenVbd_Connect(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend) {
   BOOLEAN qemu_hide_filter = FALSE;
@@ -25,8 +251,10 @@ XenVbd_Connect(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend) {
   //BOOLEAN active = FALSE;
   NTSTATUS status;
   PCHAR mode;
-  PCHAR uuid;
-  PFN_NUMBER pfn;
+  CHAR ring_ref_path[XENVBD_MAX_RING_PAGES][16];
+  XN_XENSTORE_OP ops[4 + XENVBD_MAX_RING_PAGES];
+  ULONG count;
+  ULONG i;
 
   FUNCTION_ENTER();
   
@@ -42,16 +270,6 @@ XenVbd_Connect(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend) {
       return STATUS_UNSUCCESSFUL;
     }
   }
-  xvdd->sring = (blkif_sring_t *)ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, XENVBD_POOL_TAG);
-  if (!xvdd->sring) {
-    FUNCTION_MSG("Failed to allocate sring\n");
-    return STATUS_UNSUCCESSFUL;
-  }
-  pfn = (PFN_NUMBER)(MmGetPhysicalAddress(xvdd->sring).QuadPart >> PAGE_SHIFT);
-  xvdd->sring_gref = XnGrantAccess(xvdd->handle, (ULONG)pfn, FALSE, INVALID_GRANT_REF, xvdd->grant_tag);
-  SHARED_RING_INIT(xvdd->sring);
-  FRONT_RING_INIT(&xvdd->ring, xvdd->sring, PAGE_SIZE);
-
   while (xvdd->backend_state != XenbusStateInitialising &&
     xvdd->backend_state != XenbusStateInitWait &&
     xvdd->backend_state != XenbusStateInitialised &&
@@ -80,11 +298,55 @@ XenVbd_Connect(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend) {
     xvdd->device_state = DEVICE_STATE_INACTIVE;
     return STATUS_SUCCESS;
   }
+  /* page aligned because it is a whole page from NonPagedPool. Nothing is granted from it until a WRITE SAME is
+     put on the ring, so one left over from a hibernate that never completed can be used again */
+  if (!xvdd->write_same_buffer) {
+    xvdd->write_same_buffer = (PUCHAR)ExAllocatePoolWithTag(NonPagedPool, PAGE_SIZE, XENVBD_POOL_TAG);
+    if (!xvdd->write_same_buffer) {
+      FUNCTION_MSG("Failed to allocate write_same_buffer\n");
+      if (!suspend) {
+        XnCloseDevice(xvdd->handle);
+      }
+      return STATUS_UNSUCCESSFUL;
+    }
+  }
+  /* nothing is in flight while disconnected */
+  xvdd->write_same_refs = 0;
+  interval_tree_init(&xvdd->write_tree);
+  /* max-ring-page-order is there by the time the backend gets to InitWait */
+  if (!NT_SUCCESS(XenVbd_AllocateRing(xvdd))) {
+    ExFreePoolWithTag(xvdd->write_same_buffer, XENVBD_POOL_TAG);
+    xvdd->write_same_buffer = NULL;
+    if (!suspend) {
+      XnCloseDevice(xvdd->handle);
+    }
+    return STATUS_UNSUCCESSFUL;
+  }
+  XenVbd_AllocateBounceBuffers(xvdd);
+  XenVbd_AllocateGrefReserve(xvdd);
+  XenVbd_AllocateReadCache(xvdd);
+  KeQueryPerformanceCounter((PLARGE_INTEGER)&xvdd->performance_frequency);
+  /* KeQueryTimeIncrement is the longest clock tick, in 100ns units */
+  xvdd->completion_latency_ceiling = max(XENVBD_COMPLETION_LATENCY_CEILING_MIN, KeQueryTimeIncrement() / 10);
+  FUNCTION_MSG("completion latency ceiling = %dus\n", xvdd->completion_latency_ceiling);
   status = XnBindEvent(xvdd->handle, &xvdd->event_channel, XenVbd_HandleEventDIRQL, xvdd);
-  status = XnWriteInt32(xvdd->handle, XN_BASE_FRONTEND, "event-channel", xvdd->event_channel);
-  status = XnWriteInt32(xvdd->handle, XN_BASE_FRONTEND, "ring-ref", xvdd->sring_gref);
-  status = XnWriteString(xvdd->handle, XN_BASE_FRONTEND, "protocol", ABI_PROTOCOL);
-  status = XnWriteInt32(xvdd->handle, XN_BASE_FRONTEND, "state", XenbusStateInitialised);
+  /* write everything the backend needs in one burst. xenstored handles them in order so state still goes last */
+  count = 0;
+  XnInitXenstoreOp(&ops[count++], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "event-channel", xvdd->event_channel);
+  if (xvdd->ring_page_order) {
+    XnInitXenstoreOp(&ops[count++], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "ring-page-order", xvdd->ring_page_order);
+    for (i = 0; i < (1U << xvdd->ring_page_order); i++) {
+      RtlStringCbPrintfA(ring_ref_path[i], ARRAY_SIZE(ring_ref_path[i]), "ring-ref%d", i);
+      XnInitXenstoreOp(&ops[count++], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, ring_ref_path[i], xvdd->sring_grefs[i]);
+    }
+  } else {
+    /* backends without multi-page ring support only know ring-ref */
+    XnInitXenstoreOp(&ops[count++], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "ring-ref", xvdd->sring_grefs[0]);
+  }
+  XnInitXenstoreOp(&ops[count], XN_XENSTORE_WRITE_STRING, XN_BASE_FRONTEND, "protocol", 0);
+  ops[count++].value = ABI_PROTOCOL;
+  XnInitXenstoreOp(&ops[count++], XN_XENSTORE_WRITE_INT, XN_BASE_FRONTEND, "state", XenbusStateInitialised);
+  status = XnReadWriteMultiple(xvdd->handle, ops, count);
 
   while (xvdd->backend_state != XenbusStateConnected) {
     FUNCTION_MSG("waiting for XenbusStateConnected, backend_state = %d\n", xvdd->backend_state);
@@ -93,8 +355,21 @@ XenVbd_Connect(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend) {
 
   // TODO: some of this stuff should be read on first connect only, then only verified on resume
   xvdd->new_total_sectors = (ULONGLONG)-1L;
-  status = XnReadInt64(xvdd->handle, XN_BASE_BACKEND, "sectors", &xvdd->total_sectors);
-  status = XnReadInt32(xvdd->handle, XN_BASE_BACKEND, "sector-size", &xvdd->hw_bytes_per_sector);
+  /* read everything in one burst. A value that can't be read is left as it was, as XnReadInt32 does */
+  XnInitXenstoreOp(&ops[0], XN_XENSTORE_READ_INT, XN_BASE_BACKEND, "sectors", 0);
+  XnInitXenstoreOp(&ops[1], XN_XENSTORE_READ_INT, XN_BASE_BACKEND, "sector-size", 0);
+  XnInitXenstoreOp(&ops[2], XN_XENSTORE_READ_INT, XN_BASE_BACKEND, "feature-barrier", 0);
+  XnInitXenstoreOp(&ops[3], XN_XENSTORE_READ_INT, XN_BASE_BACKEND, "feature-discard", 0);
+  XnInitXenstoreOp(&ops[4], XN_XENSTORE_READ_INT, XN_BASE_BACKEND, "discard-granularity", 0);
+  XnInitXenstoreOp(&ops[5], XN_XENSTORE_READ_INT, XN_BASE_BACKEND, "discard-alignment", 0);
+  XnInitXenstoreOp(&ops[6], XN_XENSTORE_READ_INT, XN_BASE_BACKEND, "feature-flush-cache", 0);
+  XnInitXenstoreOp(&ops[7], XN_XENSTORE_READ_STRING, XN_BASE_BACKEND, "mode", 0);
+  XnInitXenstoreOp(&ops[8], XN_XENSTORE_READ_STRING, XN_BASE_FRONTEND, "device-type", 0);
+  status = XnReadWriteMultiple(xvdd->handle, ops, 9);
+  if (NT_SUCCESS(ops[0].status))
+    xvdd->total_sectors = ops[0].int_value;
+  if (NT_SUCCESS(ops[1].status))
+    xvdd->hw_bytes_per_sector = (ULONG)ops[1].int_value;
   if (xvdd->device_type == XENVBD_DEVICETYPE_CDROM) {
     /* CD/DVD drives must have bytes_per_sector = 2048. */
     xvdd->bytes_per_sector = 2048;
@@ -104,10 +379,27 @@ XenVbd_Connect(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend) {
   }
   /* for some reason total_sectors is measured in 512 byte sectors always, so correct this to be in bytes_per_sectors */
   xvdd->total_sectors /= xvdd->bytes_per_sector / 512;
-  status = XnReadInt32(xvdd->handle, XN_BASE_BACKEND, "feature-barrier", &xvdd->feature_barrier);
-  status = XnReadInt32(xvdd->handle, XN_BASE_BACKEND, "feature-discard", &xvdd->feature_discard);
-  status = XnReadInt32(xvdd->handle, XN_BASE_BACKEND, "feature-flush-cache", &xvdd->feature_flush_cache);
-  status = XnReadString(xvdd->handle, XN_BASE_BACKEND, "mode", &mode);
+  if (NT_SUCCESS(ops[2].status))
+    xvdd->feature_barrier = (ULONG)ops[2].int_value;
+  xvdd->feature_discard = 0;
+  if (NT_SUCCESS(ops[3].status))
+    xvdd->feature_discard = (ULONG)ops[3].int_value;
+  if (xvdd->feature_discard) {
+    /* granularity defaults to the physical block size if the backend doesn't tell us */
+    xvdd->discard_granularity = xvdd->hw_bytes_per_sector;
+    xvdd->discard_alignment = 0;
+    if (NT_SUCCESS(ops[4].status))
+      xvdd->discard_granularity = (ULONG)ops[4].int_value;
+    if (NT_SUCCESS(ops[5].status))
+      xvdd->discard_alignment = (ULONG)ops[5].int_value;
+    if (xvdd->discard_granularity < xvdd->bytes_per_sector) {
+      xvdd->discard_granularity = xvdd->bytes_per_sector;
+    }
+    FUNCTION_MSG("discard-granularity = %d, discard-alignment = %d\n", xvdd->discard_granularity, xvdd->discard_alignment);
+  }
+  if (NT_SUCCESS(ops[6].status))
+    xvdd->feature_flush_cache = (ULONG)ops[6].int_value;
+  mode = NT_SUCCESS(ops[7].status) ? ops[7].value : "";
   if (strncmp(mode, "r", 1) == 0) {
     FUNCTION_MSG("mode = r\n");
     xvdd->device_mode = XENVBD_DEVICEMODE_READ;
@@ -118,10 +410,11 @@ XenVbd_Connect(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend) {
     FUNCTION_MSG("mode = unknown\n");
     xvdd->device_mode = XENVBD_DEVICEMODE_UNKNOWN;
   }
-  XnFreeMem(xvdd->handle, mode);
+  if (NT_SUCCESS(ops[7].status))
+    XnFreeMem(xvdd->handle, ops[7].value);
 
   // read device-type
-  status = XnReadString(xvdd->handle, XN_BASE_FRONTEND, "device-type", &device_type);
+  device_type = NT_SUCCESS(ops[8].status) ? ops[8].value : "";
   if (strcmp(device_type, "disk") == 0) {
     FUNCTION_MSG("device-type = Disk\n");    
     xvdd->device_type = XENVBD_DEVICETYPE_DISK;
@@ -133,15 +426,13 @@ XenVbd_Connect(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend) {
     xvdd->device_type = XENVBD_DEVICETYPE_UNKNOWN;
   }
 
-  status = XnReadString(xvdd->handle, XN_BASE_FRONTEND, "device-type", &uuid);
-  if (status == STATUS_SUCCESS) {
-    RtlStringCbCopyA(xvdd->serial_number, ARRAY_SIZE(xvdd->serial_number), uuid);
-    XnFreeMem(xvdd->handle, uuid);
+  if (NT_SUCCESS(ops[8].status)) {
+    RtlStringCbCopyA(xvdd->serial_number, ARRAY_SIZE(xvdd->serial_number), device_type);
+    XnFreeMem(xvdd->handle, ops[8].value);
   } else {
     RtlStringCbCopyA(xvdd->serial_number, ARRAY_SIZE(xvdd->serial_number), "        ");
   }  
 
-  XnFreeMem(xvdd->handle, device_type);
   status = XnWriteInt32(xvdd->handle, XN_BASE_FRONTEND, "state", XenbusStateConnected);
 
   if (xvdd->device_type == XENVBD_DEVICETYPE_UNKNOWN
@@ -163,6 +454,9 @@ static NTSTATUS
 XenVbd_Disconnect(PVOID DeviceExtension, BOOLEAN suspend) {
   NTSTATUS status;
   PXENVBD_DEVICE_DATA xvdd = (PXENVBD_DEVICE_DATA)DeviceExtension;
+  #ifdef _NTSTORPORT_
+  STOR_LOCK_HANDLE lock_handle;
+  #endif
 
   if (xvdd->device_state == DEVICE_STATE_INACTIVE) {
     /* state stays INACTIVE */
@@ -188,8 +482,31 @@ XenVbd_Disconnect(PVOID DeviceExtension, BOOLEAN suspend) {
     KeWaitForSingleObject(&xvdd->backend_event, Executive, KernelMode, FALSE, NULL);
   }
   XnUnbindEvent(xvdd->handle, xvdd->event_channel);
-  XnEndAccess(xvdd->handle, xvdd->sring_gref, FALSE, xvdd->grant_tag);
-  ExFreePoolWithTag(xvdd->sring, XENVBD_POOL_TAG);
+  #ifdef _NTSTORPORT_
+  /* HwStartIo and the dpc still run HandleEvent, which looks at the ring until the state says it is gone */
+  StorPortAcquireSpinLock(xvdd, StartIoLock, NULL, &lock_handle);
+  xvdd->device_state = DEVICE_STATE_DISCONNECTED;
+  StorPortReleaseSpinLock(xvdd, &lock_handle);
+  #endif
+  XenVbd_FreeRing(xvdd);
+  ExFreePoolWithTag(xvdd->write_same_buffer, XENVBD_POOL_TAG);
+  xvdd->write_same_buffer = NULL;
+  FUNCTION_MSG("aligned requests = %I64d (%I64d bytes), unaligned requests = %I64d (%I64d bytes), unaligned deferred = %I64d\n",
+    xvdd->stats.aligned_requests, xvdd->stats.aligned_bytes, xvdd->stats.unaligned_requests, xvdd->stats.unaligned_bytes, xvdd->stats.unaligned_deferred);
+  FUNCTION_MSG("gref reserve used = %I64d, gref waits = %I64d, shadow waits = %I64d, retry timer calls = %I64d\n",
+    xvdd->stats.gref_reserve_used, xvdd->stats.gref_waits, xvdd->stats.shadow_waits, xvdd->stats.retry_timer_calls);
+  FUNCTION_MSG("events = %I64d, responses = %I64d, ring pushes = %I64d, notifies = %I64d, requeues = %I64d\n",
+    xvdd->stats.events, xvdd->stats.responses, xvdd->stats.ring_pushes, xvdd->stats.notifies, xvdd->stats.requeues);
+  FUNCTION_MSG("moderation timeouts = %I64d, completion budget exhausted = %I64d, final rsp_event distance = %d\n",
+    xvdd->stats.moderation_timeouts, xvdd->stats.budget_exhausted, xvdd->rsp_event_distance);
+  FUNCTION_MSG("merged srbs = %I64d, merged requests = %I64d\n", xvdd->stats.merged_srbs, xvdd->stats.merged_requests);
+  FUNCTION_MSG("read cache hits = %I64d, misses = %I64d, read-ahead requests = %I64d\n",
+    xvdd->stats.read_cache_hits, xvdd->stats.read_cache_misses, xvdd->stats.read_ahead_requests);
+  FUNCTION_MSG("event srbs = %I64d, event srbs skipped = %I64d, max event latency = %I64dus\n",
+    xvdd->stats.event_requests, xvdd->stats.event_requests_skipped, xvdd->stats.event_latency_max_us);
+  XenVbd_FreeReadCache(xvdd);
+  XenVbd_FreeBounceBuffers(xvdd);
+  XenVbd_FreeGrefReserve(xvdd);
 
   if (!suspend) {
     XnCloseDevice(xvdd->handle);
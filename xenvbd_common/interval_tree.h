@@ -0,0 +1,194 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+An AVL tree of [start, end) sector ranges, ordered by start and augmented
+with the largest end in each subtree so that an overlapping range can be
+found in O(log n). Nodes are embedded in the caller's structures and nothing
+is allocated. No locking - the caller serialises access.
+*/
+
+typedef struct interval_node {
+  struct interval_node *left;
+  struct interval_node *right;
+  ULONGLONG start; /* first sector */
+  ULONGLONG end; /* one past the last sector */
+  ULONGLONG max_end; /* largest end in this subtree */
+  LONG height;
+} interval_node_t;
+
+typedef struct {
+  interval_node_t *root;
+  ULONG count;
+} interval_tree_t;
+
+static __inline VOID
+interval_tree_init(interval_tree_t *tree) {
+  tree->root = NULL;
+  tree->count = 0;
+}
+
+static __inline LONG
+interval_node_height(interval_node_t *node) {
+  return node ? node->height : 0;
+}
+
+/* recalculate height and max_end from the children */
+static __inline VOID
+interval_node_update(interval_node_t *node) {
+  LONG left_height = interval_node_height(node->left);
+  LONG right_height = interval_node_height(node->right);
+
+  node->height = 1 + max(left_height, right_height);
+  node->max_end = node->end;
+  if (node->left && node->left->max_end > node->max_end)
+    node->max_end = node->left->max_end;
+  if (node->right && node->right->max_end > node->max_end)
+    node->max_end = node->right->max_end;
+}
+
+static __inline interval_node_t *
+interval_node_rotate_right(interval_node_t *node) {
+  interval_node_t *pivot = node->left;
+
+  node->left = pivot->right;
+  pivot->right = node;
+  interval_node_update(node);
+  interval_node_update(pivot);
+  return pivot;
+}
+
+static __inline interval_node_t *
+interval_node_rotate_left(interval_node_t *node) {
+  interval_node_t *pivot = node->right;
+
+  node->right = pivot->left;
+  pivot->left = node;
+  interval_node_update(node);
+  interval_node_update(pivot);
+  return pivot;
+}
+
+/* returns the new root of the subtree */
+static interval_node_t *
+interval_node_balance(interval_node_t *node) {
+  LONG balance;
+
+  interval_node_update(node);
+  balance = interval_node_height(node->left) - interval_node_height(node->right);
+  if (balance > 1) {
+    if (interval_node_height(node->left->left) < interval_node_height(node->left->right))
+      node->left = interval_node_rotate_left(node->left);
+    return interval_node_rotate_right(node);
+  }
+  if (balance < -1) {
+    if (interval_node_height(node->right->right) < interval_node_height(node->right->left))
+      node->right = interval_node_rotate_right(node->right);
+    return interval_node_rotate_left(node);
+  }
+  return node;
+}
+
+/* nodes with the same start are ordered by address so every node has a unique position */
+static __inline BOOLEAN
+interval_node_before(interval_node_t *a, interval_node_t *b) {
+  if (a->start != b->start)
+    return (BOOLEAN)(a->start < b->start);
+  return (BOOLEAN)((ULONG_PTR)a < (ULONG_PTR)b);
+}
+
+/* the tree is never more than about 1.44 * log2(count) deep so the recursion is shallow */
+static interval_node_t *
+interval_node_insert(interval_node_t *root, interval_node_t *node) {
+  if (!root)
+    return node;
+  if (interval_node_before(node, root))
+    root->left = interval_node_insert(root->left, node);
+  else
+    root->right = interval_node_insert(root->right, node);
+  return interval_node_balance(root);
+}
+
+/* unlinks the leftmost node of the subtree into *min and returns the new root of the subtree */
+static interval_node_t *
+interval_node_remove_min(interval_node_t *root, interval_node_t **min) {
+  if (!root->left) {
+    *min = root;
+    return root->right;
+  }
+  root->left = interval_node_remove_min(root->left, min);
+  return interval_node_balance(root);
+}
+
+static interval_node_t *
+interval_node_remove(interval_node_t *root, interval_node_t *node) {
+  interval_node_t *successor;
+
+  if (!root)
+    return NULL; /* not in the tree */
+  if (root != node) {
+    if (interval_node_before(node, root))
+      root->left = interval_node_remove(root->left, node);
+    else
+      root->right = interval_node_remove(root->right, node);
+    return interval_node_balance(root);
+  }
+  if (!node->left)
+    return node->right;
+  if (!node->right)
+    return node->left;
+  node->right = interval_node_remove_min(node->right, &successor);
+  successor->left = node->left;
+  successor->right = node->right;
+  return interval_node_balance(successor);
+}
+
+/* start and end must already be set in node */
+static __inline VOID
+interval_tree_insert(interval_tree_t *tree, interval_node_t *node) {
+  node->left = NULL;
+  node->right = NULL;
+  node->max_end = node->end;
+  node->height = 1;
+  tree->root = interval_node_insert(tree->root, node);
+  tree->count++;
+}
+
+static __inline VOID
+interval_tree_remove(interval_tree_t *tree, interval_node_t *node) {
+  tree->root = interval_node_remove(tree->root, node);
+  tree->count--;
+}
+
+/* returns a node overlapping [start, end), or NULL if there is none */
+static __inline interval_node_t *
+interval_tree_find_overlap(interval_tree_t *tree, ULONGLONG start, ULONGLONG end) {
+  interval_node_t *node = tree->root;
+
+  while (node) {
+    if (node->start < end && start < node->end)
+      return node;
+    /* if anything overlaps and the left subtree reaches past start then something in the left subtree overlaps */
+    if (node->left && node->left->max_end > start)
+      node = node->left;
+    else
+      node = node->right;
+  }
+  return NULL;
+}
@@ -0,0 +1,181 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+
+/*
+A fixed size cache of disk pages (PAGE_SIZE bytes, aligned on the disk to
+PAGE_SIZE) looked up through a small hash and recycled least recently used
+first. Page and data storage are supplied by the caller and nothing is
+allocated here. A page is FREE, VALID (hashed and on the lru list) or
+PENDING (owned by the caller, eg while a read-ahead is in flight). Every
+invalidation bumps generation so that a caller can tell whether data read
+from the disk might be older than a write it raced with. No locking - the
+caller serialises access.
+*/
+
+#define READ_CACHE_HASH_SIZE 256 /* must be a power of 2 */
+#define READ_CACHE_SECTORS_PER_PAGE (PAGE_SIZE / 512)
+
+#define READ_CACHE_PAGE_FREE    0
+#define READ_CACHE_PAGE_VALID   1
+#define READ_CACHE_PAGE_PENDING 2
+
+typedef struct read_cache_page {
+  LIST_ENTRY list_entry; /* on lru_list when VALID, free_list when FREE */
+  struct read_cache_page *next; /* hash chain when VALID, free for the caller to use when PENDING */
+  ULONGLONG page; /* disk offset / PAGE_SIZE */
+  PUCHAR data;
+  ULONG state;
+} read_cache_page_t;
+
+typedef struct {
+  read_cache_page_t *pages;
+  ULONG page_count; /* 0 if the cache is disabled */
+  read_cache_page_t *hash[READ_CACHE_HASH_SIZE];
+  LIST_ENTRY lru_list; /* least recently used at the head */
+  LIST_ENTRY free_list;
+  ULONG generation;
+} read_cache_t;
+
+/* data is page_count * PAGE_SIZE bytes */
+static __inline VOID
+read_cache_init(read_cache_t *cache, read_cache_page_t *pages, PUCHAR data, ULONG page_count) {
+  ULONG i;
+
+  RtlZeroMemory(cache, sizeof(read_cache_t));
+  InitializeListHead(&cache->lru_list);
+  InitializeListHead(&cache->free_list);
+  cache->pages = pages;
+  cache->page_count = page_count;
+  for (i = 0; i < page_count; i++) {
+    pages[i].data = data + i * PAGE_SIZE;
+    pages[i].state = READ_CACHE_PAGE_FREE;
+    pages[i].next = NULL;
+    InsertTailList(&cache->free_list, &pages[i].list_entry);
+  }
+}
+
+static __inline ULONG
+read_cache_hash(ULONGLONG page) {
+  return (ULONG)page & (READ_CACHE_HASH_SIZE - 1);
+}
+
+/* returns the VALID copy of page, or NULL */
+static __inline read_cache_page_t *
+read_cache_find(read_cache_t *cache, ULONGLONG page) {
+  read_cache_page_t *p;
+
+  for (p = cache->hash[read_cache_hash(page)]; p; p = p->next) {
+    if (p->page == page)
+      return p;
+  }
+  return NULL;
+}
+
+/* marks p as most recently used */
+static __inline VOID
+read_cache_touch(read_cache_t *cache, read_cache_page_t *p) {
+  RemoveEntryList(&p->list_entry);
+  InsertTailList(&cache->lru_list, &p->list_entry);
+}
+
+/* unhashes a VALID page and puts it on the free list */
+static VOID
+read_cache_drop(read_cache_t *cache, read_cache_page_t *p) {
+  read_cache_page_t **pp;
+
+  for (pp = &cache->hash[read_cache_hash(p->page)]; *pp != p; pp = &(*pp)->next);
+  *pp = p->next;
+  p->next = NULL;
+  RemoveEntryList(&p->list_entry);
+  p->state = READ_CACHE_PAGE_FREE;
+  InsertTailList(&cache->free_list, &p->list_entry);
+}
+
+/* returns a page for the caller to fill, recycling the least recently used VALID page if none are free. NULL if every page is PENDING */
+static __inline read_cache_page_t *
+read_cache_get_page(read_cache_t *cache) {
+  read_cache_page_t *p;
+
+  if (IsListEmpty(&cache->free_list)) {
+    if (IsListEmpty(&cache->lru_list))
+      return NULL;
+    read_cache_drop(cache, CONTAINING_RECORD(cache->lru_list.Flink, read_cache_page_t, list_entry));
+  }
+  p = CONTAINING_RECORD(RemoveHeadList(&cache->free_list), read_cache_page_t, list_entry);
+  p->state = READ_CACHE_PAGE_PENDING;
+  p->next = NULL;
+  return p;
+}
+
+/* gives back a PENDING page without caching it */
+static __inline VOID
+read_cache_put_page(read_cache_t *cache, read_cache_page_t *p) {
+  XN_ASSERT(p->state == READ_CACHE_PAGE_PENDING);
+  p->next = NULL;
+  p->state = READ_CACHE_PAGE_FREE;
+  InsertTailList(&cache->free_list, &p->list_entry);
+}
+
+/* makes a PENDING page VALID as the contents of page, replacing any older copy */
+static __inline VOID
+read_cache_insert(read_cache_t *cache, read_cache_page_t *p, ULONGLONG page) {
+  read_cache_page_t *old;
+
+  XN_ASSERT(p->state == READ_CACHE_PAGE_PENDING);
+  old = read_cache_find(cache, page);
+  if (old)
+    read_cache_drop(cache, old);
+  p->page = page;
+  p->state = READ_CACHE_PAGE_VALID;
+  p->next = cache->hash[read_cache_hash(page)];
+  cache->hash[read_cache_hash(page)] = p;
+  InsertTailList(&cache->lru_list, &p->list_entry);
+}
+
+/* drops every page overlapping [start, end) 512 byte sectors */
+static VOID
+read_cache_invalidate(read_cache_t *cache, ULONGLONG start, ULONGLONG end) {
+  ULONGLONG first = start / READ_CACHE_SECTORS_PER_PAGE;
+  ULONGLONG last = (end + READ_CACHE_SECTORS_PER_PAGE - 1) / READ_CACHE_SECTORS_PER_PAGE;
+  ULONGLONG page;
+  read_cache_page_t *p;
+  ULONG i;
+
+  cache->generation++;
+  if (last - first > cache->page_count) {
+    /* cheaper to look at every page than every page number in the range (eg a big UNMAP) */
+    for (i = 0; i < cache->page_count; i++) {
+      p = &cache->pages[i];
+      if (p->state == READ_CACHE_PAGE_VALID && p->page >= first && p->page < last)
+        read_cache_drop(cache, p);
+    }
+    return;
+  }
+  for (page = first; page < last; page++) {
+    p = read_cache_find(cache, page);
+    if (p)
+      read_cache_drop(cache, p);
+  }
+}
+
+static __inline VOID
+read_cache_invalidate_all(read_cache_t *cache) {
+  read_cache_invalidate(cache, 0, (ULONGLONG)-1 - READ_CACHE_SECTORS_PER_PAGE);
+}
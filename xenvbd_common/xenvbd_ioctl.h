@@ -0,0 +1,102 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* shared between xenvbd and user mode. Sent as IOCTL_SCSI_MINIPORT with an SRB_IO_CONTROL header */
+
+#ifndef _XENVBD_IOCTL_H
+#define _XENVBD_IOCTL_H
+
+#define XENVBD_STATS_SIG            "XENVBDST"
+#define XENVBD_STATS_GET_LATENCY    1 /* returns XENVBD_LATENCY_STATS */
+#define XENVBD_STATS_RESET_LATENCY  2
+#define XENVBD_STATS_GET_COUNTERS   3 /* returns XENVBD_DEVICE_STATS */
+#define XENVBD_STATS_RESET_COUNTERS 4
+
+#define XENVBD_LATENCY_STATS_VERSION 1
+
+#define XENVBD_LATENCY_OP_READ      0
+#define XENVBD_LATENCY_OP_WRITE     1
+#define XENVBD_LATENCY_OP_FLUSH     2
+#define XENVBD_LATENCY_OP_DISCARD   3
+#define XENVBD_LATENCY_OPS          4
+
+/* size of the ring request - up to 4K, 16K, 64K, and anything bigger */
+#define XENVBD_LATENCY_SIZES        4
+#define XENVBD_LATENCY_SIZE(bytes) ((bytes) <= 4096 ? 0 : (bytes) <= 16384 ? 1 : (bytes) <= 65536 ? 2 : 3)
+
+/* bucket 0 is under 32us, bucket n is from 2^(n+4)us up to the next bucket, the last bucket is everything over about half a second */
+#define XENVBD_LATENCY_BUCKETS      16
+#define XENVBD_LATENCY_BUCKET_MIN_US(bucket) ((bucket) ? (1UL << ((bucket) + 4)) : 0)
+
+typedef struct {
+  ULONG version;
+  ULONG reserved;
+  ULONGLONG count[XENVBD_LATENCY_OPS][XENVBD_LATENCY_SIZES][XENVBD_LATENCY_BUCKETS];
+  ULONGLONG total_us[XENVBD_LATENCY_OPS][XENVBD_LATENCY_SIZES];
+  ULONGLONG max_us[XENVBD_LATENCY_OPS][XENVBD_LATENCY_SIZES];
+} XENVBD_LATENCY_STATS;
+
+#define XENVBD_DEVICE_STATS_VERSION 2
+
+/* running totals since the device started or the last XENVBD_STATS_RESET_COUNTERS. Requests are ring requests, so a large srb counts more than once */
+typedef struct {
+  ULONG version;
+  ULONG reserved;
+  ULONGLONG requests[XENVBD_LATENCY_OPS]; /* indexed by XENVBD_LATENCY_OP_xxx */
+  ULONGLONG sectors[XENVBD_LATENCY_OPS]; /* 512 byte sectors */
+  ULONGLONG segments; /* read and write segments. Divide by read and write requests for segments per request */
+  ULONGLONG responses;
+  ULONGLONG events; /* event channel interrupts from the backend */
+  ULONGLONG ring_pushes; /* times new requests were made visible to the backend */
+  ULONGLONG notifies; /* pushes that needed the backend to be notified */
+  ULONGLONG requeues; /* times the srb queue stopped because the srb at its head couldn't go on the ring */
+  ULONGLONG moderation_timeouts; /* times responses held back by rsp_event had to be collected by the timer */
+  ULONGLONG budget_exhausted; /* times responses were left for another dpc */
+  ULONGLONG shadow_waits; /* times the ring was full with srbs still queued */
+  ULONGLONG gref_waits; /* times an srb had to wait for grefs */
+  ULONGLONG gref_reserve_used; /* grants that had to come from the per device reserve */
+  ULONGLONG retry_timer_calls; /* times the queue stalled with nothing on the ring */
+  ULONGLONG aligned_requests;
+  ULONGLONG aligned_bytes;
+  ULONGLONG unaligned_requests;
+  ULONGLONG unaligned_bytes;
+  ULONGLONG bounce_requests; /* unaligned requests that used a pre-granted bounce buffer */
+  ULONGLONG unaligned_deferred; /* unaligned requests that had to wait for a bounce buffer */
+  ULONGLONG merged_srbs; /* srbs that went on the ring as part of another srb's request */
+  ULONGLONG merged_requests; /* ring requests carrying more than one srb */
+  ULONGLONG read_cache_hits;
+  ULONGLONG read_cache_misses;
+  ULONGLONG read_ahead_requests;
+  ULONGLONG event_latency[XENVBD_LATENCY_BUCKETS]; /* event interrupt to HandleEvent, bucketed like XENVBD_LATENCY_STATS */
+  ULONGLONG event_latency_total_us;
+  ULONGLONG event_latency_max_us;
+  ULONGLONG event_requests; /* XENVBD_CONTROL_EVENT srbs sent by the filter (scsiport only) */
+  ULONGLONG event_requests_skipped; /* events the miniport had already picked up, so no srb was sent (scsiport only) */
+} XENVBD_DEVICE_STATS;
+
+static __inline ULONG
+XenVbd_LatencyBucket(ULONGLONG us) {
+  ULONG bucket = 0;
+
+  for (us >>= 5; us && bucket < XENVBD_LATENCY_BUCKETS - 1; us >>= 1)
+    bucket++;
+  return bucket;
+}
+
+#endif
@@ -171,24 +171,22 @@ XenVbd_SendEventComplete(WDFREQUEST request, WDFIOTARGET target, PWDF_REQUEST_CO
   PXENVBD_FILTER_DATA xvfd = GetXvfd(device);
   NTSTATUS status;
   PSCSI_REQUEST_BLOCK srb = context;
-  LARGE_INTEGER systemtime;
+  LARGE_INTEGER now;
   ULONGLONG elapsed;
 
   UNREFERENCED_PARAMETER(params);
-  UNREFERENCED_PARAMETER(context);
 
   status = WdfRequestGetStatus(request);
   if (status != 0 || srb->SrbStatus != SRB_STATUS_SUCCESS) {
     FUNCTION_MSG("Request Status = %08x, SRB Status = %08x\n", status, srb->SrbStatus);
   }
-  KeQuerySystemTime(&systemtime);
-  elapsed = systemtime.QuadPart - ((PLARGE_INTEGER)((PUCHAR)context + sizeof(SCSI_REQUEST_BLOCK) + sizeof(SRB_IO_CONTROL)))->QuadPart;
-  elapsed = elapsed / 10000; // now in ms
-  if (elapsed > 1000) {
-    FUNCTION_MSG("Event took %d ms\n", (ULONG)elapsed);
+  if (xvfd->xvdd.performance_frequency) {
+    now = KeQueryPerformanceCounter(NULL);
+    elapsed = (ULONGLONG)(now.QuadPart - xvfd->event_sent_time.QuadPart) * 1000 / xvfd->xvdd.performance_frequency; // ms
+    if (elapsed > 1000) {
+      FUNCTION_MSG("Event took %d ms\n", (ULONG)elapsed);
+    }
   }
-  ExFreePoolWithTag(context, XENVBD_POOL_TAG);
-  WdfObjectDelete(request);
 
   for (;;) {
     if (InterlockedCompareExchange(&xvfd->event_state, 0, 1) == 1) {
@@ -197,9 +195,13 @@ XenVbd_SendEventComplete(WDFREQUEST request, WDFIOTARGET target, PWDF_REQUEST_CO
     }
     if (InterlockedCompareExchange(&xvfd->event_state, 1, 2) == 2) {
       /* there was a pending event, and we set the flag back to outstanding */
-      //FUNCTION_MSG("sending pended event\n");
-      XenVbd_SendEvent(device);
-      break;
+      if (xvfd->xvdd.event_pending) {
+        XenVbd_SendEvent(device);
+        break;
+      }
+      /* the miniport already got to the ring from StartIo or its timer. Go round again to clear the outstanding flag */
+      InterlockedIncrement64((volatile LONG64 *)&xvfd->xvdd.stats.event_requests_skipped);
+      continue;
     }
     /* event_state changed while we were looking at it, go round again */
   }
@@ -208,22 +210,17 @@ XenVbd_SendEventComplete(WDFREQUEST request, WDFIOTARGET target, PWDF_REQUEST_CO
 static VOID
 XenVbd_SendEvent(WDFDEVICE device) {
   PXENVBD_FILTER_DATA xvfd = GetXvfd(device);
-  NTSTATUS status;
-  WDFREQUEST request;
+  WDFREQUEST request = xvfd->event_request;
+  WDF_REQUEST_REUSE_PARAMS reuse_params;
   WDF_REQUEST_SEND_OPTIONS send_options;
   IO_STACK_LOCATION stack;
-  PUCHAR buf;
+  PUCHAR buf = xvfd->event_buf;
   PSCSI_REQUEST_BLOCK srb;
   PSRB_IO_CONTROL sic;
 
-  status = WdfRequestCreate(WDF_NO_OBJECT_ATTRIBUTES, xvfd->wdf_target, &request);
-  if (status != STATUS_SUCCESS) {
-    FUNCTION_MSG("WdfRequestCreate failed %08x\n", status);
-    /* this is bad - event will be dropped */
-    return;
-  }
+  WDF_REQUEST_REUSE_PARAMS_INIT(&reuse_params, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+  WdfRequestReuse(request, &reuse_params);
 
-  buf = ExAllocatePoolWithTag(NonPagedPool, sizeof(SCSI_REQUEST_BLOCK) + sizeof(SRB_IO_CONTROL) + sizeof(LARGE_INTEGER), XENVBD_POOL_TAG);
   RtlZeroMemory(buf, sizeof(SCSI_REQUEST_BLOCK) + sizeof(SRB_IO_CONTROL));
   srb = (PSCSI_REQUEST_BLOCK)(buf);
   sic = (PSRB_IO_CONTROL)(buf + sizeof(SCSI_REQUEST_BLOCK));
@@ -244,7 +241,8 @@ XenVbd_SendEvent(WDFDEVICE device) {
   sic->Timeout = (ULONG)-1;
   sic->ControlCode = XENVBD_CONTROL_EVENT;
   
-  KeQuerySystemTime((PLARGE_INTEGER)((PUCHAR)buf + sizeof(SCSI_REQUEST_BLOCK) + sizeof(SRB_IO_CONTROL)));
+  xvfd->event_sent_time = KeQueryPerformanceCounter(NULL);
+  InterlockedIncrement64((volatile LONG64 *)&xvfd->xvdd.stats.event_requests);
 
   RtlZeroMemory(&stack, sizeof(IO_STACK_LOCATION));
   stack.MajorFunction = IRP_MJ_SCSI;
@@ -257,6 +255,8 @@ XenVbd_SendEvent(WDFDEVICE device) {
   WDF_REQUEST_SEND_OPTIONS_INIT(&send_options, 0); //WDF_REQUEST_SEND_OPTION_IGNORE_TARGET_STATE);
   if (!WdfRequestSend(request, xvfd->wdf_target, &send_options)) {
     FUNCTION_MSG("Error sending request\n");
+    /* the completion routine won't run, so let the next event try again */
+    InterlockedExchange(&xvfd->event_state, 0);
   }
 }
 
@@ -265,6 +265,11 @@ XenVbd_EvtDpcEvent(WDFDPC dpc) {
   WDFDEVICE device = WdfDpcGetParentObject(dpc);
   PXENVBD_FILTER_DATA xvfd = GetXvfd(device);
 
+  if (!xvfd->xvdd.event_pending) {
+    /* StartIo or the timer has already been through the ring since the event was raised */
+    InterlockedIncrement64((volatile LONG64 *)&xvfd->xvdd.stats.event_requests_skipped);
+    return;
+  }
   for (;;) {
     if (InterlockedCompareExchange(&xvfd->event_state, 1, 0) == 0) {
       /* was no event outstanding, now there is */
@@ -284,6 +289,7 @@ static VOID
 XenVbd_HandleEventDIRQL(PVOID context) {
   PXENVBD_DEVICE_DATA xvdd = (PXENVBD_DEVICE_DATA)context;
   PXENVBD_FILTER_DATA xvfd = (PXENVBD_FILTER_DATA)xvdd->xvfd;
+  XenVbd_MarkEventPending(xvdd);
   WdfDpcEnqueue(xvfd->dpc);
 }
 
@@ -428,6 +434,7 @@ XenVbd_EvtDeviceAdd(WDFDRIVER driver, PWDFDEVICE_INIT device_init) {
   WDF_PNPPOWER_EVENT_CALLBACKS pnp_power_callbacks;
   WDF_DPC_CONFIG dpc_config;
   WDF_OBJECT_ATTRIBUTES oa;
+  WDFMEMORY event_memory;
   UCHAR pnp_minor_functions[] = { IRP_MN_START_DEVICE };
   UCHAR power_minor_functions[] = { IRP_MN_SET_POWER };
   
@@ -476,6 +483,26 @@ XenVbd_EvtDeviceAdd(WDFDRIVER driver, PWDFDEVICE_INIT device_init) {
   WDF_OBJECT_ATTRIBUTES_INIT(&oa);
   oa.ParentObject = device;
   status = WdfDpcCreate(&dpc_config, &oa, &xvfd->dpc);
+  if (!NT_SUCCESS(status)) {
+    FUNCTION_MSG("Error creating dpc 0x%x\n", status);
+    return status;
+  }
+
+  /* created up front so that an event can never be dropped for want of memory */
+  WDF_OBJECT_ATTRIBUTES_INIT(&oa);
+  oa.ParentObject = device;
+  status = WdfRequestCreate(&oa, xvfd->wdf_target, &xvfd->event_request);
+  if (!NT_SUCCESS(status)) {
+    FUNCTION_MSG("Error creating event request 0x%x\n", status);
+    return status;
+  }
+  WDF_OBJECT_ATTRIBUTES_INIT(&oa);
+  oa.ParentObject = device;
+  status = WdfMemoryCreate(&oa, NonPagedPool, XENVBD_POOL_TAG, sizeof(SCSI_REQUEST_BLOCK) + sizeof(SRB_IO_CONTROL), &event_memory, (PVOID *)&xvfd->event_buf);
+  if (!NT_SUCCESS(status)) {
+    FUNCTION_MSG("Error creating event buffer 0x%x\n", status);
+    return status;
+  }
 
   WdfDeviceSetSpecialFileSupport(device, WdfSpecialFilePaging, TRUE);
   WdfDeviceSetSpecialFileSupport(device, WdfSpecialFileHibernation, TRUE);
@@ -71,6 +71,10 @@ typedef struct {
   BOOLEAN hibernate_flag;
   /* event state 0 = no event outstanding, 1 = event outstanding, 2 = need event */
   LONG event_state;
+  /* only one event is ever outstanding so the request and srb are allocated once and reused */
+  WDFREQUEST event_request;
+  PUCHAR event_buf; /* SCSI_REQUEST_BLOCK followed by SRB_IO_CONTROL */
+  LARGE_INTEGER event_sent_time; /* performance counter when event_request was sent */
   
   XENVBD_DEVICE_DATA xvdd;
 } XENVBD_FILTER_DATA, *PXENVBD_FILTER_DATA;
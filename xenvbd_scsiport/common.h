@@ -23,9 +23,6 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #define XENVBD_CONTROL_EVENT       2
 
 
-#define MAX_SHADOW_ENTRIES  64
-#define SHADOW_ENTRIES min(MAX_SHADOW_ENTRIES, BLK_RING_SIZE)
-
 struct {
   /* filter data */
   PVOID xvfd;
@@ -39,7 +36,8 @@ struct {
   evtchn_port_t event_channel;
   blkif_front_ring_t ring;
   blkif_sring_t *sring;
-  grant_ref_t sring_gref; 
+  ULONG ring_page_order;
+  grant_ref_t sring_grefs[XENVBD_MAX_RING_PAGES];
   UCHAR last_sense_key;
   UCHAR last_additional_sense_code;
   UCHAR last_additional_sense_code_qualifier;
@@ -52,18 +50,44 @@ struct {
   ULONGLONG new_total_sectors;
   ULONG feature_flush_cache;
   ULONG feature_discard;
+  ULONG discard_granularity; /* in bytes */
+  ULONG discard_alignment; /* in bytes */
+  PUCHAR write_same_buffer; /* one page filled with the current WRITE SAME pattern */
+  ULONG write_same_refs; /* number of WRITE SAME srbs and reset WRITE SAME requests using write_same_buffer */
   ULONG feature_barrier;
   CHAR serial_number[64];
 
   /* miniport data */
   PVOID xvsd;
-  blkif_shadow_t shadows[MAX_SHADOW_ENTRIES];
-  USHORT shadow_free_list[MAX_SHADOW_ENTRIES];
+  blkif_shadow_t *shadows; /* one per ring slot, allocated with the ring on connect */
+  USHORT *shadow_free_list;
+  ULONG shadow_count;
   USHORT shadow_free;
   //USHORT shadow_min_free;
+  ULONG rsp_event_distance; /* most responses the backend may batch before an event. Not used in dump mode */
+  LARGE_INTEGER rsp_event_time; /* when rsp_event was last set with requests outstanding, 0 if it wasn't */
+  ULONG completion_latency_ceiling; /* longest a response should wait for rsp_event (us). At least one clock tick */
+  volatile LONG event_pending; /* set at DIRQL when the backend raises an event, cleared when HandleEvent looks at the ring */
+  LARGE_INTEGER event_time; /* performance counter when event_pending was set */
+  grant_ref_t dump_grefs[DUMP_MODE_SHADOWS][BLKIF_MAX_SEGMENTS_PER_REQUEST]; /* dump mode only. Each dump shadow's own grefs */
+  ULONG dump_shadow_count; /* shadows usable in dump mode, 0 if no grefs could be put aside */
   ULONG grant_tag;
   LIST_ENTRY srb_list;
+  interval_tree_t write_tree; /* sector ranges of write srbs with requests on the ring */
   BOOLEAN aligned_buffer_in_use;
   ULONG aligned_buffer_size;
   PVOID aligned_buffer;
+  bounce_buffer_t bounce_buffers[MAX_BOUNCE_BUFFERS]; /* used before aligned_buffer */
+  ULONG bounce_buffer_count;
+  grant_ref_t gref_reserve[GREF_RESERVE_ENTRIES];
+  ULONG gref_reserve_count;
+  read_cache_t read_cache;
+  read_cache_page_t *read_cache_pages;
+  PUCHAR read_cache_data;
+  ULONGLONG read_cache_next_sector; /* where the next read starts if reads are sequential */
+  ULONG read_cache_sequential; /* sequential reads in a row */
+  ULONGLONG read_ahead_next_sector; /* end of the last read-ahead */
+  XENVBD_DEVICE_STATS stats; /* updated with StartIoLock held, except events, and the filter's event_requests counts which it updates with interlocked ops */
+  ULONGLONG performance_frequency;
+  XENVBD_LATENCY_STATS latency_stats; /* ring request submit to response, not recorded in dump mode */
 } typedef XENVBD_DEVICE_DATA, *PXENVBD_DEVICE_DATA;
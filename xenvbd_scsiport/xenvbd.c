@@ -40,6 +40,8 @@ static IO_WORKITEM_ROUTINE XenVbd_DisconnectWorkItem;
 static VOID XenVbd_ProcessSrbList(PXENVBD_DEVICE_DATA xvdd);
 static BOOLEAN XenVbd_ResetBus(PXENVBD_DEVICE_DATA xvdd, ULONG PathId);
 static VOID XenVbd_CompleteDisconnect(PXENVBD_DEVICE_DATA xvdd);
+static VOID XenVbd_QueueRetry(PXENVBD_DEVICE_DATA xvdd, ULONG interval);
+static BOOLEAN XenVbd_QueueEvent(PXENVBD_DEVICE_DATA xvdd);
 
 static BOOLEAN dump_mode = FALSE;
 #define DUMP_MODE_ERROR_LIMIT 64
@@ -140,6 +142,11 @@ XenVbd_HwScsiFindAdapter(PVOID DeviceExtension, PVOID HwContext, PVOID BusInform
     xvsd->xvdd = xvdd;
     xvdd->xvsd = xvsd;
     xvdd->aligned_buffer = (PVOID)((ULONG_PTR)((PUCHAR)xvsd->aligned_buffer_data + sizeof(XENVBD_DEVICE_DATA) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+    /* the bounce buffers, gref reserve and read cache belong to the original xvdd. dump mode only uses aligned_buffer */
+    xvdd->bounce_buffer_count = 0;
+    xvdd->gref_reserve_count = 0;
+    xvdd->read_cache.page_count = 0;
+    xvdd->dump_shadow_count = 0;
     /* restore hypercall_stubs into dump_xenpci */
     XnSetHypercallStubs(xvsd->hypercall_stubs);
     if (xvsd->xvdd->device_state != DEVICE_STATE_ACTIVE) {
@@ -152,6 +159,7 @@ XenVbd_HwScsiFindAdapter(PVOID DeviceExtension, PVOID HwContext, PVOID BusInform
   FUNCTION_MSG("aligned_buffer = %p\n", xvdd->aligned_buffer);
 
   InitializeListHead(&xvdd->srb_list);
+  interval_tree_init(&xvdd->write_tree);
   xvdd->aligned_buffer_in_use = FALSE;
   /* align the buffer to PAGE_SIZE */
 
@@ -205,20 +213,23 @@ XenVbd_HwScsiInitialize(PVOID DeviceExtension) {
   FUNCTION_MSG("IRQL = %d\n", KeGetCurrentIrql());
   FUNCTION_MSG("dump_mode = %d\n", dump_mode);
   
+  if (!dump_mode) {
+    /* nothing */
+  } else {
+    xvdd->grant_tag = (ULONG)'DUMP';
+    XenVbd_ReserveDumpGrefs(xvdd);
+  }
+
   xvdd->shadow_free = 0;
-  memset(xvdd->shadows, 0, sizeof(blkif_shadow_t) * SHADOW_ENTRIES);
-  for (i = 0; i < SHADOW_ENTRIES; i++) {
+  memset(xvdd->shadows, 0, sizeof(blkif_shadow_t) * xvdd->shadow_count);
+  for (i = 0; i < xvdd->shadow_count; i++) {
     xvdd->shadows[i].req.id = i;
     /* make sure leftover real requests's are never confused with dump mode requests */
     if (dump_mode)
       xvdd->shadows[i].req.id |= SHADOW_ID_DUMP_FLAG;
-    put_shadow_on_freelist(xvdd, &xvdd->shadows[i]);
-  }
-
-  if (!dump_mode) {
-    /* nothing */
-  } else {
-    xvdd->grant_tag = (ULONG)'DUMP';
+    /* in dump mode only the shadows with their own grefs are used */
+    if (!dump_mode || !xvdd->dump_shadow_count || i < xvdd->dump_shadow_count)
+      put_shadow_on_freelist(xvdd, &xvdd->shadows[i]);
   }
   
   FUNCTION_EXIT();
@@ -255,20 +266,56 @@ XenVbd_CompleteDisconnect(PXENVBD_DEVICE_DATA xvdd) {
   }
 }
 
+/* srbs we accept before asking scsiport to hold off. Queued srbs beyond the ring are what requests get merged from.
+   2 tags are kept spare - 1 for EVENT and 1 for STOP/START */
+static ULONG
+XenVbd_MaxOutstanding(PXENVBD_DEVICE_DATA xvdd) {
+  if (!xvdd->shadow_count)
+    return 30;
+  return min(xvdd->shadow_count * 2, XENVBD_SCSIPORT_MAX_OUTSTANDING) - 2;
+}
+
+static VOID XenVbd_HwScsiTimer(PVOID DeviceExtension);
+
+/* only from StartIo or HwScsiTimer. Doesn't push back a timer that is already due sooner */
+static VOID
+XenVbd_SetTimer(PXENVBD_SCSIPORT_DATA xvsd, ULONG interval) {
+  if (xvsd->timer_interval && xvsd->timer_interval <= interval)
+    return;
+  xvsd->timer_interval = interval;
+  ScsiPortNotification(RequestTimerCall, xvsd, XenVbd_HwScsiTimer, interval);
+}
+
 static VOID
 XenVbd_HwScsiTimer(PVOID DeviceExtension) {
   PXENVBD_SCSIPORT_DATA xvsd = DeviceExtension;
   PXENVBD_DEVICE_DATA xvdd = (PXENVBD_DEVICE_DATA)xvsd->xvdd;
 
   //FUNCTION_MSG("HwScsiTimer\n");
+  xvsd->timer_interval = 0;
   XenVbd_HandleEvent(xvdd);
+  if (xvsd->outstanding < XenVbd_MaxOutstanding(xvdd)) {
+    /* completions here may have brought us back under the limit */
+    ScsiPortNotification(NextLuRequest, xvsd, 0, 0, 0);
+  }
   if (xvsd->outstanding) {
-    ScsiPortNotification(RequestTimerCall, xvsd, XenVbd_HwScsiTimer, 100000);
-  } else {
-    ScsiPortNotification(RequestTimerCall, xvsd, XenVbd_HwScsiTimer, 0);
+    XenVbd_SetTimer(xvsd, XENVBD_SCSIPORT_POLL_INTERVAL);
   }
 }
 
+/* called from HandleEvent, which for scsiport only runs from StartIo or HwScsiTimer */
+static VOID
+XenVbd_QueueRetry(PXENVBD_DEVICE_DATA xvdd, ULONG interval) {
+  XenVbd_SetTimer((PXENVBD_SCSIPORT_DATA)xvdd->xvsd, interval);
+}
+
+static BOOLEAN
+XenVbd_QueueEvent(PXENVBD_DEVICE_DATA xvdd) {
+  /* events arrive by way of the filter, so there is no dpc of our own to queue */
+  UNREFERENCED_PARAMETER(xvdd);
+  return FALSE;
+}
+
 static BOOLEAN
 XenVbd_HwScsiStartIo(PVOID DeviceExtension, PSCSI_REQUEST_BLOCK srb) {
   PXENVBD_SCSIPORT_DATA xvsd = DeviceExtension;
@@ -290,7 +337,7 @@ XenVbd_HwScsiStartIo(PVOID DeviceExtension, PSCSI_REQUEST_BLOCK srb) {
       ScsiPortNotification(RequestComplete, xvsd, srb);
       break;
     case XENVBD_CONTROL_STOP:
-      if (xvdd->shadow_free == SHADOW_ENTRIES) {
+      if (xvdd->shadow_free == xvdd->shadow_count) {
         srb->SrbStatus = SRB_STATUS_SUCCESS;
         ScsiPortNotification(RequestComplete, xvsd, srb);
         FUNCTION_MSG("CONTROL_STOP done\n");
@@ -319,16 +366,17 @@ XenVbd_HwScsiStartIo(PVOID DeviceExtension, PSCSI_REQUEST_BLOCK srb) {
   }
   /* HandleEvent also puts queued SRB's on the ring */
   XenVbd_HandleEvent(xvdd);
-  /* need 2 spare slots - 1 for EVENT and 1 for STOP/START */
-  if (xvsd->outstanding < 30) {
+  if (xvsd->outstanding < XenVbd_MaxOutstanding(xvdd)) {
     ScsiPortNotification(NextLuRequest, xvsd, 0, 0, 0);
   } else {
     ScsiPortNotification(NextRequest, xvsd);
   }
-  /* if there was an error returned by an SRB then the queue will freeze. Queue a timer to resolve this */
+  /* completions are driven by XENVBD_CONTROL_EVENT from the filter. The timer is only a backstop for when the queue
+     freezes after an error, and is left alone if already set rather than re-armed for every srb */
   if (xvsd->outstanding) {
-    ScsiPortNotification(RequestTimerCall, xvsd, XenVbd_HwScsiTimer, 100000);
-  } else {
+    XenVbd_SetTimer(xvsd, XENVBD_SCSIPORT_POLL_INTERVAL);
+  } else if (xvsd->timer_interval) {
+    xvsd->timer_interval = 0;
     ScsiPortNotification(RequestTimerCall, xvsd, XenVbd_HwScsiTimer, 0);
   }
   return TRUE;
@@ -360,7 +408,7 @@ XenVbd_HwScsiAdapterControl(PVOID DeviceExtension, SCSI_ADAPTER_CONTROL_TYPE Con
       break;
     }
     XN_ASSERT(IsListEmpty(&xvdd->srb_list));
-    //XN_ASSERT(xvdd->shadow_free == SHADOW_ENTRIES);
+    //XN_ASSERT(xvdd->shadow_free == xvdd->shadow_count);
     break;
   case ScsiRestartAdapter:
     FUNCTION_MSG("ScsiRestartAdapter\n");
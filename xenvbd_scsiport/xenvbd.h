@@ -63,19 +63,24 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "..\xenvbd_common\common.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
-#define BLK_RING_SIZE __RING_SIZE((blkif_sring_t *)0, PAGE_SIZE)
 
-#define SHADOW_ID_ID_MASK   0x03FF /* maximum of 1024 requests - currently use a maximum of 64 though */
+#define SHADOW_ID_ID_MASK   0x7FFF /* shadow_count is the ring size so is much less than this */
 #define SHADOW_ID_DUMP_FLAG 0x8000 /* indicates the request was generated by dump mode */
 
 /* if this is ever increased to more than 1 then we need a way of tracking it properly */
 #define DUMP_MODE_UNALIGNED_PAGES 1 /* only for unaligned buffer use */
 
+/* scsiport queue tags are a UCHAR */
+#define XENVBD_SCSIPORT_MAX_OUTSTANDING 254
+/* how often outstanding srbs are polled for in case an event was missed or the queue froze (us) */
+#define XENVBD_SCSIPORT_POLL_INTERVAL 100000
+
 #include "common.h"
 
 struct {
   PXENVBD_DEVICE_DATA xvdd;
   ULONG outstanding;
+  ULONG timer_interval; /* interval HwScsiTimer was last set for, 0 if it isn't set */
   PVOID hypercall_stubs;
   PSCSI_REQUEST_BLOCK stop_srb;
   /* this is the size of the buffer to allocate at the end of DeviceExtenstion. It includes an extra PAGE_SIZE-1 bytes to assure that we can always align to PAGE_SIZE */
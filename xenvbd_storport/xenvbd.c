@@ -45,6 +45,8 @@ static VOID XenVbd_DeviceCallback(PVOID context, ULONG callback_type, PVOID valu
 static VOID XenVbd_StopRing(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend);
 static VOID XenVbd_StartRing(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend);
 static VOID XenVbd_CompleteDisconnect(PXENVBD_DEVICE_DATA xvdd);
+static VOID XenVbd_QueueRetry(PXENVBD_DEVICE_DATA xvdd, ULONG interval);
+static BOOLEAN XenVbd_QueueEvent(PXENVBD_DEVICE_DATA xvdd);
 
 #define SxxxPortNotification(...) StorPortNotification(__VA_ARGS__)
 #define SxxxPortGetSystemAddress(xvdd, srb, system_address) StorPortGetSystemAddress(xvdd, srb, system_address)
@@ -54,8 +56,8 @@ static BOOLEAN dump_mode = FALSE;
 #define DUMP_MODE_ERROR_LIMIT 64
 static ULONG dump_mode_errors = 0;
 
-#include "..\xenvbd_common\common_miniport.h"
-#include "..\xenvbd_common\common_xen.h"
+#include "../xenvbd_common/common_miniport.h"
+#include "../xenvbd_common/common_xen.h"
 
 static VOID
 XenVbd_StopRing(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend) {
@@ -66,7 +68,8 @@ XenVbd_StopRing(PXENVBD_DEVICE_DATA xvdd, BOOLEAN suspend) {
 
   StorPortAcquireSpinLock(xvdd, StartIoLock, NULL, &lock_handle);
   xvdd->device_state = DEVICE_STATE_DISCONNECTING;
-  if (xvdd->shadow_free == SHADOW_ENTRIES) {
+  xvdd->closing_queued = (BOOLEAN)(xvdd->shadow_free == xvdd->shadow_count);
+  if (xvdd->shadow_free == xvdd->shadow_count) {
     FUNCTION_MSG("Ring already empty\n");
     /* nothing on the ring - okay to disconnect now */
     StorPortReleaseSpinLock(xvdd, &lock_handle);
@@ -112,6 +115,11 @@ XenVbd_ConnectWorkItem(PDEVICE_OBJECT device_object, PVOID context) {
 
 static VOID
 XenVbd_CompleteDisconnect(PXENVBD_DEVICE_DATA xvdd) {
+  /* HandleEvent calls this every time it finds the ring empty while disconnecting. A second Closing could be written
+     after the disconnect is over and the device is connected again */
+  if (xvdd->closing_queued)
+    return;
+  xvdd->closing_queued = TRUE;
   IoQueueWorkItem(xvdd->disconnect_workitem, XenVbd_DisconnectWorkItem, DelayedWorkQueue, xvdd);
 }
 
@@ -139,6 +147,7 @@ XenVbd_VirtualHwStorFindAdapter(PVOID DeviceExtension, PVOID HwContext, PVOID Bu
 
   RtlZeroMemory(xvdd, sizeof(XENVBD_DEVICE_DATA));
   InitializeListHead(&xvdd->srb_list);
+  interval_tree_init(&xvdd->write_tree);
   KeInitializeEvent(&xvdd->device_state_event, SynchronizationEvent, FALSE);
   KeInitializeEvent(&xvdd->backend_event, SynchronizationEvent, FALSE);
   xvdd->pdo = (PDEVICE_OBJECT)HwContext; // TODO: maybe should get PDO from FDO below? HwContext isn't really documented
@@ -220,10 +229,16 @@ XenVbd_HwStorFindAdapter(PVOID DeviceExtension, PVOID HwContext, PVOID BusInform
   /* make sure original xvdd is set to DISCONNECTED or resume will not work */
   ((PXENVBD_DEVICE_DATA)dump_data)->device_state = DEVICE_STATE_DISCONNECTED;
   InitializeListHead(&xvdd->srb_list);
+  interval_tree_init(&xvdd->write_tree);
   xvdd->aligned_buffer_in_use = FALSE;
   /* align the buffer to PAGE_SIZE */
   xvdd->aligned_buffer = (PVOID)((ULONG_PTR)((PUCHAR)xvdd->aligned_buffer_data + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
   xvdd->aligned_buffer_size = DUMP_MODE_UNALIGNED_PAGES * PAGE_SIZE;
+  /* the bounce buffers, gref reserve and read cache belong to the original xvdd. dump mode only uses aligned_buffer */
+  xvdd->bounce_buffer_count = 0;
+  xvdd->gref_reserve_count = 0;
+  xvdd->read_cache.page_count = 0;
+  xvdd->dump_shadow_count = 0;
   xvdd->grant_tag = (ULONG)'DUMP';
   FUNCTION_MSG("aligned_buffer_data = %p\n", xvdd->aligned_buffer_data);
   FUNCTION_MSG("aligned_buffer = %p\n", xvdd->aligned_buffer);
@@ -267,14 +282,18 @@ XenVbd_HwStorInitialize(PVOID DeviceExtension)
   FUNCTION_MSG("IRQL = %d\n", KeGetCurrentIrql());
   FUNCTION_MSG("dump_mode = %d\n", dump_mode);
   
+  if (dump_mode)
+    XenVbd_ReserveDumpGrefs(xvdd);
   xvdd->shadow_free = 0;
-  memset(xvdd->shadows, 0, sizeof(blkif_shadow_t) * SHADOW_ENTRIES);
-  for (i = 0; i < SHADOW_ENTRIES; i++) {
+  memset(xvdd->shadows, 0, sizeof(blkif_shadow_t) * xvdd->shadow_count);
+  for (i = 0; i < xvdd->shadow_count; i++) {
     xvdd->shadows[i].req.id = i;
     /* make sure leftover real requests's are never confused with dump mode requests */
     if (dump_mode)
       xvdd->shadows[i].req.id |= SHADOW_ID_DUMP_FLAG;
-    put_shadow_on_freelist(xvdd, &xvdd->shadows[i]);
+    /* in dump mode only the shadows with their own grefs are used */
+    if (!dump_mode || !xvdd->dump_shadow_count || i < xvdd->dump_shadow_count)
+      put_shadow_on_freelist(xvdd, &xvdd->shadows[i]);
   }
 
   FUNCTION_EXIT();
@@ -298,11 +317,36 @@ static VOID
 XenVbd_HandleEventDIRQL(PVOID DeviceExtension) {
   PXENVBD_DEVICE_DATA xvdd = DeviceExtension;
   //if (dump_mode) FUNCTION_ENTER();
+  XenVbd_MarkEventPending(xvdd);
   StorPortIssueDpc(DeviceExtension, &xvdd->dpc, NULL, NULL);
   //if (dump_mode) FUNCTION_EXIT();
   return;
 }
 
+static VOID
+XenVbd_HwStorTimer(PVOID DeviceExtension) {
+  PXENVBD_DEVICE_DATA xvdd = DeviceExtension;
+
+  /* run the queue from the dpc so StartIoLock is taken the same way as for an event */
+  StorPortIssueDpc(DeviceExtension, &xvdd->dpc, NULL, NULL);
+}
+
+/* called with StartIoLock held */
+static VOID
+XenVbd_QueueRetry(PXENVBD_DEVICE_DATA xvdd, ULONG interval) {
+  StorPortNotification(RequestTimerCall, xvdd, XenVbd_HwStorTimer, interval);
+}
+
+/* called with StartIoLock held */
+/* runs HandleEvent again soon from the dpc. Returns FALSE if the caller has to keep going itself */
+static BOOLEAN
+XenVbd_QueueEvent(PXENVBD_DEVICE_DATA xvdd) {
+  if (dump_mode)
+    return FALSE;
+  StorPortIssueDpc(xvdd, &xvdd->dpc, NULL, NULL);
+  return TRUE;
+}
+
 /* this is only used during hiber and dump */
 static BOOLEAN
 XenVbd_HwStorInterrupt(PVOID DeviceExtension)
@@ -383,7 +427,7 @@ XenVbd_HwStorAdapterControl(PVOID DeviceExtension, SCSI_ADAPTER_CONTROL_TYPE Con
       break;
     }
     XN_ASSERT(IsListEmpty(&xvdd->srb_list));
-    // XN_ASSERT(xvdd->shadow_free == SHADOW_ENTRIES); /* this assert failes to compile because it expands to a too long string */
+    // XN_ASSERT(xvdd->shadow_free == xvdd->shadow_count);
     if (xvdd->power_action != StorPowerActionHibernate) {
       /* if hibernate then device_state will be set on our behalf in the hibernate FindAdapter */
       xvdd->device_state = DEVICE_STATE_DISCONNECTED;
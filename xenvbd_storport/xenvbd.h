@@ -46,31 +46,39 @@ Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
 #include "../xenvbd_common/common.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
-#define BLK_RING_SIZE __RING_SIZE((blkif_sring_t *)0, PAGE_SIZE)
 
 #define SCSIOP_UNMAP 0x42
 
 #define VPD_BLOCK_LIMITS 0xB0
 
-#define MAX_SHADOW_ENTRIES  64
-#define SHADOW_ID_ID_MASK   0x03FF /* maximum of 1024 requests - currently use a maximum of 64 though */
+#define SHADOW_ID_ID_MASK   0x7FFF /* shadow_count is the ring size so is much less than this */
 #define SHADOW_ID_DUMP_FLAG 0x8000 /* indicates the request was generated by dump mode */
 
-#define SHADOW_ENTRIES min(MAX_SHADOW_ENTRIES, BLK_RING_SIZE)
-
 /* if this is ever increased to more than 1 then we need a way of tracking it properly */
 #define DUMP_MODE_UNALIGNED_PAGES 1 /* only for unaligned buffer use */
 
+/* the most StorPortSetDeviceQueueDepth accepts for a LUN */
+#define XENVBD_STORPORT_MAX_QUEUE_DEPTH 254
+
 struct {
   ULONG device_state;
   KEVENT device_state_event;
   STOR_DPC dpc;
   PIO_WORKITEM disconnect_workitem;
+  BOOLEAN closing_queued; /* XenbusStateClosing has been written or disconnect_workitem queued to write it. StartIoLock */
   PIO_WORKITEM connect_workitem;
-  blkif_shadow_t shadows[MAX_SHADOW_ENTRIES];
-  USHORT shadow_free_list[MAX_SHADOW_ENTRIES];
+  blkif_shadow_t *shadows; /* one per ring slot, allocated with the ring on connect */
+  USHORT *shadow_free_list;
+  ULONG shadow_count;
   USHORT shadow_free;
   USHORT shadow_min_free;
+  ULONG rsp_event_distance; /* most responses the backend may batch before an event. Not used in dump mode */
+  LARGE_INTEGER rsp_event_time; /* when rsp_event was last set with requests outstanding, 0 if it wasn't */
+  ULONG completion_latency_ceiling; /* longest a response should wait for rsp_event (us). At least one clock tick */
+  volatile LONG event_pending; /* set at DIRQL when the backend raises an event, cleared when HandleEvent looks at the ring */
+  LARGE_INTEGER event_time; /* performance counter when event_pending was set */
+  grant_ref_t dump_grefs[DUMP_MODE_SHADOWS][BLKIF_MAX_SEGMENTS_PER_REQUEST]; /* dump mode only. Each dump shadow's own grefs */
+  ULONG dump_shadow_count; /* shadows usable in dump mode, 0 if no grefs could be put aside */
   ULONG grant_tag;
   PDEVICE_OBJECT pdo;
   PDEVICE_OBJECT fdo;
@@ -78,7 +86,8 @@ struct {
   evtchn_port_t event_channel;
   blkif_front_ring_t ring;
   blkif_sring_t *sring;
-  grant_ref_t sring_gref; 
+  ULONG ring_page_order;
+  grant_ref_t sring_grefs[XENVBD_MAX_RING_PAGES];
   KEVENT backend_event;
   ULONG backend_state;
   UCHAR last_sense_key;
@@ -95,21 +104,32 @@ struct {
   CHAR serial_number[64];
   ULONG feature_flush_cache;
   ULONG feature_discard;
+  ULONG discard_granularity; /* in bytes */
+  ULONG discard_alignment; /* in bytes */
+  PUCHAR write_same_buffer; /* one page filled with the current WRITE SAME pattern */
+  ULONG write_same_refs; /* number of WRITE SAME srbs and reset WRITE SAME requests using write_same_buffer */
   ULONG feature_barrier;
   LIST_ENTRY srb_list;
+  interval_tree_t write_tree; /* sector ranges of write srbs with requests on the ring */
   BOOLEAN aligned_buffer_in_use;
   STOR_POWER_ACTION power_action;
   STOR_DEVICE_POWER_STATE power_state;
   PVOID hypercall_stubs;
   ULONG aligned_buffer_size;
   PVOID aligned_buffer;
-/*  
-  ULONGLONG interrupts;
-  ULONGLONG aligned_requests;
-  ULONGLONG aligned_bytes;
-  ULONGLONG unaligned_requests;
-  ULONGLONG unaligned_bytes;
-*/
+  bounce_buffer_t bounce_buffers[MAX_BOUNCE_BUFFERS]; /* used before aligned_buffer */
+  ULONG bounce_buffer_count;
+  grant_ref_t gref_reserve[GREF_RESERVE_ENTRIES];
+  ULONG gref_reserve_count;
+  read_cache_t read_cache;
+  read_cache_page_t *read_cache_pages;
+  PUCHAR read_cache_data;
+  ULONGLONG read_cache_next_sector; /* where the next read starts if reads are sequential */
+  ULONG read_cache_sequential; /* sequential reads in a row */
+  ULONGLONG read_ahead_next_sector; /* end of the last read-ahead */
+  XENVBD_DEVICE_STATS stats; /* updated with StartIoLock held, except events and the filter's event_requests counts */
+  ULONGLONG performance_frequency;
+  XENVBD_LATENCY_STATS latency_stats; /* ring request submit to response, not recorded in dump mode */
   /* this is the size of the buffer to allocate at the end of DeviceExtenstion. It includes an extra PAGE_SIZE-1 bytes to assure that we can always align to PAGE_SIZE */
   #define UNALIGNED_BUFFER_DATA_SIZE ((BLKIF_MAX_SEGMENTS_PER_REQUEST + 1) * PAGE_SIZE - 1)
   #define UNALIGNED_BUFFER_DATA_SIZE_DUMP_MODE ((DUMP_MODE_UNALIGNED_PAGES + 1) * PAGE_SIZE - 1)
@@ -0,0 +1,163 @@
+/*
+PV Drivers for Windows Xen HVM Domains
+Copyright (C) 2013 James Harper
+
+This program is free software; you can redistribute it and/or
+modify it under the terms of the GNU General Public License
+as published by the Free Software Foundation; either version 2
+of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* dumps (or resets with -r) the xenvbd counters and latency histograms of each scsi adapter */
+
+#pragma warning(disable: 4201)
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <winioctl.h>
+#include <ntddscsi.h>
+
+#include "../xenvbd_common/xenvbd_ioctl.h"
+
+#define MAX_SCSI_PORTS 64
+
+typedef struct {
+  SRB_IO_CONTROL sic;
+  union {
+    XENVBD_LATENCY_STATS stats;
+    XENVBD_DEVICE_STATS counters;
+  };
+} xenvbd_stats_request_t;
+
+static char *op_names[XENVBD_LATENCY_OPS] = {"read", "write", "flush", "discard"};
+static char *size_names[XENVBD_LATENCY_SIZES] = {"<=4K", "<=16K", "<=64K", ">64K"};
+
+static BOOL
+send_request(HANDLE handle, ULONG control_code, ULONG length, xenvbd_stats_request_t *request) {
+  DWORD bytes_returned;
+
+  memset(request, 0, sizeof(*request));
+  request->sic.HeaderLength = sizeof(SRB_IO_CONTROL);
+  memcpy(request->sic.Signature, XENVBD_STATS_SIG, 8);
+  request->sic.Timeout = 10;
+  request->sic.ControlCode = control_code;
+  request->sic.Length = length;
+  return DeviceIoControl(handle, IOCTL_SCSI_MINIPORT, request, sizeof(SRB_IO_CONTROL) + length, request, sizeof(SRB_IO_CONTROL) + length, &bytes_returned, NULL);
+}
+
+static VOID
+print_counters(int port, XENVBD_DEVICE_STATS *counters) {
+  ULONGLONG rw_requests;
+  ULONGLONG events_handled;
+  int op, bucket;
+
+  printf("Scsi%d:\n", port);
+  for (op = 0; op < XENVBD_LATENCY_OPS; op++) {
+    if (counters->requests[op])
+      printf("  %-7s requests = %I64u, sectors = %I64u\n", op_names[op], counters->requests[op], counters->sectors[op]);
+  }
+  rw_requests = counters->requests[XENVBD_LATENCY_OP_READ] + counters->requests[XENVBD_LATENCY_OP_WRITE];
+  if (rw_requests)
+    printf("  segments per request = %I64u.%02I64u\n", counters->segments / rw_requests, counters->segments * 100 / rw_requests % 100);
+  printf("  events = %I64u, responses = %I64u, ring pushes = %I64u, notifies = %I64u\n",
+    counters->events, counters->responses, counters->ring_pushes, counters->notifies);
+  printf("  moderation timeouts = %I64u, completion budget exhausted = %I64u\n", counters->moderation_timeouts, counters->budget_exhausted);
+  printf("  requeues = %I64u, ring full = %I64u, gref waits = %I64u, gref reserve used = %I64u, retry timer = %I64u\n",
+    counters->requeues, counters->shadow_waits, counters->gref_waits, counters->gref_reserve_used, counters->retry_timer_calls);
+  printf("  aligned = %I64u (%I64u bytes), unaligned = %I64u (%I64u bytes), bounced = %I64u, deferred = %I64u\n",
+    counters->aligned_requests, counters->aligned_bytes, counters->unaligned_requests, counters->unaligned_bytes,
+    counters->bounce_requests, counters->unaligned_deferred);
+  printf("  merged srbs = %I64u, merged requests = %I64u\n", counters->merged_srbs, counters->merged_requests);
+  printf("  read cache hits = %I64u, misses = %I64u, read-ahead requests = %I64u\n",
+    counters->read_cache_hits, counters->read_cache_misses, counters->read_ahead_requests);
+  if (counters->event_requests || counters->event_requests_skipped)
+    printf("  event srbs = %I64u, event srbs skipped = %I64u\n", counters->event_requests, counters->event_requests_skipped);
+  events_handled = 0;
+  for (bucket = 0; bucket < XENVBD_LATENCY_BUCKETS; bucket++)
+    events_handled += counters->event_latency[bucket];
+  if (!events_handled)
+    return;
+  printf("  event latency count = %I64u, avg = %I64uus, max = %I64uus\n", events_handled,
+    counters->event_latency_total_us / events_handled, counters->event_latency_max_us);
+  for (bucket = 0; bucket < XENVBD_LATENCY_BUCKETS; bucket++) {
+    if (counters->event_latency[bucket])
+      printf("    >= %8luus %I64u\n", XENVBD_LATENCY_BUCKET_MIN_US(bucket), counters->event_latency[bucket]);
+  }
+}
+
+static VOID
+print_stats(XENVBD_LATENCY_STATS *stats) {
+  int op, size, bucket;
+  ULONGLONG total;
+
+  for (op = 0; op < XENVBD_LATENCY_OPS; op++) {
+    for (size = 0; size < XENVBD_LATENCY_SIZES; size++) {
+      total = 0;
+      for (bucket = 0; bucket < XENVBD_LATENCY_BUCKETS; bucket++)
+        total += stats->count[op][size][bucket];
+      if (!total)
+        continue;
+      printf("  %-7s %-5s count = %I64u, avg = %I64uus, max = %I64uus\n", op_names[op], size_names[size],
+        total, stats->total_us[op][size] / total, stats->max_us[op][size]);
+      for (bucket = 0; bucket < XENVBD_LATENCY_BUCKETS; bucket++) {
+        if (!stats->count[op][size][bucket])
+          continue;
+        printf("    >= %8luus %I64u\n", XENVBD_LATENCY_BUCKET_MIN_US(bucket), stats->count[op][size][bucket]);
+      }
+    }
+  }
+}
+
+int __cdecl
+main(int argc, char *argv[]) {
+  HANDLE handle;
+  CHAR filename[32];
+  xenvbd_stats_request_t request;
+  BOOL reset = FALSE;
+  int found = 0;
+  int i;
+
+  if (argc > 1) {
+    if (strcmp(argv[1], "-r") != 0) {
+      fprintf(stderr, "usage: %s [-r]\n", argv[0]);
+      return 1;
+    }
+    reset = TRUE;
+  }
+  for (i = 0; i < MAX_SCSI_PORTS; i++) {
+    sprintf(filename, "\\\\.\\Scsi%d:", i);
+    handle = CreateFile(filename, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (handle == INVALID_HANDLE_VALUE)
+      continue;
+    /* non-xenvbd adapters will just fail the request */
+    if (reset) {
+      if (send_request(handle, XENVBD_STATS_RESET_COUNTERS, 0, &request) && request.sic.ReturnCode == 0
+          && send_request(handle, XENVBD_STATS_RESET_LATENCY, 0, &request) && request.sic.ReturnCode == 0) {
+        found++;
+        printf("Scsi%d: reset\n", i);
+      }
+    } else if (send_request(handle, XENVBD_STATS_GET_COUNTERS, sizeof(XENVBD_DEVICE_STATS), &request) && request.sic.ReturnCode == 0) {
+      found++;
+      if (request.sic.Length >= sizeof(XENVBD_DEVICE_STATS) && request.counters.version == XENVBD_DEVICE_STATS_VERSION)
+        print_counters(i, &request.counters);
+      if (send_request(handle, XENVBD_STATS_GET_LATENCY, sizeof(XENVBD_LATENCY_STATS), &request) && request.sic.ReturnCode == 0
+          && request.sic.Length >= sizeof(XENVBD_LATENCY_STATS) && request.stats.version == XENVBD_LATENCY_STATS_VERSION)
+        print_stats(&request.stats);
+    }
+    CloseHandle(handle);
+  }
+  if (!found) {
+    fprintf(stderr, "No xenvbd adapters found\n");
+    return 1;
+  }
+  return 0;
+}